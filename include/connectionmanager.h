@@ -28,6 +28,7 @@
 
 #include <memory>
 #include <vector>
+#include <set>
 #include <string>
 
 namespace jami {
@@ -54,7 +55,10 @@ struct PeerConnectionRequest : public dht::EncryptedValue<PeerConnectionRequest>
     std::string ice_msg {};
     bool isAnswer {false};
     std::string connType {}; // Used for push notifications to know why we open a new connection
-    MSGPACK_DEFINE_MAP(id, ice_msg, isAnswer, connType)
+    bool direct {false}; // Attempt racing on a known direct path, no relay needed
+    bool udp {false};    // ICE over UDP, TCP otherwise
+    uint16_t port {0};   // TCP port accepting TLS connections, 0 if none
+    MSGPACK_DEFINE_MAP(id, ice_msg, isAnswer, connType, direct, udp, port)
 };
 
 /**
@@ -87,6 +91,7 @@ class ConnectionManager
 {
 public:
     class Config;
+    class SharedContext;
 
     ConnectionManager(std::shared_ptr<Config> config_);
     ~ConnectionManager();
@@ -102,19 +107,23 @@ public:
      * @param forceNewSocket Negotiate a new socket even if there is one // todo group with previous
      * (enum)
      * @param connType       Type of the connection
+     * @param type           Type of the channel, a stream never uses a
+     *                       socket negotiated over ICE-UDP
      */
     void connectDevice(const DeviceId& deviceId,
                        const std::string& name,
                        ConnectCallback cb,
                        bool noNewSocket = false,
                        bool forceNewSocket = false,
-                       const std::string& connType = "");
+                       const std::string& connType = "",
+                       ChannelType type = ChannelType::STREAM);
     void connectDevice(const std::shared_ptr<dht::crypto::Certificate>& cert,
                        const std::string& name,
                        ConnectCallback cb,
                        bool noNewSocket = false,
                        bool forceNewSocket = false,
-                       const std::string& connType = "");
+                       const std::string& connType = "",
+                       ChannelType type = ChannelType::STREAM);
 
     /**
      * Check if we are already connecting to a device with a specific name
@@ -168,6 +177,23 @@ public:
      */
     std::size_t activeSockets() const;
 
+    /**
+     * @return the number of sockets negotiated over ICE-UDP (first) and
+     * over ICE-TCP (second)
+     */
+    std::pair<std::size_t, std::size_t> transportCounts() const;
+
+    /**
+     * @return the port accepting the direct TCP connections, 0 if none
+     */
+    uint16_t directConnectPort() const;
+
+    /**
+     * @return the bytes used by each connection (including the pending
+     * ones), per layer
+     */
+    std::vector<std::pair<DeviceId, ConnectionMemoryUsage>> memoryUsage() const;
+
     /**
      * Log informations for all sockets
      */
@@ -208,6 +234,41 @@ private:
     std::shared_ptr<Impl> pimpl_;
 };
 
+/**
+ * State shared by the connection managers of many identities hosted in
+ * the same process (see Config::sharedContext).
+ * The managers share the DHT runner, a single dispatch table from the DHT
+ * listen keys to the managers, the store of the treated requests (saved
+ * in cachePath/treatedMessages) and the ICE transport factory (so the
+ * same pj caching pool).
+ * The DHT runner must run without identity: each manager signs and
+ * encrypts its values, and decrypts the requests for its identity.
+ * Delivering the values encrypted for the managers needs OpenDHT built
+ * with its proxy server (OPENDHT_PROXY_SERVER).
+ */
+class ConnectionManager::SharedContext
+{
+public:
+    SharedContext(const std::shared_ptr<dht::DhtRunner>& dht,
+                  const std::string& cachePath = {},
+                  const std::shared_ptr<dht::log::Logger>& logger = {});
+    ~SharedContext();
+
+    const std::shared_ptr<dht::DhtRunner>& dht() const;
+
+    /**
+     * @return the number of listen keys dispatched to a manager
+     */
+    std::size_t listenCount() const;
+
+private:
+    friend class ConnectionManager::Impl;
+    SharedContext(const SharedContext&) = delete;
+    SharedContext& operator=(const SharedContext&) = delete;
+    class Impl;
+    std::shared_ptr<Impl> pimpl_;
+};
+
 struct ConnectionManager::Config
 {
     /**
@@ -241,10 +302,23 @@ struct ConnectionManager::Config
     dht::SockAddr cacheTurnV4 {};
     dht::SockAddr cacheTurnV6 {};
 
+    /**
+     * Directory where the DH parameters, the treated messages and the UPnP state are cached.
+     * If set, the UPnP mappings open at shutdown are left on the router so the next instance
+     * can reuse them. They are requested with a one hour lease, renewed while running, so the
+     * router removes them if no later instance renews them.
+     */
     std::string cachePath {};
 
     std::shared_ptr<asio::io_context> ioContext;
     std::shared_ptr<dht::DhtRunner> dht;
+
+    /**
+     * Optional state shared with the managers of other identities. If set,
+     * dht defaults to the shared DHT runner, and the treated requests are
+     * stored in the shared context instead of cachePath.
+     */
+    std::shared_ptr<ConnectionManager::SharedContext> sharedContext;
     dht::crypto::Identity id;
 
     tls::CertificateStore* certStore;
@@ -255,6 +329,100 @@ struct ConnectionManager::Config
     bool upnpEnabled;
     std::shared_ptr<jami::upnp::Controller> upnpCtrl;
 
+    /**
+     * Bounds of the pool of UPnP mappings opened in advance, per protocol.
+     * The pool is sized within these bounds from the observed reservation
+     * rate. Only used if upnpCtrl is created by the connection manager.
+     */
+    unsigned upnpMinPoolSize {4};
+    unsigned upnpMaxPoolSize {32};
+
+    /**
+     * Sockets without any channel and without traffic during this delay
+     * are closed. Later calls to connectDevice negotiate a new socket.
+     * 0 disables the reaper.
+     */
+    std::chrono::seconds idleConnectionTimeout {0};
+
+    /**
+     * Number of ICE transports kept initialized in advance, with their TURN
+     * allocation done, so new connections don't wait for the allocation.
+     * A non-zero size costs TURN quota: each pooled transport holds its own
+     * allocation on the TURN server, on top of the ones of the connections,
+     * and is refreshed every few minutes while the account keeps connecting.
+     * At most 4 transports are pooled, and the pool is released after a few
+     * idle minutes. 0 (default) disables it.
+     */
+    unsigned turnPoolSize {0};
+
+    /**
+     * If enabled, a "signaling" channel is opened on each new socket, and the
+     * connection requests are first sent over the channels already connected
+     * to the device, to another device of the same account or to one of
+     * signalingRelays. The DHT is used if no answer comes in time. A request
+     * received over signaling is answered the same way, without the DHT.
+     * Devices with signaling enabled forward the messages from or to the
+     * devices of their own account only, at most 16 per 10 s per device.
+     */
+    bool signalingEnabled {false};
+    std::set<DeviceId> signalingRelays {};
+
+    /**
+     * If enabled, connectDevice negotiates ICE over UDP and over TCP in
+     * parallel for a datagram channel and keeps the first socket ready. The
+     * transport of the last direct path with the device starts first, the
+     * other one iceRaceDelay later (TCP first by default).
+     * Over UDP, the TLS session runs in datagram mode (DTLS) and lost packets
+     * are not retransmitted, so a socket negotiated over UDP never carries
+     * stream channels: those always negotiate over TCP.
+     */
+    bool iceTransportRace {false};
+    std::chrono::milliseconds iceRaceDelay {250};
+
+    /**
+     * If enabled, the device is announced on the LAN (multicast on
+     * lanDiscoveryPort, signed with the device key) with a TCP port accepting
+     * TLS connections. connectDevice then connects to the address announced
+     * by the device in parallel with the ICE negotiation.
+     * Incoming LAN connections are accepted from the devices with a
+     * certificate in the certificate store, if accepted by onICERequest.
+     */
+    bool lanDiscoveryEnabled {false};
+    uint16_t lanDiscoveryPort {8889};
+
+    /**
+     * If enabled, a TCP port accepting TLS connections is opened (the one
+     * of lanDiscoveryEnabled) and sent with the connection requests and
+     * answers. Reconnecting to a device with a known direct path then dials
+     * this port over TCP and TLS, without any DHT exchange, in parallel
+     * with the ICE negotiation. The relay-free ICE attempt is only started
+     * if the port is unreachable. The incoming connections are accepted as
+     * the LAN ones.
+     */
+    bool directConnectEnabled {false};
+
+    /**
+     * Closed connections are destroyed in the background by at most
+     * teardownConcurrency threads. Their ICE transports don't wait for the
+     * TURN deallocation more than teardownTimeout after the close.
+     */
+    unsigned teardownConcurrency {4};
+    std::chrono::milliseconds teardownTimeout {3000};
+
+    /**
+     * Per connection memory, see memoryUsage().
+     * icePoolSize/icePoolIncrement: memory pool of the ICE transports.
+     * tlsRxBufferSize: buffer receiving each DTLS record, 0 for 64 KiB.
+     * Borrowed from a shared pool while receiving. Raised to 16 KiB, the
+     * maximum size of a record, when smaller.
+     * muxReadBufferSize: initial buffer and read size of the sockets, 0
+     * for 8 KiB.
+     */
+    std::size_t icePoolSize {512};
+    std::size_t icePoolIncrement {512};
+    std::size_t tlsRxBufferSize {0};
+    std::size_t muxReadBufferSize {0};
+
     std::shared_ptr<dht::log::Logger> logger;
 
     /**
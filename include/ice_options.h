@@ -1,6 +1,8 @@
 #pragma once
 
+#include <chrono>
 #include <functional>
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -9,6 +11,9 @@
 namespace jami {
 
 class IceTransportFactory;
+namespace upnp {
+class UPnPContext;
+}
 using IceTransportCompleteCb = std::function<void(bool)>;
 
 struct StunServerInfo
@@ -53,6 +58,8 @@ struct IceTransportOptions
     unsigned streamsCount {1};
     unsigned compCountPerStream {1};
     bool upnpEnable {false};
+    // UPnP context used to reserve the port mappings (required if upnpEnable).
+    std::shared_ptr<upnp::UPnPContext> upnpContext {};
     IceTransportCompleteCb onInitDone {};
     IceTransportCompleteCb onNegoDone {};
     std::vector<StunServerInfo> stunServers;
@@ -61,6 +68,17 @@ struct IceTransportOptions
     // Addresses used by the account owning the transport instance.
     IpAddr accountLocalAddr {};
     IpAddr accountPublicAddr {};
+    // Once running, the transport becomes dormant after this delay
+    // without traffic: its thread only wakes up for incoming data, sends
+    // and pjnath timers instead of polling. 0 (the default) disables it.
+    // A dormant transport still has its thread, as do the TLS session and
+    // the multiplexed socket using it: dormancy saves wake-ups, not threads,
+    // and costs a loopback socket to wake the thread up.
+    std::chrono::seconds dormantDelay {0};
+    // Initial size and increment of the memory pool of the transport
+    // (pjnath sessions, timer heap and IO queue).
+    std::size_t poolSize {512};
+    std::size_t poolIncrement {512};
 };
 
 }
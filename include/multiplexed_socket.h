@@ -54,6 +54,8 @@ using OnShutdownCb = std::function<void(void)>;
 static constexpr auto SEND_BEACON_TIMEOUT = std::chrono::milliseconds(3000);
 static constexpr uint16_t CONTROL_CHANNEL {0};
 static constexpr uint16_t PROTOCOL_CHANNEL {0xffff};
+// Max size of the writes queued on a channel until the peer accepts it
+static constexpr std::size_t CHANNEL_PENDING_WRITES_MAX {64 * 1024};
 
 enum class ChannelRequestState {
     REQUEST,
@@ -61,16 +63,58 @@ enum class ChannelRequestState {
     DECLINE,
 };
 
+/**
+ * STREAM: ordered and reliable bytes
+ * DATAGRAM: messages, neither ordered nor retransmitted over DTLS. Over a
+ * reliable transport, or with a peer not supporting datagrams, they are
+ * carried by the stream but still read one message at a time.
+ */
+enum class ChannelType {
+    STREAM,
+    DATAGRAM,
+};
+
+/**
+ * Compression of the data of a stream channel, one context per direction
+ * sliding over the whole channel, flushed at each write
+ * ZSTD: only available if built with zstd
+ */
+enum class ChannelCompression {
+    NONE,
+    ZSTD,
+};
+
 /**
  * That msgpack structure is used to request a new channel (id, name)
  * Transmitted over the TLS socket
+ * The type is answered in ACCEPT, older peers don't send it (STREAM)
+ * The data of a REQUEST is the first payload of the channel, delivered if
+ * accepted. Only sent to peers announcing version 2 or more.
+ * The compression offered in REQUEST is answered in ACCEPT, NONE if the peer
+ * doesn't support it (older peers don't send it)
  */
 struct ChannelRequest
 {
     std::string name {};
     uint16_t channel {0};
     ChannelRequestState state {ChannelRequestState::REQUEST};
-    MSGPACK_DEFINE(name, channel, state)
+    ChannelType type {ChannelType::STREAM};
+    std::vector<uint8_t> data {};
+    ChannelCompression compression {ChannelCompression::NONE};
+    MSGPACK_DEFINE(name, channel, state, type, data, compression)
+};
+
+/**
+ * Bytes used by the buffers of a connection, per layer
+ */
+struct ConnectionMemoryUsage
+{
+    std::size_t ice {0};      // Memory pool and received packets of the ICE transport
+    std::size_t tls {0};      // Received records not read yet
+    std::size_t mux {0};      // Buffer of the unpacker of the multiplexed socket
+    std::size_t channels {0}; // Received data not read yet by the channels
+
+    std::size_t total() const { return ice + tls + mux + channels; }
 };
 
 /**
@@ -79,9 +123,27 @@ struct ChannelRequest
 class MultiplexedSocket : public std::enable_shared_from_this<MultiplexedSocket>
 {
 public:
-    MultiplexedSocket(std::shared_ptr<asio::io_context> ctx, const DeviceId& deviceId, std::unique_ptr<TlsSocketEndpoint> endpoint);
+    /**
+     * @param readBufferSize    Initial size of the buffer receiving the
+     *                          messages and size of each read, 0 for 8 KiB
+     */
+    MultiplexedSocket(std::shared_ptr<asio::io_context> ctx,
+                      const DeviceId& deviceId,
+                      std::unique_ptr<TlsSocketEndpoint> endpoint,
+                      std::size_t readBufferSize = 0,
+                      std::shared_ptr<Logger> logger = {});
     ~MultiplexedSocket();
-    std::shared_ptr<ChannelSocket> addChannel(const std::string& name);
+    std::shared_ptr<ChannelSocket> addChannel(const std::string& name,
+                                              ChannelType type = ChannelType::STREAM);
+    /**
+     * Add a channel whose first payload is carried by the ChannelRequest,
+     * if the peer supports it. Else the payload is sent once accepted.
+     * @note the request must carry ChannelSocket::takeInitialData()
+     * @return nullptr if the payload is larger than CHANNEL_PENDING_WRITES_MAX
+     */
+    std::shared_ptr<ChannelSocket> addChannel(const std::string& name,
+                                              std::vector<uint8_t>&& initialData,
+                                              ChannelType type = ChannelType::STREAM);
 
     std::shared_ptr<MultiplexedSocket> shared()
     {
@@ -104,6 +166,20 @@ public:
     bool isReliable() const;
     bool isInitiator() const;
     int maxPayload() const;
+    /**
+     * Version announced by the peer, 0 until received
+     */
+    int peerVersion() const;
+
+    /**
+     * Number of channels currently opened on the socket
+     */
+    std::size_t channelCount() const;
+    /**
+     * Last time a channel was opened, closed, or carried data.
+     * Beacons are not considered.
+     */
+    std::chrono::steady_clock::time_point lastActivity() const;
 
     /**
      * Will be triggered when a new channel is ready
@@ -118,6 +194,34 @@ public:
                       const uint8_t* buf,
                       std::size_t len,
                       std::error_code& ec);
+    /**
+     * Write the output of the compressor of a channel, decompressed by the
+     * channel of the peer. Only once canWriteCompressed(), else the peer
+     * can't tell it from the data.
+     */
+    std::size_t writeCompressed(uint16_t channel,
+                                const uint8_t* buf,
+                                std::size_t len,
+                                std::error_code& ec);
+    /**
+     * True once the compact frames are sent, then stays true
+     */
+    bool canWriteCompressed() const;
+
+    /**
+     * Send a message of a datagram channel, in a DTLS record of its own if
+     * the session supports it, else on the stream
+     * @note len should be <= maxDatagramSize(), else you will get ec = EMSGSIZE
+     */
+    std::size_t writeDatagram(uint16_t channel,
+                              const uint8_t* buf,
+                              std::size_t len,
+                              std::error_code& ec);
+    /**
+     * Largest message of a datagram channel: the DTLS payload minus the
+     * headers, or UINT16_MAX when carried by the stream
+     */
+    std::size_t maxDatagramSize() const;
 
     /**
      * This will close all channels and send a TLS EOF on the main socket.
@@ -139,6 +243,11 @@ public:
      */
     void monitor() const;
 
+    /**
+     * Bytes used by the buffers of the socket and of its channels
+     */
+    ConnectionMemoryUsage memoryUsage() const;
+
     const std::shared_ptr<Logger>& logger();
 
     /**
@@ -236,6 +345,11 @@ public:
     void shutdown() override;
 
     std::size_t read(ValueType* buf, std::size_t len, std::error_code& ec) override;
+    /**
+     * Until the peer accepts the channel, the data is queued, up to
+     * CHANNEL_PENDING_WRITES_MAX bytes. Beyond, the write fails with
+     * std::errc::no_buffer_space and can be retried once ready.
+     */
     std::size_t write(const ValueType* buf, std::size_t len, std::error_code& ec) override;
     int waitForData(std::chrono::milliseconds timeout, std::error_code&) const override;
     void setOnRecv(RecvCb&&) override;
@@ -277,7 +391,8 @@ public:
                   const std::string& name,
                   const uint16_t& channel,
                   bool isInitiator = false,
-                  std::function<void()> rmFromMxSockCb = {});
+                  std::function<void()> rmFromMxSockCb = {},
+                  ChannelType type = ChannelType::STREAM);
     ~ChannelSocket();
 
     DeviceId deviceId() const override;
@@ -285,7 +400,28 @@ public:
     uint16_t channel() const override;
     bool isReliable() const override;
     bool isInitiator() const override;
+    /**
+     * For a datagram channel, the largest message that can be written
+     */
     int maxPayload() const override;
+
+    ChannelType type() const;
+    /**
+     * Set from the answer of the peer, before the channel is ready
+     */
+    void setType(ChannelType type);
+    /**
+     * Payload to send in the ChannelRequest, empty once taken
+     */
+    void setInitialData(std::vector<uint8_t>&& data);
+    std::vector<uint8_t> takeInitialData();
+    ChannelCompression compression() const;
+    /**
+     * Compression to offer in the ChannelRequest, then set from the answer
+     * of the peer, before the channel is ready.
+     * NONE if not supported by this build, or for a datagram channel.
+     */
+    void setCompression(ChannelCompression compression);
     /**
      * Like shutdown, but don't send any packet on the socket.
      * Used by Multiplexed Socket when the TLS endpoint is already shutting down
@@ -309,9 +445,15 @@ public:
      */
     void onShutdown(OnShutdownCb&& cb) override;
 
+    /**
+     * For a datagram channel, reads one message, truncated to len
+     */
     std::size_t read(ValueType* buf, std::size_t len, std::error_code& ec) override;
     /**
      * @note len should be < UINT8_MAX, else you will get ec = EMSGSIZE
+     * For a datagram channel, writes one message of at most maxPayload()
+     * Until the peer accepts a channel we requested, the data is queued and
+     * sent on accept. It is dropped if the channel is declined or shut down.
      */
     std::size_t write(const ValueType* buf, std::size_t len, std::error_code& ec) override;
     int waitForData(std::chrono::milliseconds timeout, std::error_code&) const override;
@@ -324,6 +466,20 @@ public:
     void setOnRecv(RecvCb&&) override;
 
     void onRecv(std::vector<uint8_t>&& pkt) override;
+    /**
+     * Data parsed in place, only copied if not taken by the callback
+     */
+    void onRecv(const uint8_t* data, std::size_t len);
+    /**
+     * Data compressed by the peer, the channel is shut down if it can't be
+     * decompressed
+     */
+    void onRecvCompressed(const uint8_t* data, std::size_t len);
+
+    /**
+     * Bytes allocated for the received data
+     */
+    std::size_t memoryUsage() const;
 
     /**
      * Send a beacon on the socket and close if no response come
@@ -359,3 +515,5 @@ private:
 } // namespace jami
 
 MSGPACK_ADD_ENUM(jami::ChannelRequestState);
+MSGPACK_ADD_ENUM(jami::ChannelType);
+MSGPACK_ADD_ENUM(jami::ChannelCompression);
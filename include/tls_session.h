@@ -88,6 +88,11 @@ struct TlsParams
     std::shared_ptr<asio::io_context> io_context;
 
     std::shared_ptr<Logger> logger;
+
+    // Size of the buffer receiving each DTLS record, 0 for the maximum
+    // size of a UDP packet (64 KiB). Raised to 16 KiB, the maximum size
+    // of a record, when smaller.
+    std::size_t rxBufferSize {0};
 };
 
 /// TlsSession
@@ -115,6 +120,8 @@ public:
         OnRxDataFunc onRxData;
         OnCertificatesUpdate onCertificatesUpdate;
         VerifyCertificate verifyCertificate;
+        // Datagrams, as received (not ordered, lost ones are not waited for)
+        OnRxDataFunc onRxDatagram;
     };
 
     TlsSession(std::unique_ptr<SocketType>&& transport,
@@ -140,18 +147,34 @@ public:
 
     int maxPayload() const override;
 
+    /// Bytes used by the received packets and records not read yet, and
+    /// by the buffer receiving a DTLS record while it is borrowed.
+    std::size_t memoryUsage() const;
+
     void waitForReady(const duration& timeout = {});
 
     /// Synchronous writing.
     /// Return a positive number for number of bytes write, or 0 and \a ec set in case of error.
     std::size_t write(const ValueType* data, std::size_t size, std::error_code& ec) override;
 
+    /// Write the buffers in order, like a write() of their concatenation, without
+    /// gathering them first. Small writes are sent in a single record.
+    std::size_t writev(const giovec_t* iov, int iovcnt, std::error_code& ec);
+
     /// Synchronous reading.
     /// Return a positive number for number of bytes read, or 0 and \a ec set in case of error.
     std::size_t read(ValueType* data, std::size_t size, std::error_code& ec) override;
 
     int waitForData(std::chrono::milliseconds, std::error_code&) const override;
 
+    /// Maximal size of a datagram, 0 if datagrams are not supported
+    /// (reliable transport, or peer not supporting typed DTLS records).
+    std::size_t maxDatagramSize() const;
+
+    /// Send data in a single record, neither ordered nor retransmitted.
+    /// Return the size sent, or 0 and \a ec set in case of error.
+    std::size_t writeDatagram(const ValueType* data, std::size_t size, std::error_code& ec);
+
     std::shared_ptr<dht::crypto::Certificate> peerCertificate() const;
 
     const std::shared_ptr<dht::log::Logger>& logger() const;
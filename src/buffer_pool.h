@@ -0,0 +1,138 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace jami {
+
+/**
+ * Receive buffers shared by all the sessions, by size classes (powers of
+ * two from 1 KiB to 64 KiB). A buffer is borrowed while processing a
+ * packet and returned to the pool afterwards, so the idle sessions don't
+ * hold any. Larger buffers are not pooled.
+ */
+class BufferPool
+{
+public:
+    static constexpr std::size_t MIN_SIZE {1024};
+    static constexpr std::size_t MAX_SIZE {64 * 1024};
+    // Free buffers kept per size class
+    static constexpr std::size_t MAX_FREE {32};
+
+    /**
+     * Borrowed buffer, returned to the pool on destruction.
+     * Its content is not initialized.
+     */
+    class Buffer
+    {
+    public:
+        Buffer(Buffer&&) = default;
+        Buffer& operator=(Buffer&&) = delete;
+        ~Buffer()
+        {
+            if (data_)
+                pool_.release(std::move(data_), size_);
+        }
+
+        uint8_t* data() { return data_.get(); }
+        std::size_t size() const { return size_; }
+
+    private:
+        friend class BufferPool;
+        Buffer(BufferPool& pool, std::unique_ptr<uint8_t[]>&& data, std::size_t size)
+            : pool_(pool)
+            , data_(std::move(data))
+            , size_(size)
+        {}
+
+        BufferPool& pool_;
+        std::unique_ptr<uint8_t[]> data_;
+        std::size_t size_;
+    };
+
+    static BufferPool& instance()
+    {
+        static BufferPool pool;
+        return pool;
+    }
+
+    /**
+     * @return a buffer of at least size bytes
+     */
+    Buffer get(std::size_t size)
+    {
+        auto sizeClass = getSizeClass(size);
+        if (sizeClass >= CLASSES)
+            return Buffer(*this, std::unique_ptr<uint8_t[]>(new uint8_t[size]), size);
+        size = MIN_SIZE << sizeClass;
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            auto& free = free_[sizeClass];
+            if (not free.empty()) {
+                auto data = std::move(free.back());
+                free.pop_back();
+                return Buffer(*this, std::move(data), size);
+            }
+        }
+        return Buffer(*this, std::unique_ptr<uint8_t[]>(new uint8_t[size]), size);
+    }
+
+    /**
+     * @return the bytes held by the free buffers
+     */
+    std::size_t freeSize() const
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        std::size_t size = 0;
+        for (unsigned i = 0; i < CLASSES; i++)
+            size += free_[i].size() * (MIN_SIZE << i);
+        return size;
+    }
+
+private:
+    static constexpr unsigned CLASSES {7};
+
+    static unsigned getSizeClass(std::size_t size)
+    {
+        unsigned sizeClass = 0;
+        while (sizeClass < CLASSES and (MIN_SIZE << sizeClass) < size)
+            sizeClass++;
+        return sizeClass;
+    }
+
+    void release(std::unique_ptr<uint8_t[]>&& data, std::size_t size)
+    {
+        auto sizeClass = getSizeClass(size);
+        if (sizeClass >= CLASSES or (MIN_SIZE << sizeClass) != size)
+            return;
+        std::lock_guard<std::mutex> lk(mutex_);
+        auto& free = free_[sizeClass];
+        if (free.size() < MAX_FREE)
+            free.emplace_back(std::move(data));
+    }
+
+    mutable std::mutex mutex_ {};
+    std::array<std::vector<std::unique_ptr<uint8_t[]>>, CLASSES> free_ {};
+};
+
+} // namespace jami
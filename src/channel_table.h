@@ -0,0 +1,226 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace jami {
+
+/**
+ * Table of the channels of a socket, indexed by channel id.
+ * Open addressing (linear probing, backward shift deletion) in a flat array
+ * sized to the number of channels, so the lookup of each received frame
+ * stays in one or two cache lines.
+ * Past BITMAP_THRESHOLD channels, a bitmap of the used ids is kept as well
+ * (8 KiB), so free ids are found by words of 64 ids.
+ * Not thread safe.
+ */
+template<typename T>
+class ChannelTable
+{
+public:
+    static constexpr std::size_t BITMAP_THRESHOLD {1024};
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    /**
+     * @return the value of the channel, nullptr if not in the table
+     */
+    T* find(uint16_t id)
+    {
+        if (slots_.empty())
+            return nullptr;
+        for (auto i = index(id);; i = next(i)) {
+            auto& slot = slots_[i];
+            if (not slot.used)
+                return nullptr;
+            if (slot.id == id)
+                return &slot.value;
+        }
+    }
+    const T* find(uint16_t id) const { return const_cast<ChannelTable*>(this)->find(id); }
+    bool contains(uint16_t id) const { return find(id) != nullptr; }
+
+    /**
+     * @return the value of the channel, inserted if not in the table
+     */
+    T& operator[](uint16_t id)
+    {
+        if (auto* value = find(id))
+            return *value;
+        if ((size_ + 1) * 4 > slots_.size() * 3)
+            rehash(slots_.empty() ? MIN_CAPACITY : slots_.size() * 2);
+        auto i = index(id);
+        while (slots_[i].used)
+            i = next(i);
+        slots_[i].used = true;
+        slots_[i].id = id;
+        size_++;
+        setUsed(id, true);
+        return slots_[i].value;
+    }
+
+    bool erase(uint16_t id)
+    {
+        if (slots_.empty())
+            return false;
+        auto i = index(id);
+        for (;; i = next(i)) {
+            if (not slots_[i].used)
+                return false;
+            if (slots_[i].id == id)
+                break;
+        }
+        // Shift back the next slots of the cluster, so lookups don't need tombstones
+        for (auto j = next(i); slots_[j].used; j = next(j)) {
+            auto home = index(slots_[j].id);
+            auto inRange = i <= j ? (home > i and home <= j) : (home > i or home <= j);
+            if (not inRange) {
+                slots_[i].id = slots_[j].id;
+                slots_[i].value = std::move(slots_[j].value);
+                i = j;
+            }
+        }
+        slots_[i].used = false;
+        slots_[i].value = T {};
+        size_--;
+        setUsed(id, false);
+        if (slots_.size() > MIN_CAPACITY and size_ * 8 < slots_.size())
+            rehash(slots_.size() / 2);
+        return true;
+    }
+
+    void clear()
+    {
+        slots_.clear();
+        slots_.shrink_to_fit();
+        bitmap_.clear();
+        bitmap_.shrink_to_fit();
+        bits_ = 0;
+        size_ = 0;
+    }
+
+    /**
+     * Calls f(id, value) for each channel
+     */
+    template<typename F>
+    void forEach(F&& f) const
+    {
+        for (const auto& slot : slots_)
+            if (slot.used)
+                f(slot.id, slot.value);
+    }
+
+    /**
+     * @return the first id of [first, last] not in the table, from start
+     * and wrapping around, or 0 if none
+     */
+    uint16_t findFree(uint16_t start, uint16_t first, uint16_t last) const
+    {
+        const uint32_t count = last - first + 1u;
+        const uint32_t offset = (start >= first and start <= last) ? start - first : 0;
+        for (uint32_t n = 0; n < count;) {
+            uint32_t id = first + (offset + n) % count;
+            if (bitmap_.empty()) {
+                if (not contains(id))
+                    return id;
+                n++;
+                continue;
+            }
+            // Skip the used ids by words
+            auto freeBits = ~bitmap_[id >> 6] >> (id & 63);
+            if (freeBits == 0) {
+                n += std::min<uint32_t>(64 - (id & 63), last + 1u - id);
+                continue;
+            }
+            auto freeId = id;
+            while (not (freeBits & 1)) {
+                freeBits >>= 1;
+                freeId++;
+            }
+            if (freeId <= last)
+                return freeId;
+            n += last + 1u - id;
+        }
+        return 0;
+    }
+
+private:
+    static constexpr std::size_t MIN_CAPACITY {8};
+
+    struct Slot
+    {
+        uint16_t id {0};
+        bool used {false};
+        T value {};
+    };
+
+    std::size_t index(uint16_t id) const
+    {
+        // Fibonacci hashing, as the ids are not always random
+        return (static_cast<uint32_t>(id) * 2654435769u) >> (32 - bits_);
+    }
+    std::size_t next(std::size_t i) const { return (i + 1) & (slots_.size() - 1); }
+
+    void rehash(std::size_t capacity)
+    {
+        auto slots = std::move(slots_);
+        slots_ = std::vector<Slot>(capacity);
+        bits_ = 0;
+        while ((std::size_t(1) << bits_) < capacity)
+            bits_++;
+        for (auto& slot : slots) {
+            if (not slot.used)
+                continue;
+            auto i = index(slot.id);
+            while (slots_[i].used)
+                i = next(i);
+            slots_[i] = std::move(slot);
+        }
+    }
+
+    void setUsed(uint16_t id, bool used)
+    {
+        if (bitmap_.empty()) {
+            if (size_ <= BITMAP_THRESHOLD)
+                return;
+            bitmap_.resize((UINT16_MAX + 1) / 64);
+            forEach([&](uint16_t channel, const T&) {
+                bitmap_[channel >> 6] |= uint64_t(1) << (channel & 63);
+            });
+        } else if (size_ < BITMAP_THRESHOLD / 2) {
+            bitmap_.clear();
+            bitmap_.shrink_to_fit();
+        } else if (used) {
+            bitmap_[id >> 6] |= uint64_t(1) << (id & 63);
+        } else {
+            bitmap_[id >> 6] &= ~(uint64_t(1) << (id & 63));
+        }
+    }
+
+    std::vector<Slot> slots_ {};
+    unsigned bits_ {0};
+    std::size_t size_ {0};
+    std::vector<uint64_t> bitmap_ {};
+};
+
+} // namespace jami
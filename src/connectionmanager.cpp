@@ -17,6 +17,8 @@
  */
 #include "connectionmanager.h"
 #include "peer_connection.h"
+#include "lan_discovery.h"
+#include "serial_executor.h"
 #include "upnp/upnp_control.h"
 #include "certstore.h"
 #include "fileutils.h"
@@ -34,14 +36,136 @@
 #include <condition_variable>
 #include <set>
 #include <charconv>
+#include <optional>
+#include <deque>
 
 namespace jami {
 static constexpr std::chrono::seconds DHT_MSG_TIMEOUT {30};
 static constexpr uint64_t ID_MAX_VAL = 9007199254740992;
+// Idle sockets are tracked in a timer wheel of IDLE_WHEEL_SLOTS slots
+// spanning Config::idleConnectionTimeout, driven by a single timer.
+static constexpr std::size_t IDLE_WHEEL_SLOTS {64};
+static constexpr std::chrono::seconds IDLE_WHEEL_MIN_TICK {1};
+// Period of the purge and refill of the TURN pool
+static constexpr std::chrono::minutes TURN_POOL_REFRESH_PERIOD {1};
+// Incoming TCP connections waiting for their TLS handshake, overall and
+// from a single address: the ones beyond are closed once accepted
+static constexpr std::size_t TCP_PENDING_HANDSHAKES_MAX {16};
+static constexpr std::size_t TCP_PENDING_HANDSHAKES_PER_SOURCE {4};
+// Known direct paths are not tried anymore after this delay
+static constexpr std::chrono::hours KNOWN_PATH_LIFETIME {24};
+// Carries the connection requests between connected devices
+static constexpr const char SIGNALING_CHANNEL[] {"signaling"};
+// Requests sent over a signaling channel are put on the DHT if not answered
+// after this delay
+static constexpr std::chrono::seconds SIGNALING_FALLBACK_DELAY {2};
+// Signaling messages forwarded for each connected device, per period
+static constexpr unsigned SIGNALING_FORWARD_MAX {16};
+static constexpr std::chrono::seconds SIGNALING_FORWARD_PERIOD {10};
+// LAN connections are abandoned if not connected after this delay
+static constexpr std::chrono::seconds LAN_CONNECT_TIMEOUT {3};
 
 using ValueIdDist = std::uniform_int_distribution<dht::Value::Id>;
 using CallbackId = std::pair<jami::DeviceId, dht::Value::Id>;
 
+/**
+ * Last direct (not relayed) path used with a device
+ */
+struct KnownPath
+{
+    IpAddr local;
+    IpAddr remote;
+    std::chrono::steady_clock::time_point updated;
+    bool udp {false};
+    // TCP port of the device accepting TLS connections, 0 if none
+    uint16_t port {0};
+};
+
+/**
+ * Concurrent attempts to connect to a device: the regular one, one
+ * without relay for devices with a known direct path (dialed over TCP
+ * if the device sent its port, without DHT exchange), one over UDP
+ * if Config::iceTransportRace is enabled and one to the address announced
+ * on the LAN by the device. The first connected socket is
+ * kept, and the pending operations fail only once all the attempts failed.
+ * The ids are set before starting the attempts.
+ */
+struct ConnectRace
+{
+    ConnectRace(dht::Value::Id vid)
+        : vid(vid)
+    {}
+
+    // Id of the regular attempt, used by the pending operations
+    const dht::Value::Id vid;
+    dht::Value::Id directVid {0};
+    dht::Value::Id udpVid {0};
+    dht::Value::Id lanVid {0};
+    std::atomic_bool won {false};
+    std::atomic_uint failures {0};
+
+    std::vector<dht::Value::Id> others(const dht::Value::Id& id) const
+    {
+        std::vector<dht::Value::Id> ret;
+        for (const auto& other : {vid, directVid, udpVid, lanVid})
+            if (other != 0 and other != id)
+                ret.emplace_back(other);
+        return ret;
+    }
+
+    /**
+     * Returns true if all the attempts failed.
+     * @param attemptFailed     per attempt flag, so failures are counted once
+     */
+    bool fail(std::atomic_bool& attemptFailed)
+    {
+        unsigned attempts = 1 + (directVid != 0) + (udpVid != 0) + (lanVid != 0);
+        return not attemptFailed.exchange(true) and ++failures == attempts;
+    }
+};
+
+/**
+ * Connection request or answer sent over a signaling channel.
+ * data is a SignedRequest encrypted for the recipient, so the devices
+ * forwarding the message can't read or alter it.
+ */
+struct SignalingMessage
+{
+    DeviceId to;
+    bool forwarded {false};
+    dht::Blob data;
+    MSGPACK_DEFINE_MAP(to, forwarded, data)
+};
+
+struct SignedRequest
+{
+    dht::Blob owner;     // Packed public key of the sender
+    dht::Blob request;   // Packed PeerConnectionRequest
+    dht::Blob signature; // Of the request and the recipient id
+    MSGPACK_DEFINE_MAP(owner, request, signature)
+};
+
+static dht::Blob
+getSignedData(const dht::Blob& request, const DeviceId& to)
+{
+    dht::Blob data;
+    data.reserve(request.size() + to.size());
+    data.insert(data.end(), request.begin(), request.end());
+    data.insert(data.end(), to.data(), to.data() + to.size());
+    return data;
+}
+
+static std::optional<KnownPath>
+getDirectPath(const IceTransport& ice)
+{
+    if (ice.isRelayed(1))
+        return std::nullopt;
+    return KnownPath {ice.getLocalAddress(1),
+                      ice.getRemoteAddress(1),
+                      std::chrono::steady_clock::now(),
+                      not ice.isTCPEnabled()};
+}
+
 struct ConnectionInfo
 {
     ~ConnectionInfo()
@@ -61,6 +185,113 @@ struct ConnectionInfo
 
     std::function<void(bool)> onConnected_;
     std::unique_ptr<asio::steady_timer> waitForAnswer_ {};
+    // Puts the request on the DHT if sent over signaling channels and not answered
+    std::unique_ptr<asio::steady_timer> dhtFallback_ {};
+
+    // Set if the attempt is part of a race (see ConnectRace)
+    std::shared_ptr<ConnectRace> race_ {};
+    std::shared_ptr<std::atomic_bool> raceFailed_ {};
+    // Selected path, if not relayed
+    std::optional<KnownPath> path_ {};
+    // Set once negotiated over ICE-UDP
+    bool udp_ {false};
+    // TLS directly over TCP (on the LAN or to a known path), without ICE
+    bool lan_ {false};
+};
+
+/**
+ * Destroys the closed connections in the background, without blocking more
+ * than maxWorkers threads of the pool: the destruction joins the threads of
+ * the socket and waits for the TURN deallocation of the ICE transport, up to
+ * the deadline of the connection.
+ */
+class ConnectionTeardown : public std::enable_shared_from_this<ConnectionTeardown>
+{
+public:
+    ConnectionTeardown(unsigned maxWorkers, const std::shared_ptr<dht::log::Logger>& logger)
+        : maxWorkers_(std::max(maxWorkers, 1u))
+        , logger_(logger)
+    {}
+
+    void add(std::vector<std::shared_ptr<ConnectionInfo>>&& infos,
+             std::chrono::steady_clock::time_point deadline)
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        if (queue_.empty() and workers_ == 0) {
+            start_ = std::chrono::steady_clock::now();
+            count_ = 0;
+            socketsDuration_ = {};
+            iceDuration_ = {};
+        }
+        for (auto& info : infos)
+            queue_.emplace_back(Item {std::move(info), deadline});
+        while (workers_ < maxWorkers_ and workers_ < queue_.size()) {
+            workers_++;
+            dht::ThreadPool::io().run([sthis = shared_from_this()] { sthis->work(); });
+        }
+    }
+
+private:
+    struct Item
+    {
+        std::shared_ptr<ConnectionInfo> info;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        while (not queue_.empty()) {
+            auto item = std::move(queue_.front());
+            queue_.pop_front();
+            lk.unlock();
+            auto [sockets, ice] = destroy(std::move(item));
+            lk.lock();
+            count_++;
+            socketsDuration_ += sockets;
+            iceDuration_ += ice;
+        }
+        if (--workers_ == 0 and logger_)
+            logger_->debug("Destroyed {} connections in {} (sockets: {}, ICE: {})",
+                           count_,
+                           dht::print_duration(std::chrono::steady_clock::now() - start_),
+                           dht::print_duration(socketsDuration_),
+                           dht::print_duration(iceDuration_));
+    }
+
+    static std::pair<std::chrono::steady_clock::duration, std::chrono::steady_clock::duration>
+    destroy(Item&& item)
+    {
+        auto& info = item.info;
+        // Still used somewhere, so destroyed by its last owner
+        if (info.use_count() > 1)
+            return {};
+        auto start = std::chrono::steady_clock::now();
+        if (info->socket_) {
+            info->socket_->join();
+            info->socket_.reset();
+        }
+        info->tls_.reset();
+        auto socketsDone = std::chrono::steady_clock::now();
+        if (info->ice_) {
+            info->ice_->setDestructionDeadline(item.deadline);
+            info->ice_.reset();
+        }
+        info.reset();
+        return {socketsDone - start, std::chrono::steady_clock::now() - socketsDone};
+    }
+
+    const unsigned maxWorkers_;
+    std::shared_ptr<dht::log::Logger> logger_;
+
+    std::mutex mutex_ {};
+    std::deque<Item> queue_ {};
+    unsigned workers_ {0};
+    // Statistics of the current batch
+    std::chrono::steady_clock::time_point start_ {};
+    std::size_t count_ {0};
+    std::chrono::steady_clock::duration socketsDuration_ {};
+    std::chrono::steady_clock::duration iceDuration_ {};
 };
 
 /**
@@ -75,12 +306,98 @@ ConnectionManager::Config::getUPnPActive() const
     return false;
 }
 
+class ConnectionManager::SharedContext::Impl
+    : public std::enable_shared_from_this<ConnectionManager::SharedContext::Impl>
+{
+public:
+    Impl(const std::shared_ptr<dht::DhtRunner>& dht,
+         const std::string& cachePath,
+         const std::shared_ptr<dht::log::Logger>& logger)
+        : dht_ {dht}
+        , cachePath_ {cachePath}
+        , logger_ {logger}
+    {
+#ifdef OPENDHT_PROXY_SERVER
+        // Without identity, the runner only delivers the values encrypted
+        // for other keys if asked to
+        dht_->forwardAllMessages(true);
+#else
+        if (logger_)
+            logger_->warn("OpenDHT is built without its proxy server, the shared DHT runner "
+                          "only delivers the requests encrypted for its own identity");
+#endif
+        loadTreatedMessages();
+    }
+
+    /**
+     * Dispatch the requests received on the listen key to the manager.
+     * A single DHT listen is made per key.
+     */
+    void listen(const dht::InfoHash& key, const std::weak_ptr<ConnectionManager::Impl>& manager);
+    void cancelListen(const dht::InfoHash& key, const ConnectionManager::Impl* manager);
+    std::size_t listenCount() const
+    {
+        std::lock_guard<std::mutex> lk(listenersMtx_);
+        return listeners_.size();
+    }
+
+    bool isMessageTreated(std::string_view id);
+
+    std::shared_ptr<dht::DhtRunner> dht_;
+    IceTransportFactory iceFactory_ {};
+
+private:
+    struct Listener
+    {
+        std::weak_ptr<ConnectionManager::Impl> manager;
+        std::shared_future<size_t> token;
+    };
+
+    std::shared_ptr<ConnectionManager::Impl> getManager(const dht::InfoHash& key);
+
+    void loadTreatedMessages();
+    // Must be called with messageMutex_ held.
+    void saveTreatedMessages();
+
+    std::string cachePath_;
+    std::shared_ptr<dht::log::Logger> logger_;
+
+    mutable std::mutex listenersMtx_ {};
+    std::map<dht::InfoHash, Listener> listeners_ {};
+
+    std::mutex messageMutex_ {};
+    std::set<std::string, std::less<>> treatedMessages_ {};
+    // Saves are coalesced, at most one is pending.
+    bool saveScheduled_ {false};
+};
+
 class ConnectionManager::Impl : public std::enable_shared_from_this<ConnectionManager::Impl>
 {
 public:
-    explicit Impl(std::shared_ptr<ConnectionManager::Config> config_)
-        : config_ {std::move(config_)}
-    {}
+    explicit Impl(std::shared_ptr<ConnectionManager::Config> config)
+        : config_ {std::move(config)}
+        , teardown_ {std::make_shared<ConnectionTeardown>(config_->teardownConcurrency,
+                                                          config_->logger)}
+    {
+        if (config_->sharedContext) {
+            sharedContext_ = config_->sharedContext->pimpl_;
+            if (not config_->dht)
+                config_->dht = sharedContext_->dht_;
+        } else {
+            iceFactory_ = std::make_unique<IceTransportFactory>();
+        }
+        if (config_->turnPoolSize > 0)
+            iceFactory()->setTurnPoolSize(config_->turnPoolSize);
+        if (config_->upnpEnabled and not config_->upnpCtrl and config_->ioContext) {
+            auto upnpContext = std::make_shared<upnp::UPnPContext>(config_->ioContext,
+                                                                   config_->logger);
+            upnpContext->setMappingPoolBounds(config_->upnpMinPoolSize, config_->upnpMaxPoolSize);
+            if (not config_->cachePath.empty())
+                upnpContext->setCachePath(config_->cachePath);
+            config_->upnpCtrl = std::make_shared<upnp::Controller>(upnpContext);
+            upnpContext_ = std::move(upnpContext);
+        }
+    }
     ~Impl() {}
 
     std::shared_ptr<dht::DhtRunner> dht() { return config_->dht; }
@@ -109,15 +426,61 @@ public:
                 info->socket_->shutdown();
             if (info->waitForAnswer_)
                 info->waitForAnswer_->cancel();
+            if (info->dhtFallback_)
+                info->dhtFallback_->cancel();
         }
-        if (!unused.empty())
-            dht::ThreadPool::io().run([infos = std::move(unused)]() mutable { infos.clear(); });
+        teardown(std::move(unused));
+    }
+
+    void teardown(std::vector<std::shared_ptr<ConnectionInfo>>&& infos)
+    {
+        if (!infos.empty())
+            teardown_->add(std::move(infos),
+                           std::chrono::steady_clock::now() + config_->teardownTimeout);
     }
 
     void shutdown()
     {
         if (isDestroying_.exchange(true))
             return;
+        auto start = std::chrono::steady_clock::now();
+        if (sharedContext_ and listenKey_)
+            sharedContext_->cancelListen(listenKey_, this);
+        {
+            std::lock_guard<std::mutex> lk(idleMtx_);
+            if (idleTimer_)
+                idleTimer_->cancel();
+            idleWheel_.clear();
+            idleCount_ = 0;
+        }
+        {
+            std::lock_guard<std::mutex> lk(turnPoolMtx_);
+            if (turnPoolTimer_)
+                turnPoolTimer_->cancel();
+        }
+        {
+            std::lock_guard<std::mutex> lk(signalingMtx_);
+            signalingChannels_.clear();
+            signalingReplyHops_.clear();
+            signalingForwards_.clear();
+            signalingAnswers_.clear();
+        }
+        {
+            std::lock_guard<std::mutex> lk(lanMtx_);
+            if (tcpAcceptor_) {
+                asio::error_code ec;
+                tcpAcceptor_->close(ec);
+                tcpAcceptor_.reset();
+            }
+            tcpPort_ = 0;
+            lanDiscovery_.reset();
+            lanIncoming_.clear();
+        }
+        // Mappings are released on the IGD, the controllers of the
+        // remaining transports find it shut down
+        if (upnpContext_)
+            upnpContext_->shutdown();
+        auto listenersDone = std::chrono::steady_clock::now();
         decltype(pendingOperations_) po;
         {
             std::lock_guard<std::mutex> lk(connectCbsMtx_);
@@ -129,14 +492,26 @@ public:
             for (auto& [id, pending] : pcbs.waiting)
                 pending.cb(nullptr, deviceId);
         }
+        auto pendingDone = std::chrono::steady_clock::now();
 
+        // The connections are closed now, and destroyed in the background
         removeUnusedConnections();
+        if (config_->logger)
+            config_->logger->debug("Shutdown in {} (listeners: {}, pending operations: {}, "
+                                   "connections: {})",
+                                   dht::print_duration(std::chrono::steady_clock::now() - start),
+                                   dht::print_duration(listenersDone - start),
+                                   dht::print_duration(pendingDone - listenersDone),
+                                   dht::print_duration(std::chrono::steady_clock::now()
+                                                       - pendingDone));
     }
 
     void connectDeviceStartIce(const std::shared_ptr<dht::crypto::PublicKey>& devicePk,
                                const dht::Value::Id& vid,
                                const std::string& connType,
                                std::function<void(bool)> onConnected);
+    void putRequest(const std::shared_ptr<dht::crypto::PublicKey>& devicePk,
+                    const std::shared_ptr<dht::Value>& value);
     void onResponse(const asio::error_code& ec, const DeviceId& deviceId, const dht::Value::Id& vid);
     bool connectDeviceOnNegoDone(const DeviceId& deviceId,
                                  const std::string& name,
@@ -147,24 +522,67 @@ public:
                        ConnectCallback cb,
                        bool noNewSocket = false,
                        bool forceNewSocket = false,
-                       const std::string& connType = "");
+                       const std::string& connType = "",
+                       ChannelType type = ChannelType::STREAM);
     void connectDevice(const std::shared_ptr<dht::crypto::Certificate>& cert,
                        const std::string& name,
                        ConnectCallback cb,
                        bool noNewSocket = false,
                        bool forceNewSocket = false,
-                       const std::string& connType = "");
+                       const std::string& connType = "",
+                       ChannelType type = ChannelType::STREAM);
+    /**
+     * Negotiate a new ICE transport, then a TLS session with the device
+     * @param race      set if racing with another attempt
+     */
+    void startConnectionAttempt(const std::shared_ptr<dht::crypto::PublicKey>& devicePk,
+                                const std::string& name,
+                                const std::shared_ptr<dht::crypto::Certificate>& cert,
+                                const dht::Value::Id& vid,
+                                const std::string& connType,
+                                IceTransportOptions&& ice_config,
+                                const std::shared_ptr<ConnectRace>& race);
+    // Cancel an attempt that lost its race
+    void dropConnectionAttempt(const DeviceId& deviceId, const dht::Value::Id& vid);
+
+    // Accept the TLS connections over TCP and announce the device on the LAN
+    void startDirectConnections();
+    void acceptTcpConnection();
+    void onTcpConnection(asio::ip::tcp::socket&& socket);
+    IpAddr getLanAddress(const DeviceId& deviceId) const;
+    // Port accepting the TLS connections, 0 if none
+    uint16_t getTcpPort() const
+    {
+        std::lock_guard<std::mutex> lk(lanMtx_);
+        return tcpPort_;
+    }
+    /**
+     * Negotiate a TLS session over TCP with the device, on the address it
+     * announced on the LAN or of its known path, racing with the ICE attempts
+     * @param onUnreachable     if set, called instead of failing the attempt
+     *                          if the address can't be reached
+     */
+    void startTcpAttempt(const std::shared_ptr<dht::crypto::Certificate>& cert,
+                         const std::string& name,
+                         const IpAddr& addr,
+                         const dht::Value::Id& vid,
+                         const std::shared_ptr<ConnectRace>& race,
+                         std::function<void()>&& onUnreachable = {});
     /**
      * Send a ChannelRequest on the TLS socket. Triggers cb when ready
      * @param sock      socket used to send the request
      * @param name      channel's name
+     * @param type      channel's type
      * @param vid       channel's id
      * @param deviceId  to identify the linked ConnectCallback
      */
     void sendChannelRequest(std::shared_ptr<MultiplexedSocket>& sock,
                             const std::string& name,
+                            ChannelType type,
                             const DeviceId& deviceId,
                             const dht::Value::Id& vid);
+    void writeChannelRequest(const std::shared_ptr<MultiplexedSocket>& sock,
+                             const std::shared_ptr<ChannelSocket>& channelSock);
     /**
      * Triggered when a PeerConnectionRequest comes from the DHT
      */
@@ -177,8 +595,54 @@ public:
                           const std::shared_ptr<dht::crypto::Certificate>& cert);
 
     void addNewMultiplexedSocket(const CallbackId& id, const std::shared_ptr<ConnectionInfo>& info);
+
+    /**
+     * Idle connections reaper. Sockets are checked once their deadline
+     * is reached, and closed if they have no channel and no traffic since
+     * Config::idleConnectionTimeout. Otherwise they are rescheduled.
+     */
+    void watchIdleSocket(const std::shared_ptr<MultiplexedSocket>& socket);
+    // Must be called with idleMtx_ held.
+    void scheduleIdleCheck(std::weak_ptr<MultiplexedSocket>&& socket,
+                           std::chrono::steady_clock::time_point deadline);
+    void armIdleTimer(std::chrono::steady_clock::time_point expiry);
+    void onIdleTick();
+
+    /**
+     * Signaling over the connected devices (see Config::signalingEnabled)
+     */
+    void openSignalingChannel(const std::shared_ptr<MultiplexedSocket>& sock);
+    void onSignalingChannel(const std::shared_ptr<ChannelSocket>& channel);
+    // Channels to send a request or an answer to the device, the device itself first
+    std::vector<std::shared_ptr<ChannelSocket>> getSignalingRoutes(const DeviceId& deviceId,
+                                                                   const dht::Value::Id& id);
+    // Returns false if the request was not sent over any channel
+    bool sendSignaling(const PeerConnectionRequest& req,
+                       const std::shared_ptr<dht::crypto::PublicKey>& devicePk);
+    void onSignalingMessage(const DeviceId& hop, SignalingMessage&& msg);
+    // Returns true if the device has a certificate issued by the account
+    bool isAccountDevice(const DeviceId& deviceId) const;
+    void putAnswer(const std::shared_ptr<dht::crypto::PublicKey>& to,
+                   const std::shared_ptr<dht::Value>& value);
+    /**
+     * Put the value encrypted for the device on its listen key. With a
+     * shared context, the value is signed and encrypted with the identity
+     * of the manager, as the shared DHT runner has none.
+     */
+    void putEncrypted(const std::shared_ptr<dht::crypto::PublicKey>& to,
+                      const std::shared_ptr<dht::Value>& value,
+                      dht::DoneCallbackSimple&& cb);
+    // Returns 1 if the socket carries the signaling channel of its device
+    std::size_t signalingChannelCount(const MultiplexedSocket& socket);
+
     void onPeerResponse(const PeerConnectionRequest& req);
     void onDhtConnected(const dht::crypto::PublicKey& devicePk);
+    // Handle a request received on the listen key, or over a signaling
+    // channel if not fromDht. Returns false to stop listening.
+    bool onDhtRequest(PeerConnectionRequest&& req, bool fromDht = true);
+    // Decrypt a value received by the shared context, and handle it if
+    // it is a request for this manager. Returns false to stop listening.
+    bool onDhtValue(const dht::Value& value);
 
     const std::shared_future<tls::DhParams> dhParams() const;
     tls::CertificateStore& certStore() const { return *config_->certStore; }
@@ -273,8 +737,21 @@ public:
                               const std::string& name = "");
 
     std::shared_ptr<ConnectionManager::Config> config_;
-
-    IceTransportFactory iceFactory_ {};
+    // Destroys the closed connections, may outlive the manager
+    std::shared_ptr<ConnectionTeardown> teardown_;
+
+    // Set if the manager shares its DHT dispatch, treated requests and
+    // ICE transport factory with other managers.
+    std::shared_ptr<ConnectionManager::SharedContext::Impl> sharedContext_;
+    // Listen key of the requests, if dispatched by the shared context.
+    dht::InfoHash listenKey_ {};
+
+    // Only set if there is no shared context.
+    std::unique_ptr<IceTransportFactory> iceFactory_;
+    IceTransportFactory* iceFactory() const
+    {
+        return sharedContext_ ? &sharedContext_->iceFactory_ : iceFactory_.get();
+    }
 
     mutable std::mt19937_64 rand;
 
@@ -285,6 +762,69 @@ public:
     // each device can have multiple multiplexed sockets.
     std::map<CallbackId, std::shared_ptr<ConnectionInfo>> infos_ {};
 
+    std::mutex knownPathsMtx_ {};
+    std::map<DeviceId, KnownPath> knownPaths_ {};
+
+    // Sockets negotiated per ICE transport
+    std::atomic<std::size_t> udpSockets_ {0};
+    std::atomic<std::size_t> tcpSockets_ {0};
+
+    std::optional<KnownPath> getKnownPath(const DeviceId& deviceId)
+    {
+        std::lock_guard<std::mutex> lk(knownPathsMtx_);
+        auto it = knownPaths_.find(deviceId);
+        if (it == knownPaths_.end())
+            return std::nullopt;
+        if (std::chrono::steady_clock::now() - it->second.updated > KNOWN_PATH_LIFETIME) {
+            knownPaths_.erase(it);
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    void setKnownPath(const DeviceId& deviceId, const std::optional<KnownPath>& path)
+    {
+        std::lock_guard<std::mutex> lk(knownPathsMtx_);
+        if (path)
+            knownPaths_[deviceId] = *path;
+        else
+            knownPaths_.erase(deviceId);
+    }
+
+    std::mutex turnPoolMtx_ {};
+    std::unique_ptr<asio::steady_timer> turnPoolTimer_ {};
+    void scheduleTurnPoolRefresh();
+
+    std::mutex idleMtx_ {};
+    std::unique_ptr<asio::steady_timer> idleTimer_ {};
+    std::vector<std::vector<std::weak_ptr<MultiplexedSocket>>> idleWheel_ {};
+    std::size_t idleCursor_ {0};
+    std::size_t idleCount_ {0};
+    std::chrono::steady_clock::duration idleTick_ {};
+    // Time of the slot under the cursor
+    std::chrono::steady_clock::time_point idleWheelTime_ {};
+    std::chrono::steady_clock::time_point idleArmedAt_ {std::chrono::steady_clock::time_point::max()};
+
+    std::mutex signalingMtx_ {};
+    // Ready signaling channels, the last one per device
+    std::map<DeviceId, std::shared_ptr<ChannelSocket>> signalingChannels_ {};
+    // Device that sent a request over signaling, so the answer goes back the
+    // same way
+    std::map<dht::Value::Id, std::pair<DeviceId, std::chrono::steady_clock::time_point>>
+        signalingReplyHops_ {};
+    // Messages forwarded for each device since the start of its period
+    std::map<DeviceId, std::pair<std::chrono::steady_clock::time_point, unsigned>>
+        signalingForwards_ {};
+    // Answers sent over signaling only, put on the DHT if the request comes
+    // again from the DHT (the answer was lost on the way)
+    struct SignalingAnswer
+    {
+        std::shared_ptr<dht::crypto::PublicKey> to;
+        std::shared_ptr<dht::Value> value;
+        std::chrono::steady_clock::time_point sent;
+    };
+    std::map<dht::Value::Id, SignalingAnswer> signalingAnswers_ {};
+
     std::shared_ptr<ConnectionInfo> getInfo(const DeviceId& deviceId, const dht::Value::Id& id)
     {
         std::lock_guard<std::mutex> lk(infosMtx_);
@@ -294,12 +834,14 @@ public:
         return {};
     }
 
-    std::shared_ptr<ConnectionInfo> getConnectedInfo(const DeviceId& deviceId)
+    // With reliable, skip the sockets negotiated over ICE-UDP
+    std::shared_ptr<ConnectionInfo> getConnectedInfo(const DeviceId& deviceId, bool reliable = false)
     {
         std::lock_guard<std::mutex> lk(infosMtx_);
         auto it = std::find_if(infos_.begin(), infos_.end(), [&](const auto& item) {
             auto& [key, value] = item;
-            return key.first == deviceId && value && value->socket_;
+            return key.first == deviceId && value && value->socket_
+                   && not(reliable && value->udp_);
         });
         if (it != infos_.end())
             return it->second;
@@ -310,6 +852,18 @@ public:
     ConnectionReadyCallback connReadyCb_ {};
     onICERequestCallback iceReqCb_ {};
 
+    mutable std::mutex lanMtx_ {};
+    std::shared_ptr<LanDiscovery> lanDiscovery_ {};
+    std::unique_ptr<asio::ip::tcp::acceptor> tcpAcceptor_ {};
+    uint16_t tcpPort_ {0};
+    // Incoming TCP connections, until the TLS session is ready
+    struct IncomingTcp
+    {
+        std::shared_ptr<ConnectionInfo> info;
+        asio::ip::address source;
+    };
+    std::map<dht::Value::Id, IncomingTcp> lanIncoming_ {};
+
     /**
      * Stores callback from connectDevice
      * @note: each device needs a vector because several connectDevice can
@@ -321,6 +875,7 @@ public:
     {
         std::string name;
         ConnectCallback cb;
+        ChannelType type {ChannelType::STREAM};
     };
     struct PendingOperations {
         std::map<dht::Value::Id, PendingCb> connecting;
@@ -368,9 +923,9 @@ public:
             cb.cb(sock, deviceId);
     }
 
-    std::map<dht::Value::Id, std::string> getPendingIds(const DeviceId& deviceId, const dht::Value::Id vid = 0)
+    std::map<dht::Value::Id, std::pair<std::string, ChannelType>> getPendingIds(const DeviceId& deviceId, const dht::Value::Id vid = 0)
     {
-        std::map<dht::Value::Id, std::string> ret;
+        std::map<dht::Value::Id, std::pair<std::string, ChannelType>> ret;
         std::lock_guard<std::mutex> lk(connectCbsMtx_);
         auto it = pendingOperations_.find(deviceId);
         if (it == pendingOperations_.end())
@@ -378,12 +933,35 @@ public:
         auto& pendingOp = it->second;
         for (const auto& [id, pc]: pendingOp.connecting) {
             if (vid == 0 || id == vid)
-                ret[id] = pc.name;
+                ret[id] = {pc.name, pc.type};
         }
         for (const auto& [id, pc]: pendingOp.waiting) {
             if (vid == 0 || id == vid)
-                ret[id] = pc.name;
+                ret[id] = {pc.name, pc.type};
+        }
+        return ret;
+    }
+
+    // Removes the pending stream channels, they can't use an unreliable socket
+    std::vector<PendingCb> takePendingStreams(const DeviceId& deviceId)
+    {
+        std::vector<PendingCb> ret;
+        std::lock_guard<std::mutex> lk(connectCbsMtx_);
+        auto it = pendingOperations_.find(deviceId);
+        if (it == pendingOperations_.end())
+            return ret;
+        for (auto* pendings : {&it->second.connecting, &it->second.waiting}) {
+            for (auto pc = pendings->begin(); pc != pendings->end();) {
+                if (pc->second.type == ChannelType::STREAM) {
+                    ret.emplace_back(std::move(pc->second));
+                    pc = pendings->erase(pc);
+                } else {
+                    ++pc;
+                }
+            }
         }
+        if (it->second.connecting.empty() && it->second.waiting.empty())
+            pendingOperations_.erase(it);
         return ret;
     }
 
@@ -405,6 +983,8 @@ public:
     }
 
     std::atomic_bool isDestroying_ {false};
+    // Created for this manager, if not given by the config
+    std::shared_ptr<upnp::UPnPContext> upnpContext_ {};
 };
 
 void
@@ -447,23 +1027,20 @@ ConnectionManager::Impl::connectDeviceStartIce(
     val.id = vid; /* Random id for the message unicity */
     val.ice_msg = icemsg.str();
     val.connType = connType;
+    val.direct = info->race_ and info->race_->directVid == vid;
+    val.udp = not ice->isTCPEnabled();
+    val.port = getTcpPort();
+
+    // Try the connected devices first, the DHT is used if they don't answer in time
+    auto sentOverSignaling = sendSignaling(val, devicePk);
 
     auto value = std::make_shared<dht::Value>(std::move(val));
     value->user_type = "peer_request";
 
-    // Send connection request through DHT
     if (config_->logger)
         config_->logger->debug("Request connection to {}", deviceId);
-    dht()->putEncrypted(dht::InfoHash::get(PeerConnectionRequest::key_prefix
-                                           + devicePk->getId().toString()),
-                        devicePk,
-                        value,
-                        [l=config_->logger,deviceId](bool ok) {
-                            if (l)
-                                l->debug("Sent connection request to {:s}. Put encrypted {:s}",
-                                       deviceId,
-                                       (ok ? "ok" : "failed"));
-                        });
+    if (!sentOverSignaling)
+        putRequest(devicePk, value);
     // Wait for call to onResponse() operated by DHT
     if (isDestroying_) {
         onConnected(true); // This avoid to wait new negotiation when destroying
@@ -476,6 +1053,70 @@ ConnectionManager::Impl::connectDeviceStartIce(
                                                                     + DHT_MSG_TIMEOUT);
     info->waitForAnswer_->async_wait(
         std::bind(&ConnectionManager::Impl::onResponse, this, std::placeholders::_1, deviceId, vid));
+
+    if (sentOverSignaling) {
+        info->dhtFallback_ = std::make_unique<asio::steady_timer>(*config_->ioContext,
+                                                                  std::chrono::steady_clock::now()
+                                                                      + SIGNALING_FALLBACK_DELAY);
+        info->dhtFallback_->async_wait(
+            [w = weak(), devicePk, value, deviceId, vid](const asio::error_code& ec) {
+                if (ec == asio::error::operation_aborted)
+                    return;
+                auto sthis = w.lock();
+                if (!sthis)
+                    return;
+                auto info = sthis->getInfo(deviceId, vid);
+                if (!info)
+                    return;
+                {
+                    std::lock_guard<std::mutex> lk(info->mutex_);
+                    if (info->responseReceived_)
+                        return;
+                }
+                if (sthis->config_->logger)
+                    sthis->config_->logger->debug("No answer over signaling from {}, use the DHT",
+                                                  deviceId);
+                sthis->putRequest(devicePk, value);
+            });
+    }
+}
+
+void
+ConnectionManager::Impl::putRequest(const std::shared_ptr<dht::crypto::PublicKey>& devicePk,
+                                    const std::shared_ptr<dht::Value>& value)
+{
+    // Send connection request through DHT
+    putEncrypted(devicePk,
+                 value,
+                 [l=config_->logger,deviceId=devicePk->getLongId()](bool ok) {
+                     if (l)
+                         l->debug("Sent connection request to {:s}. Put encrypted {:s}",
+                                deviceId,
+                                (ok ? "ok" : "failed"));
+                 });
+}
+
+void
+ConnectionManager::Impl::putEncrypted(const std::shared_ptr<dht::crypto::PublicKey>& to,
+                                      const std::shared_ptr<dht::Value>& value,
+                                      dht::DoneCallbackSimple&& cb)
+{
+    auto key = dht::InfoHash::get(PeerConnectionRequest::key_prefix + to->getId().toString());
+    if (not sharedContext_) {
+        dht()->putEncrypted(key, to, value, std::move(cb));
+        return;
+    }
+    std::shared_ptr<dht::Value> encrypted;
+    try {
+        encrypted = std::make_shared<dht::Value>(value->encrypt(*identity().first, *to));
+    } catch (const std::exception& e) {
+        if (config_->logger)
+            config_->logger->error("Unable to encrypt value for {}: {}", to->getLongId(), e.what());
+        if (cb)
+            cb(false);
+        return;
+    }
+    dht()->put(key, std::move(encrypted), std::move(cb));
 }
 
 void
@@ -541,6 +1182,10 @@ ConnectionManager::Impl::connectDeviceOnNegoDone(
             config_->logger->error("No ICE detected or not running");
         return false;
     }
+    info->path_ = getDirectPath(*ice);
+    if (info->path_)
+        info->path_->port = info->response_.port;
+    info->udp_ = not ice->isTCPEnabled();
 
     // Build socket
     auto endpoint = std::make_unique<IceSocketEndpoint>(std::shared_ptr<IceTransport>(
@@ -554,7 +1199,8 @@ ConnectionManager::Impl::connectDeviceOnNegoDone(
                                                      certStore(),
                                                      identity(),
                                                      dhParams(),
-                                                     *cert);
+                                                     *cert,
+                                                     config_->tlsRxBufferSize);
 
     info->tls_->setOnReady(
         [w = weak(), deviceId = std::move(deviceId), vid = std::move(vid), name = std::move(name)](
@@ -571,7 +1217,8 @@ ConnectionManager::Impl::connectDevice(const DeviceId& deviceId,
                                        ConnectCallback cb,
                                        bool noNewSocket,
                                        bool forceNewSocket,
-                                       const std::string& connType)
+                                       const std::string& connType,
+                                       ChannelType type)
 {
     if (!dht()) {
         cb(nullptr, deviceId);
@@ -588,7 +1235,8 @@ ConnectionManager::Impl::connectDevice(const DeviceId& deviceId,
                      cb = std::move(cb),
                      noNewSocket,
                      forceNewSocket,
-                     connType](const std::shared_ptr<dht::crypto::Certificate>& cert) {
+                     connType,
+                     type](const std::shared_ptr<dht::crypto::Certificate>& cert) {
                         if (!cert) {
                             if (auto shared = w.lock())
                                 if (shared->config_->logger)
@@ -604,7 +1252,8 @@ ConnectionManager::Impl::connectDevice(const DeviceId& deviceId,
                                                   std::move(cb),
                                                   noNewSocket,
                                                   forceNewSocket,
-                                                  connType);
+                                                  connType,
+                                                  type);
                         } else
                             cb(nullptr, deviceId);
                     });
@@ -616,7 +1265,8 @@ ConnectionManager::Impl::connectDevice(const std::shared_ptr<dht::crypto::Certif
                                        ConnectCallback cb,
                                        bool noNewSocket,
                                        bool forceNewSocket,
-                                       const std::string& connType)
+                                       const std::string& connType,
+                                       ChannelType type)
 {
     // Avoid dht operation in a DHT callback to avoid deadlocks
     dht::ThreadPool::computation().run([w = weak(),
@@ -625,7 +1275,8 @@ ConnectionManager::Impl::connectDevice(const std::shared_ptr<dht::crypto::Certif
                      cb = std::move(cb),
                      noNewSocket,
                      forceNewSocket,
-                     connType] {
+                     connType,
+                     type] {
         auto devicePk = cert->getSharedPublicKey();
         auto deviceId = devicePk->getLongId();
         auto sthis = w.lock();
@@ -652,20 +1303,21 @@ ConnectionManager::Impl::connectDevice(const std::shared_ptr<dht::crypto::Certif
             // socket is negotiated and first channel is pending
             // so return only after we checked the info
             if (isConnectingToDevice && !forceNewSocket)
-                pendingsIt->second.waiting[vid] = PendingCb {name, std::move(cb)};
+                pendingsIt->second.waiting[vid] = PendingCb {name, std::move(cb), type};
             else
-                sthis->pendingOperations_[deviceId].connecting[vid] = PendingCb {name, std::move(cb)};
+                sthis->pendingOperations_[deviceId].connecting[vid] = PendingCb {name, std::move(cb), type};
         }
 
         // Check if already negotiated
         CallbackId cbId(deviceId, vid);
-        if (auto info = sthis->getConnectedInfo(deviceId)) {
+        // A stream needs a reliable socket, not one negotiated over ICE-UDP
+        if (auto info = sthis->getConnectedInfo(deviceId, type == ChannelType::STREAM)) {
             std::lock_guard<std::mutex> lk(info->mutex_);
             if (info->socket_) {
                 if (sthis->config_->logger)
                     sthis->config_->logger->debug("Peer already connected to {}. Add a new channel", deviceId);
                 info->cbIds_.emplace(cbId);
-                sthis->sendChannelRequest(info->socket_, name, deviceId, vid);
+                sthis->sendChannelRequest(info->socket_, name, type, deviceId, vid);
                 return;
             }
         }
@@ -681,108 +1333,483 @@ ConnectionManager::Impl::connectDevice(const std::shared_ptr<dht::crypto::Certif
             return;
         }
 
-        // Note: used when the ice negotiation fails to erase
-        // all stored structures.
-        auto eraseInfo = [w, cbId] {
-            if (auto shared = w.lock()) {
-                // If no new socket is specified, we don't try to generate a new socket
-                shared->executePendingOperations(cbId.first, cbId.second, nullptr);
-                std::lock_guard<std::mutex> lk(shared->infosMtx_);
-                shared->infos_.erase(cbId);
-            }
-        };
-
         // If no socket exists, we need to initiate an ICE connection.
         sthis->getIceOptions([w,
-                              deviceId = std::move(deviceId),
                               devicePk = std::move(devicePk),
                               name = std::move(name),
                               cert = std::move(cert),
                               vid,
                               connType,
-                              eraseInfo](auto&& ice_config) {
+                              type](auto&& ice_config) {
             auto sthis = w.lock();
-            if (!sthis) {
-                dht::ThreadPool::io().run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
+            if (!sthis)
                 return;
+            // Without retransmission over DTLS, UDP only carries datagram channels
+            auto transportRace = sthis->config_->iceTransportRace and type == ChannelType::DATAGRAM;
+            auto path = sthis->getKnownPath(devicePk->getLongId());
+            auto lanAddr = sthis->getLanAddress(devicePk->getLongId());
+            std::shared_ptr<ConnectRace> race;
+            if (path or transportRace or lanAddr) {
+                race = std::make_shared<ConnectRace>(vid);
+                if (path)
+                    race->directVid = ValueIdDist(1, ID_MAX_VAL)(sthis->rand);
+                if (transportRace)
+                    race->udpVid = ValueIdDist(1, ID_MAX_VAL)(sthis->rand);
+                if (lanAddr)
+                    race->lanVid = ValueIdDist(1, ID_MAX_VAL)(sthis->rand);
             }
-            ice_config.tcpEnable = true;
-            ice_config.onInitDone = [w,
-                                     deviceId = std::move(deviceId),
-                                     devicePk = std::move(devicePk),
-                                     name = std::move(name),
-                                     cert = std::move(cert),
-                                     vid,
-                                     connType,
-                                     eraseInfo](bool ok) {
-                dht::ThreadPool::io().run([w = std::move(w),
-                                           devicePk = std::move(devicePk),
-                                           vid = std::move(vid),
-                                           eraseInfo,
-                                           connType, ok] {
+            if (lanAddr)
+                sthis->startTcpAttempt(cert, name, lanAddr, race->lanVid, race);
+            if (path) {
+                // The last path was direct, so race an attempt without relay
+                // (faster to gather and to check) with the regular one.
+                auto directConfig = ice_config;
+                directConfig.turnServers.clear();
+                if (path->local.isPrivate() and path->remote.isPrivate())
+                    directConfig.stunServers.clear();
+                directConfig.tcpEnable = not(transportRace and path->udp);
+                auto startDirect = [w,
+                                    devicePk,
+                                    name,
+                                    cert,
+                                    connType,
+                                    race,
+                                    path = *path,
+                                    directConfig = std::move(directConfig)]() mutable {
                     auto sthis = w.lock();
-                    if (!ok && sthis && sthis->config_->logger)
-                        sthis->config_->logger->error("Cannot initialize ICE session.");
-                    if (!sthis || !ok) {
-                        eraseInfo();
+                    if (!sthis or sthis->isDestroying_ or race->won)
                         return;
-                    }
-                    sthis->connectDeviceStartIce(devicePk, vid, connType, [=](bool ok) {
-                        if (!ok) {
-                            dht::ThreadPool::io().run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
-                        }
-                    });
-                });
-            };
-            ice_config.onNegoDone = [w,
-                    deviceId,
-                    name,
-                     cert = std::move(cert),
-                     vid,
-                     eraseInfo](bool ok) {
-                dht::ThreadPool::io().run([w = std::move(w),
-                                           deviceId = std::move(deviceId),
-                                           name = std::move(name),
-                                           cert = std::move(cert),
-                                           vid = std::move(vid),
-                                           eraseInfo = std::move(eraseInfo),
-                                           ok] {
-                    auto sthis = w.lock();
-                    if (!ok && sthis && sthis->config_->logger)
-                        sthis->config_->logger->error("ICE negotiation failed.");
-                    if (!sthis || !ok || !sthis->connectDeviceOnNegoDone(deviceId, name, vid, cert))
-                        eraseInfo();
-                });
-            };
-
-            auto info = std::make_shared<ConnectionInfo>();
-            {
-                std::lock_guard<std::mutex> lk(sthis->infosMtx_);
-                sthis->infos_[{deviceId, vid}] = info;
+                    if (sthis->config_->logger)
+                        sthis->config_->logger->debug("Try known path {} <-> {} ({}) to {}",
+                                                      path.local.toString(true),
+                                                      path.remote.toString(true),
+                                                      directConfig.tcpEnable ? "TCP" : "UDP",
+                                                      devicePk->getLongId());
+                    sthis->startConnectionAttempt(devicePk,
+                                                  name,
+                                                  cert,
+                                                  race->directVid,
+                                                  connType,
+                                                  std::move(directConfig),
+                                                  race);
+                };
+                if (path->port and path->remote.isIpv4()) {
+                    // The device accepts TLS connections, dial it without
+                    // any DHT exchange. ICE is only needed if unreachable.
+                    auto addr = path->remote;
+                    addr.setPort(path->port);
+                    sthis->startTcpAttempt(cert, name, addr, race->directVid, race, std::move(startDirect));
+                } else {
+                    startDirect();
+                }
             }
-            std::unique_lock<std::mutex> lk {info->mutex_};
-            ice_config.master = false;
-            ice_config.streamsCount = 1;
-            ice_config.compCountPerStream = 1;
-            info->ice_ = sthis->iceFactory_.createUTransport("");
-            if (!info->ice_) {
-                if (sthis->config_->logger)
-                    sthis->config_->logger->error("Cannot initialize ICE session.");
+            if (not transportRace) {
+                ice_config.tcpEnable = true;
+                sthis->startConnectionAttempt(devicePk,
+                                              name,
+                                              cert,
+                                              vid,
+                                              connType,
+                                              std::move(ice_config),
+                                              race);
+                return;
+            }
+
+            // Happy eyeballs: start the transport of the last direct path
+            // (TCP by default), then the other one after a delay, unless a
+            // socket is already connected.
+            auto udpFirst = path and path->udp;
+            auto udpConfig = ice_config;
+            udpConfig.tcpEnable = false;
+            ice_config.tcpEnable = true;
+            auto first = udpFirst ? std::move(udpConfig) : std::move(ice_config);
+            auto second = udpFirst ? std::move(ice_config) : std::move(udpConfig);
+            auto secondVid = udpFirst ? vid : race->udpVid;
+            sthis->startConnectionAttempt(devicePk,
+                                          name,
+                                          cert,
+                                          udpFirst ? race->udpVid : vid,
+                                          connType,
+                                          std::move(first),
+                                          race);
+            auto timer = std::make_shared<asio::steady_timer>(*sthis->config_->ioContext,
+                                                              sthis->config_->iceRaceDelay);
+            timer->async_wait([w,
+                               timer,
+                               devicePk,
+                               name,
+                               cert,
+                               secondVid,
+                               connType,
+                               second = std::move(second),
+                               race](const asio::error_code& ec) mutable {
+                auto sthis = w.lock();
+                if (ec or !sthis or sthis->isDestroying_ or race->won)
+                    return;
+                sthis->startConnectionAttempt(devicePk,
+                                              name,
+                                              cert,
+                                              secondVid,
+                                              connType,
+                                              std::move(second),
+                                              race);
+            });
+        });
+    });
+}
+
+void
+ConnectionManager::Impl::startConnectionAttempt(
+    const std::shared_ptr<dht::crypto::PublicKey>& devicePk,
+    const std::string& name,
+    const std::shared_ptr<dht::crypto::Certificate>& cert,
+    const dht::Value::Id& vid,
+    const std::string& connType,
+    IceTransportOptions&& ice_config,
+    const std::shared_ptr<ConnectRace>& race)
+{
+    auto w = weak();
+    auto deviceId = devicePk->getLongId();
+    auto raceFailed = std::make_shared<std::atomic_bool>(false);
+    // The events of the attempt run in order, off the ICE threads
+    auto executor = std::make_shared<SerialExecutor>(config_->logger);
+    // Note: used when the ice negotiation fails to erase
+    // all stored structures.
+    auto eraseInfo = [w, cbId = CallbackId(deviceId, vid), race, raceFailed] {
+        if (auto shared = w.lock()) {
+            if (race and cbId.second == race->directVid and not race->won)
+                shared->setKnownPath(cbId.first, std::nullopt);
+            // With a race, the pending operations fail once all the attempts failed
+            if (not race or race->fail(*raceFailed))
+                shared->executePendingOperations(cbId.first, race ? race->vid : cbId.second, nullptr);
+            std::lock_guard<std::mutex> lk(shared->infosMtx_);
+            shared->infos_.erase(cbId);
+        }
+    };
+
+    ice_config.onInitDone = [w,
+                             devicePk,
+                             vid,
+                             connType,
+                             executor,
+                             eraseInfo](bool ok) {
+        executor->run([w = std::move(w),
+                       devicePk = std::move(devicePk),
+                       vid = std::move(vid),
+                       executor,
+                       eraseInfo,
+                       connType, ok] {
+            auto sthis = w.lock();
+            if (!ok && sthis && sthis->config_->logger)
+                sthis->config_->logger->error("Cannot initialize ICE session.");
+            if (!sthis || !ok) {
                 eraseInfo();
                 return;
             }
-            // We need to detect any shutdown if the ice session is destroyed before going to the
-            // TLS session;
-            info->ice_->setOnShutdown([eraseInfo]() {
-                dht::ThreadPool::io().run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
+            sthis->connectDeviceStartIce(devicePk, vid, connType, [=](bool ok) {
+                if (!ok) {
+                    executor->run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
+                }
             });
-            try {
-                info->ice_->initIceInstance(ice_config);
-            } catch (const std::exception& e) {
-                if (sthis->config_->logger)
-                    sthis->config_->logger->error("{}", e.what());
-                dht::ThreadPool::io().run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
+        });
+    };
+    ice_config.onNegoDone = [w, deviceId, name, cert, vid, executor, eraseInfo](bool ok) {
+        executor->run([w = std::move(w),
+                       deviceId = std::move(deviceId),
+                       name = std::move(name),
+                       cert = std::move(cert),
+                       vid = std::move(vid),
+                       eraseInfo = std::move(eraseInfo),
+                       ok] {
+            auto sthis = w.lock();
+            if (!ok && sthis && sthis->config_->logger)
+                sthis->config_->logger->error("ICE negotiation failed.");
+            if (!sthis || !ok || !sthis->connectDeviceOnNegoDone(deviceId, name, vid, cert))
+                eraseInfo();
+        });
+    };
+
+    auto info = std::make_shared<ConnectionInfo>();
+    info->race_ = race;
+    info->raceFailed_ = raceFailed;
+    {
+        std::lock_guard<std::mutex> lk(infosMtx_);
+        infos_[{deviceId, vid}] = info;
+    }
+    std::unique_lock<std::mutex> lk {info->mutex_};
+    ice_config.master = false;
+    ice_config.streamsCount = 1;
+    ice_config.compCountPerStream = 1;
+    info->ice_ = iceFactory()->createUTransport("");
+    if (!info->ice_) {
+        if (config_->logger)
+            config_->logger->error("Cannot initialize ICE session.");
+        eraseInfo();
+        return;
+    }
+    // We need to detect any shutdown if the ice session is destroyed before going to the
+    // TLS session;
+    info->ice_->setOnShutdown([executor, eraseInfo]() {
+        executor->run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
+    });
+    try {
+        info->ice_->initIceInstance(ice_config);
+    } catch (const std::exception& e) {
+        if (config_->logger)
+            config_->logger->error("{}", e.what());
+        executor->run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
+    }
+}
+
+void
+ConnectionManager::Impl::dropConnectionAttempt(const DeviceId& deviceId, const dht::Value::Id& vid)
+{
+    // Can be called from the TLS callbacks, so avoid any lock here
+    dht::ThreadPool::io().run([w = weak(), deviceId, vid] {
+        auto sthis = w.lock();
+        if (!sthis)
+            return;
+        std::shared_ptr<ConnectionInfo> info;
+        {
+            std::lock_guard<std::mutex> lk(sthis->infosMtx_);
+            auto it = sthis->infos_.find({deviceId, vid});
+            if (it == sthis->infos_.end())
+                return;
+            info = std::move(it->second);
+            sthis->infos_.erase(it);
+        }
+        if (sthis->config_->logger)
+            sthis->config_->logger->debug("Cancel concurrent connection attempt to {} - vid: {}",
+                                          deviceId,
+                                          vid);
+        std::lock_guard<std::mutex> lk(info->mutex_);
+        if (info->tls_) {
+            // The pending operations are handled by the other attempt
+            info->tls_->setOnReady({});
+            info->tls_->shutdown();
+        }
+        if (info->waitForAnswer_)
+            info->waitForAnswer_->cancel();
+        if (info->dhtFallback_)
+            info->dhtFallback_->cancel();
+    });
+}
+
+void
+ConnectionManager::Impl::startDirectConnections()
+{
+    if (not(config_->lanDiscoveryEnabled or config_->directConnectEnabled)
+        or not config_->ioContext or isDestroying_)
+        return;
+    std::lock_guard<std::mutex> lk(lanMtx_);
+    if (tcpAcceptor_)
+        return;
+    asio::error_code ec;
+    auto acceptor = std::make_unique<asio::ip::tcp::acceptor>(*config_->ioContext);
+    acceptor->open(asio::ip::tcp::v4(), ec);
+    if (!ec)
+        acceptor->bind({asio::ip::address_v4::any(), 0}, ec);
+    if (!ec)
+        acceptor->listen(asio::socket_base::max_listen_connections, ec);
+    if (ec) {
+        if (config_->logger)
+            config_->logger->error("Unable to accept TCP connections: {}", ec.message());
+        return;
+    }
+    tcpPort_ = acceptor->local_endpoint().port();
+    tcpAcceptor_ = std::move(acceptor);
+    if (config_->lanDiscoveryEnabled) {
+        lanDiscovery_ = std::make_shared<LanDiscovery>(config_->ioContext,
+                                                       config_->id,
+                                                       config_->lanDiscoveryPort,
+                                                       config_->logger);
+        lanDiscovery_->start(tcpPort_);
+    }
+    if (config_->logger)
+        config_->logger->debug("Accepting TCP connections on port {}", tcpPort_);
+    dht::ThreadPool::io().run([w = weak()] {
+        if (auto sthis = w.lock())
+            sthis->acceptTcpConnection();
+    });
+}
+
+void
+ConnectionManager::Impl::acceptTcpConnection()
+{
+    std::lock_guard<std::mutex> lk(lanMtx_);
+    if (not tcpAcceptor_)
+        return;
+    tcpAcceptor_->async_accept([w = weak()](const asio::error_code& ec, asio::ip::tcp::socket socket) {
+        if (ec == asio::error::operation_aborted)
+            return;
+        auto sthis = w.lock();
+        if (!sthis or sthis->isDestroying_)
+            return;
+        if (!ec)
+            sthis->onTcpConnection(std::move(socket));
+        else if (sthis->config_->logger)
+            sthis->config_->logger->warn("TCP accept failed: {}", ec.message());
+        sthis->acceptTcpConnection();
+    });
+}
+
+void
+ConnectionManager::Impl::onTcpConnection(asio::ip::tcp::socket&& socket)
+{
+    asio::error_code ec;
+    auto source = socket.remote_endpoint(ec).address();
+    if (ec)
+        return;
+    auto vid = ValueIdDist(1, ID_MAX_VAL)(rand);
+    auto info = std::make_shared<ConnectionInfo>();
+    info->lan_ = true;
+    {
+        // Each handshake has its own thread: the port is advertised, so
+        // anyone reaching it must not be able to start more
+        std::lock_guard<std::mutex> lk(lanMtx_);
+        auto fromSource = std::count_if(lanIncoming_.begin(),
+                                        lanIncoming_.end(),
+                                        [&](const auto& incoming) {
+                                            return incoming.second.source == source;
+                                        });
+        if (lanIncoming_.size() >= TCP_PENDING_HANDSHAKES_MAX
+            or static_cast<std::size_t>(fromSource) >= TCP_PENDING_HANDSHAKES_PER_SOURCE) {
+            if (config_->logger)
+                config_->logger->warn("Too many pending TCP connections, closing the one from {}",
+                                      source.to_string());
+            socket.close(ec);
+            return;
+        }
+        lanIncoming_[vid] = {info, source};
+    }
+    // Known once the certificate is checked
+    auto deviceId = std::make_shared<DeviceId>();
+    std::lock_guard<std::mutex> lk(info->mutex_);
+    info->tls_ = std::make_unique<TlsSocketEndpoint>(
+        std::make_unique<TcpSocketEndpoint>(std::move(socket), false),
+        certStore(),
+        identity(),
+        dhParams(),
+        [w = weak(), deviceId](const dht::crypto::Certificate& cert) {
+            auto shared = w.lock();
+            if (!shared)
+                return false;
+            // Unlike the DHT requests, nothing pins the certificate, so only
+            // the devices already known are accepted
+            auto crt = shared->certStore().getCertificate(cert.getLongId().toString());
+            if (!crt or crt->getPacked() != cert.getPacked())
+                return false;
+            *deviceId = cert.getLongId();
+            return shared->iceReqCb_ and shared->iceReqCb_(*deviceId);
+        },
+        config_->tlsRxBufferSize);
+    info->tls_->setOnReady([w = weak(), vid, deviceId](bool ok) {
+        auto shared = w.lock();
+        if (!shared)
+            return;
+        std::shared_ptr<ConnectionInfo> info;
+        {
+            std::lock_guard<std::mutex> lk(shared->lanMtx_);
+            auto it = shared->lanIncoming_.find(vid);
+            if (it == shared->lanIncoming_.end())
+                return;
+            info = std::move(it->second.info);
+            shared->lanIncoming_.erase(it);
+        }
+        if (!ok) {
+            // Don't destroy the TLS socket from its own callback
+            dht::ThreadPool::io().run([info = std::move(info)] {});
+            return;
+        }
+        if (shared->config_->logger)
+            shared->config_->logger->debug("Direct connection from {} is ready - vid: {}",
+                                           *deviceId,
+                                           vid);
+        {
+            std::lock_guard<std::mutex> lk(shared->infosMtx_);
+            shared->infos_[{*deviceId, vid}] = std::move(info);
+        }
+        shared->onTlsNegotiationDone(true, *deviceId, vid);
+    });
+}
+
+IpAddr
+ConnectionManager::Impl::getLanAddress(const DeviceId& deviceId) const
+{
+    std::lock_guard<std::mutex> lk(lanMtx_);
+    return lanDiscovery_ ? lanDiscovery_->getAddress(deviceId) : IpAddr {};
+}
+
+void
+ConnectionManager::Impl::startTcpAttempt(const std::shared_ptr<dht::crypto::Certificate>& cert,
+                                         const std::string& name,
+                                         const IpAddr& addr,
+                                         const dht::Value::Id& vid,
+                                         const std::shared_ptr<ConnectRace>& race,
+                                         std::function<void()>&& onUnreachable)
+{
+    auto deviceId = cert->getLongId();
+    auto raceFailed = std::make_shared<std::atomic_bool>(false);
+    auto info = std::make_shared<ConnectionInfo>();
+    info->race_ = race;
+    info->raceFailed_ = raceFailed;
+    info->lan_ = true;
+    {
+        std::lock_guard<std::mutex> lk(infosMtx_);
+        infos_[{deviceId, vid}] = info;
+    }
+    if (config_->logger)
+        config_->logger->debug("Connect to {} at {} over TCP - vid: {}",
+                               deviceId,
+                               addr.toString(true),
+                               vid);
+
+    auto socket = std::make_shared<asio::ip::tcp::socket>(*config_->ioContext);
+    auto timer = std::make_shared<asio::steady_timer>(*config_->ioContext, LAN_CONNECT_TIMEOUT);
+    timer->async_wait([socket](const asio::error_code& ec) {
+        if (ec)
+            return;
+        asio::error_code err;
+        socket->close(err);
+    });
+    asio::ip::tcp::endpoint endpoint(asio::ip::make_address(addr.toString()), addr.getPort());
+    socket->async_connect(endpoint, [w = weak(), socket, timer, cert, name, deviceId, vid, race, raceFailed,
+                                     onUnreachable = std::move(onUnreachable)](
+                                        const asio::error_code& ec) {
+        timer->cancel();
+        auto sthis = w.lock();
+        if (!sthis)
+            return;
+        auto info = sthis->getInfo(deviceId, vid);
+        if (!info)
+            // Dropped, another attempt won
+            return;
+        if (ec) {
+            if (sthis->config_->logger)
+                sthis->config_->logger->debug("Unable to connect to {} over TCP: {}",
+                                              deviceId,
+                                              ec.message());
+            {
+                std::lock_guard<std::mutex> lk(sthis->infosMtx_);
+                sthis->infos_.erase({deviceId, vid});
             }
+            if (onUnreachable)
+                onUnreachable();
+            else if (race->fail(*raceFailed))
+                sthis->executePendingOperations(deviceId, race->vid, nullptr);
+            return;
+        }
+        std::lock_guard<std::mutex> lk(info->mutex_);
+        info->tls_ = std::make_unique<TlsSocketEndpoint>(
+            std::make_unique<TcpSocketEndpoint>(std::move(*socket), true),
+            sthis->certStore(),
+            sthis->identity(),
+            sthis->dhParams(),
+            *cert,
+            sthis->config_->tlsRxBufferSize);
+        info->tls_->setOnReady([w, deviceId, vid, name](bool ok) {
+            if (auto shared = w.lock())
+                shared->onTlsNegotiationDone(ok, deviceId, vid, name);
         });
     });
 }
@@ -790,10 +1817,15 @@ ConnectionManager::Impl::connectDevice(const std::shared_ptr<dht::crypto::Certif
 void
 ConnectionManager::Impl::sendChannelRequest(std::shared_ptr<MultiplexedSocket>& sock,
                                             const std::string& name,
+                                            ChannelType type,
                                             const DeviceId& deviceId,
                                             const dht::Value::Id& vid)
 {
-    auto channelSock = sock->addChannel(name);
+    auto channelSock = sock->addChannel(name, type);
+    if (!channelSock) {
+        executePendingOperations(deviceId, vid, nullptr);
+        return;
+    }
     channelSock->onShutdown([name, deviceId, vid, w = weak()] {
         auto shared = w.lock();
         if (auto shared = w.lock())
@@ -806,12 +1838,21 @@ ConnectionManager::Impl::sendChannelRequest(std::shared_ptr<MultiplexedSocket>&
             if (shared)
                 shared->executePendingOperations(deviceId, vid, accepted ? channelSock : nullptr, accepted);
         });
+    writeChannelRequest(sock, channelSock);
+}
 
+void
+ConnectionManager::Impl::writeChannelRequest(const std::shared_ptr<MultiplexedSocket>& sock,
+                                             const std::shared_ptr<ChannelSocket>& channelSock)
+{
     ChannelRequest val;
     val.name = channelSock->name();
     val.state = ChannelRequestState::REQUEST;
     val.channel = channelSock->channel();
-    msgpack::sbuffer buffer(256);
+    val.type = channelSock->type();
+    val.data = channelSock->takeInitialData();
+    val.compression = channelSock->compression();
+    msgpack::sbuffer buffer(256 + val.data.size());
     msgpack::pack(buffer, val);
 
     std::error_code ec;
@@ -848,58 +1889,138 @@ ConnectionManager::Impl::onPeerResponse(const PeerConnectionRequest& req)
     }
 }
 
+void
+ConnectionManager::Impl::scheduleTurnPoolRefresh()
+{
+    if (config_->turnPoolSize == 0 or not config_->ioContext)
+        return;
+    std::lock_guard<std::mutex> lk(turnPoolMtx_);
+    if (isDestroying_)
+        return;
+    if (not turnPoolTimer_)
+        turnPoolTimer_ = std::make_unique<asio::steady_timer>(*config_->ioContext);
+    else if (turnPoolTimer_->expiry() > std::chrono::steady_clock::now())
+        // Already scheduled
+        return;
+    turnPoolTimer_->expires_after(TURN_POOL_REFRESH_PERIOD);
+    turnPoolTimer_->async_wait([w = weak()](const asio::error_code& ec) {
+        if (ec == asio::error::operation_aborted)
+            return;
+        if (auto sthis = w.lock()) {
+            sthis->iceFactory()->refreshTurnPool();
+            sthis->scheduleTurnPoolRefresh();
+        }
+    });
+}
+
 void
 ConnectionManager::Impl::onDhtConnected(const dht::crypto::PublicKey& devicePk)
 {
     if (!dht())
         return;
+    startDirectConnections();
+    scheduleTurnPoolRefresh();
+    auto key = dht::InfoHash::get(PeerConnectionRequest::key_prefix + devicePk.getId().toString());
+    if (sharedContext_) {
+        listenKey_ = key;
+        sharedContext_->listen(key, weak());
+        return;
+    }
     dht()->listen<PeerConnectionRequest>(
-        dht::InfoHash::get(PeerConnectionRequest::key_prefix + devicePk.getId().toString()),
+        key,
         [w = weak()](PeerConnectionRequest&& req) {
             auto shared = w.lock();
             if (!shared)
                 return false;
-            if (shared->isMessageTreated(to_hex_string(req.id))) {
-                // Message already treated. Just ignore
+            return shared->onDhtRequest(std::move(req));
+        },
+        dht::Value::UserTypeFilter("peer_request"));
+}
+
+bool
+ConnectionManager::Impl::onDhtValue(const dht::Value& value)
+{
+    if (isDestroying_)
+        return false;
+    try {
+        // Values for the identity of the runner, if any, are already decrypted
+        std::optional<dht::Value> decrypted;
+        if (value.isEncrypted()) {
+            auto data = identity().first->decrypt(value.cypher);
+            auto msg = msgpack::unpack((const char*) data.data(), data.size());
+            decrypted.emplace(value.id);
+            decrypted->msgpack_unpack_body(msg.get());
+            if (not decrypted->owner
+                or not decrypted->owner->checkSignature(decrypted->getToSign(),
+                                                        decrypted->signature))
                 return true;
-            }
-            if (req.isAnswer) {
-                if (shared->config_->logger)
-                    shared->config_->logger->debug("Received request answer from {}", req.owner->getLongId());
-            } else {
-                if (shared->config_->logger)
-                    shared->config_->logger->debug("Received request from {}", req.owner->getLongId());
-            }
-            if (req.isAnswer) {
-                shared->onPeerResponse(req);
-            } else {
-                // Async certificate checking
-                shared->dht()->findCertificate(
-                    req.from,
-                    [w, req = std::move(req)](
-                        const std::shared_ptr<dht::crypto::Certificate>& cert) mutable {
-                        auto shared = w.lock();
-                        if (!shared)
-                            return;
-                        dht::InfoHash peer_h;
-                        if (foundPeerDevice(cert, peer_h, shared->config_->logger)) {
+        }
+        const auto& v = decrypted ? *decrypted : value;
+        if (not v.owner or v.recipient != identity().second->getId()
+            or v.user_type != "peer_request")
+            return true;
+        return onDhtRequest(dht::Value::unpack<PeerConnectionRequest>(v));
+    } catch (const std::exception& e) {
+        // Not for this manager
+        return true;
+    }
+}
+
+bool
+ConnectionManager::Impl::onDhtRequest(PeerConnectionRequest&& req, bool fromDht)
+{
+    if (isDestroying_)
+        return false;
+    if (fromDht and not req.isAnswer) {
+        // The requester fell back to the DHT, so it didn't get the answer
+        SignalingAnswer answer;
+        {
+            std::lock_guard<std::mutex> lk(signalingMtx_);
+            if (auto n = signalingAnswers_.extract(req.id))
+                answer = std::move(n.mapped());
+        }
+        if (answer.value)
+            putAnswer(answer.to, answer.value);
+    }
+    if (isMessageTreated(to_hex_string(req.id))) {
+        // Message already treated. Just ignore
+        return true;
+    }
+    if (req.isAnswer) {
+        if (config_->logger)
+            config_->logger->debug("Received request answer from {}", req.owner->getLongId());
+    } else {
+        if (config_->logger)
+            config_->logger->debug("Received request from {}", req.owner->getLongId());
+    }
+    if (req.isAnswer) {
+        onPeerResponse(req);
+    } else {
+        // Async certificate checking
+        dht()->findCertificate(
+            req.from,
+            [w = weak(), req = std::move(req)](
+                const std::shared_ptr<dht::crypto::Certificate>& cert) mutable {
+                auto shared = w.lock();
+                if (!shared)
+                    return;
+                dht::InfoHash peer_h;
+                if (foundPeerDevice(cert, peer_h, shared->config_->logger)) {
 #if TARGET_OS_IOS
-                            if (shared->iOSConnectedCb_(req.connType, peer_h))
-                                return;
+                    if (shared->iOSConnectedCb_(req.connType, peer_h))
+                        return;
 #endif
-                            shared->onDhtPeerRequest(req, cert);
-                        } else {
-                            if (shared->config_->logger)
-                                shared->config_->logger->warn(
-                                    "Received request from untrusted peer {}",
-                                    req.owner->getLongId());
-                        }
-                    });
-            }
+                    shared->onDhtPeerRequest(req, cert);
+                } else {
+                    if (shared->config_->logger)
+                        shared->config_->logger->warn(
+                            "Received request from untrusted peer {}",
+                            req.owner->getLongId());
+                }
+            });
+    }
 
-            return true;
-        },
-        dht::Value::UserTypeFilter("peer_request"));
+    return true;
 }
 
 void
@@ -929,7 +2050,15 @@ ConnectionManager::Impl::onTlsNegotiationDone(bool ok,
                                        deviceId,
                                        name,
                                        vid);
-            executePendingOperations(deviceId, vid, nullptr);
+            auto info = getInfo(deviceId, vid);
+            if (info and info->race_) {
+                if (vid == info->race_->directVid and not info->race_->won)
+                    setKnownPath(deviceId, std::nullopt);
+                if (info->race_->fail(*info->raceFailed_))
+                    executePendingOperations(deviceId, info->race_->vid, nullptr);
+            } else {
+                executePendingOperations(deviceId, vid, nullptr);
+            }
         }
     } else {
         // The socket is ready, store it
@@ -947,16 +2076,49 @@ ConnectionManager::Impl::onTlsNegotiationDone(bool ok,
         }
 
         auto info = getInfo(deviceId, vid);
+        if (!info)
+            return;
+        if (info->race_) {
+            if (info->race_->won.exchange(true)) {
+                // The other attempt is already connected
+                dropConnectionAttempt(deviceId, vid);
+                return;
+            }
+            for (const auto& other : info->race_->others(vid))
+                dropConnectionAttempt(deviceId, other);
+        }
+        if (not info->lan_) {
+            std::lock_guard<std::mutex> lk(info->mutex_);
+            setKnownPath(deviceId, info->path_);
+            ++(info->udp_ ? udpSockets_ : tcpSockets_);
+            if (config_->logger and info->race_ and config_->iceTransportRace)
+                config_->logger->debug("Connected to {} over ICE-{} - vid: {}",
+                                       deviceId,
+                                       info->udp_ ? "UDP" : "TCP",
+                                       vid);
+        }
         addNewMultiplexedSocket({deviceId, vid}, info);
         // Finally, open the channel and launch pending callbacks
         if (info->socket_) {
+            if (info->udp_) {
+                // Negotiate a reliable socket for the streams asked meanwhile
+                auto forceNewSocket = true;
+                for (auto& pending : takePendingStreams(deviceId)) {
+                    connectDevice(deviceId,
+                                  pending.name,
+                                  std::move(pending.cb),
+                                  false,
+                                  forceNewSocket);
+                    forceNewSocket = false;
+                }
+            }
             // Note: do not remove pending there it's done in sendChannelRequest
-            for (const auto& [id, name] : getPendingIds(deviceId)) {
+            for (const auto& [id, pending] : getPendingIds(deviceId)) {
                 if (config_->logger)
                     config_->logger->debug("Send request on TLS socket for channel {} to {}",
-                         name,
+                         pending.first,
                          deviceId.toString());
-                sendChannelRequest(info->socket_, name, deviceId, id);
+                sendChannelRequest(info->socket_, pending.first, pending.second, deviceId, id);
             }
         }
     }
@@ -981,21 +2143,46 @@ ConnectionManager::Impl::answerTo(IceTransport& ice,
     val.id = id;
     val.ice_msg = icemsg.str();
     val.isAnswer = true;
+    val.port = getTcpPort();
+    // A request received over signaling is answered the same way
+    bool overSignaling;
+    {
+        std::lock_guard<std::mutex> lk(signalingMtx_);
+        overSignaling = signalingReplyHops_.find(id) != signalingReplyHops_.end();
+    }
+    overSignaling = overSignaling and sendSignaling(val, from);
     auto value = std::make_shared<dht::Value>(std::move(val));
     value->user_type = "peer_request";
 
+    if (overSignaling) {
+        std::lock_guard<std::mutex> lk(signalingMtx_);
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = signalingAnswers_.begin(); it != signalingAnswers_.end();) {
+            if (now - it->second.sent > DHT_MSG_TIMEOUT)
+                it = signalingAnswers_.erase(it);
+            else
+                ++it;
+        }
+        signalingAnswers_[id] = {from, std::move(value), now};
+        return;
+    }
     if (config_->logger)
         config_->logger->debug("Connection accepted, DHT reply to {}", from->getLongId());
-    dht()->putEncrypted(dht::InfoHash::get(PeerConnectionRequest::key_prefix
-                                           + from->getId().toString()),
-                        from,
-                        value,
-                        [from,l=config_->logger](bool ok) {
-                            if (l)
-                                l->debug("Answer to connection request from {:s}. Put encrypted {:s}",
-                                         from->getLongId(),
-                                         (ok ? "ok" : "failed"));
-                        });
+    putAnswer(from, value);
+}
+
+void
+ConnectionManager::Impl::putAnswer(const std::shared_ptr<dht::crypto::PublicKey>& to,
+                                   const std::shared_ptr<dht::Value>& value)
+{
+    putEncrypted(to,
+                 value,
+                 [to,l=config_->logger](bool ok) {
+                     if (l)
+                         l->debug("Answer to connection request from {:s}. Put encrypted {:s}",
+                                  to->getLongId(),
+                                  (ok ? "ok" : "failed"));
+                 });
 }
 
 bool
@@ -1044,6 +2231,10 @@ ConnectionManager::Impl::onRequestOnNegoDone(const PeerConnectionRequest& req)
             config_->logger->error("No ICE detected");
         return false;
     }
+    info->path_ = getDirectPath(*ice);
+    if (info->path_)
+        info->path_->port = req.port;
+    info->udp_ = not ice->isTCPEnabled();
 
     // Build socket
     auto endpoint = std::make_unique<IceSocketEndpoint>(std::shared_ptr<IceTransport>(
@@ -1069,7 +2260,8 @@ ConnectionManager::Impl::onRequestOnNegoDone(const PeerConnectionRequest& req)
             if (!crt)
                 return false;
             return crt->getPacked() == cert.getPacked();
-        });
+        },
+        config_->tlsRxBufferSize);
 
     info->tls_->setOnReady(
         [w = weak(), deviceId = std::move(deviceId), vid = std::move(req.id)](bool ok) {
@@ -1110,19 +2302,23 @@ ConnectionManager::Impl::onDhtPeerRequest(const PeerConnectionRequest& req,
             }
         };
 
-        ice_config.tcpEnable = true;
-        ice_config.onInitDone = [w, req, eraseInfo](bool ok) {
+        // The events of the connection run in order, off the ICE threads
+        auto executor = std::make_shared<SerialExecutor>(shared->config_->logger);
+        ice_config.tcpEnable = not req.udp;
+        if (req.direct)
+            ice_config.turnServers.clear();
+        ice_config.onInitDone = [w, req, executor, eraseInfo](bool ok) {
             auto shared = w.lock();
             if (!shared)
                 return;
             if (!ok) {
                 if (shared->config_->logger)
                     shared->config_->logger->error("Cannot initialize ICE session.");
-                dht::ThreadPool::io().run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
+                executor->run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
                 return;
             }
 
-            dht::ThreadPool::io().run(
+            executor->run(
                 [w = std::move(w), req = std::move(req), eraseInfo = std::move(eraseInfo)] {
                     auto shared = w.lock();
                     if (!shared)
@@ -1132,18 +2328,18 @@ ConnectionManager::Impl::onDhtPeerRequest(const PeerConnectionRequest& req,
                 });
         };
 
-        ice_config.onNegoDone = [w, req, eraseInfo](bool ok) {
+        ice_config.onNegoDone = [w, req, executor, eraseInfo](bool ok) {
             auto shared = w.lock();
             if (!shared)
                 return;
             if (!ok) {
                 if (shared->config_->logger)
                     shared->config_->logger->error("ICE negotiation failed.");
-                dht::ThreadPool::io().run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
+                executor->run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
                 return;
             }
 
-            dht::ThreadPool::io().run(
+            executor->run(
                 [w = std::move(w), req = std::move(req), eraseInfo = std::move(eraseInfo)] {
                     if (auto shared = w.lock())
                         if (!shared->onRequestOnNegoDone(req))
@@ -1163,7 +2359,7 @@ ConnectionManager::Impl::onDhtPeerRequest(const PeerConnectionRequest& req,
         ice_config.streamsCount = 1;
         ice_config.compCountPerStream = 1; // TCP
         ice_config.master = true;
-        info->ice_ = shared->iceFactory_.createUTransport("");
+        info->ice_ = shared->iceFactory()->createUTransport("");
         if (not info->ice_) {
             if (shared->config_->logger)
                 shared->config_->logger->error("Cannot initialize ICE session");
@@ -1171,15 +2367,15 @@ ConnectionManager::Impl::onDhtPeerRequest(const PeerConnectionRequest& req,
             return;
         }
         // We need to detect any shutdown if the ice session is destroyed before going to the TLS session;
-        info->ice_->setOnShutdown([eraseInfo]() {
-            dht::ThreadPool::io().run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
+        info->ice_->setOnShutdown([executor, eraseInfo]() {
+            executor->run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
         });
         try {
             info->ice_->initIceInstance(ice_config);
         } catch (const std::exception& e) {
             if (shared->config_->logger)
                 shared->config_->logger->error("{}", e.what());
-            dht::ThreadPool::io().run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
+            executor->run([eraseInfo = std::move(eraseInfo)] { eraseInfo(); });
         }
     });
 }
@@ -1187,19 +2383,29 @@ ConnectionManager::Impl::onDhtPeerRequest(const PeerConnectionRequest& req,
 void
 ConnectionManager::Impl::addNewMultiplexedSocket(const CallbackId& id, const std::shared_ptr<ConnectionInfo>& info)
 {
-    info->socket_ = std::make_shared<MultiplexedSocket>(config_->ioContext, id.first, std::move(info->tls_));
+    info->socket_ = std::make_shared<MultiplexedSocket>(config_->ioContext,
+                                                        id.first,
+                                                        std::move(info->tls_),
+                                                        config_->muxReadBufferSize,
+                                                        config_->logger);
     info->socket_->setOnReady(
         [w = weak()](const DeviceId& deviceId, const std::shared_ptr<ChannelSocket>& socket) {
-            if (auto sthis = w.lock())
-                if (sthis->connReadyCb_)
+            if (auto sthis = w.lock()) {
+                if (socket->name() == SIGNALING_CHANNEL)
+                    sthis->onSignalingChannel(socket);
+                else if (sthis->connReadyCb_)
                     sthis->connReadyCb_(deviceId, socket->name(), socket);
+            }
         });
     info->socket_->setOnRequest([w = weak()](const std::shared_ptr<dht::crypto::Certificate>& peer,
                                              const uint16_t&,
                                              const std::string& name) {
-        if (auto sthis = w.lock())
+        if (auto sthis = w.lock()) {
+            if (name == SIGNALING_CHANNEL)
+                return sthis->config_->signalingEnabled;
             if (sthis->channelReqCb_)
                 return sthis->channelReqCb_(peer, name);
+        }
         return false;
     });
     info->socket_->onShutdown([w = weak(), deviceId=id.first, vid=id.second]() {
@@ -1224,6 +2430,401 @@ ConnectionManager::Impl::addNewMultiplexedSocket(const CallbackId& id, const std
             sthis->infos_.erase({deviceId, vid});
         });
     });
+    watchIdleSocket(info->socket_);
+    // A single channel per socket, opened by the TLS client. It's a stream, so
+    // never over ICE-UDP
+    if (config_->signalingEnabled and info->socket_->isInitiator() and not info->udp_)
+        openSignalingChannel(info->socket_);
+}
+
+void
+ConnectionManager::Impl::watchIdleSocket(const std::shared_ptr<MultiplexedSocket>& socket)
+{
+    if (config_->idleConnectionTimeout <= std::chrono::seconds::zero() or not config_->ioContext)
+        return;
+    std::lock_guard<std::mutex> lk(idleMtx_);
+    if (isDestroying_)
+        return;
+    scheduleIdleCheck(socket, socket->lastActivity() + config_->idleConnectionTimeout);
+}
+
+void
+ConnectionManager::Impl::scheduleIdleCheck(std::weak_ptr<MultiplexedSocket>&& socket,
+                                           std::chrono::steady_clock::time_point deadline)
+{
+    if (idleWheel_.empty()) {
+        idleTick_ = std::max<std::chrono::steady_clock::duration>(
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                config_->idleConnectionTimeout)
+                / IDLE_WHEEL_SLOTS,
+            IDLE_WHEEL_MIN_TICK);
+        idleWheel_.resize(IDLE_WHEEL_SLOTS + 1);
+        if (not idleTimer_)
+            idleTimer_ = std::make_unique<asio::steady_timer>(*config_->ioContext);
+    }
+    if (idleCount_ == 0)
+        // The wheel is stopped, restart it from now
+        idleWheelTime_ = std::chrono::steady_clock::now();
+
+    // Deadlines beyond the wheel are checked early, then rescheduled
+    auto ticks = (deadline - idleWheelTime_ + idleTick_ - std::chrono::steady_clock::duration(1))
+                 / idleTick_;
+    ticks = std::clamp<decltype(ticks)>(ticks, 1, IDLE_WHEEL_SLOTS);
+    idleWheel_[(idleCursor_ + ticks) % idleWheel_.size()].emplace_back(std::move(socket));
+    idleCount_++;
+
+    auto expiry = idleWheelTime_ + ticks * idleTick_;
+    if (expiry < idleArmedAt_)
+        armIdleTimer(expiry);
+}
+
+void
+ConnectionManager::Impl::armIdleTimer(std::chrono::steady_clock::time_point expiry)
+{
+    idleArmedAt_ = expiry;
+    idleTimer_->expires_at(expiry);
+    idleTimer_->async_wait([w = weak()](const asio::error_code& ec) {
+        if (ec == asio::error::operation_aborted)
+            return;
+        if (auto sthis = w.lock())
+            sthis->onIdleTick();
+    });
+}
+
+void
+ConnectionManager::Impl::onIdleTick()
+{
+    std::vector<std::shared_ptr<MultiplexedSocket>> idleSockets;
+    {
+        std::lock_guard<std::mutex> lk(idleMtx_);
+        if (isDestroying_ or idleWheel_.empty())
+            return;
+        auto now = std::chrono::steady_clock::now();
+        idleArmedAt_ = std::chrono::steady_clock::time_point::max();
+
+        std::vector<std::weak_ptr<MultiplexedSocket>> expired;
+        while (idleCount_ > 0 and idleWheelTime_ + idleTick_ <= now) {
+            idleCursor_ = (idleCursor_ + 1) % idleWheel_.size();
+            idleWheelTime_ += idleTick_;
+            auto& slot = idleWheel_[idleCursor_];
+            idleCount_ -= slot.size();
+            expired.insert(expired.end(),
+                           std::make_move_iterator(slot.begin()),
+                           std::make_move_iterator(slot.end()));
+            slot.clear();
+        }
+
+        for (auto& w : expired) {
+            auto socket = w.lock();
+            if (not socket)
+                continue;
+            auto deadline = now + config_->idleConnectionTimeout;
+            // The signaling channel alone doesn't keep the socket alive
+            if (socket->channelCount() <= signalingChannelCount(*socket)) {
+                deadline = socket->lastActivity() + config_->idleConnectionTimeout;
+                if (deadline <= now) {
+                    idleSockets.emplace_back(std::move(socket));
+                    continue;
+                }
+            }
+            scheduleIdleCheck(std::move(w), deadline);
+        }
+
+        // Re-arm the timer on the next non-empty slot
+        for (std::size_t i = 1; idleCount_ > 0 and i < idleWheel_.size(); i++) {
+            if (not idleWheel_[(idleCursor_ + i) % idleWheel_.size()].empty()) {
+                auto expiry = idleWheelTime_ + static_cast<int>(i) * idleTick_;
+                if (expiry < idleArmedAt_)
+                    armIdleTimer(expiry);
+                break;
+            }
+        }
+    }
+    for (auto& socket : idleSockets) {
+        if (config_->logger)
+            config_->logger->debug("Closing idle connection with {}", socket->deviceId());
+        // onShutdown() removes the connection info
+        socket->shutdown();
+    }
+}
+
+void
+ConnectionManager::Impl::openSignalingChannel(const std::shared_ptr<MultiplexedSocket>& sock)
+{
+    auto channelSock = sock->addChannel(SIGNALING_CHANNEL);
+    if (!channelSock)
+        return;
+    // Once accepted, the channel is handled by onSignalingChannel()
+    channelSock->onReady(
+        [w = weak(), deviceId = sock->deviceId()](bool accepted) {
+            auto sthis = w.lock();
+            if (!accepted && sthis && sthis->config_->logger)
+                sthis->config_->logger->debug("Signaling channel declined by {}", deviceId);
+        });
+    writeChannelRequest(sock, channelSock);
+}
+
+void
+ConnectionManager::Impl::onSignalingChannel(const std::shared_ptr<ChannelSocket>& channel)
+{
+    auto deviceId = channel->deviceId();
+    if (config_->logger)
+        config_->logger->debug("Signaling channel with {} is ready", deviceId);
+    {
+        std::lock_guard<std::mutex> lk(signalingMtx_);
+        signalingChannels_[deviceId] = channel;
+    }
+    channel->onShutdown([w = weak(), deviceId, ptr = channel.get()] {
+        auto sthis = w.lock();
+        if (!sthis)
+            return;
+        std::shared_ptr<ChannelSocket> removed;
+        {
+            std::lock_guard<std::mutex> lk(sthis->signalingMtx_);
+            auto it = sthis->signalingChannels_.find(deviceId);
+            if (it != sthis->signalingChannels_.end() and it->second.get() == ptr) {
+                removed = std::move(it->second);
+                sthis->signalingChannels_.erase(it);
+                sthis->signalingForwards_.erase(deviceId);
+            }
+        }
+        // Called by the channel, so do not destroy it here
+        if (removed)
+            dht::ThreadPool::io().run([removed = std::move(removed)] {});
+    });
+    channel->setOnRecv([w = weak(), deviceId, unpacker = std::make_shared<msgpack::unpacker>()](
+                           const uint8_t* buf, size_t len) {
+        auto sthis = w.lock();
+        if (!sthis)
+            return len;
+        unpacker->reserve_buffer(len);
+        std::copy_n(buf, len, reinterpret_cast<uint8_t*>(unpacker->buffer()));
+        unpacker->buffer_consumed(len);
+        msgpack::object_handle oh;
+        try {
+            while (unpacker->next(oh)) {
+                // Decryption can be slow, do not block the socket
+                dht::ThreadPool::io().run([w, deviceId, msg = oh.get().as<SignalingMessage>()]() mutable {
+                    if (auto sthis = w.lock())
+                        sthis->onSignalingMessage(deviceId, std::move(msg));
+                });
+            }
+        } catch (const std::exception& e) {
+            if (sthis->config_->logger)
+                sthis->config_->logger->warn("Invalid signaling message from {}: {}",
+                                             deviceId,
+                                             e.what());
+        }
+        return len;
+    });
+}
+
+std::vector<std::shared_ptr<ChannelSocket>>
+ConnectionManager::Impl::getSignalingRoutes(const DeviceId& deviceId, const dht::Value::Id& id)
+{
+    std::vector<std::shared_ptr<ChannelSocket>> routes;
+    std::optional<DeviceId> replyHop;
+    decltype(signalingChannels_) channels;
+    {
+        std::lock_guard<std::mutex> lk(signalingMtx_);
+        if (auto n = signalingReplyHops_.extract(id))
+            replyHop = n.mapped().first;
+        if (auto it = signalingChannels_.find(deviceId); it != signalingChannels_.end())
+            return {it->second};
+        channels = signalingChannels_;
+    }
+    if (channels.empty())
+        return routes;
+
+    if (replyHop) {
+        if (auto it = channels.find(*replyHop); it != channels.end())
+            routes.emplace_back(it->second);
+    }
+    auto cert = certStore().getCertificate(deviceId.toString());
+    // A device forwards only from or to the devices of its account
+    for (const auto& [hop, channel] : channels) {
+        if (replyHop and hop == *replyHop)
+            continue;
+        if (config_->signalingRelays.count(hop)) {
+            routes.emplace_back(channel);
+        } else if (cert) {
+            // Other devices of the same account are usually connected to the device
+            auto hopCert = certStore().getCertificate(hop.toString());
+            if (hopCert and hopCert->getIssuerUID() == cert->getIssuerUID())
+                routes.emplace_back(channel);
+        }
+    }
+    return routes;
+}
+
+bool
+ConnectionManager::Impl::sendSignaling(const PeerConnectionRequest& req,
+                                       const std::shared_ptr<dht::crypto::PublicKey>& devicePk)
+{
+    if (not config_->signalingEnabled or isDestroying_)
+        return false;
+    auto deviceId = devicePk->getLongId();
+    auto routes = getSignalingRoutes(deviceId, req.id);
+    if (routes.empty())
+        return false;
+
+    msgpack::sbuffer buffer(512);
+    try {
+        msgpack::pack(buffer, req);
+        SignedRequest signedReq;
+        signedReq.owner = identity().second->getSharedPublicKey()->getPacked();
+        signedReq.request.assign(buffer.data(), buffer.data() + buffer.size());
+        signedReq.signature = identity().first->sign(getSignedData(signedReq.request, deviceId));
+        buffer.clear();
+        msgpack::pack(buffer, signedReq);
+
+        SignalingMessage msg;
+        msg.to = deviceId;
+        msg.data = devicePk->encrypt(dht::Blob(buffer.data(), buffer.data() + buffer.size()));
+        buffer.clear();
+        msgpack::pack(buffer, msg);
+    } catch (const std::exception& e) {
+        if (config_->logger)
+            config_->logger->error("Unable to prepare signaling message for {}: {}",
+                                   deviceId,
+                                   e.what());
+        return false;
+    }
+
+    auto sent = false;
+    for (const auto& channel : routes) {
+        std::error_code ec;
+        channel->write(reinterpret_cast<const uint8_t*>(buffer.data()), buffer.size(), ec);
+        if (ec) {
+            if (config_->logger)
+                config_->logger->warn("Unable to send signaling message to {}: {}",
+                                      channel->deviceId(),
+                                      ec.message());
+            continue;
+        }
+        if (config_->logger)
+            config_->logger->debug("Sent connection {} for {} over signaling channel with {}",
+                                   req.isAnswer ? "answer" : "request",
+                                   deviceId,
+                                   channel->deviceId());
+        sent = true;
+    }
+    return sent;
+}
+
+void
+ConnectionManager::Impl::onSignalingMessage(const DeviceId& hop, SignalingMessage&& msg)
+{
+    if (isDestroying_)
+        return;
+    auto deviceId = identity().second->getLongId();
+    if (msg.to != deviceId) {
+        // Forward once, only to a connected device, and only from or to a
+        // device of the account so it can't relay for anyone
+        if (msg.forwarded)
+            return;
+        if (not isAccountDevice(hop) and not isAccountDevice(msg.to)) {
+            if (config_->logger)
+                config_->logger->warn("Refused to forward signaling message from {} to {}",
+                                      hop,
+                                      msg.to);
+            return;
+        }
+        std::shared_ptr<ChannelSocket> channel;
+        bool limited = false;
+        {
+            std::lock_guard<std::mutex> lk(signalingMtx_);
+            auto it = signalingChannels_.find(msg.to);
+            if (it != signalingChannels_.end()) {
+                auto now = std::chrono::steady_clock::now();
+                auto& [start, count] = signalingForwards_[hop];
+                if (now - start >= SIGNALING_FORWARD_PERIOD) {
+                    start = now;
+                    count = 0;
+                }
+                limited = count == SIGNALING_FORWARD_MAX;
+                if (not limited) {
+                    ++count;
+                    channel = it->second;
+                }
+            }
+        }
+        if (!channel) {
+            if (config_->logger)
+                config_->logger->debug("Unable to forward signaling message from {} to {}{}",
+                                       hop,
+                                       msg.to,
+                                       limited ? ": too many messages" : "");
+            return;
+        }
+        msg.forwarded = true;
+        msgpack::sbuffer buffer(msg.data.size() + 64);
+        msgpack::pack(buffer, msg);
+        std::error_code ec;
+        channel->write(reinterpret_cast<const uint8_t*>(buffer.data()), buffer.size(), ec);
+        if (ec and config_->logger)
+            config_->logger->warn("Unable to forward signaling message to {}: {}",
+                                  msg.to,
+                                  ec.message());
+        return;
+    }
+
+    PeerConnectionRequest req;
+    try {
+        auto data = identity().first->decrypt(msg.data);
+        auto oh = msgpack::unpack(reinterpret_cast<const char*>(data.data()), data.size());
+        auto signedReq = oh.get().as<SignedRequest>();
+        auto owner = std::make_shared<dht::crypto::PublicKey>(signedReq.owner);
+        if (not owner->checkSignature(getSignedData(signedReq.request, deviceId),
+                                      signedReq.signature)) {
+            if (config_->logger)
+                config_->logger->warn("Invalid signature of signaling message from {}", hop);
+            return;
+        }
+        auto reqOh = msgpack::unpack(reinterpret_cast<const char*>(signedReq.request.data()),
+                                     signedReq.request.size());
+        reqOh.get().convert(req);
+        req.owner = std::move(owner);
+        req.from = req.owner->getId();
+    } catch (const std::exception& e) {
+        if (config_->logger)
+            config_->logger->warn("Unable to read signaling message from {}: {}", hop, e.what());
+        return;
+    }
+
+    if (not req.isAnswer) {
+        std::lock_guard<std::mutex> lk(signalingMtx_);
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = signalingReplyHops_.begin(); it != signalingReplyHops_.end();) {
+            if (now - it->second.second > DHT_MSG_TIMEOUT)
+                it = signalingReplyHops_.erase(it);
+            else
+                ++it;
+        }
+        signalingReplyHops_[req.id] = {hop, now};
+    }
+    // Duplicates received from the DHT are dropped by isMessageTreated()
+    onDhtRequest(std::move(req), false);
+}
+
+bool
+ConnectionManager::Impl::isAccountDevice(const DeviceId& deviceId) const
+{
+    auto account = identity().second->getIssuerUID();
+    if (account.empty())
+        return false;
+    auto cert = certStore().getCertificate(deviceId.toString());
+    return cert and cert->getIssuerUID() == account;
+}
+
+std::size_t
+ConnectionManager::Impl::signalingChannelCount(const MultiplexedSocket& socket)
+{
+    std::lock_guard<std::mutex> lk(signalingMtx_);
+    auto it = signalingChannels_.find(socket.deviceId());
+    if (it == signalingChannels_.end())
+        return 0;
+    return it->second->underlyingSocket().get() == &socket ? 1 : 0;
 }
 
 const std::shared_future<tls::DhParams>
@@ -1303,6 +2904,8 @@ ConnectionManager::Impl::saveTreatedMessages() const
 bool
 ConnectionManager::Impl::isMessageTreated(std::string_view id)
 {
+    if (sharedContext_)
+        return sharedContext_->isMessageTreated(id);
     std::lock_guard<std::mutex> lock(messageMutex_);
     auto res = treatedMessages_.emplace(id);
     if (res.second) {
@@ -1409,7 +3012,12 @@ IceTransportOptions
 ConnectionManager::Impl::getIceOptions() const noexcept
 {
     IceTransportOptions opts;
+    opts.factory = iceFactory();
+    opts.poolSize = config_->icePoolSize;
+    opts.poolIncrement = config_->icePoolIncrement;
     opts.upnpEnable = getUPnPActive();
+    if (config_->upnpCtrl)
+        opts.upnpContext = config_->upnpCtrl->upnpContext();
 
     if (config_->stunEnabled)
         opts.stunServers.emplace_back(StunServerInfo().setUri(config_->stunServer));
@@ -1502,6 +3110,130 @@ ConnectionManager::Impl::findCertificate(
     return true;
 }
 
+void
+ConnectionManager::SharedContext::Impl::listen(const dht::InfoHash& key,
+                                               const std::weak_ptr<ConnectionManager::Impl>& manager)
+{
+    std::lock_guard<std::mutex> lk(listenersMtx_);
+    auto& listener = listeners_[key];
+    listener.manager = manager;
+    if (listener.token.valid())
+        return;
+    // Encrypted for the manager, so not filtered by type before decryption
+    listener.token = dht_->listen(
+                             key,
+                             [w = weak_from_this(), key](const std::vector<std::shared_ptr<dht::Value>>& values,
+                                                         bool expired) {
+                                 if (expired)
+                                     return true;
+                                 auto sthis = w.lock();
+                                 if (!sthis)
+                                     return false;
+                                 auto manager = sthis->getManager(key);
+                                 if (!manager)
+                                     return false;
+                                 for (const auto& value : values)
+                                     if (not manager->onDhtValue(*value))
+                                         return false;
+                                 return true;
+                             })
+                         .share();
+}
+
+void
+ConnectionManager::SharedContext::Impl::cancelListen(const dht::InfoHash& key,
+                                                     const ConnectionManager::Impl* manager)
+{
+    std::shared_future<size_t> token;
+    {
+        std::lock_guard<std::mutex> lk(listenersMtx_);
+        auto it = listeners_.find(key);
+        if (it == listeners_.end())
+            return;
+        // The key may have been taken over by another manager.
+        auto current = it->second.manager.lock();
+        if (current and current.get() != manager)
+            return;
+        token = std::move(it->second.token);
+        listeners_.erase(it);
+    }
+    if (token.valid())
+        dht_->cancelListen(key, token);
+}
+
+std::shared_ptr<ConnectionManager::Impl>
+ConnectionManager::SharedContext::Impl::getManager(const dht::InfoHash& key)
+{
+    std::lock_guard<std::mutex> lk(listenersMtx_);
+    auto it = listeners_.find(key);
+    if (it == listeners_.end())
+        return {};
+    auto manager = it->second.manager.lock();
+    // The DHT stops listening when the callback returns false.
+    if (!manager)
+        listeners_.erase(it);
+    return manager;
+}
+
+bool
+ConnectionManager::SharedContext::Impl::isMessageTreated(std::string_view id)
+{
+    std::lock_guard<std::mutex> lock(messageMutex_);
+    auto res = treatedMessages_.emplace(id);
+    if (res.second) {
+        saveTreatedMessages();
+        return false;
+    }
+    return true;
+}
+
+void
+ConnectionManager::SharedContext::Impl::loadTreatedMessages()
+{
+    if (cachePath_.empty())
+        return;
+    std::lock_guard<std::mutex> lock(messageMutex_);
+    treatedMessages_ = loadIdList<std::string>(cachePath_ + DIR_SEPARATOR_STR "treatedMessages");
+}
+
+void
+ConnectionManager::SharedContext::Impl::saveTreatedMessages()
+{
+    if (cachePath_.empty() or saveScheduled_)
+        return;
+    saveScheduled_ = true;
+    dht::ThreadPool::io().run([w = weak_from_this()]() {
+        if (auto sthis = w.lock()) {
+            std::lock_guard<std::mutex> lock(sthis->messageMutex_);
+            sthis->saveScheduled_ = false;
+            fileutils::check_dir(sthis->cachePath_.c_str());
+            saveIdList<decltype(sthis->treatedMessages_)>(sthis->cachePath_
+                                                              + DIR_SEPARATOR_STR "treatedMessages",
+                                                          sthis->treatedMessages_);
+        }
+    });
+}
+
+ConnectionManager::SharedContext::SharedContext(const std::shared_ptr<dht::DhtRunner>& dht,
+                                                const std::string& cachePath,
+                                                const std::shared_ptr<dht::log::Logger>& logger)
+    : pimpl_ {std::make_shared<Impl>(dht, cachePath, logger)}
+{}
+
+ConnectionManager::SharedContext::~SharedContext() {}
+
+const std::shared_ptr<dht::DhtRunner>&
+ConnectionManager::SharedContext::dht() const
+{
+    return pimpl_->dht_;
+}
+
+std::size_t
+ConnectionManager::SharedContext::listenCount() const
+{
+    return pimpl_->listenCount();
+}
+
 ConnectionManager::ConnectionManager(std::shared_ptr<ConnectionManager::Config> config_)
     : pimpl_ {std::make_shared<Impl>(config_)}
 {}
@@ -1518,9 +3250,10 @@ ConnectionManager::connectDevice(const DeviceId& deviceId,
                                  ConnectCallback cb,
                                  bool noNewSocket,
                                  bool forceNewSocket,
-                                 const std::string& connType)
+                                 const std::string& connType,
+                                 ChannelType type)
 {
-    pimpl_->connectDevice(deviceId, name, std::move(cb), noNewSocket, forceNewSocket, connType);
+    pimpl_->connectDevice(deviceId, name, std::move(cb), noNewSocket, forceNewSocket, connType, type);
 }
 
 void
@@ -1529,16 +3262,17 @@ ConnectionManager::connectDevice(const std::shared_ptr<dht::crypto::Certificate>
                                  ConnectCallback cb,
                                  bool noNewSocket,
                                  bool forceNewSocket,
-                                 const std::string& connType)
+                                 const std::string& connType,
+                                 ChannelType type)
 {
-    pimpl_->connectDevice(cert, name, std::move(cb), noNewSocket, forceNewSocket, connType);
+    pimpl_->connectDevice(cert, name, std::move(cb), noNewSocket, forceNewSocket, connType, type);
 }
 
 bool
 ConnectionManager::isConnecting(const DeviceId& deviceId, const std::string& name) const
 {
     auto pending = pimpl_->getPendingIds(deviceId);
-    return std::find_if(pending.begin(), pending.end(), [&](auto p) { return p.second == name; })
+    return std::find_if(pending.begin(), pending.end(), [&](auto p) { return p.second.first == name; })
            != pending.end();
 }
 
@@ -1573,12 +3307,8 @@ ConnectionManager::closeConnectionsWith(const std::string& peerUri)
             info->socket_->shutdown();
         if (info->waitForAnswer_)
             info->waitForAnswer_->cancel();
-        if (info->ice_) {
-            std::unique_lock<std::mutex> lk {info->mutex_};
-            dht::ThreadPool::io().run(
-                [ice = std::shared_ptr<IceTransport>(std::move(info->ice_))] {});
-        }
     }
+    pimpl_->teardown(std::move(connInfos));
 }
 
 void
@@ -1618,6 +3348,51 @@ ConnectionManager::activeSockets() const
     return pimpl_->infos_.size();
 }
 
+uint16_t
+ConnectionManager::directConnectPort() const
+{
+    return pimpl_->getTcpPort();
+}
+
+std::pair<std::size_t, std::size_t>
+ConnectionManager::transportCounts() const
+{
+    return {pimpl_->udpSockets_.load(), pimpl_->tcpSockets_.load()};
+}
+
+std::vector<std::pair<DeviceId, ConnectionMemoryUsage>>
+ConnectionManager::memoryUsage() const
+{
+    std::vector<std::pair<DeviceId, std::shared_ptr<ConnectionInfo>>> infos;
+    {
+        // info->mutex_ is locked before infosMtx_ elsewhere
+        std::lock_guard<std::mutex> lk(pimpl_->infosMtx_);
+        infos.reserve(pimpl_->infos_.size());
+        for (const auto& [key, info] : pimpl_->infos_)
+            if (info)
+                infos.emplace_back(key.first, info);
+    }
+    std::vector<std::pair<DeviceId, ConnectionMemoryUsage>> usages;
+    usages.reserve(infos.size());
+    for (const auto& [deviceId, info] : infos) {
+        std::lock_guard<std::mutex> lkInfo(info->mutex_);
+        ConnectionMemoryUsage usage;
+        if (info->socket_) {
+            usage = info->socket_->memoryUsage();
+        } else {
+            // Not negotiated yet
+            if (info->ice_)
+                usage.ice = info->ice_->memoryUsage();
+            if (info->tls_) {
+                usage.ice += info->tls_->iceMemoryUsage();
+                usage.tls = info->tls_->memoryUsage();
+            }
+        }
+        usages.emplace_back(deviceId, usage);
+    }
+    return usages;
+}
+
 void
 ConnectionManager::monitor() const
 {
@@ -1625,7 +3400,9 @@ ConnectionManager::monitor() const
     auto logger = pimpl_->config_->logger;
     if (!logger)
         return;
-    logger->debug("ConnectionManager current status:");
+    logger->debug("ConnectionManager current status: {} sockets over ICE-UDP, {} over ICE-TCP",
+                  pimpl_->udpSockets_.load(),
+                  pimpl_->tcpSockets_.load());
     for (const auto& [_, ci] : pimpl_->infos_) {
         if (ci->socket_)
             ci->socket_->monitor();
@@ -1636,6 +3413,17 @@ ConnectionManager::monitor() const
 void
 ConnectionManager::connectivityChanged()
 {
+    {
+        // The known paths may not be valid anymore
+        std::lock_guard<std::mutex> lk(pimpl_->knownPathsMtx_);
+        pimpl_->knownPaths_.clear();
+    }
+    pimpl_->iceFactory()->clearTurnPool();
+    {
+        std::lock_guard<std::mutex> lk(pimpl_->lanMtx_);
+        if (pimpl_->lanDiscovery_)
+            pimpl_->lanDiscovery_->connectivityChanged();
+    }
     std::lock_guard<std::mutex> lk(pimpl_->infosMtx_);
     for (const auto& [_, ci] : pimpl_->infos_) {
         if (ci->socket_)
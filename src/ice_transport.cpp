@@ -28,6 +28,7 @@
 
 #include <opendht/logger.h>
 #include <opendht/utils.h>
+#include <opendht/thread_pool.h>
 
 #include <pjlib.h>
 
@@ -40,6 +41,7 @@
 #include <utility>
 #include <tuple>
 #include <algorithm>
+#include <functional>
 #include <sstream>
 #include <chrono>
 #include <thread>
@@ -68,6 +70,15 @@ static constexpr uint16_t IPV4_HEADER_SIZE = 20; ///< Size in bytes of IPV4 pack
 static constexpr int MAX_CANDIDATES {32};
 static constexpr int MAX_DESTRUCTION_TIMEOUT {3000};
 static constexpr int HANDLE_EVENT_DURATION {500};
+// Max wait of a dormant transport, bounded anyway by the next pjnath timer.
+static constexpr int DORMANT_HANDLE_EVENT_DURATION {60000};
+// Transports of the TURN pool are destroyed after this delay, as their
+// host candidates may be outdated.
+static constexpr std::chrono::minutes TURN_POOL_MAX_AGE {5};
+// Each pooled transport holds its own TURN allocation (one per component),
+// as pjnath doesn't share a TURN session between transports, so the pool
+// is kept small: this is the total for all the options.
+static constexpr unsigned TURN_POOL_MAX_SIZE {4};
 
 //==============================================================================
 
@@ -102,6 +113,9 @@ public:
     ~Impl();
 
     void initIceInstance(const IceTransportOptions& options);
+    // Called when the transport, initialized by the TURN pool, is used
+    // with the given options
+    void onAdopted(const IceTransportOptions& options);
 
     void onComplete(pj_ice_strans* ice_st, pj_ice_strans_op op, pj_status_t status);
 
@@ -133,6 +147,7 @@ public:
     const pj_ice_sess_cand* getSelectedCandidate(unsigned comp_id, bool remote) const;
     IpAddr getLocalAddress(unsigned comp_id) const;
     IpAddr getRemoteAddress(unsigned comp_id) const;
+    bool isRelayed(unsigned comp_id) const;
     static const char* getCandidateType(const pj_ice_sess_cand* cand);
     bool isTcpEnabled() const { return config_.protocol == PJ_ICE_TP_TCP; }
     bool addStunConfig(int af);
@@ -145,9 +160,38 @@ public:
     std::vector<std::pair<IpAddr, IpAddr>> setupGenericReflexiveCandidates();
     // Generate server reflexive candidates using UPNP mappings.
     std::vector<std::pair<IpAddr, IpAddr>> setupUpnpReflexiveCandidates();
+    // Generate server reflexive candidates using the UPNP mappings not
+    // open yet. They will be reachable once the IGD opens the mappings.
+    std::vector<std::pair<IpAddr, IpAddr>> setupPendingUpnpReflexiveCandidates();
     void setDefaultRemoteAddress(unsigned comp_id, const IpAddr& addr);
     IpAddr getDefaultRemoteAddress(unsigned comp_id) const;
     bool handleEvents(unsigned max_msec);
+    // Dormant mode
+    bool setupWakeup();
+    void wakeUp();
+    void onWakeup(pj_ssize_t bytesRead);
+    unsigned nextEventsDuration();
+    void onActivity()
+    {
+        lastActivity_ = std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+    /**
+     * Called before calling pjnath from another thread, as it may arm
+     * timers a dormant thread doesn't wait for. As this counts as
+     * activity, the thread then polls normally for dormantDelay_ and
+     * sees these timers.
+     */
+    void wakeIfDormant()
+    {
+        onActivity();
+        if (dormant_.exchange(false))
+            wakeUp();
+    }
+    /**
+     * Process the IO events until the timer heap is empty, or until the
+     * destruction deadline (MAX_DESTRUCTION_TIMEOUT if not set).
+     * @return the number of timers left, or a negative value on error
+     */
     int flushTimerHeapAndIoQueue();
     int checkEventQueue(int maxEventToPoll);
 
@@ -220,6 +264,8 @@ public:
     std::shared_ptr<upnp::Controller> upnp_ {};
     std::mutex upnpMutex_ {};
     std::map<Mapping::key_t, Mapping> upnpMappings_;
+    // Mappings reserved but not open yet when the session was created.
+    std::map<Mapping::key_t, Mapping> upnpPendingMappings_;
     std::mutex upnpMappingsMutex_ {};
 
     bool onlyIPv4Private_ {true};
@@ -228,6 +274,19 @@ public:
     std::thread thread_ {};
     std::atomic_bool threadTerminateFlags_ {false};
 
+    // Dormant mode: the thread waits for the next pjnath timer or IO
+    // event, and is woken up by a datagram on wakeSock_ if needed.
+    std::chrono::seconds dormantDelay_ {0};
+    std::atomic<std::chrono::steady_clock::rep> lastActivity_ {0};
+    // Deadline of the destruction, 0 for MAX_DESTRUCTION_TIMEOUT
+    std::atomic<std::chrono::steady_clock::rep> destructionDeadline_ {0};
+    std::atomic_bool dormant_ {false};
+    pj_sock_t wakeSock_ {PJ_INVALID_SOCKET};
+    pj_sockaddr wakeAddr_ {};
+    pj_ioqueue_key_t* wakeKey_ {nullptr};
+    pj_ioqueue_op_key_t wakeOp_ {};
+    char wakeBuf_[16];
+
     // Wait data on components
     mutable std::mutex sendDataMutex_ {};
     std::condition_variable waitDataCv_ = {};
@@ -343,6 +402,7 @@ IceTransport::Impl::~Impl()
         logger_->debug("[ice:{}] destroying {}", fmt::ptr(this), fmt::ptr(icest_));
 
     threadTerminateFlags_ = true;
+    wakeUp();
 
     if (thread_.joinable()) {
         thread_.join();
@@ -383,6 +443,13 @@ IceTransport::Impl::~Impl()
                 logger_->warn("[ice:{}] Unexpected left events in IO queue", fmt::ptr(this));
         }
 
+        // Also closes the socket
+        if (wakeKey_) {
+            pj_ioqueue_unregister(wakeKey_);
+            wakeKey_ = nullptr;
+            wakeSock_ = PJ_INVALID_SOCKET;
+        }
+
         if (config_.stun_cfg.ioqueue)
             pj_ioqueue_destroy(config_.stun_cfg.ioqueue);
 
@@ -412,6 +479,7 @@ IceTransport::Impl::initIceInstance(const IceTransportOptions& options)
     initiatorSession_ = options.master;
     accountLocalAddr_ = std::move(options.accountLocalAddr);
     accountPublicAddr_ = std::move(options.accountPublicAddr);
+    dormantDelay_ = options.dormantDelay;
     stunServers_ = std::move(options.stunServers);
     turnServers_ = std::move(options.turnServers);
 
@@ -421,8 +489,8 @@ IceTransport::Impl::initIceInstance(const IceTransportOptions& options)
              compCount_,
              initiatorSession_ ? "master" : "slave");
 
-    if (upnpEnabled_)
-        upnp_.reset(new upnp::Controller());
+    if (upnpEnabled_ and options.upnpContext)
+        upnp_.reset(new upnp::Controller(options.upnpContext));
 
     config_ = options.factory->getIceCfg(); // config copy
     if (isTcp_) {
@@ -436,7 +504,11 @@ IceTransport::Impl::initIceInstance(const IceTransportOptions& options)
     }
 
     pool_.reset(
-        pj_pool_create(options.factory->getPoolFactory(), "IceTransport.pool", 512, 512, NULL));
+        pj_pool_create(options.factory->getPoolFactory(),
+                       "IceTransport.pool",
+                       options.poolSize,
+                       options.poolIncrement,
+                       NULL));
     if (not pool_)
         throw std::runtime_error("pj_pool_create() failed");
 
@@ -461,6 +533,7 @@ IceTransport::Impl::initIceInstance(const IceTransportOptions& options)
     addStunConfig(pj_AF_INET6());
 
     std::vector<std::pair<IpAddr, IpAddr>> upnpSrflxCand;
+    std::vector<std::pair<IpAddr, IpAddr>> pendingUpnpSrflxCand;
     if (upnp_) {
         requestUpnpMappings();
         upnpSrflxCand = setupUpnpReflexiveCandidates();
@@ -468,6 +541,16 @@ IceTransport::Impl::initIceInstance(const IceTransportOptions& options)
             addServerReflexiveCandidates(upnpSrflxCand);
             if (logger_)
                 logger_->debug("[ice:{}] Added UPNP srflx candidates:", fmt::ptr(this));
+        } else {
+            // Don't wait for the IGD. The candidates are only usable
+            // once the mappings are open, so keep the generic ones too.
+            pendingUpnpSrflxCand = setupPendingUpnpReflexiveCandidates();
+            if (not pendingUpnpSrflxCand.empty()) {
+                addServerReflexiveCandidates(pendingUpnpSrflxCand);
+                if (logger_)
+                    logger_->debug("[ice:{}] Added pending UPNP srflx candidates:",
+                                   fmt::ptr(this));
+            }
         }
     }
 
@@ -484,7 +567,7 @@ IceTransport::Impl::initIceInstance(const IceTransportOptions& options)
         }
     }
 
-    if (upnpSrflxCand.empty() and genericSrflxCand.empty()) {
+    if (upnpSrflxCand.empty() and pendingUpnpSrflxCand.empty() and genericSrflxCand.empty()) {
         if (logger_)
             logger_->warn("[ice:{}] No server reflexive candidates added", fmt::ptr(this));
     }
@@ -548,16 +631,115 @@ IceTransport::Impl::initIceInstance(const IceTransportOptions& options)
         throw std::runtime_error("pj_ice_strans_create() failed");
     }
 
+    if (dormantDelay_.count() > 0 and not setupWakeup()) {
+        if (logger_)
+            logger_->warn("[ice:{}] Unable to create wake-up socket, dormant mode disabled",
+                          fmt::ptr(this));
+        dormantDelay_ = {};
+    }
+    onActivity();
+
     // Must be created after any potential failure
     thread_ = std::thread([this] {
         while (not threadTerminateFlags_) {
             // NOTE: handleEvents can return false in this case
             // but here we don't care if there is event or not.
-            handleEvents(HANDLE_EVENT_DURATION);
+            handleEvents(nextEventsDuration());
         }
     });
 }
 
+void
+IceTransport::Impl::onAdopted(const IceTransportOptions& options)
+{
+    on_initdone_cb_ = options.onInitDone;
+    on_negodone_cb_ = options.onNegoDone;
+    if (logger_)
+        logger_->debug("[ice:{}] Using a preallocated transport", fmt::ptr(this));
+    if (options.master)
+        setInitiatorSession();
+    else
+        setSlaveSession();
+    // As for a regular initialization, the callback is asynchronous
+    if (on_initdone_cb_)
+        dht::ThreadPool::io().run([cb = on_initdone_cb_] { cb(true); });
+}
+
+bool
+IceTransport::Impl::setupWakeup()
+{
+    if (pj_sock_socket(pj_AF_INET(), pj_SOCK_DGRAM(), 0, &wakeSock_) != PJ_SUCCESS)
+        return false;
+    pj_str_t loopback = pj_str((char*) "127.0.0.1");
+    pj_sockaddr_in_init(&wakeAddr_.ipv4, &loopback, 0);
+    int addrLen = sizeof(pj_sockaddr_in);
+    if (pj_sock_bind(wakeSock_, &wakeAddr_, addrLen) != PJ_SUCCESS
+        or pj_sock_getsockname(wakeSock_, &wakeAddr_, &addrLen) != PJ_SUCCESS) {
+        pj_sock_close(wakeSock_);
+        wakeSock_ = PJ_INVALID_SOCKET;
+        return false;
+    }
+
+    pj_ioqueue_callback cb;
+    pj_bzero(&cb, sizeof(cb));
+    cb.on_read_complete = [](pj_ioqueue_key_t* key, pj_ioqueue_op_key_t*, pj_ssize_t bytesRead) {
+        if (auto* tr = static_cast<Impl*>(pj_ioqueue_get_user_data(key)))
+            tr->onWakeup(bytesRead);
+    };
+    if (pj_ioqueue_register_sock(pool_.get(),
+                                 config_.stun_cfg.ioqueue,
+                                 wakeSock_,
+                                 this,
+                                 &cb,
+                                 &wakeKey_)
+        != PJ_SUCCESS) {
+        pj_sock_close(wakeSock_);
+        wakeSock_ = PJ_INVALID_SOCKET;
+        wakeKey_ = nullptr;
+        return false;
+    }
+    pj_ioqueue_op_key_init(&wakeOp_, sizeof(wakeOp_));
+    onWakeup(0);
+    return true;
+}
+
+void
+IceTransport::Impl::onWakeup(pj_ssize_t bytesRead)
+{
+    if (bytesRead < 0 or threadTerminateFlags_)
+        return;
+    // Wait for the next wake-up
+    pj_ssize_t size = sizeof(wakeBuf_);
+    pj_ioqueue_recv(wakeKey_, &wakeOp_, wakeBuf_, &size, PJ_IOQUEUE_ALWAYS_ASYNC);
+}
+
+void
+IceTransport::Impl::wakeUp()
+{
+    if (wakeSock_ == PJ_INVALID_SOCKET)
+        return;
+    char c = 0;
+    pj_ssize_t size = 1;
+    pj_sock_sendto(wakeSock_, &c, &size, 0, &wakeAddr_, sizeof(pj_sockaddr_in));
+}
+
+unsigned
+IceTransport::Impl::nextEventsDuration()
+{
+    if (dormantDelay_.count() == 0 or not _isRunning())
+        return HANDLE_EVENT_DURATION;
+    // Set the flag before checking the activity, so either the thread
+    // sees a concurrent send, or the sender sees the flag and wakes it up.
+    dormant_ = true;
+    auto lastActivity = std::chrono::steady_clock::time_point(
+        std::chrono::steady_clock::duration(lastActivity_.load()));
+    if (std::chrono::steady_clock::now() - lastActivity < dormantDelay_) {
+        dormant_ = false;
+        return HANDLE_EVENT_DURATION;
+    }
+    return DORMANT_HANDLE_EVENT_DURATION;
+}
+
 bool
 IceTransport::Impl::_isInitialized() const
 {
@@ -605,6 +787,7 @@ IceTransport::Impl::handleEvents(unsigned max_msec)
     pj_time_val max_timeout = {0, static_cast<long>(max_msec)};
     pj_time_val timeout = {0, 0};
     unsigned net_event_count = 0;
+    pj_time_val_normalize(&max_timeout);
 
     pj_timer_heap_poll(config_.stun_cfg.timer_heap, &timeout);
     auto hasActiveTimer = timeout.sec != PJ_MAXINT32 || timeout.msec != PJ_MAXINT32;
@@ -634,6 +817,7 @@ IceTransport::Impl::handleEvents(unsigned max_msec)
             return hasActiveTimer;
         }
 
+        dormant_ = false;
         net_event_count += n_events;
         timeout.sec = timeout.msec = 0;
     } while (net_event_count < MAX_NET_EVENTS);
@@ -643,30 +827,38 @@ IceTransport::Impl::handleEvents(unsigned max_msec)
 int
 IceTransport::Impl::flushTimerHeapAndIoQueue()
 {
-    pj_time_val timerTimeout = {0, 0};
-    pj_time_val defaultWaitTime = {0, HANDLE_EVENT_DURATION};
-    bool hasActiveTimer = false;
-    std::chrono::milliseconds totalWaitTime {0};
     auto const start = std::chrono::steady_clock::now();
+    auto deadline = destructionDeadline_.load()
+                        ? std::chrono::steady_clock::time_point(
+                            std::chrono::steady_clock::duration(destructionDeadline_.load()))
+                        : start + std::chrono::milliseconds(MAX_DESTRUCTION_TIMEOUT);
+    pj_time_val timerTimeout = {0, 0};
     // We try to process pending events as fast as possible to
     // speed-up the release.
-    int maxEventToProcess = 10;
-
-    do {
-        if (checkEventQueue(maxEventToProcess) < 0)
-            return -1;
+    if (checkEventQueue(10) < 0)
+        return -1;
 
+    while (true) {
         pj_timer_heap_poll(config_.stun_cfg.timer_heap, &timerTimeout);
-        hasActiveTimer = !(timerTimeout.sec == PJ_MAXINT32 && timerTimeout.msec == PJ_MAXINT32);
-
-        if (hasActiveTimer) {
-            pj_time_val_normalize(&timerTimeout);
-            auto waitTime = std::chrono::milliseconds(
-                std::min(PJ_TIME_VAL_MSEC(timerTimeout), PJ_TIME_VAL_MSEC(defaultWaitTime)));
-            std::this_thread::sleep_for(waitTime);
-            totalWaitTime += waitTime;
+        if (timerTimeout.sec == PJ_MAXINT32 && timerTimeout.msec == PJ_MAXINT32)
+            break;
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+            break;
+        // Wait for the next timer, or wake up as soon as an answer is
+        // received (e.g. the TURN deallocation), instead of sleeping.
+        pj_time_val_normalize(&timerTimeout);
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+        auto waitTime = std::min<long>(PJ_TIME_VAL_MSEC(timerTimeout), left.count());
+        pj_time_val timeout = {0, waitTime};
+        pj_time_val_normalize(&timeout);
+        if (pj_ioqueue_poll(config_.stun_cfg.ioqueue, &timeout) < 0) {
+            const auto err = pj_get_os_error();
+            if (logger_)
+                logger_->error("[ice:{}] ioqueue error {:d}: {:s}", fmt::ptr(this), err, sip_utils::sip_strerror(err));
+            return -1;
         }
-    } while (hasActiveTimer && totalWaitTime < std::chrono::milliseconds(MAX_DESTRUCTION_TIMEOUT));
+    }
 
     auto duration = std::chrono::steady_clock::now() - start;
     if (logger_)
@@ -775,6 +967,7 @@ IceTransport::Impl::setInitiatorSession()
         logger_->debug("[ice:{}] as master", fmt::ptr(this));
     initiatorSession_ = true;
     if (_isInitialized()) {
+        wakeIfDormant();
         auto status = pj_ice_strans_change_role(icest_, PJ_ICE_SESS_ROLE_CONTROLLING);
         if (status != PJ_SUCCESS) {
             if (logger_)
@@ -793,6 +986,7 @@ IceTransport::Impl::setSlaveSession()
         logger_->debug("[ice:{}] as slave", fmt::ptr(this));
     initiatorSession_ = false;
     if (_isInitialized()) {
+        wakeIfDormant();
         auto status = pj_ice_strans_change_role(icest_, PJ_ICE_SESS_ROLE_CONTROLLED);
         if (status != PJ_SUCCESS) {
             if (logger_)
@@ -830,6 +1024,17 @@ IceTransport::Impl::getSelectedCandidate(unsigned comp_id, bool remote) const
         return sess->lcand;
 }
 
+bool
+IceTransport::Impl::isRelayed(unsigned comp_id) const
+{
+    for (auto remote : {false, true}) {
+        auto cand = getSelectedCandidate(comp_id, remote);
+        if (cand and cand->type == PJ_ICE_CAND_TYPE_RELAYED)
+            return true;
+    }
+    return false;
+}
+
 IpAddr
 IceTransport::Impl::getLocalAddress(unsigned comp_id) const
 {
@@ -941,8 +1146,21 @@ IceTransport::Impl::requestUpnpMappings()
         // Set port number to 0 to get any available port.
         Mapping requestedMap(portType);
 
-        // Request the mapping
-        Mapping::sharedPtr_t mapPtr = upnp_->reserveMapping(requestedMap);
+        // Request the mapping. Don't wait for the IGD if none is open
+        // yet, the pending mapping is used as is and may open later.
+        // Note: the callback may outlive the transport, don't capture it.
+        Mapping::sharedPtr_t mapPtr = upnp_->reserveMapping(
+            requestedMap,
+            [logger = logger_, ice = fmt::ptr(this)](Mapping::sharedPtr_t map) {
+                if (not logger)
+                    return;
+                if (map->getState() == MappingState::OPEN)
+                    logger->debug("[ice:{}] UPNP mapping {:s} is open",
+                                  ice,
+                                  map->toString(true));
+                else
+                    logger->warn("[ice:{}] UPNP mapping {:s} failed", ice, map->toString());
+            });
 
         // To use a mapping, it must be valid, open and has valid host address.
         if (mapPtr and mapPtr->getMapKey() and (mapPtr->getState() == MappingState::OPEN)
@@ -960,10 +1178,20 @@ IceTransport::Impl::requestUpnpMappings()
                           fmt::ptr(this),
                           mapPtr->toString());
             }
+        } else if (mapPtr and mapPtr->getMapKey()
+                   and mapPtr->getState() != MappingState::FAILED) {
+            // The controller keeps the reservation until the transport
+            // is destroyed.
+            std::lock_guard<std::mutex> lock(upnpMappingsMutex_);
+            upnpPendingMappings_.emplace(mapPtr->getMapKey(), *mapPtr);
+            if (logger_)
+                logger_->debug("[ice:{}] UPNP mapping {:s} requested",
+                               fmt::ptr(this),
+                               mapPtr->toString());
         } else {
             if (logger_)
                 logger_->warn("[ice:{}] UPNP mapping request failed!", fmt::ptr(this));
-            upnp_->releaseMapping(requestedMap);
+            upnp_->releaseMapping(mapPtr ? *mapPtr : requestedMap);
         }
     }
 }
@@ -1098,6 +1326,42 @@ IceTransport::Impl::setupUpnpReflexiveCandidates()
     return addrList;
 }
 
+std::vector<std::pair<IpAddr, IpAddr>>
+IceTransport::Impl::setupPendingUpnpReflexiveCandidates()
+{
+    std::lock_guard<std::mutex> lock(upnpMappingsMutex_);
+
+    if (not upnp_ or upnpPendingMappings_.size() != compCount_)
+        return {};
+
+    // The IGD may be known even if no mapping is open yet.
+    auto publicIp = upnp_->getExternalIP();
+    if (not publicIp)
+        publicIp = accountPublicAddr_;
+    IpAddr localIp = accountLocalAddr_ ? accountLocalAddr_ : ip_utils::getLocalAddr(pj_AF_INET());
+    if (not publicIp or not localIp) {
+        if (logger_)
+            logger_->warn("[ice:{}] Missing address, pending UPNP srflx candidates wont be generated!",
+                  fmt::ptr(this));
+        return {};
+    }
+
+    std::vector<std::pair<IpAddr, IpAddr>> addrList;
+
+    addrList.reserve(upnpPendingMappings_.size());
+    for (auto const& [_, map] : upnpPendingMappings_) {
+        // The local socket is bound to the internal port, so the
+        // candidate is reachable as soon as the mapping is open.
+        IpAddr localAddr {localIp};
+        localAddr.setPort(map.getInternalPort());
+        IpAddr publicAddr {publicIp};
+        publicAddr.setPort(map.getExternalPort());
+        addrList.emplace_back(localAddr, publicAddr);
+    }
+
+    return addrList;
+}
+
 void
 IceTransport::Impl::setDefaultRemoteAddress(unsigned compId, const IpAddr& addr)
 {
@@ -1127,6 +1391,7 @@ IceTransport::Impl::onReceiveData(unsigned comp_id, void* pkt, pj_size_t size)
                                getRemoteAddress(comp_id).toString().c_str());
     if (size == 0)
         return;
+    onActivity();
 
     {
         auto& io = compIO_[comp_id - 1];
@@ -1182,6 +1447,16 @@ IceTransport::logger() const
 void
 IceTransport::initIceInstance(const IceTransportOptions& options)
 {
+    if (options.factory) {
+        if (auto ice = options.factory->takePreallocated(options)) {
+            // Keep the callbacks set before the initialization
+            ice->pimpl_->scb = std::move(pimpl_->scb);
+            std::swap(pimpl_, ice->pimpl_);
+            pimpl_->onAdopted(options);
+            jami_tracepoint(ice_transport_context, reinterpret_cast<uint64_t>(this));
+            return;
+        }
+    }
     pimpl_->initIceInstance(options);
     jami_tracepoint(ice_transport_context, reinterpret_cast<uint64_t>(this));
 }
@@ -1293,6 +1568,7 @@ IceTransport::startIce(const Attribute& rem_attrs, std::vector<IceCandidate>&& r
              fmt::ptr(pimpl_),
              rem_candidates.size());
 
+    pimpl_->wakeIfDormant();
     auto status = pj_ice_strans_start_ice(pimpl_->icest_,
                                           pj_strset(&ufrag,
                                                     (char*) rem_attrs.ufrag.c_str(),
@@ -1350,6 +1626,7 @@ IceTransport::startIce(const SDP& sdp)
             rem_candidates.emplace_back(cand);
     }
 
+    pimpl_->wakeIfDormant();
     auto status = pj_ice_strans_start_ice(pimpl_->icest_,
                                           pj_strset(&ufrag,
                                                     (char*) sdp.ufrag.c_str(),
@@ -1379,6 +1656,12 @@ IceTransport::getLocalAddress(unsigned comp_id) const
     return pimpl_->getLocalAddress(comp_id);
 }
 
+bool
+IceTransport::isRelayed(unsigned comp_id) const
+{
+    return pimpl_->isRelayed(comp_id);
+}
+
 IpAddr
 IceTransport::getRemoteAddress(unsigned comp_id) const
 {
@@ -1695,6 +1978,9 @@ IceTransport::send(unsigned compId, const unsigned char* buf, size_t len)
         return -1;
     }
 
+    // A dormant thread must handle the pending writes
+    pimpl_->wakeIfDormant();
+
     std::unique_lock dlk(pimpl_->sendDataMutex_, std::defer_lock);
     if (isTCPEnabled())
         dlk.lock();
@@ -1749,11 +2035,33 @@ IceTransport::waitForData(unsigned compId, std::chrono::milliseconds timeout, st
 }
 
 bool
-IceTransport::isTCPEnabled()
+IceTransport::isTCPEnabled() const
 {
     return pimpl_->isTcpEnabled();
 }
 
+std::size_t
+IceTransport::memoryUsage() const
+{
+    std::size_t size = 0;
+    if (pimpl_->pool_)
+        size += pj_pool_get_capacity(pimpl_->pool_.get());
+    for (auto& io : pimpl_->compIO_) {
+        std::lock_guard<std::mutex> lk(io.mutex);
+        for (const auto& packet : io.queue)
+            size += packet.data.capacity();
+    }
+    for (const auto& channel : pimpl_->peerChannels_)
+        size += channel.size();
+    return size;
+}
+
+void
+IceTransport::setDestructionDeadline(std::chrono::steady_clock::time_point deadline)
+{
+    pimpl_->destructionDeadline_ = deadline.time_since_epoch().count();
+}
+
 ICESDP
 IceTransport::parseIceCandidates(std::string_view sdp_msg)
 {
@@ -1798,6 +2106,62 @@ IceTransport::link() const
 
 //==============================================================================
 
+struct IceTransportFactory::TurnPool
+{
+    struct Entry
+    {
+        std::shared_ptr<IceTransport> ice;
+        std::chrono::steady_clock::time_point created;
+        std::shared_ptr<std::atomic_bool> ready;
+    };
+    // Options of the keys in use, to refill their entries
+    struct Usage
+    {
+        IceTransportOptions options;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    // Maximum number of transports, for all the options
+    unsigned size {0};
+    // Transports being initialized, waited for by the factory destructor
+    unsigned initializing {0};
+    bool closed {false};
+    std::map<std::size_t, std::vector<Entry>> entries;
+    std::map<std::size_t, Usage> used;
+
+    std::size_t count() const
+    {
+        std::size_t count = 0;
+        for (const auto& [key, list] : entries)
+            count += list.size();
+        return count;
+    }
+};
+
+// Transports are only taken from the pool if created with the same options.
+// The credentials are not part of the key: the transports keep the ones
+// they were allocated with, until they expire.
+// Returns 0 for the options not using TURN.
+static std::size_t
+getTurnPoolKey(const IceTransportOptions& options)
+{
+    if (options.turnServers.empty())
+        return 0;
+    std::ostringstream key;
+    key << options.tcpEnable << ' ' << options.streamsCount << ' ' << options.compCountPerStream
+        << ' ' << options.upnpEnable << ' ' << options.upnpContext.get() << ' '
+        << options.accountLocalAddr.toString(true) << ' '
+        << options.accountPublicAddr.toString(true) << ' ' << options.dormantDelay.count()
+        << '\n';
+    for (const auto& server : options.stunServers)
+        key << server.uri << '\n';
+    for (const auto& server : options.turnServers)
+        key << server.uri << ' ' << server.username << ' ' << server.realm << '\n';
+    return std::max<std::size_t>(std::hash<std::string> {}(key.str()), 1);
+}
+
 IceTransportFactory::IceTransportFactory()
     : cp_(new pj_caching_pool(),
           [](pj_caching_pool* p) {
@@ -1805,6 +2169,7 @@ IceTransportFactory::IceTransportFactory()
               delete p;
           })
     , ice_cfg_()
+    , turnPool_(std::make_shared<TurnPool>())
 {
     pj_caching_pool_init(cp_.get(), NULL, 0);
 
@@ -1823,7 +2188,16 @@ IceTransportFactory::IceTransportFactory()
     ice_cfg_.opt.aggressive = PJ_FALSE;
 }
 
-IceTransportFactory::~IceTransportFactory() {}
+IceTransportFactory::~IceTransportFactory()
+{
+    // The transports use the pools of cp_ and the ICE configuration
+    decltype(turnPool_->entries) entries;
+    std::unique_lock<std::mutex> lk(turnPool_->mutex);
+    turnPool_->closed = true;
+    turnPool_->cv.wait(lk, [&] { return turnPool_->initializing == 0; });
+    entries = std::move(turnPool_->entries);
+    lk.unlock();
+}
 
 std::shared_ptr<IceTransport>
 IceTransportFactory::createTransport(std::string_view name)
@@ -1847,6 +2221,236 @@ IceTransportFactory::createUTransport(std::string_view name)
     }
 }
 
+void
+IceTransportFactory::setTurnPoolSize(unsigned size)
+{
+    std::lock_guard<std::mutex> lk(turnPool_->mutex);
+    turnPool_->size = std::min(size, TURN_POOL_MAX_SIZE);
+}
+
+void
+IceTransportFactory::clearTurnPool()
+{
+    std::vector<std::shared_ptr<IceTransport>> transports;
+    {
+        std::lock_guard<std::mutex> lk(turnPool_->mutex);
+        for (auto& [key, list] : turnPool_->entries)
+            for (auto& entry : list)
+                transports.emplace_back(std::move(entry.ice));
+        turnPool_->entries.clear();
+        turnPool_->used.clear();
+    }
+    if (transports.empty())
+        return;
+    // Destroying a transport waits for its thread
+    dht::ThreadPool::io().run([transports = std::move(transports), cp = cp_]() mutable {
+        transports.clear();
+    });
+}
+
+std::size_t
+IceTransportFactory::turnPoolCount() const
+{
+    std::lock_guard<std::mutex> lk(turnPool_->mutex);
+    std::size_t count = 0;
+    for (const auto& [key, list] : turnPool_->entries)
+        count += std::count_if(list.begin(), list.end(), [](const auto& entry) {
+            return entry.ready->load();
+        });
+    return count;
+}
+
+std::shared_ptr<IceTransport>
+IceTransportFactory::takePreallocated(const IceTransportOptions& options)
+{
+    auto key = getTurnPoolKey(options);
+    if (key == 0)
+        return {};
+
+    std::shared_ptr<IceTransport> ice;
+    std::vector<std::shared_ptr<IceTransport>> expired;
+    std::size_t missing = 0;
+    {
+        std::lock_guard<std::mutex> lk(turnPool_->mutex);
+        if (turnPool_->size == 0 or turnPool_->closed)
+            return {};
+        auto now = std::chrono::steady_clock::now();
+        auto& usage = turnPool_->used[key];
+        usage.options = options;
+        // Not kept alive by the pool
+        usage.options.onInitDone = {};
+        usage.options.onNegoDone = {};
+        usage.lastUsed = now;
+        auto& list = turnPool_->entries[key];
+        for (auto it = list.begin(); it != list.end();) {
+            if (now - it->created > TURN_POOL_MAX_AGE) {
+                expired.emplace_back(std::move(it->ice));
+                it = list.erase(it);
+            } else if (not ice and it->ready->load() and it->ice->isInitialized()) {
+                ice = std::move(it->ice);
+                it = list.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        // Refilled for the options used last, instead of the others
+        missing = turnPool_->size - std::min<std::size_t>(list.size(), turnPool_->size);
+        for (auto it = turnPool_->entries.begin(); it != turnPool_->entries.end();) {
+            if (it->first == key) {
+                ++it;
+                continue;
+            }
+            for (auto& entry : it->second)
+                expired.emplace_back(std::move(entry.ice));
+            it = turnPool_->entries.erase(it);
+        }
+    }
+    if (not expired.empty())
+        dht::ThreadPool::io().run([expired = std::move(expired), cp = cp_]() mutable {
+            expired.clear();
+        });
+    for (std::size_t i = 0; i < missing; i++)
+        fillTurnPool(key, options);
+    return ice;
+}
+
+void
+IceTransportFactory::refreshTurnPool()
+{
+    std::vector<std::shared_ptr<IceTransport>> expired;
+    std::size_t key = 0;
+    IceTransportOptions options;
+    std::size_t missing = 0;
+    {
+        std::lock_guard<std::mutex> lk(turnPool_->mutex);
+        if (turnPool_->closed)
+            return;
+        auto now = std::chrono::steady_clock::now();
+        auto isIdle = [&](std::size_t key) {
+            auto usage = turnPool_->used.find(key);
+            return turnPool_->size == 0 or usage == turnPool_->used.end()
+                   or now - usage->second.lastUsed > TURN_POOL_MAX_AGE;
+        };
+        for (auto it = turnPool_->entries.begin(); it != turnPool_->entries.end();) {
+            auto& list = it->second;
+            // Options not used anymore release all of their allocations
+            bool idle = isIdle(it->first);
+            for (auto entry = list.begin(); entry != list.end();) {
+                if (idle or now - entry->created > TURN_POOL_MAX_AGE) {
+                    expired.emplace_back(std::move(entry->ice));
+                    entry = list.erase(entry);
+                } else {
+                    ++entry;
+                }
+            }
+            if (list.empty())
+                it = turnPool_->entries.erase(it);
+            else
+                ++it;
+        }
+        // Only the options used last are refilled
+        const TurnPool::Usage* last = nullptr;
+        for (auto it = turnPool_->used.begin(); it != turnPool_->used.end();) {
+            if (isIdle(it->first)) {
+                it = turnPool_->used.erase(it);
+                continue;
+            }
+            if (not last or it->second.lastUsed > last->lastUsed) {
+                key = it->first;
+                last = &it->second;
+            }
+            ++it;
+        }
+        auto count = turnPool_->count();
+        if (last and count < turnPool_->size) {
+            options = last->options;
+            missing = turnPool_->size - count;
+        }
+    }
+    if (not expired.empty())
+        dht::ThreadPool::io().run([expired = std::move(expired), cp = cp_]() mutable {
+            expired.clear();
+        });
+    for (std::size_t i = 0; i < missing; i++)
+        fillTurnPool(key, options);
+}
+
+void
+IceTransportFactory::fillTurnPool(std::size_t key, const IceTransportOptions& options)
+{
+    auto ice = createTransport("");
+    if (not ice)
+        return;
+    auto ready = std::make_shared<std::atomic_bool>(false);
+
+    auto opts = options;
+    opts.onNegoDone = {};
+    opts.onInitDone = [w = std::weak_ptr<TurnPool>(turnPool_),
+                       key,
+                       ready,
+                       transport = ice.get(),
+                       cp = cp_](bool ok) {
+        if (ok) {
+            *ready = true;
+            return;
+        }
+        // Called by the transport, so destroy it from another thread
+        dht::ThreadPool::io().run([w, key, transport, cp] {
+            std::shared_ptr<IceTransport> failed;
+            if (auto pool = w.lock()) {
+                std::lock_guard<std::mutex> lk(pool->mutex);
+                auto it = pool->entries.find(key);
+                if (it == pool->entries.end())
+                    return;
+                auto& list = it->second;
+                auto entry = std::find_if(list.begin(), list.end(), [&](const auto& entry) {
+                    return entry.ice.get() == transport;
+                });
+                if (entry != list.end()) {
+                    failed = std::move(entry->ice);
+                    list.erase(entry);
+                }
+            }
+        });
+    };
+
+    {
+        std::lock_guard<std::mutex> lk(turnPool_->mutex);
+        if (turnPool_->closed)
+            return;
+        turnPool_->entries[key].emplace_back(
+            TurnPool::Entry {ice, std::chrono::steady_clock::now(), ready});
+        turnPool_->initializing++;
+    }
+    dht::ThreadPool::io().run([pool = turnPool_, ice, opts = std::move(opts)]() mutable {
+        bool closed;
+        {
+            std::lock_guard<std::mutex> lk(pool->mutex);
+            closed = pool->closed;
+        }
+        if (not closed) {
+            try {
+                // Not through IceTransport::initIceInstance, to not take from the pool
+                ice->pimpl_->initIceInstance(opts);
+            } catch (const std::exception& e) {
+                if (ice->logger())
+                    ice->logger()->error("Unable to preallocate ICE transport: {}", e.what());
+                std::lock_guard<std::mutex> lk(pool->mutex);
+                for (auto& [key, list] : pool->entries)
+                    list.erase(std::remove_if(list.begin(),
+                                              list.end(),
+                                              [&](const auto& entry) { return entry.ice == ice; }),
+                               list.end());
+            }
+        }
+        // The factory may be destroyed once initializing is 0
+        ice.reset();
+        std::lock_guard<std::mutex> lk(pool->mutex);
+        pool->initializing--;
+        pool->cv.notify_all();
+    });
+}
+
 //==============================================================================
 
 void
@@ -138,6 +138,12 @@ public:
 
     IpAddr getDefaultLocalAddress() const { return getLocalAddress(1); }
 
+    /**
+     * Returns true if the selected pair of the component uses a relay
+     * (TURN) candidate
+     */
+    bool isRelayed(unsigned comp_id) const;
+
     /**
      * Return ICE session attributes
      */
@@ -177,11 +183,24 @@ public:
 
     unsigned getComponentCount() const;
 
+    /**
+     * Bytes allocated by the transport: its memory pool (pjnath sessions,
+     * timer heap and IO queue) and the received packets not read yet.
+     */
+    std::size_t memoryUsage() const;
+
     // Set session state
     bool setSlaveSession();
     bool setInitiatorSession();
 
-    bool isTCPEnabled();
+    bool isTCPEnabled() const;
+
+    /**
+     * On destruction, the pending operations (e.g. the TURN deallocation)
+     * are not waited for after this deadline.
+     * By default, they are waited for up to 3 seconds.
+     */
+    void setDestructionDeadline(std::chrono::steady_clock::time_point deadline);
 
     ICESDP parseIceCandidates(std::string_view sdp_msg);
 
@@ -190,6 +209,7 @@ public:
     std::string link() const;
 
 private:
+    friend class IceTransportFactory;
     class Impl;
     std::unique_ptr<Impl> pimpl_;
 };
@@ -211,9 +231,48 @@ public:
     pj_pool_factory* getPoolFactory() { return &cp_->factory; }
     std::shared_ptr<pj_caching_pool> getPoolCaching() { return cp_; }
 
+    /**
+     * Keep up to size transports initialized in advance, so the next
+     * transports initialized with options using TURN servers take one with
+     * its TURN allocation done instead of waiting for it. Each of them
+     * holds its own allocation: size is the total for all the options,
+     * capped to 4, and the pool is filled for the options used last.
+     * 0 disables the pool.
+     */
+    void setTurnPoolSize(unsigned size);
+
+    /**
+     * Destroy the transports initialized in advance (e.g. after a
+     * connectivity change, as their candidates may be outdated)
+     */
+    void clearTurnPool();
+
+    /**
+     * Destroy the expired transports of the pool and refill it. The
+     * transports of options not used during the last minutes are destroyed
+     * without being replaced, so an idle pool releases its allocations.
+     * To be called periodically while the pool is enabled.
+     */
+    void refreshTurnPool();
+
+    /**
+     * @return the number of transports ready in the pool
+     */
+    std::size_t turnPoolCount() const;
+
 private:
+    friend class IceTransport;
+    struct TurnPool;
+
+    // Returns a transport initialized with the same options, if any,
+    // and refills the pool
+    std::shared_ptr<IceTransport> takePreallocated(const IceTransportOptions& options);
+    void fillTurnPool(std::size_t key, const IceTransportOptions& options);
+
     std::shared_ptr<pj_caching_pool> cp_;
     pj_ice_strans_cfg ice_cfg_;
+    // Destroyed before cp_, as the transports use its pools
+    std::shared_ptr<TurnPool> turnPool_;
 };
 
 }; // namespace jami
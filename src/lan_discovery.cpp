@@ -0,0 +1,231 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#include "lan_discovery.h"
+
+#include <opendht/peer_discovery.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace jami {
+
+// dht::PeerDiscovery service name
+static constexpr const char LAN_DISCOVERY_SERVICE[] {"dhtnet"};
+
+dht::Blob
+LanAnnouncement::getSignedData() const
+{
+    dht::Blob data;
+    data.reserve(owner.size() + sizeof(port) + sizeof(time) + addrs.size() * 16);
+    data.insert(data.end(), owner.begin(), owner.end());
+    data.emplace_back(port >> 8);
+    data.emplace_back(port & 0xff);
+    for (int i = sizeof(time) - 1; i >= 0; i--)
+        data.emplace_back((static_cast<uint64_t>(time) >> (i * 8)) & 0xff);
+    for (const auto& addr : addrs) {
+        data.insert(data.end(), addr.begin(), addr.end());
+        data.emplace_back('\0');
+    }
+    return data;
+}
+
+LanDiscovery::LanDiscovery(const std::shared_ptr<asio::io_context>& ctx,
+                           const dht::crypto::Identity& id,
+                           uint16_t port,
+                           const std::shared_ptr<dht::log::Logger>& logger)
+    : ctx_(ctx)
+    , id_(id)
+    , deviceId_(id.second->getLongId())
+    , logger_(logger)
+    , discovery_(std::make_unique<dht::PeerDiscovery>(port, ctx, logger))
+    , publishTimer_(*ctx)
+{}
+
+LanDiscovery::~LanDiscovery()
+{
+    publishTimer_.cancel();
+    discovery_->stop();
+}
+
+void
+LanDiscovery::start(uint16_t port)
+{
+    discovery_->startDiscovery(LAN_DISCOVERY_SERVICE,
+                               [w = weak_from_this()](msgpack::object&& obj, dht::SockAddr&& from) {
+                                   auto sthis = w.lock();
+                                   if (!sthis)
+                                       return;
+                                   try {
+                                       sthis->onAnnouncement(obj.as<LanAnnouncement>(),
+                                                             IpAddr(*from.get(), from.getLength()));
+                                   } catch (const std::exception& e) {
+                                       if (sthis->logger_)
+                                           sthis->logger_->warn("[LAN] Invalid announce: {}",
+                                                                e.what());
+                                   }
+                               });
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        port_ = port;
+    }
+    if (port)
+        publish();
+}
+
+void
+LanDiscovery::publish()
+{
+    LanAnnouncement announce;
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        announce.port = port_;
+    }
+    announce.owner = id_.second->getSharedPublicKey()->getPacked();
+    announce.time = std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+    for (const auto& addr : ip_utils::getAllIpInterface())
+        announce.addrs.emplace_back(IpAddr(addr).toString());
+    announce.signature = id_.first->sign(announce.getSignedData());
+    msgpack::sbuffer buffer;
+    msgpack::pack(buffer, announce);
+    discovery_->startPublish(LAN_DISCOVERY_SERVICE, buffer);
+
+    publishTimer_.expires_after(LAN_ANNOUNCE_PERIOD);
+    publishTimer_.async_wait([w = weak_from_this()](const asio::error_code& ec) {
+        if (ec)
+            return;
+        if (auto sthis = w.lock())
+            sthis->publish();
+    });
+}
+
+void
+LanDiscovery::onAnnouncement(LanAnnouncement&& announce, const IpAddr& from)
+{
+    auto now = std::chrono::duration_cast<std::chrono::seconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+                   .count();
+    if (announce.port == 0 or std::abs(now - announce.time) > LAN_ANNOUNCE_MAX_AGE.count())
+        return;
+    auto source = from.toString();
+    if (std::find(announce.addrs.begin(), announce.addrs.end(), source) == announce.addrs.end())
+        return;
+    dht::crypto::PublicKey owner(announce.owner);
+    auto deviceId = owner.getLongId();
+    if (deviceId == deviceId_)
+        return;
+
+    IpAddr addr = from;
+    addr.setPort(announce.port);
+    auto seen = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        // The same announce is sent again to each query, it's checked once
+        auto it = peers_.find(deviceId);
+        if (it != peers_.end() and it->second.time == announce.time and it->second.addr == addr)
+            return;
+        // Bounds the signature checks a host can cause
+        if (verifications_.size() >= LAN_PEERS_MAX) {
+            for (auto v = verifications_.begin(); v != verifications_.end();) {
+                if (seen - v->second.start >= LAN_VERIFY_PERIOD)
+                    v = verifications_.erase(v);
+                else
+                    ++v;
+            }
+        }
+        auto v = verifications_.find(source);
+        if (v == verifications_.end()) {
+            if (verifications_.size() >= LAN_PEERS_MAX)
+                return;
+            v = verifications_.emplace(source, Verifications {seen, 0}).first;
+        } else if (seen - v->second.start >= LAN_VERIFY_PERIOD) {
+            v->second = {seen, 0};
+        }
+        if (v->second.count == LAN_VERIFY_MAX)
+            return;
+        v->second.count++;
+    }
+    if (not owner.checkSignature(announce.getSignedData(), announce.signature)) {
+        if (logger_)
+            logger_->warn("[LAN] Ignoring announce of {} with an invalid signature", deviceId);
+        return;
+    }
+
+    OnPeer cb;
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        auto it = peers_.find(deviceId);
+        if (it == peers_.end()) {
+            // Forget the devices not announced anymore, then the new ones are ignored if full
+            for (auto p = peers_.begin(); p != peers_.end();) {
+                if (seen - p->second.seen > LAN_ANNOUNCE_MAX_AGE)
+                    p = peers_.erase(p);
+                else
+                    ++p;
+            }
+            if (peers_.size() >= LAN_PEERS_MAX) {
+                if (logger_)
+                    logger_->warn("[LAN] Too many devices, ignoring {}", deviceId);
+                return;
+            }
+            it = peers_.emplace(deviceId, Peer {}).first;
+        }
+        auto& peer = it->second;
+        if (peer.addr != addr and logger_)
+            logger_->debug("[LAN] Device {} announced at {}", deviceId, addr.toString(true));
+        peer.addr = addr;
+        peer.time = announce.time;
+        peer.seen = seen;
+        cb = onPeer_;
+    }
+    if (cb)
+        cb(deviceId, addr);
+}
+
+IpAddr
+LanDiscovery::getAddress(const DeviceId& deviceId) const
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto it = peers_.find(deviceId);
+    if (it == peers_.end()
+        or std::chrono::steady_clock::now() - it->second.seen > LAN_ANNOUNCE_MAX_AGE)
+        return {};
+    return it->second.addr;
+}
+
+void
+LanDiscovery::setOnPeer(OnPeer&& cb)
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    onPeer_ = std::move(cb);
+}
+
+void
+LanDiscovery::connectivityChanged()
+{
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        peers_.clear();
+        verifications_.clear();
+    }
+    discovery_->connectivityChanged();
+}
+
+} // namespace jami
@@ -0,0 +1,144 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+#pragma once
+
+#include "ip_utils.h"
+#include "multiplexed_socket.h"
+
+#include <opendht/crypto.h>
+#include <opendht/logger.h>
+
+#include <asio/io_context.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace dht {
+class PeerDiscovery;
+}
+
+namespace jami {
+
+// Multicast port used by default to announce the devices on the LAN.
+constexpr static uint16_t LAN_DISCOVERY_DEFAULT_PORT {8889};
+// The announcements are signed again after this delay.
+constexpr static std::chrono::seconds LAN_ANNOUNCE_PERIOD {60};
+// Older announcements are ignored, and the addresses are forgotten if not
+// announced again within this delay.
+constexpr static std::chrono::seconds LAN_ANNOUNCE_MAX_AGE {180};
+// At most LAN_VERIFY_MAX announcements are verified per LAN_VERIFY_PERIOD
+// for each source address.
+constexpr static unsigned LAN_VERIFY_MAX {16};
+constexpr static std::chrono::seconds LAN_VERIFY_PERIOD {10};
+// Devices, and source addresses, remembered at most.
+constexpr static std::size_t LAN_PEERS_MAX {256};
+
+/**
+ * Announce of a device accepting TLS connections on the LAN.
+ * The address is the one the announce comes from, which must be one of the
+ * signed addresses, so the announce can't be replayed from another host.
+ */
+struct LanAnnouncement
+{
+    dht::Blob owner;                // Packed public key of the device
+    uint16_t port {0};              // TCP port accepting TLS connections
+    int64_t time {0};               // Seconds since epoch
+    std::vector<std::string> addrs; // Addresses of the device, without port
+    dht::Blob signature;            // Of the other fields
+    MSGPACK_DEFINE_MAP(owner, port, time, addrs, signature)
+
+    dht::Blob getSignedData() const;
+};
+
+/**
+ * Announces the device on the LAN (multicast, see dht::PeerDiscovery) and
+ * keeps the addresses announced by the other devices.
+ * The announcements are signed with the device key, so a device can't be
+ * announced by another one.
+ */
+class LanDiscovery : public std::enable_shared_from_this<LanDiscovery>
+{
+public:
+    using OnPeer = std::function<void(const DeviceId&, const IpAddr&)>;
+
+    LanDiscovery(const std::shared_ptr<asio::io_context>& ctx,
+                 const dht::crypto::Identity& id,
+                 uint16_t port = LAN_DISCOVERY_DEFAULT_PORT,
+                 const std::shared_ptr<dht::log::Logger>& logger = {});
+    ~LanDiscovery();
+
+    /**
+     * Start discovering the other devices and announcing this one
+     * @param port      TCP port accepting the TLS connections, 0 to only discover
+     */
+    void start(uint16_t port);
+
+    /**
+     * @return the last address announced by a device, or an invalid address
+     */
+    IpAddr getAddress(const DeviceId& deviceId) const;
+
+    /**
+     * Triggered for each valid announce from another device
+     */
+    void setOnPeer(OnPeer&& cb);
+
+    /**
+     * Forget the known addresses and announce the device again
+     */
+    void connectivityChanged();
+
+private:
+    LanDiscovery(const LanDiscovery&) = delete;
+    LanDiscovery& operator=(const LanDiscovery&) = delete;
+
+    void publish();
+    void onAnnouncement(LanAnnouncement&& announce, const IpAddr& from);
+
+    struct Peer
+    {
+        IpAddr addr;
+        int64_t time {0}; // Of the last announce
+        std::chrono::steady_clock::time_point seen;
+    };
+    // Announcements verified from a source address since the period start
+    struct Verifications
+    {
+        std::chrono::steady_clock::time_point start;
+        unsigned count {0};
+    };
+
+    std::shared_ptr<asio::io_context> ctx_;
+    dht::crypto::Identity id_;
+    DeviceId deviceId_;
+    std::shared_ptr<dht::log::Logger> logger_;
+    std::unique_ptr<dht::PeerDiscovery> discovery_;
+    asio::steady_timer publishTimer_;
+
+    mutable std::mutex mutex_;
+    uint16_t port_ {0};
+    std::map<DeviceId, Peer> peers_;
+    std::map<std::string, Verifications> verifications_;
+    OnPeer onPeer_;
+};
+
+} // namespace jami
@@ -20,17 +20,47 @@
 #include "peer_connection.h"
 #include "ice_transport.h"
 #include "certstore.h"
+#include "serial_executor.h"
+#include "channel_table.h"
+#include "mux_frame.h"
+#ifdef HAVE_LIBZSTD
+#include "stream_compressor.h"
+#include "buffer_pool.h"
+#endif
 
 #include <opendht/logger.h>
 #include <opendht/thread_pool.h>
 
 #include <asio/io_context.hpp>
+#include <asio/post.hpp>
 #include <asio/steady_timer.hpp>
 
 #include <deque>
 
 static constexpr std::size_t IO_BUFFER_SIZE {8192}; ///< Size of char buffer used by IO operations
-static constexpr int MULTIPLEXED_SOCKET_VERSION {1};
+// The receive buffer is released if bigger than this factor of the read size
+static constexpr std::size_t UNPACKER_SHRINK_FACTOR {4};
+// The idle channel buffers bigger than this are released
+static constexpr std::size_t CHANNEL_BUFFER_KEEP_SIZE {IO_BUFFER_SIZE};
+// Unread datagrams kept by a channel, the oldest are dropped
+static constexpr std::size_t DATAGRAM_QUEUE_MAX {256};
+// Largest ChanneledMessage header (array, uint16 channel, bin16 size)
+static constexpr std::size_t DATAGRAM_HEADER_SIZE {1 + 3 + 3};
+// Largest payload carried by a ChannelRequest, bigger ones are sent once accepted
+static constexpr std::size_t INITIAL_DATA_MAX {16 * 1024};
+// Smaller writes of a compressed channel are sent as they are
+static constexpr std::size_t COMPRESSION_MIN_SIZE {32};
+// Compression is skipped for COMPRESSION_SKIP bytes when the last
+// COMPRESSION_SAMPLE bytes were compressed to more than COMPRESSION_RATIO_MAX %
+static constexpr std::size_t COMPRESSION_SAMPLE {64 * 1024};
+static constexpr std::size_t COMPRESSION_SKIP {1024 * 1024};
+static constexpr std::size_t COMPRESSION_RATIO_MAX {90};
+// 1: beacons
+// 2: datagram channels, initial data in ChannelRequest
+// 3: compact frames (mux_frame.h)
+static constexpr int MULTIPLEXED_SOCKET_VERSION {3};
+static constexpr int INITIAL_DATA_VERSION {2};
+static constexpr int COMPACT_FRAME_VERSION {3};
 
 struct ChanneledMessage
 {
@@ -51,6 +81,26 @@ struct VersionMsg
     MSGPACK_DEFINE_MAP(v)
 };
 
+// Last message before the compact frames, parsed by the event loop
+struct FramingMsg
+{
+    int f;
+    MSGPACK_DEFINE_MAP(f)
+};
+
+static bool
+isFramingMsg(const std::vector<uint8_t>& data)
+{
+    try {
+        auto result = msgpack::unpack((const char*) data.data(), data.size());
+        const auto& o = result.get();
+        return o.type == msgpack::type::MAP && o.via.map.size > 0
+               && o.via.map.ptr[0].key.as<std::string_view>() == "f";
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
 namespace jami {
 
 using clock = std::chrono::steady_clock;
@@ -62,8 +112,13 @@ public:
     Impl(MultiplexedSocket& parent,
          std::shared_ptr<asio::io_context> ctx,
          const DeviceId& deviceId,
-         std::unique_ptr<TlsSocketEndpoint> endpoint)
-        : parent_(parent)
+         std::unique_ptr<TlsSocketEndpoint> endpoint,
+         std::size_t readBufferSize,
+         std::shared_ptr<Logger> logger)
+        : readSize_(readBufferSize ? readBufferSize : IO_BUFFER_SIZE)
+        , pac_(nullptr, nullptr, readSize_)
+        , parent_(parent)
+        , logger_(std::move(logger))
         , deviceId(deviceId)
         , ctx_(std::move(ctx))
         , beaconTimer_(*ctx_)
@@ -79,10 +134,16 @@ public:
         }}
     {}
 
-    ~Impl() {}
+    ~Impl()
+    {
+        if (endpoint)
+            endpoint->setOnDatagram({});
+    }
 
     void join()
     {
+        if (endpoint)
+            endpoint->setOnDatagram({});
         if (!isShutdown_) {
             if (endpoint)
                 endpoint->setOnStateChange({});
@@ -99,15 +160,15 @@ public:
         decltype(sockets) socks;
         {
             std::lock_guard<std::mutex> lkSockets(socketsMutex);
-            socks = std::move(sockets);
+            std::swap(socks, sockets);
         }
-        for (auto& socket : socks) {
+        socks.forEach([](uint16_t, const std::shared_ptr<ChannelSocket>& socket) {
             // Just trigger onShutdown() to make client know
             // No need to write the EOF for the channel, the write will fail because endpoint is
             // already shutdown
-            if (socket.second)
-                socket.second->stop();
-        }
+            if (socket)
+                socket->stop();
+        });
     }
 
     void shutdown()
@@ -121,6 +182,9 @@ public:
             onShutdown_();
         if (endpoint) {
             std::unique_lock<std::mutex> lk(writeMtx);
+            // Last answers and closes, if the session is still up
+            std::error_code ec;
+            writeControl(ec);
             endpoint->shutdown();
         }
         clearSockets();
@@ -128,19 +192,20 @@ public:
 
     std::shared_ptr<ChannelSocket> makeSocket(const std::string& name,
                                               uint16_t channel,
-                                              bool isInitiator = false)
+                                              bool isInitiator = false,
+                                              ChannelType type = ChannelType::STREAM)
     {
         auto& channelSocket = sockets[channel];
         if (not channelSocket)
             channelSocket = std::make_shared<ChannelSocket>(
-                parent_.weak(), name, channel, isInitiator, [w = parent_.weak(), channel]() {
+                parent_.weak(), name, channel, isInitiator, [w = parent_.weak(), executor = executor_, channel]() {
                     // Remove socket in another thread to avoid any lock
-                    dht::ThreadPool::io().run([w, channel]() {
+                    executor->run([w, channel]() {
                         if (auto shared = w.lock()) {
                             shared->eraseChannel(channel);
                         }
                     });
-                });
+                }, type);
         else {
             if (logger_)
                 logger_->warn("A channel is already present on that socket, accepting "
@@ -153,6 +218,36 @@ public:
      * Handle packets on the TLS endpoint and parse RTP
      */
     void eventLoop();
+    /**
+     * Read and handle the msgpack messages, or the compact frames.
+     * Return false to stop the event loop.
+     */
+    bool readMessages(std::error_code& ec);
+    bool readFrames(std::error_code& ec);
+    bool parseFrames();
+    void handleMessage(uint16_t channel, const uint8_t* data, std::size_t len, uint8_t flags = 0);
+    /**
+     * Write a message of the channel. Requires writeMtx.
+     */
+    std::size_t writeMessage(uint16_t channel, const uint8_t* buf, std::size_t len, std::error_code& ec);
+    std::size_t writeFrame(uint16_t channel,
+                           const uint8_t* buf,
+                           std::size_t len,
+                           std::error_code& ec,
+                           uint8_t flags = 0);
+    void startWritingFrames();
+    /**
+     * Control messages and channel closes are queued, and sent together
+     * once the operations of the current tick of ctx_ are done.
+     * Requires writeMtx.
+     */
+    void queueControl(uint16_t channel, const uint8_t* buf, std::size_t len);
+    int writeControl(std::error_code& ec);
+    void appendHeader(msgpack::sbuffer& out, uint16_t channel, std::size_t len);
+    void flushControl();
+    // The answers to a batch of requests are sent once it is handled
+    void holdControl();
+    void releaseControl();
     /**
      * Triggered when a new control packet is received
      */
@@ -162,13 +257,32 @@ public:
     /**
      * Triggered when a new packet on a channel is received
      */
-    void handleChannelPacket(uint16_t channel, std::vector<uint8_t>&& pkt);
-    void onRequest(const std::string& name, uint16_t channel);
-    void onAccept(const std::string& name, uint16_t channel);
+    void handleChannelPacket(uint16_t channel,
+                             const uint8_t* data,
+                             std::size_t len,
+                             bool compressed = false);
+    /**
+     * Triggered by the TLS thread when a datagram is received
+     */
+    void handleDatagram(std::vector<uint8_t>&& pkt);
+    void onRequest(const std::string& name,
+                   uint16_t channel,
+                   ChannelType type,
+                   ChannelCompression compression,
+                   std::vector<uint8_t>&& data);
+    void onAccept(const std::string& name,
+                  uint16_t channel,
+                  ChannelType type,
+                  ChannelCompression compression);
 
     void setOnReady(OnConnectionReadyCb&& cb) { onChannelReady_ = std::move(cb); }
     void setOnRequest(OnConnectionRequestCb&& cb) { onRequest_ = std::move(cb); }
 
+    void touch()
+    {
+        lastActivity_.store(clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+
     // Beacon
     void sendBeacon(const std::chrono::milliseconds& timeout);
     void handleBeaconRequest();
@@ -177,12 +291,26 @@ public:
 
     bool writeProtocolMessage(const msgpack::sbuffer& buffer);
 
-    msgpack::unpacker pac_ {};
+    // Size of each read, and initial size of the buffer of pac_
+    const std::size_t readSize_;
+    msgpack::unpacker pac_;
+    // Allocated by pac_ or rx_, updated by the event loop
+    std::atomic_size_t pacSize_ {0};
+    // Compact frames, parsed in place by the event loop
+    bool rxFrames_ {false};
+    std::vector<uint8_t> rx_ {};
+    std::size_t rxBegin_ {0};
+    std::size_t rxEnd_ {0};
 
     MultiplexedSocket& parent_;
 
     std::shared_ptr<Logger> logger_;
     std::shared_ptr<asio::io_context> ctx_;
+    // Runs the events of the socket in order, off the event loop
+    std::shared_ptr<SerialExecutor> executor_ {std::make_shared<SerialExecutor>(logger_)};
+    // Protocol messages (beacons, version), not delayed by the callbacks
+    // of the channel requests run by executor_
+    std::shared_ptr<SerialExecutor> protocolExecutor_ {std::make_shared<SerialExecutor>(logger_)};
 
     OnConnectionReadyCb onChannelReady_ {};
     OnConnectionRequestCb onRequest_ {};
@@ -193,7 +321,7 @@ public:
     std::unique_ptr<TlsSocketEndpoint> endpoint {};
 
     std::mutex socketsMutex {};
-    std::map<uint16_t, std::shared_ptr<ChannelSocket>> sockets {};
+    ChannelTable<std::shared_ptr<ChannelSocket>> sockets {};
 
     // Main loop to parse incoming packets
     std::atomic_bool stop {false};
@@ -202,8 +330,15 @@ public:
     std::atomic_bool isShutdown_ {false};
 
     std::mutex writeMtx {};
+    // Sending compact frames, set under writeMtx
+    std::atomic_bool txFrames_ {false};
+    // Queued control messages (or closes, empty), protected by writeMtx
+    std::vector<std::pair<uint16_t, std::vector<uint8_t>>> controlQueue_ {};
+    bool controlFlushPosted_ {false};
+    unsigned controlHold_ {0};
 
     time_point start_ {clock::now()};
+    std::atomic<clock::rep> lastActivity_ {start_.time_since_epoch().count()};
     //std::shared_ptr<Task> beaconTask_ {};
     asio::steady_timer beaconTimer_;
 
@@ -213,6 +348,7 @@ public:
     std::atomic_bool canSendBeacon_ {false};
     std::atomic_bool answerBeacon_ {true};
     int version_ {MULTIPLEXED_SOCKET_VERSION};
+    std::atomic_int peerVersion_ {0};
     std::function<void(bool)> onBeaconCb_ {};
     std::function<void(int)> onVersionCb_ {};
 };
@@ -229,6 +365,7 @@ MultiplexedSocket::Impl::eventLoop()
         }
         return true;
     });
+    endpoint->setOnDatagram([this](std::vector<uint8_t>&& pkt) { handleDatagram(std::move(pkt)); });
     sendVersion();
     std::error_code ec;
     while (!stop) {
@@ -236,60 +373,190 @@ MultiplexedSocket::Impl::eventLoop()
             shutdown();
             return;
         }
-        pac_.reserve_buffer(IO_BUFFER_SIZE);
-        int size = endpoint->read(reinterpret_cast<uint8_t*>(&pac_.buffer()[0]), IO_BUFFER_SIZE, ec);
-        if (size < 0) {
-            if (ec && logger_)
-                logger_->error("Read error detected: {}", ec.message());
+        if (!(rxFrames_ ? readFrames(ec) : readMessages(ec)))
             break;
+    }
+}
+
+bool
+MultiplexedSocket::Impl::readMessages(std::error_code& ec)
+{
+    pac_.reserve_buffer(readSize_);
+    pacSize_ = pac_.parsed_size() + pac_.nonparsed_size() + pac_.buffer_capacity();
+    int size = endpoint->read(reinterpret_cast<uint8_t*>(&pac_.buffer()[0]), readSize_, ec);
+    if (size < 0) {
+        if (ec && logger_)
+            logger_->error("Read error detected: {}", ec.message());
+        return false;
+    }
+    if (size == 0) {
+        // We can close the socket
+        shutdown();
+        return false;
+    }
+
+    pac_.buffer_consumed(size);
+    msgpack::object_handle oh;
+    while (pac_.next(oh) && !stop) {
+        try {
+            auto msg = oh.get().as<ChanneledMessage>();
+            if (msg.channel == PROTOCOL_CHANNEL && isFramingMsg(msg.data)) {
+                // The peer sends compact frames from now on
+                rx_.assign(pac_.nonparsed_buffer(), pac_.nonparsed_buffer() + pac_.nonparsed_size());
+                rxBegin_ = 0;
+                rxEnd_ = rx_.size();
+                rxFrames_ = true;
+                pac_ = msgpack::unpacker(nullptr, nullptr, 0);
+                pacSize_ = pac_.buffer_capacity() + rx_.capacity();
+                if (!parseFrames()) {
+                    shutdown();
+                    return false;
+                }
+                return true;
+            }
+            handleMessage(msg.channel, msg.data.data(), msg.data.size());
+        } catch (const std::exception& e) {
+            if (logger_)
+                logger_->warn("Failed to unpacked message of {:d} bytes: {:s}", size, e.what());
+        } catch (...) {
+            if (logger_)
+                logger_->error("Unknown exception catched while unpacking message of {:d} bytes", size);
         }
-        if (size == 0) {
-            // We can close the socket
-            shutdown();
-            break;
+    }
+    // Release the buffer grown by a burst once everything is parsed
+    if (pac_.nonparsed_size() == 0 and pacSize_ > UNPACKER_SHRINK_FACTOR * readSize_) {
+        pac_ = msgpack::unpacker(nullptr, nullptr, readSize_);
+        pacSize_ = pac_.buffer_capacity();
+    }
+    return true;
+}
+
+bool
+MultiplexedSocket::Impl::readFrames(std::error_code& ec)
+{
+    // Room for a full read after the partial frame
+    if (rx_.size() - rxEnd_ < readSize_) {
+        if (rxBegin_ > 0) {
+            std::copy(rx_.begin() + rxBegin_, rx_.begin() + rxEnd_, rx_.begin());
+            rxEnd_ -= rxBegin_;
+            rxBegin_ = 0;
         }
+        if (rx_.size() - rxEnd_ < readSize_)
+            rx_.resize(rxEnd_ + readSize_);
+        pacSize_ = rx_.capacity();
+    }
+    int size = endpoint->read(rx_.data() + rxEnd_, readSize_, ec);
+    if (size < 0) {
+        if (ec && logger_)
+            logger_->error("Read error detected: {}", ec.message());
+        return false;
+    }
+    if (size == 0) {
+        // We can close the socket
+        shutdown();
+        return false;
+    }
+    rxEnd_ += size;
+    if (!parseFrames()) {
+        shutdown();
+        return false;
+    }
+    // Release the buffer grown by a burst once everything is parsed
+    if (rxEnd_ == 0 and rx_.capacity() > UNPACKER_SHRINK_FACTOR * readSize_) {
+        std::vector<uint8_t>().swap(rx_);
+        pacSize_ = 0;
+    }
+    return true;
+}
 
-        pac_.buffer_consumed(size);
-        msgpack::object_handle oh;
-        while (pac_.next(oh) && !stop) {
-            try {
-                auto msg = oh.get().as<ChanneledMessage>();
-                if (msg.channel == CONTROL_CHANNEL)
-                    handleControlPacket(std::move(msg.data));
-                else if (msg.channel == PROTOCOL_CHANNEL)
-                    handleProtocolPacket(std::move(msg.data));
-                else
-                    handleChannelPacket(msg.channel, std::move(msg.data));
-            } catch (const std::exception& e) {
-                if (logger_)
-                    logger_->warn("Failed to unpacked message of {:d} bytes: {:s}", size, e.what());
-            } catch (...) {
-                if (logger_)
-                    logger_->error("Unknown exception catched while unpacking message of {:d} bytes", size);
-            }
+bool
+MultiplexedSocket::Impl::parseFrames()
+{
+    mux::FrameHeader header;
+    while (!stop) {
+        auto data = rx_.data() + rxBegin_;
+        auto size = rxEnd_ - rxBegin_;
+        auto res = mux::parseFrameHeader(data, size, header);
+        if (res == mux::FrameParse::INVALID) {
+            // The next frames can't be found
+            if (logger_)
+                logger_->error("Invalid frame received from {}", deviceId);
+            return false;
+        }
+        if (res == mux::FrameParse::INCOMPLETE || size < header.size + header.length)
+            break;
+        rxBegin_ += header.size + header.length;
+        try {
+            handleMessage(header.channel, data + header.size, header.length, header.flags);
+        } catch (const std::exception& e) {
+            if (logger_)
+                logger_->warn("Failed to handle frame of {:d} bytes: {:s}", header.length, e.what());
         }
     }
+    if (rxBegin_ == rxEnd_)
+        rxBegin_ = rxEnd_ = 0;
+    return true;
 }
 
 void
-MultiplexedSocket::Impl::onAccept(const std::string& name, uint16_t channel)
-{
-    std::lock_guard<std::mutex> lkSockets(socketsMutex);
-    auto& socket = sockets[channel];
-    if (!socket) {
+MultiplexedSocket::Impl::handleMessage(uint16_t channel,
+                                       const uint8_t* data,
+                                       std::size_t len,
+                                       uint8_t flags)
+{
+    if (channel != PROTOCOL_CHANNEL)
+        touch();
+    bool compressed = flags & mux::FRAME_COMPRESSED;
+    if (compressed && (channel == CONTROL_CHANNEL || channel == PROTOCOL_CHANNEL)) {
         if (logger_)
-            logger_->error("Receiving an answer for a non existing channel. This is a bug.");
+            logger_->warn("Compressed message received on channel {}", channel);
         return;
     }
+    if (channel == CONTROL_CHANNEL)
+        handleControlPacket(std::vector<uint8_t>(data, data + len));
+    else if (channel == PROTOCOL_CHANNEL)
+        handleProtocolPacket(std::vector<uint8_t>(data, data + len));
+    else
+        handleChannelPacket(channel, data, len, compressed);
+}
 
+void
+MultiplexedSocket::Impl::onAccept(const std::string& name,
+                                  uint16_t channel,
+                                  ChannelType type,
+                                  ChannelCompression compression)
+{
+    std::shared_ptr<ChannelSocket> socket;
+    {
+        std::lock_guard<std::mutex> lkSockets(socketsMutex);
+        auto* found = sockets.find(channel);
+        if (!found || !*found) {
+            if (logger_)
+                logger_->error("Receiving an answer for a non existing channel. This is a bug.");
+            return;
+        }
+        socket = *found;
+    }
+    // Peers not supporting datagrams answer with a stream
+    if (socket->type() != type)
+        socket->setType(type);
+    // Peers not supporting the offered compression answer NONE
+    if (socket->compression() != compression)
+        socket->setCompression(ChannelCompression::NONE);
+
+    // Not under socketsMutex: ready() sends the queued writes, and a failed
+    // write shuts the socket down
     onChannelReady_(deviceId, socket);
     socket->ready(true);
     // Due to the callbacks that can take some time, onAccept can arrive after
     // receiving all the data. In this case, the socket should be removed here
     // as handle by onChannelReady_
-    if (socket->isRemovable())
-        sockets.erase(channel);
-    else
+    std::lock_guard<std::mutex> lkSockets(socketsMutex);
+    if (socket->isRemovable()) {
+        auto* found = sockets.find(channel);
+        if (found && *found == socket)
+            sockets.erase(channel);
+    } else
         socket->answered();
 }
 
@@ -327,7 +594,7 @@ MultiplexedSocket::Impl::handleBeaconRequest()
     if (!answerBeacon_)
         return;
     // Run this on dedicated thread because some callbacks can take time
-    dht::ThreadPool::io().run([w = parent_.weak()]() {
+    protocolExecutor_->run([w = parent_.weak()]() {
         if (auto shared = w.lock()) {
             msgpack::sbuffer buffer(8);
             msgpack::packer<msgpack::sbuffer> pk(&buffer);
@@ -361,7 +628,7 @@ MultiplexedSocket::Impl::writeProtocolMessage(const msgpack::sbuffer& buffer)
 void
 MultiplexedSocket::Impl::sendVersion()
 {
-    dht::ThreadPool::io().run([w = parent_.weak()]() {
+    protocolExecutor_->run([w = parent_.weak()]() {
         if (auto shared = w.lock()) {
             auto version = shared->pimpl_->version_;
             msgpack::sbuffer buffer(8);
@@ -375,6 +642,9 @@ MultiplexedSocket::Impl::sendVersion()
 void
 MultiplexedSocket::Impl::onVersion(int version)
 {
+    peerVersion_ = version;
+    if (version >= COMPACT_FRAME_VERSION && version_ >= COMPACT_FRAME_VERSION)
+        startWritingFrames();
     // Check if version > 1
     if (version >= 1) {
         if (logger_)
@@ -390,13 +660,171 @@ MultiplexedSocket::Impl::onVersion(int version)
 }
 
 void
-MultiplexedSocket::Impl::onRequest(const std::string& name, uint16_t channel)
+MultiplexedSocket::Impl::startWritingFrames()
+{
+    msgpack::sbuffer buffer(8);
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack(FramingMsg {1});
+    std::lock_guard<std::mutex> lk(writeMtx);
+    if (txFrames_ || !endpoint)
+        return;
+    std::error_code ec;
+    writeMessage(PROTOCOL_CHANNEL, (const uint8_t*) buffer.data(), buffer.size(), ec);
+    if (ec) {
+        if (logger_)
+            logger_->error("Error when writing on socket: {:s}", ec.message());
+        return;
+    }
+    if (logger_)
+        logger_->debug("Sending compact frames to peer {}", deviceId);
+    txFrames_ = true;
+}
+
+std::size_t
+MultiplexedSocket::Impl::writeMessage(uint16_t channel,
+                                      const uint8_t* buf,
+                                      std::size_t len,
+                                      std::error_code& ec)
+{
+    bool oneShot = len < 8192;
+    msgpack::sbuffer buffer(oneShot ? 16 + len : 16);
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_array(2);
+    pk.pack(channel);
+    pk.pack_bin(len);
+    if (oneShot)
+        pk.pack_bin_body((const char*) buf, len);
+
+    int res = endpoint->write((const unsigned char*) buffer.data(), buffer.size(), ec);
+    if (not oneShot and res >= 0)
+        res = endpoint->write(buf, len, ec);
+    return res;
+}
+
+std::size_t
+MultiplexedSocket::Impl::writeFrame(uint16_t channel,
+                                    const uint8_t* buf,
+                                    std::size_t len,
+                                    std::error_code& ec,
+                                    uint8_t flags)
+{
+    uint8_t header[mux::FRAME_HEADER_MAX];
+    giovec_t iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = mux::writeFrameHeader(header, channel, flags, len);
+    iov[1].iov_base = const_cast<uint8_t*>(buf);
+    iov[1].iov_len = len;
+    return endpoint->writev(iov, len ? 2 : 1, ec);
+}
+
+void
+MultiplexedSocket::Impl::queueControl(uint16_t channel, const uint8_t* buf, std::size_t len)
+{
+    controlQueue_.emplace_back(channel, std::vector<uint8_t>(buf, buf + len));
+    if (controlFlushPosted_ || controlHold_)
+        return;
+    controlFlushPosted_ = true;
+    asio::post(*ctx_, [w = parent_.weak()] {
+        if (auto shared = w.lock())
+            shared->pimpl_->flushControl();
+    });
+}
+
+void
+MultiplexedSocket::Impl::appendHeader(msgpack::sbuffer& out, uint16_t channel, std::size_t len)
+{
+    if (txFrames_) {
+        uint8_t header[mux::FRAME_HEADER_MAX];
+        out.write((const char*) header, mux::writeFrameHeader(header, channel, 0, len));
+    } else {
+        msgpack::packer<msgpack::sbuffer> pk(&out);
+        pk.pack_array(2);
+        pk.pack(channel);
+        pk.pack_bin(len);
+    }
+}
+
+int
+MultiplexedSocket::Impl::writeControl(std::error_code& ec)
+{
+    controlFlushPosted_ = false;
+    if (controlQueue_.empty() || !endpoint)
+        return 0;
+    msgpack::sbuffer out(512);
+    for (std::size_t i = 0; i < controlQueue_.size();) {
+        auto channel = controlQueue_[i].first;
+        if (channel != CONTROL_CHANNEL) {
+            appendHeader(out, channel, 0);
+            i++;
+            continue;
+        }
+        // Consecutive control messages in one message, the peer handles
+        // them in a single pass
+        auto end = i;
+        std::size_t size = 0;
+        while (end < controlQueue_.size() && controlQueue_[end].first == CONTROL_CHANNEL
+               && (end == i || size + controlQueue_[end].second.size() <= UINT16_MAX))
+            size += controlQueue_[end++].second.size();
+        appendHeader(out, CONTROL_CHANNEL, size);
+        for (; i < end; i++)
+            out.write((const char*) controlQueue_[i].second.data(), controlQueue_[i].second.size());
+    }
+    controlQueue_.clear();
+    return endpoint->write((const uint8_t*) out.data(), out.size(), ec);
+}
+
+void
+MultiplexedSocket::Impl::flushControl()
+{
+    std::unique_lock<std::mutex> lk(writeMtx);
+    std::error_code ec;
+    int res = writeControl(ec);
+    lk.unlock();
+    if (res < 0) {
+        if (ec && logger_)
+            logger_->error("Error when writing on socket: {:s}", ec.message());
+        shutdown();
+    }
+}
+
+void
+MultiplexedSocket::Impl::holdControl()
+{
+    std::lock_guard<std::mutex> lk(writeMtx);
+    controlHold_++;
+}
+
+void
+MultiplexedSocket::Impl::releaseControl()
+{
+    std::lock_guard<std::mutex> lk(writeMtx);
+    if (--controlHold_ || controlQueue_.empty() || controlFlushPosted_)
+        return;
+    controlFlushPosted_ = true;
+    asio::post(*ctx_, [w = parent_.weak()] {
+        if (auto shared = w.lock())
+            shared->pimpl_->flushControl();
+    });
+}
+
+void
+MultiplexedSocket::Impl::onRequest(const std::string& name,
+                                   uint16_t channel,
+                                   ChannelType type,
+                                   ChannelCompression compression,
+                                   std::vector<uint8_t>&& data)
 {
     auto accept = onRequest_(endpoint->peerCertificate(), channel, name);
     std::shared_ptr<ChannelSocket> channelSocket;
     if (accept) {
         std::lock_guard<std::mutex> lkSockets(socketsMutex);
-        channelSocket = makeSocket(name, channel);
+        channelSocket = makeSocket(name, channel, false, type);
+        // Set before the ACCEPT, the peer may compress its data from then
+        channelSocket->setCompression(compression);
+        // Buffered before the ACCEPT is sent, so before any data the
+        // peer sends once accepted
+        if (!data.empty())
+            channelSocket->onRecv(std::move(data));
     }
 
     // Answer to ChannelRequest if accepted
@@ -404,6 +832,9 @@ MultiplexedSocket::Impl::onRequest(const std::string& name, uint16_t channel)
     val.channel = channel;
     val.name = name;
     val.state = accept ? ChannelRequestState::ACCEPT : ChannelRequestState::DECLINE;
+    val.type = type;
+    if (channelSocket)
+        val.compression = channelSocket->compression();
     msgpack::sbuffer buffer(512);
     msgpack::pack(buffer, val);
     std::error_code ec;
@@ -428,11 +859,12 @@ void
 MultiplexedSocket::Impl::handleControlPacket(std::vector<uint8_t>&& pkt)
 {
     // Run this on dedicated thread because some callbacks can take time
-    dht::ThreadPool::io().run([w = parent_.weak(), pkt = std::move(pkt)]() {
+    executor_->run([w = parent_.weak(), pkt = std::move(pkt)]() {
         auto shared = w.lock();
         if (!shared)
             return;
         auto& pimpl = *shared->pimpl_;
+        pimpl.holdControl();
         try {
             size_t off = 0;
             while (off != pkt.size()) {
@@ -443,48 +875,80 @@ MultiplexedSocket::Impl::handleControlPacket(std::vector<uint8_t>&& pkt)
                     continue;
                 auto req = object.as<ChannelRequest>();
                 if (req.state == ChannelRequestState::ACCEPT) {
-                    pimpl.onAccept(req.name, req.channel);
+                    pimpl.onAccept(req.name, req.channel, req.type, req.compression);
                 } else if (req.state == ChannelRequestState::DECLINE) {
                     std::lock_guard<std::mutex> lkSockets(pimpl.socketsMutex);
-                    auto channel = pimpl.sockets.find(req.channel);
-                    if (channel != pimpl.sockets.end()) {
-                        channel->second->ready(false);
-                        channel->second->stop();
-                        pimpl.sockets.erase(channel);
+                    auto* channel = pimpl.sockets.find(req.channel);
+                    if (channel && *channel) {
+                        (*channel)->ready(false);
+                        (*channel)->stop();
+                        pimpl.sockets.erase(req.channel);
                     }
                 } else if (pimpl.onRequest_) {
-                    pimpl.onRequest(req.name, req.channel);
+                    pimpl.onRequest(req.name,
+                                    req.channel,
+                                    req.type,
+                                    req.compression,
+                                    std::move(req.data));
                 }
             }
         } catch (const std::exception& e) {
             if (pimpl.logger_)
                 pimpl.logger_->error("Error on the control channel: {}", e.what());
         }
+        pimpl.releaseControl();
     });
 }
 
 void
-MultiplexedSocket::Impl::handleChannelPacket(uint16_t channel, std::vector<uint8_t>&& pkt)
+MultiplexedSocket::Impl::handleChannelPacket(uint16_t channel,
+                                             const uint8_t* data,
+                                             std::size_t len,
+                                             bool compressed)
 {
     std::lock_guard<std::mutex> lkSockets(socketsMutex);
-    auto sockIt = sockets.find(channel);
-    if (channel > 0 && sockIt != sockets.end() && sockIt->second) {
-        if (pkt.size() == 0) {
-            sockIt->second->stop();
-            if (sockIt->second->isAnswered())
-                sockets.erase(sockIt);
+    auto* socket = channel > 0 ? sockets.find(channel) : nullptr;
+    if (socket && *socket) {
+        if (len == 0) {
+            (*socket)->stop();
+            if ((*socket)->isAnswered())
+                sockets.erase(channel);
             else
-                sockIt->second->removable(); // This means that onAccept didn't happen yet, will be
-                                             // removed later.
+                (*socket)->removable(); // This means that onAccept didn't happen yet, will be
+                                        // removed later.
+        } else if (compressed) {
+            (*socket)->onRecvCompressed(data, len);
         } else {
-            sockIt->second->onRecv(std::move(pkt));
+            (*socket)->onRecv(data, len);
         }
-    } else if (pkt.size() != 0) {
+    } else if (len != 0) {
         if (logger_)
             logger_->warn("Non existing channel: {}", channel);
     }
 }
 
+void
+MultiplexedSocket::Impl::handleDatagram(std::vector<uint8_t>&& pkt)
+{
+    ChanneledMessage msg;
+    try {
+        auto result = msgpack::unpack((const char*) pkt.data(), pkt.size());
+        msg = result.get().as<ChanneledMessage>();
+    } catch (const std::exception& e) {
+        if (logger_)
+            logger_->warn("Failed to unpack datagram of {:d} bytes: {:s}", pkt.size(), e.what());
+        return;
+    }
+    if (msg.data.empty())
+        return;
+    touch();
+    std::lock_guard<std::mutex> lkSockets(socketsMutex);
+    auto* socket = sockets.find(msg.channel);
+    // A stream channel must not receive data out of its stream
+    if (socket && *socket && (*socket)->type() == ChannelType::DATAGRAM)
+        (*socket)->onRecv(std::move(msg.data));
+}
+
 bool
 MultiplexedSocket::Impl::handleProtocolMsg(const msgpack::object& o)
 {
@@ -500,6 +964,9 @@ MultiplexedSocket::Impl::handleProtocolMsg(const msgpack::object& o)
                 if (onBeaconCb_)
                     onBeaconCb_(msg.p);
                 return true;
+            } else if (key == "f") {
+                // Handled by the event loop
+                return true;
             } else if (key == "v") {
                 auto msg = o.as<VersionMsg>();
                 onVersion(msg.v);
@@ -522,7 +989,7 @@ void
 MultiplexedSocket::Impl::handleProtocolPacket(std::vector<uint8_t>&& pkt)
 {
     // Run this on dedicated thread because some callbacks can take time
-    dht::ThreadPool::io().run([w = parent_.weak(), pkt = std::move(pkt)]() {
+    protocolExecutor_->run([w = parent_.weak(), pkt = std::move(pkt)]() {
         auto shared = w.lock();
         if (!shared)
             return;
@@ -542,15 +1009,19 @@ MultiplexedSocket::Impl::handleProtocolPacket(std::vector<uint8_t>&& pkt)
     });
 }
 
-MultiplexedSocket::MultiplexedSocket(std::shared_ptr<asio::io_context> ctx, const DeviceId& deviceId,
-                                     std::unique_ptr<TlsSocketEndpoint> endpoint)
-    : pimpl_(std::make_unique<Impl>(*this, ctx, deviceId, std::move(endpoint)))
+MultiplexedSocket::MultiplexedSocket(std::shared_ptr<asio::io_context> ctx,
+                                     const DeviceId& deviceId,
+                                     std::unique_ptr<TlsSocketEndpoint> endpoint,
+                                     std::size_t readBufferSize,
+                                     std::shared_ptr<Logger> logger)
+    : pimpl_(std::make_unique<Impl>(
+        *this, ctx, deviceId, std::move(endpoint), readBufferSize, std::move(logger)))
 {}
 
 MultiplexedSocket::~MultiplexedSocket() {}
 
 std::shared_ptr<ChannelSocket>
-MultiplexedSocket::addChannel(const std::string& name)
+MultiplexedSocket::addChannel(const std::string& name, ChannelType type)
 {
     // Note: because both sides can request the same channel number at the same time
     // it's better to use a random channel number instead of just incrementing the request.
@@ -558,15 +1029,30 @@ MultiplexedSocket::addChannel(const std::string& name)
     std::uniform_int_distribution<uint16_t> dist;
     auto offset = dist(rd);
     std::lock_guard<std::mutex> lk(pimpl_->socketsMutex);
-    for (int i = 1; i < UINT16_MAX; ++i) {
-        auto c = (offset + i) % UINT16_MAX;
-        if (c == CONTROL_CHANNEL || c == PROTOCOL_CHANNEL
-            || pimpl_->sockets.find(c) != pimpl_->sockets.end())
-            continue;
-        auto channel = pimpl_->makeSocket(name, c, true);
-        return channel;
+    auto c = pimpl_->sockets.findFree(offset, CONTROL_CHANNEL + 1, PROTOCOL_CHANNEL - 1);
+    if (c == 0)
+        return {};
+    return pimpl_->makeSocket(name, c, true, type);
+}
+
+std::shared_ptr<ChannelSocket>
+MultiplexedSocket::addChannel(const std::string& name,
+                              std::vector<uint8_t>&& initialData,
+                              ChannelType type)
+{
+    if (initialData.size() > CHANNEL_PENDING_WRITES_MAX)
+        return {};
+    auto socket = addChannel(name, type);
+    if (!socket || initialData.empty())
+        return socket;
+    if (pimpl_->peerVersion_ >= INITIAL_DATA_VERSION && initialData.size() <= INITIAL_DATA_MAX) {
+        socket->setInitialData(std::move(initialData));
+    } else {
+        // Queued until accepted
+        std::error_code ec;
+        socket->write(initialData.data(), initialData.size(), ec);
     }
-    return {};
+    return socket;
 }
 
 DeviceId
@@ -615,6 +1101,12 @@ MultiplexedSocket::maxPayload() const
     return pimpl_->endpoint->maxPayload();
 }
 
+int
+MultiplexedSocket::peerVersion() const
+{
+    return pimpl_->peerVersion_;
+}
+
 std::size_t
 MultiplexedSocket::write(const uint16_t& channel,
                          const uint8_t* buf,
@@ -631,14 +1123,6 @@ MultiplexedSocket::write(const uint16_t& channel,
         ec = std::make_error_code(std::errc::message_size);
         return -1;
     }
-    bool oneShot = len < 8192;
-    msgpack::sbuffer buffer(oneShot ? 16 + len : 16);
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
-    pk.pack_array(2);
-    pk.pack(channel);
-    pk.pack_bin(len);
-    if (oneShot)
-        pk.pack_bin_body((const char*) buf, len);
 
     std::unique_lock<std::mutex> lk(pimpl_->writeMtx);
     if (!pimpl_->endpoint) {
@@ -647,10 +1131,58 @@ MultiplexedSocket::write(const uint16_t& channel,
         ec = std::make_error_code(std::errc::broken_pipe);
         return -1;
     }
-    int res = pimpl_->endpoint->write((const unsigned char*) buffer.data(), buffer.size(), ec);
-    if (not oneShot and res >= 0)
-        res = pimpl_->endpoint->write(buf, len, ec);
+    if (channel == CONTROL_CHANNEL || len == 0) {
+        pimpl_->queueControl(channel, buf, len);
+        lk.unlock();
+        pimpl_->touch();
+        ec.clear();
+        return len;
+    }
+    int res = pimpl_->txFrames_ ? pimpl_->writeFrame(channel, buf, len, ec)
+                                : pimpl_->writeMessage(channel, buf, len, ec);
+    lk.unlock();
+    if (channel != PROTOCOL_CHANNEL)
+        pimpl_->touch();
+    if (res < 0) {
+        if (ec && pimpl_->logger_)
+            pimpl_->logger_->error("Error when writing on socket: {:s}", ec.message());
+        shutdown();
+    }
+    return res;
+}
+
+std::size_t
+MultiplexedSocket::writeCompressed(uint16_t channel,
+                                   const uint8_t* buf,
+                                   std::size_t len,
+                                   std::error_code& ec)
+{
+    assert(nullptr != buf);
+
+    if (pimpl_->isShutdown_) {
+        ec = std::make_error_code(std::errc::broken_pipe);
+        return -1;
+    }
+    // An empty frame would close the channel
+    if (len == 0 || len > UINT16_MAX) {
+        ec = std::make_error_code(std::errc::message_size);
+        return -1;
+    }
+
+    std::unique_lock<std::mutex> lk(pimpl_->writeMtx);
+    if (!pimpl_->endpoint) {
+        if (pimpl_->logger_)
+            pimpl_->logger_->warn("No endpoint found for socket");
+        ec = std::make_error_code(std::errc::broken_pipe);
+        return -1;
+    }
+    if (!pimpl_->txFrames_) {
+        ec = std::make_error_code(std::errc::operation_not_supported);
+        return -1;
+    }
+    int res = pimpl_->writeFrame(channel, buf, len, ec, mux::FRAME_COMPRESSED);
     lk.unlock();
+    pimpl_->touch();
     if (res < 0) {
         if (ec && pimpl_->logger_)
             pimpl_->logger_->error("Error when writing on socket: {:s}", ec.message());
@@ -659,6 +1191,60 @@ MultiplexedSocket::write(const uint16_t& channel,
     return res;
 }
 
+bool
+MultiplexedSocket::canWriteCompressed() const
+{
+    return pimpl_->txFrames_;
+}
+
+std::size_t
+MultiplexedSocket::writeDatagram(uint16_t channel,
+                                 const uint8_t* buf,
+                                 std::size_t len,
+                                 std::error_code& ec)
+{
+    assert(nullptr != buf);
+
+    if (pimpl_->isShutdown_ || !pimpl_->endpoint) {
+        ec = std::make_error_code(std::errc::broken_pipe);
+        return -1;
+    }
+    // Reliable transport, or peer without datagram records
+    if (pimpl_->endpoint->maxDatagramSize() == 0)
+        return write(channel, buf, len, ec);
+    if (len > maxDatagramSize()) {
+        ec = std::make_error_code(std::errc::message_size);
+        return -1;
+    }
+
+    msgpack::sbuffer buffer(DATAGRAM_HEADER_SIZE + len);
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_array(2);
+    pk.pack(channel);
+    pk.pack_bin(len);
+    pk.pack_bin_body((const char*) buf, len);
+
+    // Not serialized with the stream (writeMtx): the peer doesn't read it from the stream
+    pimpl_->endpoint->writeDatagram((const uint8_t*) buffer.data(), buffer.size(), ec);
+    if (ec) {
+        if (pimpl_->logger_)
+            pimpl_->logger_->error("Error when writing datagram on socket: {:s}", ec.message());
+        return -1;
+    }
+    pimpl_->touch();
+    return len;
+}
+
+std::size_t
+MultiplexedSocket::maxDatagramSize() const
+{
+    if (!pimpl_->endpoint)
+        return 0;
+    if (auto size = pimpl_->endpoint->maxDatagramSize())
+        return size > DATAGRAM_HEADER_SIZE ? size - DATAGRAM_HEADER_SIZE : 0;
+    return UINT16_MAX;
+}
+
 void
 MultiplexedSocket::shutdown()
 {
@@ -696,16 +1282,40 @@ MultiplexedSocket::monitor() const
         return;
     pimpl_->logger_->debug("- Socket with device: {:s} - account: {:s}", deviceId(), cert->issuer->getId());
     pimpl_->logger_->debug("- Duration: {}", dht::print_duration(now - pimpl_->start_));
+    auto memory = memoryUsage();
+    pimpl_->logger_->debug("- Memory: {} bytes (ICE: {}, TLS: {}, mux: {}, channels: {})",
+                           memory.total(),
+                           memory.ice,
+                           memory.tls,
+                           memory.mux,
+                           memory.channels);
     pimpl_->endpoint->monitor();
     std::lock_guard<std::mutex> lk(pimpl_->socketsMutex);
-    for (const auto& [_, channel] : pimpl_->sockets) {
+    pimpl_->sockets.forEach([&](uint16_t, const std::shared_ptr<ChannelSocket>& channel) {
         if (channel)
             pimpl_->logger_->debug("\t\t- Channel {} (count: {}) with name {:s} Initiator: {}",
                        fmt::ptr(channel.get()),
                        channel.use_count(),
                        channel->name(),
                        channel->isInitiator());
+    });
+}
+
+ConnectionMemoryUsage
+MultiplexedSocket::memoryUsage() const
+{
+    ConnectionMemoryUsage usage;
+    if (pimpl_->endpoint) {
+        usage.ice = pimpl_->endpoint->iceMemoryUsage();
+        usage.tls = pimpl_->endpoint->memoryUsage();
     }
+    usage.mux = pimpl_->pacSize_;
+    std::lock_guard<std::mutex> lk(pimpl_->socketsMutex);
+    pimpl_->sockets.forEach([&](uint16_t, const std::shared_ptr<ChannelSocket>& channel) {
+        if (channel)
+            usage.channels += channel->memoryUsage();
+    });
+    return usage;
 }
 
 void
@@ -775,9 +1385,21 @@ void
 MultiplexedSocket::eraseChannel(uint16_t channel)
 {
     std::lock_guard<std::mutex> lkSockets(pimpl_->socketsMutex);
-    auto itSocket = pimpl_->sockets.find(channel);
-    if (pimpl_->sockets.find(channel) != pimpl_->sockets.end())
-        pimpl_->sockets.erase(itSocket);
+    pimpl_->sockets.erase(channel);
+    pimpl_->touch();
+}
+
+std::size_t
+MultiplexedSocket::channelCount() const
+{
+    std::lock_guard<std::mutex> lkSockets(pimpl_->socketsMutex);
+    return pimpl_->sockets.size();
+}
+
+std::chrono::steady_clock::time_point
+MultiplexedSocket::lastActivity() const
+{
+    return time_point(clock::duration(pimpl_->lastActivity_.load(std::memory_order_relaxed)));
 }
 
 ////////////////////////////////////////////////////////////////
@@ -789,12 +1411,15 @@ public:
          const std::string& name,
          const uint16_t& channel,
          bool isInitiator,
-         std::function<void()> rmFromMxSockCb)
+         std::function<void()> rmFromMxSockCb,
+         ChannelType type)
         : name(name)
         , channel(channel)
         , endpoint(std::move(endpoint))
         , isInitiator_(isInitiator)
         , rmFromMxSockCb_(std::move(rmFromMxSockCb))
+        , type_(type)
+        , opening_(isInitiator)
     {}
 
     ~Impl() {}
@@ -810,13 +1435,151 @@ public:
 
     bool isAnswered_ {false};
     bool isRemovable_ {false};
+    std::atomic<ChannelType> type_;
+
+    // Sent in the ChannelRequest
+    std::vector<uint8_t> initialData_ {};
+    // Writes before the peer accepts the channel, sent on accept
+    std::mutex writeMutex_ {};
+    bool opening_ {false};
+    std::vector<std::vector<uint8_t>> pendingWrites_ {};
+    std::atomic_size_t pendingSize_ {0};
+
+    std::atomic<ChannelCompression> compression_ {ChannelCompression::NONE};
+    // Size of the contexts, allocated on first use
+    std::atomic_size_t compressorMemory_ {0};
+    std::atomic_size_t decompressorMemory_ {0};
+#ifdef HAVE_LIBZSTD
+    // Held until the output is written, so the peer decompresses in order
+    std::mutex compressMutex_ {};
+    std::unique_ptr<StreamCompressor> compressor_ {};
+    std::vector<uint8_t> compressed_ {};
+    std::size_t sampleIn_ {0};
+    std::size_t sampleOut_ {0};
+    std::size_t skip_ {0};
+    // Used by the event loop only
+    std::unique_ptr<StreamDecompressor> decompressor_ {};
+#endif
 
     std::vector<uint8_t> buf {};
+    // Received messages of a datagram channel, with their boundaries
+    std::deque<std::vector<uint8_t>> datagrams {};
     std::mutex mutex {};
     std::condition_variable cv {};
     GenericSocket<uint8_t>::RecvCb cb {};
+
+    // Release the buffer grown by a burst, once read. Requires mutex.
+    void shrinkBuffer()
+    {
+        if (buf.empty() and buf.capacity() > CHANNEL_BUFFER_KEEP_SIZE)
+            std::vector<uint8_t>().swap(buf);
+    }
+
+    std::size_t send(const uint8_t* data, std::size_t len, std::error_code& ec);
+    std::size_t sendStream(MultiplexedSocket& ep,
+                           const uint8_t* data,
+                           std::size_t len,
+                           std::error_code& ec);
+#ifdef HAVE_LIBZSTD
+    std::size_t sendCompressed(MultiplexedSocket& ep,
+                               const uint8_t* data,
+                               std::size_t len,
+                               std::error_code& ec);
+#endif
 };
 
+std::size_t
+ChannelSocket::Impl::send(const uint8_t* data, std::size_t len, std::error_code& ec)
+{
+    if (auto ep = endpoint.lock()) {
+        if (type_ == ChannelType::DATAGRAM) {
+            // A message is never split, and an empty one would close the channel
+            if (len == 0)
+                return 0;
+            auto res = ep->writeDatagram(channel, data, len, ec);
+            if (ec && ep->logger())
+                ep->logger()->error("Error when writing on channel: {}", ec.message());
+            return res;
+        }
+#ifdef HAVE_LIBZSTD
+        if (compression_ == ChannelCompression::ZSTD && len >= COMPRESSION_MIN_SIZE
+            && ep->canWriteCompressed())
+            return sendCompressed(*ep, data, len, ec);
+#endif
+        return sendStream(*ep, data, len, ec);
+    }
+    ec = std::make_error_code(std::errc::broken_pipe);
+    return -1;
+}
+
+std::size_t
+ChannelSocket::Impl::sendStream(MultiplexedSocket& ep,
+                                const uint8_t* data,
+                                std::size_t len,
+                                std::error_code& ec)
+{
+    std::size_t sent = 0;
+    do {
+        std::size_t toSend = std::min(static_cast<std::size_t>(UINT16_MAX), len - sent);
+        auto res = ep.write(channel, data + sent, toSend, ec);
+        if (ec) {
+            if (ep.logger())
+                ep.logger()->error("Error when writing on channel: {}", ec.message());
+            return res;
+        }
+        sent += toSend;
+    } while (sent < len);
+    return sent;
+}
+
+#ifdef HAVE_LIBZSTD
+std::size_t
+ChannelSocket::Impl::sendCompressed(MultiplexedSocket& ep,
+                                    const uint8_t* data,
+                                    std::size_t len,
+                                    std::error_code& ec)
+{
+    std::lock_guard<std::mutex> lk(compressMutex_);
+    if (skip_ > 0) {
+        // Not in the window of the compressor, nor in the one of the peer
+        skip_ -= std::min(skip_, len);
+        return sendStream(ep, data, len, ec);
+    }
+    if (!compressor_)
+        compressor_ = std::make_unique<StreamCompressor>();
+    std::size_t sent = 0;
+    do {
+        std::size_t toSend = std::min(COMPRESSION_CHUNK_MAX, len - sent);
+        compressed_.clear();
+        if (!compressor_->compress(data + sent, toSend, compressed_)) {
+            ec = std::make_error_code(std::errc::io_error);
+            if (ep.logger())
+                ep.logger()->error("Unable to compress data on channel {}", name);
+            return -1;
+        }
+        auto res = ep.writeCompressed(channel, compressed_.data(), compressed_.size(), ec);
+        if (ec) {
+            if (ep.logger())
+                ep.logger()->error("Error when writing on channel: {}", ec.message());
+            return res;
+        }
+        sampleIn_ += toSend;
+        sampleOut_ += compressed_.size();
+        sent += toSend;
+    } while (sent < len);
+    compressorMemory_ = compressor_->memoryUsage() + compressed_.capacity();
+    if (sampleIn_ >= COMPRESSION_SAMPLE) {
+        if (sampleOut_ * 100 > sampleIn_ * COMPRESSION_RATIO_MAX) {
+            if (ep.logger())
+                ep.logger()->debug("Data of channel {} is not compressible, sent as is", name);
+            skip_ = COMPRESSION_SKIP;
+        }
+        sampleIn_ = sampleOut_ = 0;
+    }
+    return sent;
+}
+#endif
+
 ChannelSocketTest::ChannelSocketTest(std::shared_ptr<asio::io_context> ctx,
                                      const DeviceId& deviceId,
                                      const std::string& name,
@@ -959,9 +1722,10 @@ ChannelSocket::ChannelSocket(std::weak_ptr<MultiplexedSocket> endpoint,
                              const std::string& name,
                              const uint16_t& channel,
                              bool isInitiator,
-                             std::function<void()> rmFromMxSockCb)
-    : pimpl_ {
-        std::make_unique<Impl>(endpoint, name, channel, isInitiator, std::move(rmFromMxSockCb))}
+                             std::function<void()> rmFromMxSockCb,
+                             ChannelType type)
+    : pimpl_ {std::make_unique<Impl>(
+        endpoint, name, channel, isInitiator, std::move(rmFromMxSockCb), type)}
 {}
 
 ChannelSocket::~ChannelSocket() {}
@@ -1010,19 +1774,68 @@ int
 ChannelSocket::maxPayload() const
 {
     if (auto ep = pimpl_->endpoint.lock()) {
+        if (pimpl_->type_ == ChannelType::DATAGRAM)
+            return ep->maxDatagramSize();
         return ep->maxPayload();
     }
     return -1;
 }
 
+ChannelType
+ChannelSocket::type() const
+{
+    return pimpl_->type_;
+}
+
+void
+ChannelSocket::setType(ChannelType type)
+{
+    pimpl_->type_ = type;
+}
+
+void
+ChannelSocket::setInitialData(std::vector<uint8_t>&& data)
+{
+    pimpl_->initialData_ = std::move(data);
+}
+
+std::vector<uint8_t>
+ChannelSocket::takeInitialData()
+{
+    return std::move(pimpl_->initialData_);
+}
+
+ChannelCompression
+ChannelSocket::compression() const
+{
+    return pimpl_->compression_;
+}
+
+void
+ChannelSocket::setCompression(ChannelCompression compression)
+{
+#ifndef HAVE_LIBZSTD
+    compression = ChannelCompression::NONE;
+#endif
+    if (pimpl_->type_ == ChannelType::DATAGRAM)
+        compression = ChannelCompression::NONE;
+    pimpl_->compression_ = compression;
+}
+
 void
 ChannelSocket::setOnRecv(RecvCb&& cb)
 {
     std::lock_guard<std::mutex> lkSockets(pimpl_->mutex);
     pimpl_->cb = std::move(cb);
+    if (pimpl_->cb) {
+        for (auto& datagram : pimpl_->datagrams)
+            pimpl_->cb(datagram.data(), datagram.size());
+        pimpl_->datagrams.clear();
+    }
     if (!pimpl_->buf.empty() && pimpl_->cb) {
         pimpl_->cb(pimpl_->buf.data(), pimpl_->buf.size());
         pimpl_->buf.clear();
+        pimpl_->shrinkBuffer();
     }
 }
 
@@ -1034,12 +1847,60 @@ ChannelSocket::onRecv(std::vector<uint8_t>&& pkt)
         pimpl_->cb(&pkt[0], pkt.size());
         return;
     }
-    pimpl_->buf.insert(pimpl_->buf.end(),
-                       std::make_move_iterator(pkt.begin()),
-                       std::make_move_iterator(pkt.end()));
+    if (pimpl_->type_ == ChannelType::DATAGRAM) {
+        if (pimpl_->datagrams.size() == DATAGRAM_QUEUE_MAX)
+            pimpl_->datagrams.pop_front();
+        pimpl_->datagrams.emplace_back(std::move(pkt));
+    } else {
+        pimpl_->buf.insert(pimpl_->buf.end(),
+                           std::make_move_iterator(pkt.begin()),
+                           std::make_move_iterator(pkt.end()));
+    }
     pimpl_->cv.notify_all();
 }
 
+void
+ChannelSocket::onRecv(const uint8_t* data, std::size_t len)
+{
+    std::lock_guard<std::mutex> lkSockets(pimpl_->mutex);
+    if (pimpl_->cb) {
+        pimpl_->cb(data, len);
+        return;
+    }
+    if (pimpl_->type_ == ChannelType::DATAGRAM) {
+        if (pimpl_->datagrams.size() == DATAGRAM_QUEUE_MAX)
+            pimpl_->datagrams.pop_front();
+        pimpl_->datagrams.emplace_back(data, data + len);
+    } else {
+        pimpl_->buf.insert(pimpl_->buf.end(), data, data + len);
+    }
+    pimpl_->cv.notify_all();
+}
+
+void
+ChannelSocket::onRecvCompressed(const uint8_t* data, std::size_t len)
+{
+#ifdef HAVE_LIBZSTD
+    // Offered or accepted: the peer may compress before we get its answer
+    if (pimpl_->compression_ == ChannelCompression::ZSTD) {
+        if (!pimpl_->decompressor_)
+            pimpl_->decompressor_ = std::make_unique<StreamDecompressor>();
+        auto buffer = BufferPool::instance().get(COMPRESSION_CHUNK_MAX + 1);
+        auto size = buffer.size();
+        if (pimpl_->decompressor_->decompress(data, len, buffer.data(), size)) {
+            pimpl_->decompressorMemory_ = pimpl_->decompressor_->memoryUsage();
+            if (size)
+                onRecv(buffer.data(), size);
+            return;
+        }
+    }
+#endif
+    if (auto ep = pimpl_->endpoint.lock())
+        if (ep->logger())
+            ep->logger()->error("Unable to decompress data on channel {}", pimpl_->name);
+    shutdown();
+}
+
 #ifdef LIBJAMI_TESTABLE
 std::shared_ptr<MultiplexedSocket>
 ChannelSocket::underlyingSocket() const
@@ -1077,6 +1938,29 @@ ChannelSocket::isAnswered() const
 void
 ChannelSocket::ready(bool accepted)
 {
+    // Sent without writeMutex_, as a failed write shuts the socket down.
+    // Writes racing with the flush are queued behind it.
+    std::unique_lock<std::mutex> lk(pimpl_->writeMutex_);
+    bool send = accepted;
+    while (pimpl_->opening_) {
+        if (pimpl_->pendingWrites_.empty()) {
+            pimpl_->opening_ = false;
+            break;
+        }
+        auto pending = std::move(pimpl_->pendingWrites_);
+        pimpl_->pendingWrites_.clear();
+        pimpl_->pendingSize_ = 0;
+        lk.unlock();
+        std::error_code ec;
+        for (const auto& data : pending) {
+            if (!send or pimpl_->isShutdown_)
+                break;
+            pimpl_->send(data.data(), data.size(), ec);
+            send = !ec;
+        }
+        lk.lock();
+    }
+    lk.unlock();
     if (pimpl_->readyCb_)
         pimpl_->readyCb_(accepted);
 }
@@ -1115,12 +1999,20 @@ std::size_t
 ChannelSocket::read(ValueType* outBuf, std::size_t len, std::error_code& ec)
 {
     std::lock_guard<std::mutex> lkSockets(pimpl_->mutex);
+    if (!pimpl_->datagrams.empty()) {
+        // One message per read, like a datagram socket
+        auto datagram = std::move(pimpl_->datagrams.front());
+        pimpl_->datagrams.pop_front();
+        std::size_t size = std::min(len, datagram.size());
+        std::copy_n(datagram.begin(), size, outBuf);
+        return size;
+    }
     std::size_t size = std::min(len, pimpl_->buf.size());
 
-    for (std::size_t i = 0; i < size; ++i)
-        outBuf[i] = pimpl_->buf[i];
+    std::copy_n(pimpl_->buf.begin(), size, outBuf);
 
     pimpl_->buf.erase(pimpl_->buf.begin(), pimpl_->buf.begin() + size);
+    pimpl_->shrinkBuffer();
     return size;
 }
 
@@ -1131,29 +2023,44 @@ ChannelSocket::write(const ValueType* buf, std::size_t len, std::error_code& ec)
         ec = std::make_error_code(std::errc::broken_pipe);
         return -1;
     }
-    if (auto ep = pimpl_->endpoint.lock()) {
-        std::size_t sent = 0;
-        do {
-            std::size_t toSend = std::min(static_cast<std::size_t>(UINT16_MAX), len - sent);
-            auto res = ep->write(pimpl_->channel, buf + sent, toSend, ec);
-            if (ec) {
-                if (ep->logger())
-                    ep->logger()->error("Error when writing on channel: {}", ec.message());
-                return res;
-            }
-            sent += toSend;
-        } while (sent < len);
-        return sent;
+    std::unique_lock<std::mutex> lk(pimpl_->writeMutex_);
+    if (pimpl_->opening_) {
+        // The peer may never answer, don't queue without bound
+        if (pimpl_->pendingSize_ + len > CHANNEL_PENDING_WRITES_MAX) {
+            ec = std::make_error_code(std::errc::no_buffer_space);
+            return -1;
+        }
+        ec.clear();
+        if (len > 0) {
+            pimpl_->pendingWrites_.emplace_back(buf, buf + len);
+            pimpl_->pendingSize_ += len;
+        }
+        return len;
     }
-    ec = std::make_error_code(std::errc::broken_pipe);
-    return -1;
+    lk.unlock();
+    return pimpl_->send(buf, len, ec);
+}
+
+std::size_t
+ChannelSocket::memoryUsage() const
+{
+    std::lock_guard<std::mutex> lk {pimpl_->mutex};
+    auto size = pimpl_->buf.capacity() + pimpl_->pendingSize_ + pimpl_->compressorMemory_
+                + pimpl_->decompressorMemory_;
+    for (const auto& datagram : pimpl_->datagrams)
+        size += datagram.capacity();
+    return size;
 }
 
 int
 ChannelSocket::waitForData(std::chrono::milliseconds timeout, std::error_code& ec) const
 {
     std::unique_lock<std::mutex> lk {pimpl_->mutex};
-    pimpl_->cv.wait_for(lk, timeout, [&] { return !pimpl_->buf.empty() or pimpl_->isShutdown_; });
+    pimpl_->cv.wait_for(lk, timeout, [&] {
+        return !pimpl_->buf.empty() or !pimpl_->datagrams.empty() or pimpl_->isShutdown_;
+    });
+    if (!pimpl_->datagrams.empty())
+        return pimpl_->datagrams.front().size();
     return pimpl_->buf.size();
 }
 
@@ -0,0 +1,103 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace jami {
+namespace mux {
+
+/**
+ * Compact framing of the multiplexed socket, used once both peers announced
+ * it (see MultiplexedSocket). A frame is:
+ *   channel    16 bits, big endian
+ *   flags      8 bits, FRAME_COMPRESSED, unknown flags are a protocol error
+ *   length     varint (7 bits per byte, least significant first), <= UINT16_MAX
+ *   payload    length bytes
+ * The header is parsed in place, so the payload is never copied by the parser.
+ */
+static constexpr std::size_t FRAME_HEADER_MAX {2 + 1 + 3};
+static constexpr std::size_t FRAME_LENGTH_MAX {UINT16_MAX};
+// The payload is compressed by the channel (see ChannelCompression)
+static constexpr uint8_t FRAME_COMPRESSED {0x01};
+static constexpr uint8_t FRAME_FLAGS_KNOWN {FRAME_COMPRESSED};
+
+struct FrameHeader
+{
+    uint16_t channel {0};
+    uint8_t flags {0};
+    std::size_t length {0};
+    // Size of the header itself
+    std::size_t size {0};
+};
+
+enum class FrameParse {
+    OK,
+    INCOMPLETE,
+    INVALID,
+};
+
+/**
+ * Write the header of a frame of len bytes (<= FRAME_LENGTH_MAX)
+ * @param out   at least FRAME_HEADER_MAX bytes
+ * @return the size of the header
+ */
+inline std::size_t
+writeFrameHeader(uint8_t* out, uint16_t channel, uint8_t flags, std::size_t len)
+{
+    std::size_t size = 0;
+    out[size++] = static_cast<uint8_t>(channel >> 8);
+    out[size++] = static_cast<uint8_t>(channel);
+    out[size++] = flags;
+    do {
+        auto byte = static_cast<uint8_t>(len & 0x7f);
+        len >>= 7;
+        out[size++] = len ? (byte | 0x80) : byte;
+    } while (len);
+    return size;
+}
+
+/**
+ * Parse the header at the start of data
+ * @return INCOMPLETE if more bytes are needed, INVALID if it can't be a header
+ */
+inline FrameParse
+parseFrameHeader(const uint8_t* data, std::size_t size, FrameHeader& header)
+{
+    if (size < 4)
+        return FrameParse::INCOMPLETE;
+    header.channel = static_cast<uint16_t>((data[0] << 8) | data[1]);
+    header.flags = data[2];
+    if (header.flags & ~FRAME_FLAGS_KNOWN)
+        return FrameParse::INVALID;
+    header.length = 0;
+    for (std::size_t i = 3, shift = 0; i < FRAME_HEADER_MAX; i++, shift += 7) {
+        if (i == size)
+            return FrameParse::INCOMPLETE;
+        header.length |= static_cast<std::size_t>(data[i] & 0x7f) << shift;
+        if (not(data[i] & 0x80)) {
+            header.size = i + 1;
+            return header.length <= FRAME_LENGTH_MAX ? FrameParse::OK : FrameParse::INVALID;
+        }
+    }
+    return FrameParse::INVALID;
+}
+
+} // namespace mux
+} // namespace jami
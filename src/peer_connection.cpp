@@ -25,8 +25,12 @@
 #include <opendht/thread_pool.h>
 #include <opendht/logger.h>
 
+#include <asio/write.hpp>
+
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <future>
 #include <vector>
 #include <atomic>
@@ -160,16 +164,97 @@ IceSocketEndpoint::write(const ValueType* buf, std::size_t len, std::error_code&
 
 //==============================================================================
 
+TcpSocketEndpoint::TcpSocketEndpoint(asio::ip::tcp::socket&& socket, bool isInitiator)
+    : socket_(std::move(socket))
+    , isInitiator_(isInitiator)
+{
+    asio::error_code ec;
+    socket_.set_option(asio::ip::tcp::no_delay(true), ec);
+}
+
+TcpSocketEndpoint::~TcpSocketEndpoint()
+{
+    asio::error_code ec;
+    socket_.close(ec);
+}
+
+void
+TcpSocketEndpoint::shutdown()
+{
+    // Wakes up the pending reads
+    asio::error_code ec;
+    socket_.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+}
+
+int
+TcpSocketEndpoint::waitForData(std::chrono::milliseconds timeout, std::error_code& ec) const
+{
+    if (not socket_.is_open()) {
+        ec = std::make_error_code(std::errc::broken_pipe);
+        return -1;
+    }
+    auto fd = socket_.native_handle();
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(fd, &readSet);
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(timeout).count();
+    timeval tv {static_cast<decltype(tv.tv_sec)>(us / 1000000),
+                static_cast<decltype(tv.tv_usec)>(us % 1000000)};
+    auto res = select(static_cast<int>(fd) + 1, &readSet, nullptr, nullptr, &tv);
+    if (res < 0)
+        ec.assign(errno, std::generic_category());
+    return res;
+}
+
+std::size_t
+TcpSocketEndpoint::read(ValueType* buf, std::size_t len, std::error_code& ec)
+{
+    return socket_.read_some(asio::buffer(buf, len), ec);
+}
+
+std::size_t
+TcpSocketEndpoint::write(const ValueType* buf, std::size_t len, std::error_code& ec)
+{
+    return asio::write(socket_, asio::buffer(buf, len), ec);
+}
+
+IpAddr
+TcpSocketEndpoint::getLocalAddress() const
+{
+    asio::error_code ec;
+    auto ep = socket_.local_endpoint(ec);
+    if (ec)
+        return {};
+    IpAddr addr(ep.address().to_string());
+    addr.setPort(ep.port());
+    return addr;
+}
+
+IpAddr
+TcpSocketEndpoint::getRemoteAddress() const
+{
+    asio::error_code ec;
+    auto ep = socket_.remote_endpoint(ec);
+    if (ec)
+        return {};
+    IpAddr addr(ep.address().to_string());
+    addr.setPort(ep.port());
+    return addr;
+}
+
+//==============================================================================
+
 class TlsSocketEndpoint::Impl
 {
 public:
     static constexpr auto TLS_TIMEOUT = std::chrono::seconds(40);
 
-    Impl(std::unique_ptr<IceSocketEndpoint>&& ep,
+    Impl(std::unique_ptr<SocketType>&& ep,
          tls::CertificateStore& certStore,
          const dht::crypto::Certificate& peer_cert,
          const Identity& local_identity,
-         const std::shared_future<tls::DhParams>& dh_params)
+         const std::shared_future<tls::DhParams>& dh_params,
+         std::size_t rxBufferSize)
         : peerCertificate {peer_cert}
         , ep_ {ep.get()}
     {
@@ -183,7 +268,9 @@ public:
                /*.verifyCertificate = */
                [this](gnutls_session_t session) {
                    return verifyCertificate(session);
-               }};
+               },
+               /*.onRxDatagram = */
+               [this](std::vector<uint8_t>&& buf) { onTlsRxDatagram(std::move(buf)); }};
         tls::TlsParams tls_param = {
             /*.ca_list = */ "",
             /*.peer_ca = */ nullptr,
@@ -194,14 +281,16 @@ public:
             /*.timeout = */ TLS_TIMEOUT,
             /*.cert_check = */ nullptr,
         };
+        tls_param.rxBufferSize = rxBufferSize;
         tls = std::make_unique<tls::TlsSession>(std::move(ep), tls_param, tls_cbs);
     }
 
-    Impl(std::unique_ptr<IceSocketEndpoint>&& ep,
+    Impl(std::unique_ptr<SocketType>&& ep,
          tls::CertificateStore& certStore,
          std::function<bool(const dht::crypto::Certificate&)>&& cert_check,
          const Identity& local_identity,
-         const std::shared_future<tls::DhParams>& dh_params)
+         const std::shared_future<tls::DhParams>& dh_params,
+         std::size_t rxBufferSize)
         : peerCertificateCheckFunc {std::move(cert_check)}
         , peerCertificate {null_cert}
         , ep_ {ep.get()}
@@ -216,7 +305,9 @@ public:
                /*.verifyCertificate = */
                [this](gnutls_session_t session) {
                    return verifyCertificate(session);
-               }};
+               },
+               /*.onRxDatagram = */
+               [this](std::vector<uint8_t>&& buf) { onTlsRxDatagram(std::move(buf)); }};
         tls::TlsParams tls_param = {
             /*.ca_list = */ "",
             /*.peer_ca = */ nullptr,
@@ -227,6 +318,7 @@ public:
             /*.timeout = */ std::chrono::duration_cast<decltype(tls::TlsParams::timeout)>(TLS_TIMEOUT),
             /*.cert_check = */ nullptr,
         };
+        tls_param.rxBufferSize = rxBufferSize;
         tls = std::make_unique<tls::TlsSession>(std::move(ep), tls_param, tls_cbs);
     }
 
@@ -236,15 +328,15 @@ public:
             std::lock_guard<std::mutex> lk(cbMtx_);
             onStateChangeCb_ = {};
             onReadyCb_ = {};
+            onDatagramCb_ = {};
         }
         tls.reset();
     }
 
     std::shared_ptr<IceTransport> underlyingICE() const
     {
-        if (ep_)
-            if (const auto* iceSocket = reinterpret_cast<const IceSocketEndpoint*>(ep_))
-                return iceSocket->underlyingICE();
+        if (const auto* iceSocket = dynamic_cast<const IceSocketEndpoint*>(ep_))
+            return iceSocket->underlyingICE();
         return {};
     }
 
@@ -252,17 +344,29 @@ public:
     int verifyCertificate(gnutls_session_t);
     void onTlsStateChange(tls::TlsSessionState);
     void onTlsRxData(std::vector<uint8_t>&&);
+    void onTlsRxDatagram(std::vector<uint8_t>&&);
     void onTlsCertificatesUpdate(const gnutls_datum_t*, const gnutls_datum_t*, unsigned int);
 
+    std::size_t readRecords(ValueType* buf, std::size_t len, std::error_code& ec);
+
     std::mutex cbMtx_ {};
     OnStateChangeCb onStateChangeCb_;
+    OnDatagramCb onDatagramCb_;
+
+    // Ordered stream records of a DTLS session. The TLS thread is their only
+    // reader, a TLS session over a reliable transport is read directly.
+    std::mutex rxMtx_ {};
+    std::condition_variable rxCv_ {};
+    std::deque<std::vector<uint8_t>> rxRecords_ {};
+    std::size_t rxOffset_ {0};
+    bool rxShutdown_ {false};
     dht::crypto::Certificate null_cert;
     std::function<bool(const dht::crypto::Certificate&)> peerCertificateCheckFunc;
     const dht::crypto::Certificate& peerCertificate;
     std::atomic_bool isReady_ {false};
     OnReadyCb onReadyCb_;
     std::unique_ptr<tls::TlsSession> tls;
-    const IceSocketEndpoint* ep_;
+    const SocketType* ep_;
 };
 
 int
@@ -294,6 +398,11 @@ TlsSocketEndpoint::Impl::verifyCertificate(gnutls_session_t session)
 void
 TlsSocketEndpoint::Impl::onTlsStateChange(tls::TlsSessionState state)
 {
+    if (state == tls::TlsSessionState::SHUTDOWN) {
+        std::lock_guard<std::mutex> lk(rxMtx_);
+        rxShutdown_ = true;
+        rxCv_.notify_all();
+    }
     std::lock_guard<std::mutex> lk(cbMtx_);
     if ((state == tls::TlsSessionState::SHUTDOWN || state == tls::TlsSessionState::ESTABLISHED)
         && !isReady_) {
@@ -306,8 +415,45 @@ TlsSocketEndpoint::Impl::onTlsStateChange(tls::TlsSessionState state)
 }
 
 void
-TlsSocketEndpoint::Impl::onTlsRxData([[maybe_unused]] std::vector<uint8_t>&& buf)
-{}
+TlsSocketEndpoint::Impl::onTlsRxData(std::vector<uint8_t>&& buf)
+{
+    std::lock_guard<std::mutex> lk(rxMtx_);
+    rxRecords_.emplace_back(std::move(buf));
+    rxCv_.notify_all();
+}
+
+void
+TlsSocketEndpoint::Impl::onTlsRxDatagram(std::vector<uint8_t>&& buf)
+{
+    std::lock_guard<std::mutex> lk(cbMtx_);
+    if (onDatagramCb_)
+        onDatagramCb_(std::move(buf));
+}
+
+std::size_t
+TlsSocketEndpoint::Impl::readRecords(ValueType* buf, std::size_t len, std::error_code& ec)
+{
+    std::unique_lock<std::mutex> lk(rxMtx_);
+    rxCv_.wait(lk, [this] { return not rxRecords_.empty() or rxShutdown_; });
+    if (rxRecords_.empty()) {
+        ec = std::make_error_code(std::errc::broken_pipe);
+        return 0;
+    }
+    std::size_t size = 0;
+    while (size < len and not rxRecords_.empty()) {
+        const auto& record = rxRecords_.front();
+        auto n = std::min(len - size, record.size() - rxOffset_);
+        std::copy_n(record.begin() + rxOffset_, n, buf + size);
+        size += n;
+        rxOffset_ += n;
+        if (rxOffset_ == record.size()) {
+            rxRecords_.pop_front();
+            rxOffset_ = 0;
+        }
+    }
+    ec.clear();
+    return size;
+}
 
 void
 TlsSocketEndpoint::Impl::onTlsCertificatesUpdate([[maybe_unused]] const gnutls_datum_t* local_raw,
@@ -315,22 +461,25 @@ TlsSocketEndpoint::Impl::onTlsCertificatesUpdate([[maybe_unused]] const gnutls_d
                                                  [[maybe_unused]] unsigned int remote_count)
 {}
 
-TlsSocketEndpoint::TlsSocketEndpoint(std::unique_ptr<IceSocketEndpoint>&& tr,
+TlsSocketEndpoint::TlsSocketEndpoint(std::unique_ptr<SocketType>&& tr,
                                      tls::CertificateStore& certStore,
                                      const Identity& local_identity,
                                      const std::shared_future<tls::DhParams>& dh_params,
-                                     const dht::crypto::Certificate& peer_cert)
-    : pimpl_ {std::make_unique<Impl>(std::move(tr), certStore, peer_cert, local_identity, dh_params)}
+                                     const dht::crypto::Certificate& peer_cert,
+                                     std::size_t rxBufferSize)
+    : pimpl_ {std::make_unique<Impl>(
+        std::move(tr), certStore, peer_cert, local_identity, dh_params, rxBufferSize)}
 {}
 
 TlsSocketEndpoint::TlsSocketEndpoint(
-    std::unique_ptr<IceSocketEndpoint>&& tr,
+    std::unique_ptr<SocketType>&& tr,
     tls::CertificateStore& certStore,
     const Identity& local_identity,
     const std::shared_future<tls::DhParams>& dh_params,
-    std::function<bool(const dht::crypto::Certificate&)>&& cert_check)
-    : pimpl_ {
-        std::make_unique<Impl>(std::move(tr), certStore, std::move(cert_check), local_identity, dh_params)}
+    std::function<bool(const dht::crypto::Certificate&)>&& cert_check,
+    std::size_t rxBufferSize)
+    : pimpl_ {std::make_unique<Impl>(
+        std::move(tr), certStore, std::move(cert_check), local_identity, dh_params, rxBufferSize)}
 {}
 
 TlsSocketEndpoint::~TlsSocketEndpoint() {}
@@ -360,6 +509,8 @@ TlsSocketEndpoint::read(ValueType* buf, std::size_t len, std::error_code& ec)
         ec = std::make_error_code(std::errc::broken_pipe);
         return -1;
     }
+    if (!pimpl_->tls->isReliable())
+        return pimpl_->readRecords(buf, len, ec);
     return pimpl_->tls->read(buf, len, ec);
 }
 
@@ -373,6 +524,16 @@ TlsSocketEndpoint::write(const ValueType* buf, std::size_t len, std::error_code&
     return pimpl_->tls->write(buf, len, ec);
 }
 
+std::size_t
+TlsSocketEndpoint::writev(const giovec_t* iov, int iovcnt, std::error_code& ec)
+{
+    if (!pimpl_->tls) {
+        ec = std::make_error_code(std::errc::broken_pipe);
+        return -1;
+    }
+    return pimpl_->tls->writev(iov, iovcnt, ec);
+}
+
 std::shared_ptr<dht::crypto::Certificate>
 TlsSocketEndpoint::peerCertificate() const
 {
@@ -397,6 +558,13 @@ TlsSocketEndpoint::waitForData(std::chrono::milliseconds timeout, std::error_cod
         ec = std::make_error_code(std::errc::broken_pipe);
         return -1;
     }
+    if (!pimpl_->tls->isReliable()) {
+        std::unique_lock<std::mutex> lk(pimpl_->rxMtx_);
+        pimpl_->rxCv_.wait_for(lk, timeout, [&] {
+            return not pimpl_->rxRecords_.empty() or pimpl_->rxShutdown_;
+        });
+        return pimpl_->rxRecords_.empty() ? 0 : 1;
+    }
     return pimpl_->tls->waitForData(timeout, ec);
 }
 
@@ -407,6 +575,29 @@ TlsSocketEndpoint::setOnStateChange(std::function<bool(tls::TlsSessionState stat
     pimpl_->onStateChangeCb_ = std::move(cb);
 }
 
+void
+TlsSocketEndpoint::setOnDatagram(OnDatagramCb&& cb)
+{
+    std::lock_guard<std::mutex> lk(pimpl_->cbMtx_);
+    pimpl_->onDatagramCb_ = std::move(cb);
+}
+
+std::size_t
+TlsSocketEndpoint::writeDatagram(const ValueType* buf, std::size_t len, std::error_code& ec)
+{
+    if (!pimpl_->tls) {
+        ec = std::make_error_code(std::errc::broken_pipe);
+        return 0;
+    }
+    return pimpl_->tls->writeDatagram(buf, len, ec);
+}
+
+std::size_t
+TlsSocketEndpoint::maxDatagramSize() const
+{
+    return pimpl_->tls ? pimpl_->tls->maxDatagramSize() : 0;
+}
+
 void
 TlsSocketEndpoint::setOnReady(std::function<void(bool ok)>&& cb)
 {
@@ -417,12 +608,14 @@ TlsSocketEndpoint::setOnReady(std::function<void(bool ok)>&& cb)
 void
 TlsSocketEndpoint::shutdown()
 {
-    pimpl_->tls->shutdown();
-    if (pimpl_->ep_) {
-        const auto* iceSocket = reinterpret_cast<const IceSocketEndpoint*>(pimpl_->ep_);
-        if (iceSocket && iceSocket->underlyingICE())
-            iceSocket->underlyingICE()->cancelOperations();
+    {
+        std::lock_guard<std::mutex> lk(pimpl_->rxMtx_);
+        pimpl_->rxShutdown_ = true;
+        pimpl_->rxCv_.notify_all();
     }
+    pimpl_->tls->shutdown();
+    if (auto ice = pimpl_->underlyingICE())
+        ice->cancelOperations();
 }
 
 void
@@ -433,11 +626,31 @@ TlsSocketEndpoint::monitor() const
             logger->debug("\t- Ice connection: {}", ice->link());
 }
 
+std::size_t
+TlsSocketEndpoint::memoryUsage() const
+{
+    std::size_t size = pimpl_->tls ? pimpl_->tls->memoryUsage() : 0;
+    std::lock_guard<std::mutex> lk(pimpl_->rxMtx_);
+    for (const auto& record : pimpl_->rxRecords_)
+        size += record.capacity();
+    return size;
+}
+
+std::size_t
+TlsSocketEndpoint::iceMemoryUsage() const
+{
+    if (auto ice = pimpl_->underlyingICE())
+        return ice->memoryUsage();
+    return 0;
+}
+
 IpAddr
 TlsSocketEndpoint::getLocalAddress() const
 {
     if (auto ice = pimpl_->underlyingICE())
         return ice->getLocalAddress(ICE_COMP_ID_SIP_TRANSPORT);
+    if (const auto* tcpSocket = dynamic_cast<const TcpSocketEndpoint*>(pimpl_->ep_))
+        return tcpSocket->getLocalAddress();
     return {};
 }
 
@@ -446,6 +659,8 @@ TlsSocketEndpoint::getRemoteAddress() const
 {
     if (auto ice = pimpl_->underlyingICE())
         return ice->getRemoteAddress(ICE_COMP_ID_SIP_TRANSPORT);
+    if (const auto* tcpSocket = dynamic_cast<const TcpSocketEndpoint*>(pimpl_->ep_))
+        return tcpSocket->getRemoteAddress();
     return {};
 }
 
@@ -27,6 +27,8 @@
 #include "ice_transport.h"
 #include "tls_session.h"
 
+#include <asio/ip/tcp.hpp>
+
 #include <functional>
 #include <future>
 #include <limits>
@@ -50,6 +52,7 @@ class DhParams;
 
 using OnStateChangeCb = std::function<bool(tls::TlsSessionState state)>;
 using OnReadyCb = std::function<void(bool ok)>;
+using OnDatagramCb = std::function<void(std::vector<uint8_t>&&)>;
 using onShutdownCb = std::function<void(void)>;
 
 //==============================================================================
@@ -62,7 +65,11 @@ public:
     ~IceSocketEndpoint();
 
     void shutdown() override;
-    bool isReliable() const override { return ice_ ? ice_->isRunning() : false; }
+    // ICE over UDP needs a datagram mode (DTLS) on top of it
+    bool isReliable() const override
+    {
+        return ice_ ? ice_->isRunning() and ice_->isTCPEnabled() : false;
+    }
     bool isInitiator() const override { return ice_ ? ice_->isInitiator() : true; }
     int maxPayload() const override
     {
@@ -89,6 +96,37 @@ private:
 
 //==============================================================================
 
+/// Implement system socket IO over a connected TCP socket, without ICE (used on the LAN)
+class TcpSocketEndpoint : public GenericSocket<uint8_t>
+{
+public:
+    using SocketType = GenericSocket<uint8_t>;
+    TcpSocketEndpoint(asio::ip::tcp::socket&& socket, bool isInitiator);
+    ~TcpSocketEndpoint();
+
+    void shutdown() override;
+    bool isReliable() const override { return true; }
+    bool isInitiator() const override { return isInitiator_; }
+    int maxPayload() const override { return 65536; }
+    int waitForData(std::chrono::milliseconds timeout, std::error_code& ec) const override;
+    std::size_t read(ValueType* buf, std::size_t len, std::error_code& ec) override;
+    std::size_t write(const ValueType* buf, std::size_t len, std::error_code& ec) override;
+
+    void setOnRecv(RecvCb&&) override
+    {
+        throw std::logic_error("TcpSocketEndpoint::setOnRecv not implemented");
+    }
+
+    IpAddr getLocalAddress() const;
+    IpAddr getRemoteAddress() const;
+
+private:
+    mutable asio::ip::tcp::socket socket_;
+    const bool isInitiator_;
+};
+
+//==============================================================================
+
 /// Implement a TLS session IO over a system socket
 class TlsSocketEndpoint : public GenericSocket<uint8_t>
 {
@@ -97,16 +135,20 @@ public:
     using Identity = std::pair<std::shared_ptr<dht::crypto::PrivateKey>,
                                std::shared_ptr<dht::crypto::Certificate>>;
 
-    TlsSocketEndpoint(std::unique_ptr<IceSocketEndpoint>&& tr,
+    // tr is an IceSocketEndpoint or a TcpSocketEndpoint
+    // rxBufferSize: see tls::TlsParams
+    TlsSocketEndpoint(std::unique_ptr<SocketType>&& tr,
                       tls::CertificateStore& certStore,
                       const Identity& local_identity,
                       const std::shared_future<tls::DhParams>& dh_params,
-                      const dht::crypto::Certificate& peer_cert);
-    TlsSocketEndpoint(std::unique_ptr<IceSocketEndpoint>&& tr,
+                      const dht::crypto::Certificate& peer_cert,
+                      std::size_t rxBufferSize = 0);
+    TlsSocketEndpoint(std::unique_ptr<SocketType>&& tr,
                       tls::CertificateStore& certStore,
                       const Identity& local_identity,
                       const std::shared_future<tls::DhParams>& dh_params,
-                      std::function<bool(const dht::crypto::Certificate&)>&& cert_check);
+                      std::function<bool(const dht::crypto::Certificate&)>&& cert_check,
+                      std::size_t rxBufferSize = 0);
     ~TlsSocketEndpoint();
 
     bool isReliable() const override { return true; }
@@ -115,6 +157,8 @@ public:
     void shutdown() override;
     std::size_t read(ValueType* buf, std::size_t len, std::error_code& ec) override;
     std::size_t write(const ValueType* buf, std::size_t len, std::error_code& ec) override;
+    // See tls::TlsSession::writev()
+    std::size_t writev(const giovec_t* iov, int iovcnt, std::error_code& ec);
 
     std::shared_ptr<dht::crypto::Certificate> peerCertificate() const;
 
@@ -129,11 +173,22 @@ public:
     void setOnStateChange(OnStateChangeCb&& cb);
     void setOnReady(OnReadyCb&& cb);
 
+    // Datagrams of a DTLS session, see tls::TlsSession::writeDatagram()
+    // The callback is called from the TLS thread
+    void setOnDatagram(OnDatagramCb&& cb);
+    std::size_t writeDatagram(const ValueType* buf, std::size_t len, std::error_code& ec);
+    // 0 if datagrams are not supported
+    std::size_t maxDatagramSize() const;
+
     IpAddr getLocalAddress() const;
     IpAddr getRemoteAddress() const;
 
     void monitor() const;
 
+    // Bytes used by the TLS session, and by the ICE transport (0 over TCP)
+    std::size_t memoryUsage() const;
+    std::size_t iceMemoryUsage() const;
+
 private:
     class Impl;
     std::unique_ptr<Impl> pimpl_;
@@ -23,6 +23,7 @@
 #include "tls_session.h"
 #include "threadloop.h"
 #include "certstore.h"
+#include "../buffer_pool.h"
 
 #include <gnutls/gnutls.h>
 #include <gnutls/dtls.h>
@@ -43,6 +44,7 @@
 #include <stdexcept>
 #include <algorithm>
 #include <cstring> // std::memset
+#include <string_view>
 
 #include <cstdlib>
 #include <unistd.h>
@@ -74,6 +76,7 @@ static constexpr const char* TLS_FULL_PRIORITY_STRING {
     "SECURE192:-KX-ALL:+ANON-ECDH:+ANON-DH:+SECURE192:-RSA:-GROUP-FFDHE4096:-GROUP-FFDHE6144:-"
     "GROUP-FFDHE8192:+GROUP-X25519:%SERVER_PRECEDENCE:%SAFE_RENEGOTIATION"};
 static constexpr uint32_t RX_MAX_SIZE {64 * 1024}; // 64k = max size of a UDP packet
+static constexpr uint32_t RX_MIN_SIZE {16 * 1024}; // 16k = max size of a TLS record
 static constexpr std::size_t INPUT_MAX_SIZE {
     1000}; // Maximum number of packets to store before dropping (pkt size = DTLS_MTU)
 static constexpr ssize_t FLOOD_THRESHOLD {4 * 1024};
@@ -101,6 +104,16 @@ static constexpr int ASYMETRIC_TRANSPORT_MTU_OFFSET
 static constexpr auto OCSP_REQUEST_TIMEOUT = std::chrono::seconds(
     2); // Time to wait for an ocsp-request
 
+// Announced with ALPN on DTLS sessions. When both peers announce it, each application record
+// starts with its RecordType, and stream records with a 32-bit stream sequence number, so the
+// datagrams are delivered apart from the reordering of the stream.
+static constexpr std::string_view DTLS_TYPED_RECORDS_ALPN {"dhtnet-records/1"};
+enum class RecordType : uint8_t { STREAM = 0, DATAGRAM = 1 };
+static constexpr std::size_t STREAM_RECORD_HEADER {5};
+static constexpr std::size_t DATAGRAM_RECORD_HEADER {1};
+// Gathered writes up to this size are sent in one TLS record
+static constexpr std::size_t TX_CORK_MAX {8192};
+
 // Helper to cast any duration into an integer number of milliseconds
 template<class Rep, class Period>
 static std::chrono::milliseconds::rep
@@ -214,6 +227,10 @@ public:
     const TlsParams params_;
     const TlsSessionCallbacks callbacks_;
     const bool anonymous_;
+    // Size of the buffer receiving each record, never less than a full record
+    const std::size_t rxBufferSize_;
+    // Size of the receive buffer while borrowed from the pool, 0 otherwise
+    std::atomic<std::size_t> rxBufferBorrowed_ {0};
 
     TlsSessionImpl(std::unique_ptr<SocketType>&& transport,
                    const TlsParams& params,
@@ -248,7 +265,6 @@ public:
     std::list<std::vector<ValueType>> rxQueue_ {};
 
     bool flushProcessing_ {false};     ///< protect against recursive call to flushRxQueue
-    std::vector<ValueType> rawPktBuf_; ///< gnutls incoming packet buffer
     uint64_t baseSeq_ {0};   ///< sequence number of first application data packet received
     uint64_t lastRxSeq_ {0}; ///< last received and valid packet sequence number
     uint64_t gapOffset_ {0}; ///< offset of first byte not received yet
@@ -256,7 +272,15 @@ public:
     std::map<uint64_t, std::vector<ValueType>> reorderBuffer_ {};
     std::list<clock::time_point> nextFlush_ {};
 
+    // Typed DTLS records negotiated, see DTLS_TYPED_RECORDS_ALPN
+    std::atomic_bool typedRecords_ {false};
+    uint32_t txStreamSeq_ {0};        ///< protected by sessionWriteMutex_
+    std::vector<ValueType> txRecord_; ///< protected by sessionWriteMutex_
+
     std::size_t send(const ValueType*, std::size_t, std::error_code&);
+    std::size_t sendv(const giovec_t*, int, std::error_code&);
+    ssize_t sendRecord(const void*, std::size_t);
+    std::size_t sendDatagram(const ValueType*, std::size_t, std::error_code&);
     ssize_t sendRaw(const void*, size_t);
     ssize_t sendRawVec(const giovec_t*, int);
     ssize_t recvRaw(void*, size_t);
@@ -264,6 +288,8 @@ public:
 
     bool initFromRecordState(int offset = 0);
     void handleDataPacket(std::vector<ValueType>&&, uint64_t);
+    void handleTypedRecord(const ValueType*, std::size_t);
+    uint64_t extendStreamSeq(uint32_t seq) const;
     void flushRxQueue(std::unique_lock<std::mutex>&);
 
     // Statistics
@@ -337,12 +363,19 @@ TlsSession::TlsSessionImpl::TlsSessionImpl(std::unique_ptr<SocketType>&& transpo
     , params_(params)
     , callbacks_(cbs)
     , anonymous_(anonymous)
+    , rxBufferSize_(params.rxBufferSize ? std::max<std::size_t>(params.rxBufferSize, RX_MIN_SIZE)
+                                        : RX_MAX_SIZE)
     , transport_ {std::move(transport)}
     , cacred_(nullptr)
     , sacred_(nullptr)
     , xcred_(nullptr)
     , thread_(params.logger, [this] { return setup(); }, [this] { process(); }, [this] { cleanup(); })
 {
+    if (params.rxBufferSize and params.rxBufferSize < RX_MIN_SIZE and params.logger)
+        params.logger->warn("[TLS] receive buffer of {} bytes is below the size of a record, "
+                            "using {} bytes",
+                            params.rxBufferSize,
+                            rxBufferSize_);
     if (not transport_->isReliable()) {
         transport_->setOnRecv([this](const ValueType* buf, size_t len) {
             std::lock_guard<std::mutex> lk {rxMutex_};
@@ -612,6 +645,12 @@ TlsSession::TlsSessionImpl::commonSessionInit()
 
         // gnutls DTLS mtu = maximum payload size given by transport
         gnutls_dtls_set_mtu(session_, transport_->maxPayload());
+
+        gnutls_datum_t alpn {(unsigned char*) DTLS_TYPED_RECORDS_ALPN.data(),
+                             (unsigned) DTLS_TYPED_RECORDS_ALPN.size()};
+        ret = gnutls_alpn_set_protocols(session_, &alpn, 1, 0);
+        if (ret != GNUTLS_E_SUCCESS and params_.logger)
+            params_.logger->warn("[TLS] ALPN set failed: {}", gnutls_strerror(ret));
     }
 
     // Stuff for transport callbacks
@@ -856,6 +895,24 @@ TlsSession::TlsSessionImpl::peerCertificate(gnutls_session_t session) const
 
 std::size_t
 TlsSession::TlsSessionImpl::send(const ValueType* tx_data, std::size_t tx_size, std::error_code& ec)
+{
+    giovec_t iov {const_cast<ValueType*>(tx_data), tx_size};
+    return sendv(&iov, 1, ec);
+}
+
+ssize_t
+TlsSession::TlsSessionImpl::sendRecord(const void* data, std::size_t size)
+{
+    ssize_t nwritten;
+    do {
+        nwritten = gnutls_record_send(session_, data, size);
+    } while ((nwritten == GNUTLS_E_INTERRUPTED and state_ != TlsSessionState::SHUTDOWN)
+             or nwritten == GNUTLS_E_AGAIN);
+    return nwritten;
+}
+
+std::size_t
+TlsSession::TlsSessionImpl::sendv(const giovec_t* iov, int iovcnt, std::error_code& ec)
 {
     std::lock_guard<std::mutex> lk(sessionWriteMutex_);
     if (state_ != TlsSessionState::ESTABLISHED) {
@@ -863,41 +920,146 @@ TlsSession::TlsSessionImpl::send(const ValueType* tx_data, std::size_t tx_size,
         return 0;
     }
 
+    std::size_t tx_size = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        tx_size += iov[i].iov_len;
     std::size_t total_written = 0;
-    std::size_t max_tx_sz;
+    auto fail = [&](ssize_t err) {
+        /* Normally we would have to retry record_send but our internal
+         * state has not changed, so we have to ask for more data first.
+         * We will just try again later, although this should never happen.
+         */
+        if (params_.logger)
+            params_.logger->error("[TLS] send failed (only {} bytes sent): {}", total_written, gnutls_strerror(err));
+        ec = std::error_code(err, std::system_category());
+        return 0;
+    };
 
-    if (transport_->isReliable())
-        max_tx_sz = tx_size;
-    else
-        max_tx_sz = gnutls_dtls_get_data_mtu(session_);
+    if (transport_->isReliable()) {
+        // Small buffers are gathered in one record by GnuTLS, big ones are
+        // encrypted from where they are
+        bool cork = iovcnt > 1 and tx_size <= TX_CORK_MAX;
+        if (cork)
+            gnutls_record_cork(session_);
+        for (int i = 0; i < iovcnt; ++i) {
+            std::size_t off = 0;
+            while (off < iov[i].iov_len) {
+                auto nwritten = sendRecord(static_cast<const ValueType*>(iov[i].iov_base) + off,
+                                           iov[i].iov_len - off);
+                if (nwritten < 0) {
+                    if (cork)
+                        gnutls_record_uncork(session_, 0);
+                    return fail(nwritten);
+                }
+                off += nwritten;
+                if (not cork)
+                    total_written += nwritten;
+            }
+        }
+        if (cork) {
+            int ret;
+            do {
+                ret = gnutls_record_uncork(session_, GNUTLS_RECORD_WAIT);
+            } while ((ret == GNUTLS_E_INTERRUPTED and state_ != TlsSessionState::SHUTDOWN)
+                     or ret == GNUTLS_E_AGAIN);
+            if (ret < 0)
+                return fail(ret);
+            total_written = tx_size;
+        }
+        ec.clear();
+        return total_written;
+    }
 
     // Split incoming data into chunck suitable for the underlying transport
+    auto header_sz = typedRecords_ ? STREAM_RECORD_HEADER : 0;
+    std::size_t max_tx_sz = gnutls_dtls_get_data_mtu(session_) - header_sz;
+    int i = 0;
+    std::size_t off = 0;
     while (total_written < tx_size) {
+        while (off == iov[i].iov_len) {
+            ++i;
+            off = 0;
+        }
         auto chunck_sz = std::min(max_tx_sz, tx_size - total_written);
-        auto data_seq = tx_data + total_written;
-        ssize_t nwritten;
-        do {
-            nwritten = gnutls_record_send(session_, data_seq, chunck_sz);
-        } while ((nwritten == GNUTLS_E_INTERRUPTED and state_ != TlsSessionState::SHUTDOWN)
-                 or nwritten == GNUTLS_E_AGAIN);
-        if (nwritten < 0) {
-            /* Normally we would have to retry record_send but our internal
-             * state has not changed, so we have to ask for more data first.
-             * We will just try again later, although this should never happen.
-             */
-            if (params_.logger)
-                params_.logger->error("[TLS] send failed (only {} bytes sent): {}", total_written, gnutls_strerror(nwritten));
-            ec = std::error_code(nwritten, std::system_category());
-            return 0;
+        const void* record = static_cast<const ValueType*>(iov[i].iov_base) + off;
+        auto record_sz = chunck_sz;
+        if (header_sz or chunck_sz > iov[i].iov_len - off) {
+            // Gather the chunk behind the record header
+            txRecord_.resize(header_sz + chunck_sz);
+            if (typedRecords_) {
+                txRecord_[0] = static_cast<ValueType>(RecordType::STREAM);
+                for (std::size_t b = 0; b < 4; ++b)
+                    txRecord_[1 + b] = static_cast<ValueType>(txStreamSeq_ >> (24 - 8 * b));
+            }
+            for (auto copied = header_sz; copied < txRecord_.size();) {
+                while (off == iov[i].iov_len) {
+                    ++i;
+                    off = 0;
+                }
+                auto n = std::min(iov[i].iov_len - off, txRecord_.size() - copied);
+                std::copy_n(static_cast<const ValueType*>(iov[i].iov_base) + off,
+                            n,
+                            txRecord_.data() + copied);
+                off += n;
+                copied += n;
+            }
+            record = txRecord_.data();
+            record_sz = txRecord_.size();
+        } else {
+            off += chunck_sz;
         }
-
-        total_written += nwritten;
+        auto nwritten = sendRecord(record, record_sz);
+        if (nwritten < 0)
+            return fail(nwritten);
+
+        // A DTLS record is sent whole
+        if (typedRecords_)
+            ++txStreamSeq_;
+        total_written += chunck_sz;
     }
 
     ec.clear();
     return total_written;
 }
 
+std::size_t
+TlsSession::TlsSessionImpl::sendDatagram(const ValueType* tx_data,
+                                         std::size_t tx_size,
+                                         std::error_code& ec)
+{
+    std::lock_guard<std::mutex> lk(sessionWriteMutex_);
+    if (state_ != TlsSessionState::ESTABLISHED) {
+        ec = std::error_code(GNUTLS_E_INVALID_SESSION, std::system_category());
+        return 0;
+    }
+    if (not typedRecords_) {
+        ec = std::make_error_code(std::errc::operation_not_supported);
+        return 0;
+    }
+    if (DATAGRAM_RECORD_HEADER + tx_size > gnutls_dtls_get_data_mtu(session_)) {
+        ec = std::make_error_code(std::errc::message_size);
+        return 0;
+    }
+
+    txRecord_.resize(DATAGRAM_RECORD_HEADER + tx_size);
+    txRecord_[0] = static_cast<ValueType>(RecordType::DATAGRAM);
+    std::copy_n(tx_data, tx_size, txRecord_.data() + DATAGRAM_RECORD_HEADER);
+    ssize_t nwritten;
+    do {
+        nwritten = gnutls_record_send(session_, txRecord_.data(), txRecord_.size());
+    } while ((nwritten == GNUTLS_E_INTERRUPTED and state_ != TlsSessionState::SHUTDOWN)
+             or nwritten == GNUTLS_E_AGAIN);
+    if (nwritten < 0) {
+        if (params_.logger)
+            params_.logger->error("[TLS] datagram send failed: {}", gnutls_strerror(nwritten));
+        ec = std::error_code(nwritten, std::system_category());
+        return 0;
+    }
+
+    ec.clear();
+    return tx_size;
+}
+
 // Called by GNUTLS to send encrypted packet to low-level transport.
 // Should return a positive number indicating the bytes sent, and -1 on error.
 ssize_t
@@ -1281,6 +1443,16 @@ TlsSession::TlsSessionImpl::handleStateHandshake(TlsSessionState state)
         callbacks_.onCertificatesUpdate(local, remote, remote_count);
     }
 
+    if (transport_ and not transport_->isReliable()) {
+        // Older peers don't answer the ALPN extension
+        gnutls_datum_t alpn;
+        typedRecords_ = gnutls_alpn_get_selected_protocol(session_, &alpn) == GNUTLS_E_SUCCESS
+                        and std::string_view((const char*) alpn.data, alpn.size)
+                                == DTLS_TYPED_RECORDS_ALPN;
+        if (params_.logger)
+            params_.logger->debug("[TLS] typed records: {}", typedRecords_.load());
+    }
+
     return transport_ and transport_->isReliable() ? TlsSessionState::ESTABLISHED
                                                    : TlsSessionState::MTU_DISCOVERY;
 }
@@ -1438,6 +1610,40 @@ TlsSession::TlsSessionImpl::handleDataPacket(std::vector<ValueType>&& buf, uint6
     flushRxQueue(lk);
 }
 
+void
+TlsSession::TlsSessionImpl::handleTypedRecord(const ValueType* data, std::size_t size)
+{
+    auto type = static_cast<RecordType>(data[0]);
+    if (type == RecordType::DATAGRAM) {
+        // Bypass the reordering, and the wait for the lost records
+        if (callbacks_.onRxDatagram)
+            callbacks_.onRxDatagram(
+                std::vector<ValueType>(data + DATAGRAM_RECORD_HEADER, data + size));
+    } else if (type == RecordType::STREAM and size > STREAM_RECORD_HEADER) {
+        uint32_t seq = 0;
+        for (std::size_t i = 1; i < STREAM_RECORD_HEADER; ++i)
+            seq = (seq << 8) | data[i];
+        handleDataPacket(std::vector<ValueType>(data + STREAM_RECORD_HEADER, data + size),
+                         extendStreamSeq(seq));
+    } else if (params_.logger) {
+        params_.logger->warn("[TLS] drop invalid record of {:d} bytes", size);
+    }
+}
+
+// Closest 64-bit sequence number to the next expected one
+uint64_t
+TlsSession::TlsSessionImpl::extendStreamSeq(uint32_t seq) const
+{
+    constexpr uint64_t WRAP = uint64_t(1) << 32;
+    uint64_t next = lastRxSeq_ + 1;
+    uint64_t extended = (next & ~(WRAP - 1)) | seq;
+    if (extended + WRAP / 2 < next)
+        extended += WRAP;
+    else if (extended >= WRAP and extended > next + WRAP / 2)
+        extended -= WRAP;
+    return extended;
+}
+
 ///
 /// Reorder and push received packet to upper layer
 ///
@@ -1556,8 +1762,23 @@ TlsSession::TlsSessionImpl::handleStateEstablished(TlsSessionState state)
     }
 
     std::array<uint8_t, 8> seq;
-    rawPktBuf_.resize(RX_MAX_SIZE);
-    auto ret = gnutls_record_recv_seq(session_, rawPktBuf_.data(), rawPktBuf_.size(), &seq[0]);
+    // Only borrowed while receiving, the queued records are sized to their content
+    auto rawPktBuf = BufferPool::instance().get(rxBufferSize_);
+    // Counted by memoryUsage() until returned to the pool
+    class BorrowedSize
+    {
+    public:
+        BorrowedSize(std::atomic<std::size_t>& var, std::size_t size)
+            : var_ {var}
+        {
+            var_ = size;
+        }
+        ~BorrowedSize() { var_ = 0; }
+
+    private:
+        std::atomic<std::size_t>& var_;
+    } borrowed {rxBufferBorrowed_, rawPktBuf.size()};
+    auto ret = gnutls_record_recv_seq(session_, rawPktBuf.data(), rawPktBuf.size(), &seq[0]);
 
     if (ret > 0) {
         // Are we in PMTUD phase?
@@ -1569,12 +1790,20 @@ TlsSession::TlsSessionImpl::handleStateEstablished(TlsSessionState state)
             if (params_.logger)
                 params_.logger->debug("[TLS] maxPayload: {}", maxPayload_.load());
 
-            if (!initFromRecordState(-1))
+            if (typedRecords_) {
+                // Stream records are numbered from 0
+                baseSeq_ = 0;
+                gapOffset_ = baseSeq_;
+                lastRxSeq_ = baseSeq_ - 1;
+            } else if (!initFromRecordState(-1))
                 return TlsSessionState::SHUTDOWN;
         }
 
-        rawPktBuf_.resize(ret);
-        handleDataPacket(std::move(rawPktBuf_), array2uint(seq));
+        if (typedRecords_)
+            handleTypedRecord(rawPktBuf.data(), ret);
+        else
+            handleDataPacket(std::vector<ValueType>(rawPktBuf.data(), rawPktBuf.data() + ret),
+                             array2uint(seq));
         // no state change
     } else if (ret == GNUTLS_E_HEARTBEAT_PING_RECEIVED) {
         if (params_.logger)
@@ -1661,6 +1890,34 @@ TlsSession::isReliable() const
     return pimpl_->transport_->isReliable();
 }
 
+std::size_t
+TlsSession::memoryUsage() const
+{
+    std::lock_guard<std::mutex> lk(pimpl_->rxMutex_);
+    std::size_t size = 0;
+    for (const auto& packet : pimpl_->rxQueue_)
+        size += packet.capacity();
+    for (const auto& [seq, record] : pimpl_->reorderBuffer_)
+        size += record.capacity();
+    return size + pimpl_->rxBufferBorrowed_;
+}
+
+std::size_t
+TlsSession::maxDatagramSize() const
+{
+    if (not pimpl_->typedRecords_ or pimpl_->state_ != TlsSessionState::ESTABLISHED)
+        return 0;
+    std::lock_guard<std::mutex> lk(pimpl_->sessionWriteMutex_);
+    auto mtu = gnutls_dtls_get_data_mtu(pimpl_->session_);
+    return mtu > DATAGRAM_RECORD_HEADER ? mtu - DATAGRAM_RECORD_HEADER : 0;
+}
+
+std::size_t
+TlsSession::writeDatagram(const ValueType* data, std::size_t size, std::error_code& ec)
+{
+    return pimpl_->sendDatagram(data, size, ec);
+}
+
 int
 TlsSession::maxPayload() const
 {
@@ -1686,6 +1943,12 @@ TlsSession::write(const ValueType* data, std::size_t size, std::error_code& ec)
     return pimpl_->send(data, size, ec);
 }
 
+std::size_t
+TlsSession::writev(const giovec_t* iov, int iovcnt, std::error_code& ec)
+{
+    return pimpl_->sendv(iov, iovcnt, ec);
+}
+
 std::size_t
 TlsSession::read(ValueType* data, std::size_t size, std::error_code& ec)
 {
@@ -0,0 +1,96 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+#pragma once
+
+#include <opendht/logger.h>
+#include <opendht/thread_pool.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace jami {
+
+/**
+ * Runs tasks one at a time, in order, on a shared thread pool (a strand).
+ * The tasks posted while the executor is idle are drained in a single
+ * pool task, so a burst of events costs one hand-off to the pool.
+ * Unlike dht::Executor, which schedules a pool task per task.
+ * A task must not wait for a later task of the same executor.
+ * The exceptions thrown by a task are logged and don't stop the next ones.
+ */
+class SerialExecutor : public std::enable_shared_from_this<SerialExecutor>
+{
+public:
+    SerialExecutor(std::shared_ptr<dht::log::Logger> logger = {},
+                   dht::ThreadPool& pool = dht::ThreadPool::io())
+        : pool_(pool)
+        , logger_(std::move(logger))
+    {}
+
+    void run(std::function<void()>&& task)
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        tasks_.emplace_back(std::move(task));
+        if (scheduled_)
+            return;
+        scheduled_ = true;
+        // Keep the executor alive until the tasks are done
+        pool_.get().run([sthis = shared_from_this()] { sthis->drain(); });
+    }
+
+private:
+    SerialExecutor(const SerialExecutor&) = delete;
+    SerialExecutor& operator=(const SerialExecutor&) = delete;
+
+    void drain()
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        while (not tasks_.empty()) {
+            // Swap the buffers, so their capacity is reused by the next batches
+            std::swap(tasks_, running_);
+            lk.unlock();
+            for (auto& task : running_) {
+                // Don't leave the executor scheduled forever
+                try {
+                    task();
+                } catch (const std::exception& e) {
+                    if (logger_)
+                        logger_->error("Serial executor task failed: {}", e.what());
+                } catch (...) {
+                    if (logger_)
+                        logger_->error("Serial executor task failed with an unknown exception");
+                }
+            }
+            running_.clear();
+            lk.lock();
+        }
+        scheduled_ = false;
+    }
+
+    std::reference_wrapper<dht::ThreadPool> pool_;
+    std::shared_ptr<dht::log::Logger> logger_;
+    std::mutex mutex_ {};
+    std::vector<std::function<void()>> tasks_ {};
+    // Only accessed while draining
+    std::vector<std::function<void()>> running_ {};
+    bool scheduled_ {false};
+};
+
+} // namespace jami
@@ -0,0 +1,107 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+#include "stream_compressor.h"
+
+#include <zstd.h>
+
+#include <algorithm>
+#include <new>
+
+namespace jami {
+
+StreamCompressor::StreamCompressor(int level)
+    : ctx_(ZSTD_createCCtx())
+{
+    if (!ctx_)
+        throw std::bad_alloc();
+    ZSTD_CCtx_setParameter(ctx_, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(ctx_, ZSTD_c_windowLog, COMPRESSION_WINDOW_LOG);
+}
+
+StreamCompressor::~StreamCompressor()
+{
+    ZSTD_freeCCtx(ctx_);
+}
+
+bool
+StreamCompressor::compress(const uint8_t* data, std::size_t len, std::vector<uint8_t>& out)
+{
+    ZSTD_inBuffer input {data, len, 0};
+    auto offset = out.size();
+    out.resize(offset + ZSTD_compressBound(len));
+    ZSTD_outBuffer output {out.data() + offset, out.size() - offset, 0};
+    std::size_t remaining;
+    do {
+        if (output.pos == output.size) {
+            out.resize(out.size() + ZSTD_CStreamOutSize());
+            output.dst = out.data() + offset;
+            output.size = out.size() - offset;
+        }
+        remaining = ZSTD_compressStream2(ctx_, &output, &input, ZSTD_e_flush);
+        if (ZSTD_isError(remaining)) {
+            out.resize(offset);
+            return false;
+        }
+    } while (remaining);
+    out.resize(offset + output.pos);
+    return true;
+}
+
+std::size_t
+StreamCompressor::memoryUsage() const
+{
+    return ZSTD_sizeof_CCtx(ctx_);
+}
+
+StreamDecompressor::StreamDecompressor()
+    : ctx_(ZSTD_createDCtx())
+{
+    if (!ctx_)
+        throw std::bad_alloc();
+    ZSTD_DCtx_setParameter(ctx_, ZSTD_d_windowLogMax, COMPRESSION_WINDOW_LOG);
+}
+
+StreamDecompressor::~StreamDecompressor()
+{
+    ZSTD_freeDCtx(ctx_);
+}
+
+bool
+StreamDecompressor::decompress(const uint8_t* data, std::size_t len, uint8_t* out, std::size_t& size)
+{
+    ZSTD_inBuffer input {data, len, 0};
+    // Never more than a chunk: a small frame can't expand to gigabytes
+    ZSTD_outBuffer output {out, std::min(size, COMPRESSION_CHUNK_MAX + 1), 0};
+    // Flushed by the peer: everything comes out once the input is consumed
+    // and the output is not full
+    do {
+        auto res = ZSTD_decompressStream(ctx_, &output, &input);
+        if (ZSTD_isError(res) || output.pos == output.size)
+            return false;
+    } while (input.pos < input.size);
+    size = output.pos;
+    return true;
+}
+
+std::size_t
+StreamDecompressor::memoryUsage() const
+{
+    return ZSTD_sizeof_DCtx(ctx_);
+}
+
+} // namespace jami
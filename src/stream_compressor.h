@@ -0,0 +1,84 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+
+namespace jami {
+
+/**
+ * Window of the contexts, the peer must not need a bigger one.
+ * Bounds the memory of a compressed channel to about 1 MiB per direction.
+ */
+static constexpr int COMPRESSION_WINDOW_LOG {17};
+// Largest input of a compress() call, its output fits in a frame
+static constexpr std::size_t COMPRESSION_CHUNK_MAX {32 * 1024};
+
+/**
+ * zstd stream compression of one direction of a channel.
+ * The context slides over everything compressed so far, and each call is
+ * flushed, so the peer can decompress it without waiting for more data.
+ * Only built with HAVE_LIBZSTD.
+ */
+class StreamCompressor
+{
+public:
+    explicit StreamCompressor(int level = 1);
+    ~StreamCompressor();
+    StreamCompressor(const StreamCompressor&) = delete;
+    StreamCompressor& operator=(const StreamCompressor&) = delete;
+
+    /**
+     * Compress and flush len bytes (<= COMPRESSION_CHUNK_MAX), appended to out
+     * @return false on error, the stream can't be used anymore
+     */
+    bool compress(const uint8_t* data, std::size_t len, std::vector<uint8_t>& out);
+    std::size_t memoryUsage() const;
+
+private:
+    ZSTD_CCtx_s* ctx_;
+};
+
+class StreamDecompressor
+{
+public:
+    StreamDecompressor();
+    ~StreamDecompressor();
+    StreamDecompressor(const StreamDecompressor&) = delete;
+    StreamDecompressor& operator=(const StreamDecompressor&) = delete;
+
+    /**
+     * Decompress the output of one compress() call of the peer
+     * @param out   room for more than COMPRESSION_CHUNK_MAX bytes
+     * @param size  room of out, then size of the data
+     * @return false if the data is corrupted or bigger than what the peer
+     * compresses at once, the stream can't be used anymore
+     */
+    bool decompress(const uint8_t* data, std::size_t len, uint8_t* out, std::size_t& size);
+    std::size_t memoryUsage() const;
+
+private:
+    ZSTD_DCtx_s* ctx_;
+};
+
+} // namespace jami
@@ -86,6 +86,13 @@ public:
         return size;
     }
 
+    // Bytes received and not read yet
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lk {mutex_};
+        return stream_.size();
+    }
+
     void stop() noexcept
     {
         std::lock_guard<std::mutex> lk {mutex_};
@@ -100,7 +107,7 @@ private:
     PeerChannel& operator=(const PeerChannel& o) = delete;
     PeerChannel& operator=(PeerChannel&& o) = delete;
 
-    std::mutex mutex_ {};
+    mutable std::mutex mutex_ {};
     std::condition_variable cv_ {};
     std::deque<char> stream_;
     bool stop_ {false};
@@ -0,0 +1,86 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#include "mapping_pool.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace jami {
+namespace upnp {
+
+// Weight of the last window in the smoothed rate.
+constexpr static double MAPPING_POOL_RATE_WEIGHT {0.3};
+
+MappingPoolSizer::MappingPoolSizer(unsigned minSize, unsigned maxSize, clock::duration window)
+    : window_(window)
+    , windowStart_(clock::now())
+{
+    setBounds(minSize, maxSize);
+}
+
+void
+MappingPoolSizer::setBounds(unsigned minSize, unsigned maxSize)
+{
+    minSize_ = minSize;
+    maxSize_ = std::max(minSize, maxSize);
+}
+
+void
+MappingPoolSizer::onReservation(bool hit, clock::time_point now)
+{
+    update(now);
+    reservations_++;
+    if (not hit)
+        misses_++;
+}
+
+unsigned
+MappingPoolSizer::target(clock::time_point now)
+{
+    update(now);
+    // Misses mean the pool was too small for the current burst.
+    auto demand = std::max(rate_, (double) reservations_) + misses_;
+    return std::clamp((unsigned) std::ceil(demand), minSize_, maxSize_);
+}
+
+unsigned
+MappingPoolSizer::highWatermark(clock::time_point now)
+{
+    // Keep some margin so the pool does not oscillate.
+    return std::clamp(target(now) * 2, minSize_, maxSize_);
+}
+
+void
+MappingPoolSizer::update(clock::time_point now)
+{
+    if (now < windowStart_ + window_)
+        return;
+
+    auto elapsed = (unsigned) ((now - windowStart_) / window_);
+    rate_ = MAPPING_POOL_RATE_WEIGHT * reservations_ + (1 - MAPPING_POOL_RATE_WEIGHT) * rate_;
+    // The windows without any reservation.
+    if (elapsed > 1)
+        rate_ *= std::pow(1 - MAPPING_POOL_RATE_WEIGHT, elapsed - 1);
+    reservations_ = 0;
+    misses_ = 0;
+    windowStart_ += elapsed * window_;
+}
+
+} // namespace upnp
+} // namespace jami
@@ -0,0 +1,97 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace jami {
+namespace upnp {
+
+// Default bounds of the pool of mappings opened in advance (per port type).
+constexpr static unsigned MAPPING_POOL_MIN_SIZE {4};
+constexpr static unsigned MAPPING_POOL_MAX_SIZE {32};
+// Period used to measure the reservation rate.
+constexpr static auto MAPPING_POOL_WINDOW {std::chrono::seconds(30)};
+
+// Statistics of the mapping reservations.
+struct MappingPoolStats
+{
+    uint64_t reservations {0};
+    // Reservations served with an open mapping.
+    uint64_t hits {0};
+    // Mean time before a reserved mapping is open (0 for hits).
+    std::chrono::milliseconds meanWait {0};
+    // Failed mapping requests and IGDs invalidated after an error.
+    uint64_t igdErrors {0};
+    // Current target size of the pool (TCP, UDP).
+    unsigned targetSize[2] {0, 0};
+
+    double hitRate() const { return reservations ? (double) hits / reservations : 0.; }
+};
+
+/**
+ * Compute the number of mappings to keep open in advance for a port
+ * type, from the reservations observed so far.
+ *
+ * The reservation rate is smoothed over the measurement windows, and the
+ * target grows right away during a burst (reservations of the current
+ * window and pool misses). It then slowly decays to the lower bound when
+ * the demand drops.
+ *
+ * Not thread-safe.
+ */
+class MappingPoolSizer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    MappingPoolSizer(unsigned minSize = MAPPING_POOL_MIN_SIZE,
+                     unsigned maxSize = MAPPING_POOL_MAX_SIZE,
+                     clock::duration window = MAPPING_POOL_WINDOW);
+
+    // Set the bounds of the pool. The max is raised to the min if lower.
+    void setBounds(unsigned minSize, unsigned maxSize);
+    unsigned minSize() const { return minSize_; }
+    unsigned maxSize() const { return maxSize_; }
+
+    // Record a reservation. A hit means an open mapping was available.
+    void onReservation(bool hit, clock::time_point now = clock::now());
+
+    // Number of mappings to keep ready for reservation.
+    unsigned target(clock::time_point now = clock::now());
+    // Ready mappings beyond this number are closed.
+    unsigned highWatermark(clock::time_point now = clock::now());
+
+private:
+    // Close the elapsed windows.
+    void update(clock::time_point now);
+
+    unsigned minSize_;
+    unsigned maxSize_;
+    const clock::duration window_;
+    clock::time_point windowStart_;
+    // Counters of the current window.
+    unsigned reservations_ {0};
+    unsigned misses_ {0};
+    // Smoothed number of reservations per window.
+    double rate_ {0};
+};
+
+} // namespace upnp
+} // namespace jami
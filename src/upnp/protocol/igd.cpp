@@ -21,7 +21,6 @@
  */
 
 #include "igd.h"
-#include "logger.h"
 
 namespace jami {
 namespace upnp {
@@ -44,8 +43,6 @@ IGD::setValid(bool valid)
     if (valid) {
         // Reset errors counter.
         errorsCounter_ = 0;
-    } else {
-        JAMI_WARN("IGD %s [%s] was disabled", toString().c_str(), getProtocolName());
     }
 }
 
@@ -56,9 +53,7 @@ IGD::incrementErrorsCounter()
         return false;
 
     if (++errorsCounter_ >= MAX_ERRORS_COUNT) {
-        JAMI_WARN("IGD %s [%s] has too many errors, it will be disabled",
-                  toString().c_str(),
-                  getProtocolName());
+        // Too many errors, the IGD will be disabled.
         setValid(false);
         return false;
     }
@@ -21,6 +21,7 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
 
 #include "ip_utils.h"
 #include "mapping.h"
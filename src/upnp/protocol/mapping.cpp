@@ -21,7 +21,6 @@
  */
 
 #include "mapping.h"
-#include "logger.h"
 
 namespace jami {
 namespace upnp {
@@ -36,9 +35,7 @@ Mapping::Mapping(PortType type, uint16_t portExternal, uint16_t portInternal, bo
     , state_(MappingState::PENDING)
     , notifyCb_(nullptr)
     , autoUpdate_(false)
-#if HAVE_LIBNATPMP
     , renewalTime_(sys_clock::now())
-#endif
 {}
 
 Mapping::Mapping(const Mapping& other)
@@ -54,9 +51,7 @@ Mapping::Mapping(const Mapping& other)
     state_ = other.state_;
     notifyCb_ = other.notifyCb_;
     autoUpdate_ = other.autoUpdate_;
-#if HAVE_LIBNATPMP
     renewalTime_ = other.renewalTime_;
-#endif
 }
 
 void
@@ -68,10 +63,9 @@ Mapping::updateFrom(const Mapping::sharedPtr_t& other)
 void
 Mapping::updateFrom(const Mapping& other)
 {
-    if (type_ != other.type_) {
-        JAMI_ERR("The source and destination types must match");
+    // The source and destination types must match
+    if (type_ != other.type_)
         return;
-    }
 
     internalAddr_ = std::move(other.internalAddr_);
     internalPort_ = other.internalPort_;
@@ -83,11 +77,6 @@ Mapping::updateFrom(const Mapping& other)
 void
 Mapping::setAvailable(bool val)
 {
-    JAMI_DBG("Changing mapping %s state from %s to %s",
-             toString().c_str(),
-             available_ ? "AVAILABLE" : "UNAVAILABLE",
-             val ? "AVAILABLE" : "UNAVAILABLE");
-
     std::lock_guard<std::mutex> lock(mutex_);
     available_ = val;
 }
@@ -327,7 +316,6 @@ Mapping::getAutoUpdate() const
     return autoUpdate_;
 }
 
-#if HAVE_LIBNATPMP
 sys_clock::time_point
 Mapping::getRenewalTime() const
 {
@@ -341,7 +329,6 @@ Mapping::setRenewalTime(sys_clock::time_point time)
     std::lock_guard<std::mutex> lock(mutex_);
     renewalTime_ = time;
 }
-#endif
 
 } // namespace upnp
 } // namespace jami
@@ -104,9 +104,7 @@ public:
     bool getAutoUpdate() const;
     key_t getMapKey() const;
     static PortType getTypeFromMapKey(key_t key);
-#if HAVE_LIBNATPMP
     sys_clock::time_point getRenewalTime() const;
-#endif
 
 private:
     NotifyCallback getNotifyCallback() const;
@@ -118,9 +116,7 @@ private:
     void setAvailable(bool val);
     void setState(const MappingState& state);
     void updateDescription();
-#if HAVE_LIBNATPMP
     void setRenewalTime(sys_clock::time_point time);
-#endif
 
     mutable std::mutex mutex_;
     PortType type_ {PortType::UDP};
@@ -137,9 +133,7 @@ private:
     // If true, a new mapping will be requested on behave of the mapping
     // owner when the mapping state changes from "OPEN" to "FAILED".
     bool autoUpdate_;
-#if HAVE_LIBNATPMP
     sys_clock::time_point renewalTime_;
-#endif
 };
 
 } // namespace upnp
@@ -26,18 +26,39 @@
 namespace jami {
 namespace upnp {
 
-NatPmp::NatPmp()
+NatPmp::NatPmp(const std::shared_ptr<asio::io_context>& ctx,
+               const std::shared_ptr<dht::log::Logger>& logger)
+    : UPnPProtocol(ctx, logger)
+    , igd_(std::make_shared<PMPIGD>())
+    , ioContext_(std::make_shared<asio::io_context>())
+    , searchForIgdTimer_(*ioContext_)
 {
-    JAMI_DBG("NAT-PMP: Instance [%p] created", this);
-    runOnNatPmpQueue([this] {
-        threadId_ = getCurrentThread();
-        igd_ = std::make_shared<PMPIGD>();
+    ioContextRunner_ = std::thread([ioContext = ioContext_] {
+        auto work = asio::make_work_guard(*ioContext);
+        ioContext->run();
     });
+    if (logger_)
+        logger_->debug("NAT-PMP: Instance [{}] created", fmt::ptr(this));
 }
 
 NatPmp::~NatPmp()
 {
-    JAMI_DBG("NAT-PMP: Instance [%p] destroyed", this);
+    stopNatPmpQueue();
+    if (logger_)
+        logger_->debug("NAT-PMP: Instance [{}] destroyed", fmt::ptr(this));
+}
+
+void
+NatPmp::stopNatPmpQueue()
+{
+    ioContext_->stop();
+    if (ioContextRunner_.joinable()) {
+        // The last reference may be released by a task running on the queue.
+        if (ioContextRunner_.get_id() == std::this_thread::get_id())
+            ioContextRunner_.detach();
+        else
+            ioContextRunner_.join();
+    }
 }
 
 void
@@ -61,7 +82,8 @@ NatPmp::initNatPmp()
 
     // Local address must be valid.
     if (not getHostAddress() or getHostAddress().isLoopback()) {
-        JAMI_WARN("NAT-PMP: Does not have a valid local address!");
+        if (logger_)
+            logger_->warn("NAT-PMP: Does not have a valid local address!");
         return;
     }
 
@@ -75,35 +97,52 @@ NatPmp::initNatPmp()
     igd_->setPublicIp(IpAddr());
     igd_->setUID("");
 
-    JAMI_DBG("NAT-PMP: Trying to initialize IGD");
+    if (logger_)
+        logger_->debug("NAT-PMP: Trying to initialize IGD");
 
-    int err = initnatpmp(&natpmpHdl_, 0, 0);
+    // libnatpmp is only used to find the gateway, the requests
+    // are sent by the (asynchronous) NAT-PMP client.
+    natpmp_t natpmpHdl;
+    int err = initnatpmp(&natpmpHdl, 0, 0);
 
     if (err < 0) {
-        JAMI_WARN("NAT-PMP: Initializing IGD using default gateway failed!");
+        if (logger_)
+            logger_->warn("NAT-PMP: Initializing IGD using default gateway failed!");
         const auto& localGw = ip_utils::getLocalGateway();
         if (not localGw) {
-            JAMI_WARN("NAT-PMP: Couldn't find valid gateway on local host");
+            if (logger_)
+                logger_->warn("NAT-PMP: Couldn't find valid gateway on local host");
             err = NATPMP_ERR_CANNOTGETGATEWAY;
         } else {
-            JAMI_WARN("NAT-PMP: Trying to initialize using detected gateway %s",
-                      localGw.toString().c_str());
+            if (logger_)
+                logger_->warn("NAT-PMP: Trying to initialize using detected gateway {}",
+                              localGw.toString());
 
             struct in_addr inaddr;
             inet_pton(AF_INET, localGw.toString().c_str(), &inaddr);
-            err = initnatpmp(&natpmpHdl_, 1, inaddr.s_addr);
+            err = initnatpmp(&natpmpHdl, 1, inaddr.s_addr);
         }
     }
 
     if (err < 0) {
-        JAMI_ERR("NAT-PMP: Can't initialize libnatpmp -> %s", getNatPmpErrorStr(err));
+        if (logger_)
+            logger_->error("NAT-PMP: Can't initialize libnatpmp -> {}", getNatPmpErrorStr(err));
         return;
     }
 
     char addrbuf[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &natpmpHdl_.gateway, addrbuf, sizeof(addrbuf));
+    inet_ntop(AF_INET, &natpmpHdl.gateway, addrbuf, sizeof(addrbuf));
+    closenatpmp(&natpmpHdl);
     IpAddr igdAddr(addrbuf);
-    JAMI_DBG("NAT-PMP: Initialized on gateway %s", igdAddr.toString().c_str());
+    if (logger_)
+        logger_->debug("NAT-PMP: Initialized on gateway {}", igdAddr.toString());
+
+    if (pmpClient_)
+        pmpClient_->cancel();
+    pmpClient_ = std::make_shared<PmpClient>(
+        *ioContext_,
+        asio::ip::udp::endpoint(asio::ip::make_address_v4(addrbuf), NATPMP_SERVER_PORT),
+        logger_);
 
     // Set the local (gateway) address.
     igd_->setLocalIp(igdAddr);
@@ -111,14 +150,9 @@ NatPmp::initNatPmp()
     // one debugging purposes.
     igd_->setUID("NAT-PMP Gateway");
 
-    // Search and set the public address.
+    // Search and set the public address. The IGD will be
+    // reported when the gateway responds.
     getIgdPublicAddress();
-
-    // Update and notify.
-    if (igd_->isValid()) {
-        initialized_ = true;
-        processIgdUpdate(UpnpIgdEvent::ADDED);
-    };
 }
 
 void
@@ -133,7 +167,8 @@ NatPmp::setObserver(UpnpMappingObserver* obs)
         return;
     }
 
-    JAMI_DBG("NAT-PMP: Setting observer to %p", obs);
+    if (logger_)
+        logger_->debug("NAT-PMP: Setting observer to {}", fmt::ptr(obs));
 
     observer_ = obs;
 }
@@ -144,6 +179,11 @@ NatPmp::terminate(std::condition_variable& cv)
     initialized_ = false;
     observer_ = nullptr;
 
+    if (pmpClient_) {
+        pmpClient_->cancel();
+        pmpClient_.reset();
+    }
+
     {
         std::lock_guard<std::mutex> lock(natpmpMutex_);
         shutdownComplete_ = true;
@@ -164,10 +204,15 @@ NatPmp::terminate()
     });
 
     if (cv.wait_for(lk, std::chrono::seconds(10), [this] { return shutdownComplete_; })) {
-        JAMI_DBG("NAT-PMP: Shutdown completed");
+        if (logger_)
+            logger_->debug("NAT-PMP: Shutdown completed");
     } else {
-        JAMI_ERR("NAT-PMP: Shutdown timed-out");
+        if (logger_)
+            logger_->error("NAT-PMP: Shutdown timed-out");
     }
+    lk.unlock();
+
+    stopNatPmpQueue();
 }
 
 const IpAddr
@@ -189,24 +234,18 @@ NatPmp::clearIgds()
         return;
     }
 
-    bool do_close = false;
-
     if (igd_) {
-        if (igd_->isValid()) {
-            do_close = true;
-        }
         igd_->setValid(false);
     }
 
     initialized_ = false;
-    if (searchForIgdTimer_)
-        searchForIgdTimer_->cancel();
+    searchForIgdTimer_.cancel();
 
     igdSearchCounter_ = 0;
 
-    if (do_close) {
-        closenatpmp(&natpmpHdl_);
-        memset(&natpmpHdl_, 0, sizeof(natpmpHdl_));
+    if (pmpClient_) {
+        pmpClient_->cancel();
+        pmpClient_.reset();
     }
 }
 
@@ -229,18 +268,21 @@ NatPmp::searchForIgd()
     // Schedule a retry in case init failed.
     if (not initialized_) {
         if (igdSearchCounter_++ < MAX_RESTART_SEARCH_RETRIES) {
-            JAMI_DBG("NAT-PMP: Start search for IGDs. Attempt %i", igdSearchCounter_);
+            if (logger_)
+                logger_->debug("NAT-PMP: Start search for IGDs. Attempt {}", igdSearchCounter_);
 
             // Cancel the current timer (if any) and re-schedule.
-            if (searchForIgdTimer_)
-                searchForIgdTimer_->cancel();
-
-            searchForIgdTimer_ = getNatpmpScheduler()->scheduleIn([this] { searchForIgd(); },
-                                                                  NATPMP_SEARCH_RETRY_UNIT
-                                                                      * igdSearchCounter_);
+            searchForIgdTimer_.expires_after(NATPMP_SEARCH_RETRY_UNIT * igdSearchCounter_);
+            searchForIgdTimer_.async_wait([w = weak()](const asio::error_code& ec) {
+                if (ec == asio::error::operation_aborted)
+                    return;
+                if (auto pmpThis = w.lock())
+                    pmpThis->searchForIgd();
+            });
         } else {
-            JAMI_WARN("NAT-PMP: Setup failed after %u trials. NAT-PMP will be disabled!",
-                      MAX_RESTART_SEARCH_RETRIES);
+            if (logger_)
+                logger_->warn("NAT-PMP: Setup failed after {} trials. NAT-PMP will be disabled!",
+                              MAX_RESTART_SEARCH_RETRIES);
         }
     }
 }
@@ -259,7 +301,8 @@ bool
 NatPmp::isReady() const
 {
     if (observer_ == nullptr) {
-        JAMI_ERR("NAT-PMP: the observer is not set!");
+        if (logger_)
+            logger_->error("NAT-PMP: the observer is not set!");
         return false;
     }
 
@@ -286,7 +329,8 @@ NatPmp::incrementErrorsCounter(const std::shared_ptr<IGD>& igdIn)
         // Disable this IGD.
         igd_->setValid(false);
         // Notify the listener.
-        JAMI_WARN("NAT-PMP: No more valid IGD!");
+        if (logger_)
+            logger_->warn("NAT-PMP: No more valid IGD!");
 
         processIgdUpdate(UpnpIgdEvent::INVALID_STATE);
     }
@@ -305,29 +349,35 @@ NatPmp::requestMappingAdd(const Mapping& mapping)
         return;
     }
 
-    Mapping map(mapping);
-    assert(map.getIgd());
-    auto err = addPortMapping(map);
-    if (err < 0) {
-        JAMI_WARN("NAT-PMP: Request for mapping %s on %s failed with error %i: %s",
-                  map.toString().c_str(),
-                  igd_->toString().c_str(),
-                  err,
-                  getNatPmpErrorStr(err));
-
-        if (isErrorFatal(err)) {
-            // Fatal error, increment the counter.
-            incrementErrorsCounter(igd_);
+    assert(mapping.getIgd());
+    addPortMapping(mapping, [w = weak()](int err, Mapping& map) {
+        auto pmpThis = w.lock();
+        if (not pmpThis)
+            return;
+        auto const& logger = pmpThis->logger_;
+        if (err < 0) {
+            if (logger)
+                logger->warn("NAT-PMP: Request for mapping {} on {} failed with error {}: {}",
+                             map.toString(),
+                             pmpThis->igd_->toString(),
+                             err,
+                             pmpThis->getNatPmpErrorStr(err));
+
+            if (pmpThis->isErrorFatal(err)) {
+                // Fatal error, increment the counter.
+                pmpThis->incrementErrorsCounter(pmpThis->igd_);
+            }
+            // Notify the listener.
+            pmpThis->processMappingRequestFailed(std::move(map));
+        } else {
+            if (logger)
+                logger->debug("NAT-PMP: Request for mapping {} on {} succeeded",
+                              map.toString(),
+                              pmpThis->igd_->toString());
+            // Notify the listener.
+            pmpThis->processMappingAdded(std::move(map));
         }
-        // Notify the listener.
-        processMappingRequestFailed(std::move(map));
-    } else {
-        JAMI_DBG("NAT-PMP: Request for mapping %s on %s succeeded",
-                 map.toString().c_str(),
-                 igd_->toString().c_str());
-        // Notify the listener.
-        processMappingAdded(std::move(map));
-    }
+    });
 }
 
 void
@@ -343,141 +393,99 @@ NatPmp::requestMappingRenew(const Mapping& mapping)
         return;
     }
 
-    Mapping map(mapping);
-    auto err = addPortMapping(map);
-    if (err < 0) {
-        JAMI_WARN("NAT-PMP: Renewal request for mapping %s on %s failed with error %i: %s",
-                  map.toString().c_str(),
-                  igd_->toString().c_str(),
-                  err,
-                  getNatPmpErrorStr(err));
-        // Notify the listener.
-        processMappingRequestFailed(std::move(map));
-
-        if (isErrorFatal(err)) {
-            // Fatal error, increment the counter.
-            incrementErrorsCounter(igd_);
+    addPortMapping(mapping, [w = weak()](int err, Mapping& map) {
+        auto pmpThis = w.lock();
+        if (not pmpThis)
+            return;
+        auto const& logger = pmpThis->logger_;
+        if (err < 0) {
+            if (logger)
+                logger->warn(
+                    "NAT-PMP: Renewal request for mapping {} on {} failed with error {}: {}",
+                    map.toString(),
+                    pmpThis->igd_->toString(),
+                    err,
+                    pmpThis->getNatPmpErrorStr(err));
+            // Notify the listener.
+            pmpThis->processMappingRequestFailed(std::move(map));
+
+            if (pmpThis->isErrorFatal(err)) {
+                // Fatal error, increment the counter.
+                pmpThis->incrementErrorsCounter(pmpThis->igd_);
+            }
+        } else {
+            if (logger)
+                logger->debug("NAT-PMP: Renewal request for mapping {} on {} succeeded",
+                              map.toString(),
+                              pmpThis->igd_->toString());
+            // Notify the listener.
+            pmpThis->processMappingRenewed(map);
         }
-    } else {
-        JAMI_DBG("NAT-PMP: Renewal request for mapping %s on %s succeeded",
-                 map.toString().c_str(),
-                 igd_->toString().c_str());
-        // Notify the listener.
-        processMappingRenewed(map);
-    }
+    });
 }
 
 int
-NatPmp::readResponse(natpmp_t& handle, natpmpresp_t& response)
+NatPmp::toNatPmpError(const asio::error_code& ec, const PmpResponse& response)
 {
-    int err = 0;
-    unsigned readRetriesCounter = 0;
-
-    while (true) {
-        if (readRetriesCounter++ > MAX_READ_RETRIES) {
-            err = NATPMP_ERR_SOCKETERROR;
-            break;
-        }
-
-        fd_set fds;
-        struct timeval timeout;
-        FD_ZERO(&fds);
-        FD_SET(handle.s, &fds);
-        getnatpmprequesttimeout(&handle, &timeout);
-        // Wait for data.
-        if (select(FD_SETSIZE, &fds, NULL, NULL, &timeout) == -1) {
-            err = NATPMP_ERR_SOCKETERROR;
-            break;
-        }
-
-        // Read the data.
-        err = readnatpmpresponseorretry(&handle, &response);
-
-        if (err == NATPMP_TRYAGAIN) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(TIMEOUT_BEFORE_READ_RETRY));
-        } else {
-            break;
-        }
+    if (ec == asio::error::timed_out or ec == asio::error::connection_refused)
+        return NATPMP_ERR_NOGATEWAYSUPPORT;
+    if (ec)
+        return NATPMP_ERR_SOCKETERROR;
+
+    switch (response.resultCode) {
+    case PmpResultCode::SUCCESS:
+        return 0;
+    case PmpResultCode::UNSUPPORTED_VERSION:
+        return NATPMP_ERR_UNSUPPORTEDVERSION;
+    case PmpResultCode::NOT_AUTHORIZED:
+        return NATPMP_ERR_NOTAUTHORIZED;
+    case PmpResultCode::NETWORK_FAILURE:
+        return NATPMP_ERR_NETWORKFAILURE;
+    case PmpResultCode::OUT_OF_RESOURCES:
+        return NATPMP_ERR_OUTOFRESOURCES;
+    case PmpResultCode::UNSUPPORTED_OPCODE:
+        return NATPMP_ERR_UNSUPPORTEDOPCODE;
+    default:
+        return NATPMP_ERR_UNDEFINEDERROR;
     }
-
-    return err;
 }
 
-int
-NatPmp::sendMappingRequest(const Mapping& mapping, uint32_t& lifetime)
+void
+NatPmp::addPortMapping(const Mapping& mapping, MappingRequestCb&& cb)
 {
     CHECK_VALID_THREAD();
 
-    int err = sendnewportmappingrequest(&natpmpHdl_,
-                                        mapping.getType() == PortType::UDP ? NATPMP_PROTOCOL_UDP
-                                                                           : NATPMP_PROTOCOL_TCP,
-                                        mapping.getInternalPort(),
-                                        mapping.getExternalPort(),
-                                        lifetime);
-
-    if (err < 0) {
-        JAMI_ERR("NAT-PMP: Send mapping request failed with error %s %i",
-                 getNatPmpErrorStr(err),
-                 errno);
-        return err;
-    }
-
-    unsigned readRetriesCounter = 0;
-
-    while (readRetriesCounter++ < MAX_READ_RETRIES) {
-        // Read the response
-        natpmpresp_t response;
-        err = readResponse(natpmpHdl_, response);
-
-        if (err < 0) {
-            JAMI_WARN("NAT-PMP: Read response on IGD %s failed with error %s",
-                      igd_->toString().c_str(),
-                      getNatPmpErrorStr(err));
-        } else if (response.type != NATPMP_RESPTYPE_TCPPORTMAPPING
-                   and response.type != NATPMP_RESPTYPE_UDPPORTMAPPING) {
-            JAMI_ERR("NAT-PMP: Unexpected response type (%i) for mapping %s from IGD %s.",
-                     response.type,
-                     mapping.toString().c_str(),
-                     igd_->toString().c_str());
-            // Try to read again.
-            continue;
-        }
-
-        lifetime = response.pnu.newportmapping.lifetime;
-        // Done.
-        break;
-    }
-
-    return err;
-}
-
-int
-NatPmp::addPortMapping(Mapping& mapping)
-{
-    auto const& igdIn = mapping.getIgd();
+    Mapping map(mapping);
+    auto const& igdIn = map.getIgd();
     assert(igdIn);
     assert(igdIn->getProtocol() == NatProtocolType::NAT_PMP);
 
-    if (not igdIn->isValid() or not validIgdInstance(igdIn)) {
-        mapping.setState(MappingState::FAILED);
-        return NATPMP_ERR_INVALIDARGS;
-    }
-
-    mapping.setInternalAddress(getHostAddress().toString());
-
-    uint32_t lifetime = MAPPING_ALLOCATION_LIFETIME;
-    int err = sendMappingRequest(mapping, lifetime);
-
-    if (err < 0) {
-        mapping.setState(MappingState::FAILED);
-        return err;
+    if (not igdIn->isValid() or not validIgdInstance(igdIn) or not pmpClient_) {
+        map.setState(MappingState::FAILED);
+        cb(NATPMP_ERR_INVALIDARGS, map);
+        return;
     }
 
-    // Set the renewal time and update.
-    mapping.setRenewalTime(sys_clock::now() + std::chrono::seconds(lifetime * 4 / 5));
-    mapping.setState(MappingState::OPEN);
-
-    return 0;
+    map.setInternalAddress(getHostAddress().toString());
+
+    pmpClient_->requestMapping(map.getType(),
+                               map.getInternalPort(),
+                               map.getExternalPort(),
+                               MAPPING_ALLOCATION_LIFETIME,
+                               [map, cb = std::move(cb)](const asio::error_code& ec,
+                                                         const PmpResponse& response) mutable {
+                                   int err = toNatPmpError(ec, response);
+                                   if (err < 0) {
+                                       map.setState(MappingState::FAILED);
+                                   } else {
+                                       // Set the renewal time and update.
+                                       map.setRenewalTime(
+                                           sys_clock::now()
+                                           + std::chrono::seconds(response.lifetime * 4 / 5));
+                                       map.setState(MappingState::OPEN);
+                                   }
+                                   cb(err, map);
+                               });
 }
 
 void
@@ -487,16 +495,17 @@ NatPmp::requestMappingRemove(const Mapping& mapping)
     if (not isValidThread()) {
         runOnNatPmpQueue([w = weak(), mapping] {
             if (auto pmpThis = w.lock()) {
-                Mapping map {mapping};
-                pmpThis->removePortMapping(map);
+                pmpThis->removePortMapping(mapping);
             }
         });
         return;
     }
+
+    removePortMapping(mapping);
 }
 
 void
-NatPmp::removePortMapping(Mapping& mapping)
+NatPmp::removePortMapping(const Mapping& mapping)
 {
     auto igdIn = mapping.getIgd();
     assert(igdIn);
@@ -504,24 +513,33 @@ NatPmp::removePortMapping(Mapping& mapping)
         return;
     }
 
-    if (not validIgdInstance(igdIn)) {
+    if (not validIgdInstance(igdIn) or not pmpClient_) {
         return;
     }
 
-    Mapping mapToRemove(mapping);
-
-    uint32_t lifetime = 0;
-    int err = sendMappingRequest(mapping, lifetime);
-
-    if (err < 0) {
-        // Nothing to do if the request fails, just log the error.
-        JAMI_WARN("NAT-PMP: Send remove request failed with error %s. Ignoring",
-                  getNatPmpErrorStr(err));
-    }
+    pmpClient_->requestMapping(
+        mapping.getType(),
+        mapping.getInternalPort(),
+        mapping.getExternalPort(),
+        0,
+        [w = weak(), mapToRemove = mapping](const asio::error_code& ec,
+                                            const PmpResponse& response) mutable {
+            auto pmpThis = w.lock();
+            if (not pmpThis)
+                return;
+            int err = toNatPmpError(ec, response);
+            if (err < 0) {
+                // Nothing to do if the request fails, just log the error.
+                if (pmpThis->logger_)
+                    pmpThis->logger_->warn(
+                        "NAT-PMP: Send remove request failed with error {}. Ignoring",
+                        pmpThis->getNatPmpErrorStr(err));
+            }
 
-    // Update and notify the listener.
-    mapToRemove.setState(MappingState::FAILED);
-    processMappingRemoved(std::move(mapToRemove));
+            // Update and notify the listener.
+            mapToRemove.setState(MappingState::FAILED);
+            pmpThis->processMappingRemoved(std::move(mapToRemove));
+        });
 }
 
 void
@@ -532,59 +550,58 @@ NatPmp::getIgdPublicAddress()
     // Set the public address for this IGD if it does not
     // have one already.
     if (igd_->getPublicIp()) {
-        JAMI_WARN("NAT-PMP: IGD %s already have a public address (%s)",
-                  igd_->toString().c_str(),
-                  igd_->getPublicIp().toString().c_str());
+        if (logger_)
+            logger_->warn("NAT-PMP: IGD {} already have a public address ({})",
+                          igd_->toString(),
+                          igd_->getPublicIp().toString());
         return;
     }
     assert(igd_->getProtocol() == NatProtocolType::NAT_PMP);
 
-    int err = sendpublicaddressrequest(&natpmpHdl_);
-
-    if (err < 0) {
-        JAMI_ERR("NAT-PMP: send public address request on IGD %s failed with error: %s",
-                 igd_->toString().c_str(),
-                 getNatPmpErrorStr(err));
+    pmpClient_->requestPublicAddress([w = weak()](const asio::error_code& ec,
+                                                  const PmpResponse& response) {
+        auto pmpThis = w.lock();
+        if (not pmpThis or ec == asio::error::operation_aborted)
+            return;
+        auto const& igd = pmpThis->igd_;
+        auto const& logger = pmpThis->logger_;
 
-        if (isErrorFatal(err)) {
-            // Fatal error, increment the counter.
-            incrementErrorsCounter(igd_);
+        int err = toNatPmpError(ec, response);
+        if (err < 0) {
+            if (logger)
+                logger->warn("NAT-PMP: Public address request on IGD {} failed - {}",
+                             igd->toString(),
+                             pmpThis->getNatPmpErrorStr(err));
+            if (pmpThis->isErrorFatal(err)) {
+                // Fatal error, increment the counter.
+                pmpThis->incrementErrorsCounter(igd);
+            }
+            return;
         }
-        return;
-    }
-
-    natpmpresp_t response;
-    err = readResponse(natpmpHdl_, response);
-
-    if (err < 0) {
-        JAMI_WARN("NAT-PMP: Read response on IGD %s failed - %s",
-                  igd_->toString().c_str(),
-                  getNatPmpErrorStr(err));
-        return;
-    }
 
-    if (response.type != NATPMP_RESPTYPE_PUBLICADDRESS) {
-        JAMI_ERR("NAT-PMP: Unexpected response type (%i) for public address request from IGD %s.",
-                 response.type,
-                 igd_->toString().c_str());
-        return;
-    }
+        IpAddr publicAddr(response.publicAddress);
 
-    IpAddr publicAddr(response.pnu.publicaddress.addr);
+        if (not publicAddr) {
+            if (logger)
+                logger->error("NAT-PMP: IGD {} returned an invalid public address {}",
+                              igd->toString(),
+                              publicAddr.toString());
+        }
 
-    if (not publicAddr) {
-        JAMI_ERR("NAT-PMP: IGD %s returned an invalid public address %s",
-                 igd_->toString().c_str(),
-                 publicAddr.toString().c_str());
-    }
+        // Update.
+        igd->setPublicIp(publicAddr);
+        igd->setValid(true);
 
-    // Update.
-    igd_->setPublicIp(publicAddr);
-    igd_->setValid(true);
+        if (logger)
+            logger->debug("NAT-PMP: Setting IGD {} public address to {}",
+                          igd->toString(),
+                          igd->getPublicIp().toString());
 
-    JAMI_DBG("NAT-PMP: Setting IGD %s public address to %s",
-             igd_->toString().c_str(),
-             igd_->getPublicIp().toString().c_str());
+        // The search is complete, notify.
+        pmpThis->searchForIgdTimer_.cancel();
+        pmpThis->initialized_ = true;
+        pmpThis->processIgdUpdate(UpnpIgdEvent::ADDED);
+    });
 }
 
 void
@@ -592,18 +609,26 @@ NatPmp::removeAllMappings()
 {
     CHECK_VALID_THREAD();
 
-    JAMI_WARN("NAT-PMP: Send request to close all existing mappings to IGD %s",
-              igd_->toString().c_str());
+    if (not pmpClient_)
+        return;
 
-    int err = sendnewportmappingrequest(&natpmpHdl_, NATPMP_PROTOCOL_TCP, 0, 0, 0);
-    if (err < 0) {
-        JAMI_WARN("NAT-PMP: Send close all TCP mappings request failed with error %s",
-                  getNatPmpErrorStr(err));
-    }
-    err = sendnewportmappingrequest(&natpmpHdl_, NATPMP_PROTOCOL_UDP, 0, 0, 0);
-    if (err < 0) {
-        JAMI_WARN("NAT-PMP: Send close all UDP mappings request failed with error %s",
-                  getNatPmpErrorStr(err));
+    if (logger_)
+        logger_->warn("NAT-PMP: Send request to close all existing mappings to IGD {}",
+                      igd_->toString());
+
+    for (auto type : {PortType::TCP, PortType::UDP}) {
+        pmpClient_->requestMapping(
+            type,
+            0,
+            0,
+            0,
+            [logger = logger_, type](const asio::error_code& ec, const PmpResponse& response) {
+                int err = toNatPmpError(ec, response);
+                if (err < 0 and ec != asio::error::operation_aborted and logger)
+                    logger->warn("NAT-PMP: Close all {} mappings request failed with error {}",
+                                 Mapping::getTypeStr(type),
+                                 err);
+            });
     }
 }
 
@@ -706,9 +731,10 @@ bool
 NatPmp::validIgdInstance(const std::shared_ptr<IGD>& igdIn)
 {
     if (igd_.get() != igdIn.get()) {
-        JAMI_ERR("NAT-PMP: IGD (%s) does not match local instance (%s)",
-                 igdIn->toString().c_str(),
-                 igd_->toString().c_str());
+        if (logger_)
+            logger_->error("NAT-PMP: IGD ({}) does not match local instance ({})",
+                           igdIn->toString(),
+                           igd_->toString());
         return false;
     }
 
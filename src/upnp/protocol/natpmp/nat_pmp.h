@@ -21,19 +21,19 @@
 
 #pragma once
 
-#include "connectivity/upnp/protocol/upnp_protocol.h"
-#include "connectivity/upnp/protocol/igd.h"
+#include "../upnp_protocol.h"
+#include "../igd.h"
 #include "pmp_igd.h"
+#include "pmp_client.h"
 
-#include "logger.h"
-#include "connectivity/ip_utils.h"
-#include "noncopyable.h"
-#include "compiler_intrinsics.h"
+#include "ip_utils.h"
 
 // uncomment to enable native natpmp error messages
 //#define ENABLE_STRNATPMPERR 1
 #include <natpmp.h>
 
+#include <asio/steady_timer.hpp>
+
 #include <atomic>
 #include <thread>
 
@@ -48,17 +48,14 @@ namespace upnp {
 constexpr static unsigned int MAPPING_ALLOCATION_LIFETIME {60 * 60};
 // Max number of IGD search attempts before failure.
 constexpr static unsigned int MAX_RESTART_SEARCH_RETRIES {3};
-// Time-out between two successive read response.
-constexpr static auto TIMEOUT_BEFORE_READ_RETRY {std::chrono::milliseconds(300)};
-// Max number of read attempts before failure.
-constexpr static unsigned int MAX_READ_RETRIES {3};
 // Base unit for the timeout between two successive IGD search.
 constexpr static auto NATPMP_SEARCH_RETRY_UNIT {std::chrono::seconds(10)};
 
 class NatPmp : public UPnPProtocol
 {
 public:
-    NatPmp();
+    NatPmp(const std::shared_ptr<asio::io_context>& ctx,
+           const std::shared_ptr<dht::log::Logger>& logger);
     ~NatPmp();
 
     // Set the observer.
@@ -99,33 +96,38 @@ public:
     void terminate() override;
 
 private:
-    NON_COPYABLE(NatPmp);
+    NatPmp(const NatPmp&) = delete;
+    NatPmp(NatPmp&&) = delete;
+    NatPmp& operator=(NatPmp&&) = delete;
+    NatPmp& operator=(const NatPmp&) = delete;
 
     std::weak_ptr<NatPmp> weak() { return std::static_pointer_cast<NatPmp>(shared_from_this()); }
 
     // Helpers to run tasks on NAT-PMP internal execution queue.
-    ScheduledExecutor* getNatpmpScheduler() { return &natpmpScheduler_; }
+    // Hides UpnpThreadUtil::isValidThread(), the libnatpmp calls are
+    // expected to run on the private queue, not on the UPnP context.
+    bool isValidThread() const { return ioContext_->get_executor().running_in_this_thread(); }
     template<typename Callback>
     void runOnNatPmpQueue(Callback&& cb)
     {
-        natpmpScheduler_.run([cb = std::forward<Callback>(cb)]() mutable { cb(); });
+        asio::post(*ioContext_, std::forward<Callback>(cb));
     }
 
-    // Helpers to run tasks on UPNP context execution queue.
-    ScheduledExecutor* getUpnContextScheduler() { return UpnpThreadUtil::getScheduler(); }
-
     void terminate(std::condition_variable& cv);
+    void stopNatPmpQueue();
+
+    using MappingRequestCb = std::function<void(int err, Mapping& map)>;
 
     void initNatPmp();
     void getIgdPublicAddress();
     void removeAllMappings();
-    int readResponse(natpmp_t& handle, natpmpresp_t& response);
-    int sendMappingRequest(const Mapping& mapping, uint32_t& lifetime);
+    // Convert the client result to a libnatpmp error code (0 on success).
+    static int toNatPmpError(const asio::error_code& ec, const PmpResponse& response);
 
-    // Adds a port mapping.
-    int addPortMapping(Mapping& mapping);
+    // Adds (or renews) a port mapping.
+    void addPortMapping(const Mapping& mapping, MappingRequestCb&& cb);
     // Removes a port mapping.
-    void removePortMapping(Mapping& mapping);
+    void removePortMapping(const Mapping& mapping);
 
     // True if the error is fatal.
     bool isErrorFatal(int error);
@@ -151,9 +153,13 @@ private:
 
     // Data members
     std::shared_ptr<PMPIGD> igd_;
-    natpmp_t natpmpHdl_;
-    ScheduledExecutor natpmpScheduler_ {"natpmp"};
-    std::shared_ptr<Task> searchForIgdTimer_ {};
+    // Execution queue of the NAT-PMP client and of the
+    // (blocking) gateway discovery.
+    std::shared_ptr<asio::io_context> ioContext_;
+    std::thread ioContextRunner_;
+    // Requests are sent asynchronously, several may be in-flight.
+    std::shared_ptr<PmpClient> pmpClient_;
+    asio::steady_timer searchForIgdTimer_;
     unsigned int igdSearchCounter_ {0};
     UpnpMappingObserver* observer_ {nullptr};
     IpAddr hostAddress_ {};
@@ -0,0 +1,297 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#include "pmp_client.h"
+
+#include <asio/dispatch.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+namespace jami {
+namespace upnp {
+
+constexpr static uint8_t NATPMP_VERSION {0};
+// Responses opcodes are the request opcodes + 128.
+constexpr static uint8_t NATPMP_RESPONSE_BIT {128};
+// Version, opcode, result code and epoch.
+constexpr static size_t NATPMP_RESPONSE_HEADER_SIZE {8};
+constexpr static size_t NATPMP_PUBLIC_ADDRESS_RESPONSE_SIZE {12};
+constexpr static size_t NATPMP_MAPPING_RESPONSE_SIZE {16};
+
+static void
+putUint16(std::vector<uint8_t>& buf, uint16_t v)
+{
+    buf.emplace_back(v >> 8);
+    buf.emplace_back(v & 0xff);
+}
+
+static void
+putUint32(std::vector<uint8_t>& buf, uint32_t v)
+{
+    putUint16(buf, v >> 16);
+    putUint16(buf, v & 0xffff);
+}
+
+static uint16_t
+getUint16(const uint8_t* p)
+{
+    return (uint16_t(p[0]) << 8) | p[1];
+}
+
+static uint32_t
+getUint32(const uint8_t* p)
+{
+    return (uint32_t(getUint16(p)) << 16) | getUint16(p + 2);
+}
+
+PmpClient::PmpClient(asio::io_context& ctx,
+                     const asio::ip::udp::endpoint& gateway,
+                     const std::shared_ptr<dht::log::Logger>& logger,
+                     std::chrono::milliseconds initialTimeout,
+                     unsigned maxAttempts)
+    : ctx_(ctx)
+    , gateway_(gateway)
+    , socket_(ctx)
+    , logger_(logger)
+    , initialTimeout_(initialTimeout)
+    , maxAttempts_(maxAttempts)
+{
+    asio::error_code ec;
+    socket_.open(gateway_.protocol(), ec);
+    // Connecting the socket filters out the packets not sent by the gateway.
+    if (not ec)
+        socket_.connect(gateway_, ec);
+    if (ec and logger_)
+        logger_->error("NAT-PMP: Unable to open socket to gateway {}: {}",
+                       gateway_.address().to_string(),
+                       ec.message());
+}
+
+PmpClient::~PmpClient()
+{
+    asio::error_code ec;
+    socket_.close(ec);
+}
+
+void
+PmpClient::requestPublicAddress(ResponseCb&& cb)
+{
+    std::vector<uint8_t> packet {NATPMP_VERSION, uint8_t(PmpOpcode::PUBLIC_ADDRESS)};
+    startRequest({PmpOpcode::PUBLIC_ADDRESS, 0}, std::move(packet), std::move(cb));
+}
+
+void
+PmpClient::requestMapping(PortType type,
+                          uint16_t internalPort,
+                          uint16_t externalPort,
+                          uint32_t lifetime,
+                          ResponseCb&& cb)
+{
+    auto opcode = type == PortType::UDP ? PmpOpcode::MAP_UDP : PmpOpcode::MAP_TCP;
+    std::vector<uint8_t> packet {NATPMP_VERSION, uint8_t(opcode)};
+    packet.reserve(12);
+    // Reserved.
+    putUint16(packet, 0);
+    putUint16(packet, internalPort);
+    putUint16(packet, externalPort);
+    putUint32(packet, lifetime);
+    startRequest({opcode, internalPort}, std::move(packet), std::move(cb));
+}
+
+void
+PmpClient::cancel()
+{
+    asio::dispatch(ctx_, [w = weak_from_this()] {
+        if (auto client = w.lock()) {
+            asio::error_code ec;
+            client->socket_.close(ec);
+            client->failAll(asio::error::operation_aborted);
+        }
+    });
+}
+
+void
+PmpClient::startRequest(RequestKey key, std::vector<uint8_t>&& packet, ResponseCb&& cb)
+{
+    auto req = std::make_shared<Request>(ctx_);
+    req->packet = std::move(packet);
+    req->cb = std::move(cb);
+    req->timeout = initialTimeout_;
+
+    asio::dispatch(ctx_, [w = weak_from_this(), key, req] {
+        auto client = w.lock();
+        if (not client)
+            return;
+        if (not client->socket_.is_open()) {
+            if (req->cb)
+                req->cb(asio::error::bad_descriptor, {});
+            return;
+        }
+        req->sequence = client->nextSequence_++;
+        client->pending_[key].emplace_back(req);
+        client->transmit(key, req);
+        client->receive();
+    });
+}
+
+void
+PmpClient::transmit(const RequestKey& key, const std::shared_ptr<Request>& req)
+{
+    req->attempts++;
+    socket_.async_send(asio::buffer(req->packet),
+                       [w = weak_from_this(), key, req](const asio::error_code& ec, size_t) {
+                           if (not ec or ec == asio::error::operation_aborted)
+                               return;
+                           if (auto client = w.lock())
+                               client->complete(key, req, ec);
+                       });
+
+    req->timer.expires_after(req->timeout);
+    req->timer.async_wait([w = weak_from_this(), key, req](const asio::error_code& ec) {
+        if (ec == asio::error::operation_aborted)
+            return;
+        auto client = w.lock();
+        if (not client)
+            return;
+        if (req->attempts >= client->maxAttempts_) {
+            client->complete(key, req, asio::error::timed_out);
+            return;
+        }
+        req->timeout *= 2;
+        client->transmit(key, req);
+    });
+}
+
+void
+PmpClient::complete(const RequestKey& key,
+                    const std::shared_ptr<Request>& req,
+                    const asio::error_code& ec,
+                    const PmpResponse& response)
+{
+    auto it = pending_.find(key);
+    if (it == pending_.end())
+        return;
+    auto& list = it->second;
+    auto reqIt = std::find(list.begin(), list.end(), req);
+    if (reqIt == list.end())
+        // Already completed.
+        return;
+    list.erase(reqIt);
+    if (list.empty())
+        pending_.erase(it);
+
+    req->timer.cancel();
+    if (req->cb)
+        req->cb(ec, response);
+}
+
+void
+PmpClient::failAll(const asio::error_code& ec)
+{
+    auto pending = std::move(pending_);
+    pending_.clear();
+    for (auto& [_, list] : pending) {
+        for (auto& req : list) {
+            req->timer.cancel();
+            if (req->cb)
+                req->cb(ec, {});
+        }
+    }
+}
+
+void
+PmpClient::receive()
+{
+    if (receiving_ or pending_.empty())
+        return;
+    receiving_ = true;
+    socket_.async_receive(asio::buffer(rxBuffer_),
+                          [w = weak_from_this()](const asio::error_code& ec, size_t size) {
+                              auto client = w.lock();
+                              if (not client)
+                                  return;
+                              client->receiving_ = false;
+                              if (ec == asio::error::operation_aborted)
+                                  return;
+                              if (ec == asio::error::connection_refused) {
+                                  // ICMP port unreachable: no NAT-PMP server on the gateway.
+                                  client->failAll(ec);
+                              } else if (ec) {
+                                  if (client->logger_)
+                                      client->logger_->warn("NAT-PMP: Receive error: {}",
+                                                            ec.message());
+                              } else {
+                                  client->onPacket(size);
+                              }
+                              client->receive();
+                          });
+}
+
+void
+PmpClient::onPacket(size_t size)
+{
+    const uint8_t* data = rxBuffer_.data();
+    if (size < NATPMP_RESPONSE_HEADER_SIZE or data[0] != NATPMP_VERSION
+        or not(data[1] & NATPMP_RESPONSE_BIT)) {
+        if (logger_)
+            logger_->warn("NAT-PMP: Ignoring invalid packet of {} bytes from gateway", size);
+        return;
+    }
+
+    PmpResponse response;
+    response.opcode = PmpOpcode(data[1] & ~NATPMP_RESPONSE_BIT);
+    response.resultCode = PmpResultCode(getUint16(data + 2));
+    response.epoch = getUint32(data + 4);
+
+    // Error responses may be truncated after the header.
+    if (response.opcode == PmpOpcode::PUBLIC_ADDRESS) {
+        if (size >= NATPMP_PUBLIC_ADDRESS_RESPONSE_SIZE) {
+            in_addr addr;
+            std::memcpy(&addr.s_addr, data + 8, sizeof(addr.s_addr));
+            response.publicAddress = IpAddr(addr);
+        }
+    } else if (size >= NATPMP_MAPPING_RESPONSE_SIZE) {
+        response.internalPort = getUint16(data + 8);
+        response.externalPort = getUint16(data + 10);
+        response.lifetime = getUint32(data + 12);
+    }
+
+    RequestKey key {response.opcode, response.internalPort};
+    auto it = pending_.find(key);
+    if (it == pending_.end() and response.resultCode != PmpResultCode::SUCCESS) {
+        // Short error response, match the oldest request with the same opcode.
+        for (auto item = pending_.begin(); item != pending_.end(); ++item) {
+            if (item->first.first == response.opcode
+                and (it == pending_.end() or item->second.front()->sequence < it->second.front()->sequence))
+                it = item;
+        }
+    }
+    if (it == pending_.end()) {
+        // Typically a response to a retransmitted request.
+        if (logger_)
+            logger_->debug("NAT-PMP: Ignoring unexpected response (opcode {}, port {})",
+                           static_cast<int>(response.opcode),
+                           response.internalPort);
+        return;
+    }
+    complete(it->first, it->second.front(), {}, response);
+}
+
+} // namespace upnp
+} // namespace jami
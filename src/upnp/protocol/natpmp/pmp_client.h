@@ -0,0 +1,166 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+#pragma once
+
+#include "../mapping.h"
+#include "ip_utils.h"
+
+#include <opendht/logger.h>
+
+#include <asio/io_context.hpp>
+#include <asio/ip/udp.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace jami {
+namespace upnp {
+
+// NAT-PMP server port.
+constexpr static uint16_t NATPMP_SERVER_PORT {5351};
+// Initial time-out before retransmitting a request. It's doubled
+// on each retransmission (RFC 6886, section 3.1).
+constexpr static auto PMP_INITIAL_RETRANSMIT_TIMEOUT {std::chrono::milliseconds(250)};
+// Max number of transmissions of a request before giving up.
+constexpr static unsigned PMP_MAX_REQUEST_ATTEMPTS {4};
+
+// NAT-PMP request opcodes.
+enum class PmpOpcode : uint8_t { PUBLIC_ADDRESS = 0, MAP_UDP = 1, MAP_TCP = 2 };
+
+// Result codes returned by the gateway (RFC 6886, section 3.5).
+enum class PmpResultCode : uint16_t {
+    SUCCESS = 0,
+    UNSUPPORTED_VERSION,
+    NOT_AUTHORIZED,
+    NETWORK_FAILURE,
+    OUT_OF_RESOURCES,
+    UNSUPPORTED_OPCODE
+};
+
+struct PmpResponse
+{
+    PmpOpcode opcode {PmpOpcode::PUBLIC_ADDRESS};
+    PmpResultCode resultCode {PmpResultCode::SUCCESS};
+    // Seconds since the gateway mapping table was (re)initialized.
+    uint32_t epoch {0};
+    // Set for public address requests.
+    IpAddr publicAddress {};
+    // Set for mapping requests.
+    uint16_t internalPort {0};
+    uint16_t externalPort {0};
+    uint32_t lifetime {0};
+};
+
+/**
+ * Asynchronous NAT-PMP client.
+ *
+ * All the requests are sent on a single UDP socket "connected" to the
+ * gateway and matched with their responses using the opcode and the
+ * internal port, so any number of mapping and renewal requests may be
+ * outstanding at once. Requests without response are retransmitted with
+ * an exponential back-off, and fail with asio::error::timed_out once
+ * the max number of attempts is reached.
+ *
+ * The public methods may be called from any thread. The callbacks are
+ * always invoked on the io_context thread.
+ */
+class PmpClient : public std::enable_shared_from_this<PmpClient>
+{
+public:
+    using ResponseCb = std::function<void(const asio::error_code& ec, const PmpResponse& response)>;
+
+    PmpClient(asio::io_context& ctx,
+              const asio::ip::udp::endpoint& gateway,
+              const std::shared_ptr<dht::log::Logger>& logger = {},
+              std::chrono::milliseconds initialTimeout = PMP_INITIAL_RETRANSMIT_TIMEOUT,
+              unsigned maxAttempts = PMP_MAX_REQUEST_ATTEMPTS);
+    ~PmpClient();
+
+    const asio::ip::udp::endpoint& gateway() const { return gateway_; }
+
+    // Request the public address of the gateway.
+    void requestPublicAddress(ResponseCb&& cb);
+
+    // Request (or renew) a mapping. A lifetime of 0 removes the mapping,
+    // and a lifetime and an internal port of 0 remove all the mappings
+    // of the given type.
+    void requestMapping(PortType type,
+                        uint16_t internalPort,
+                        uint16_t externalPort,
+                        uint32_t lifetime,
+                        ResponseCb&& cb);
+
+    // Close the socket. The pending requests complete with operation_aborted.
+    void cancel();
+
+private:
+    PmpClient(const PmpClient&) = delete;
+    PmpClient(PmpClient&&) = delete;
+    PmpClient& operator=(PmpClient&&) = delete;
+    PmpClient& operator=(const PmpClient&) = delete;
+
+    struct Request
+    {
+        Request(asio::io_context& ctx)
+            : timer(ctx)
+        {}
+        std::vector<uint8_t> packet;
+        ResponseCb cb;
+        asio::steady_timer timer;
+        std::chrono::milliseconds timeout;
+        unsigned attempts {0};
+        // Order of the first transmission, to match the short error responses.
+        uint64_t sequence {0};
+    };
+    // Responses are matched using the opcode and the internal port.
+    using RequestKey = std::pair<PmpOpcode, uint16_t>;
+
+    void startRequest(RequestKey key, std::vector<uint8_t>&& packet, ResponseCb&& cb);
+    void transmit(const RequestKey& key, const std::shared_ptr<Request>& req);
+    // Remove the request from the pending list and invoke its callback.
+    void complete(const RequestKey& key,
+                  const std::shared_ptr<Request>& req,
+                  const asio::error_code& ec,
+                  const PmpResponse& response = {});
+    void failAll(const asio::error_code& ec);
+
+    void receive();
+    void onPacket(size_t size);
+
+    asio::io_context& ctx_;
+    asio::ip::udp::endpoint gateway_;
+    asio::ip::udp::socket socket_;
+    std::array<uint8_t, 64> rxBuffer_;
+    std::shared_ptr<dht::log::Logger> logger_;
+    const std::chrono::milliseconds initialTimeout_;
+    const unsigned maxAttempts_;
+    bool receiving_ {false};
+    uint64_t nextSequence_ {0};
+
+    // Requests waiting for a response, in sending order for each key.
+    std::map<RequestKey, std::list<std::shared_ptr<Request>>> pending_;
+};
+
+} // namespace upnp
+} // namespace jami
@@ -23,7 +23,6 @@
 
 #include "pupnp.h"
 
-#include <opendht/thread_pool.h>
 #include <opendht/http.h>
 
 namespace jami {
@@ -42,8 +41,11 @@ constexpr static int CONFLICT_IN_MAPPING = 718;
 
 // Max number of IGD search attempts before failure.
 constexpr static unsigned int PUPNP_MAX_RESTART_SEARCH_RETRIES {3};
-// IGD search timeout (in seconds).
-constexpr static unsigned int SEARCH_TIMEOUT {60};
+// IGD search timeout (in seconds). This is the MX value of the search
+// requests: the IGDs delay their answer by a random time up to this value.
+constexpr static unsigned int SEARCH_TIMEOUT {2};
+// Max number of lib-upnp actions (SOAP requests) run concurrently.
+constexpr static unsigned int PUPNP_MAX_PARALLEL_ACTIONS {4};
 // Base unit for the timeout between two successive IGD search.
 constexpr static auto PUPNP_SEARCH_RETRY_UNIT {std::chrono::seconds(10)};
 
@@ -84,7 +86,7 @@ getFirstElementItem(IXML_Element* element, const char* item)
 }
 
 static bool
-errorOnResponse(IXML_Document* doc)
+errorOnResponse(IXML_Document* doc, const std::shared_ptr<dht::log::Logger>& logger)
 {
     if (not doc)
         return true;
@@ -92,9 +94,10 @@ errorOnResponse(IXML_Document* doc)
     auto errorCode = getFirstDocItem(doc, "errorCode");
     if (not errorCode.empty()) {
         auto errorDescription = getFirstDocItem(doc, "errorDescription");
-        JAMI_WARNING("PUPnP: Response contains error: {:s}: {:s}",
-                  errorCode,
-                  errorDescription);
+        if (logger)
+            logger->warn("PUPnP: Response contains error: {:s}: {:s}",
+                         errorCode,
+                         errorDescription);
         return true;
     }
     return false;
@@ -102,18 +105,52 @@ errorOnResponse(IXML_Document* doc)
 
 // UPNP class implementation
 
-PUPnP::PUPnP()
+PUPnP::PUPnP(const std::shared_ptr<asio::io_context>& ctx,
+             const std::shared_ptr<dht::log::Logger>& logger)
+    : UPnPProtocol(ctx, logger)
+    , ioContext_(std::make_shared<asio::io_context>())
+    , actionContext_(std::make_shared<asio::io_context>())
+    , searchForIgdTimer_(*ioContext_)
 {
-    JAMI_DBG("PUPnP: Creating instance [%p] ...", this);
-    runOnPUPnPQueue([this] {
-        threadId_ = getCurrentThread();
-        JAMI_DBG("PUPnP: Instance [%p] created", this);
+    ioContextRunner_ = std::thread([ioContext = ioContext_] {
+        auto work = asio::make_work_guard(*ioContext);
+        ioContext->run();
     });
+    for (unsigned i = 0; i < PUPNP_MAX_PARALLEL_ACTIONS; i++) {
+        actionRunners_.emplace_back([actionContext = actionContext_] {
+            auto work = asio::make_work_guard(*actionContext);
+            actionContext->run();
+        });
+    }
+    if (logger_)
+        logger_->debug("PUPnP: Instance [{}] created", fmt::ptr(this));
 }
 
 PUPnP::~PUPnP()
 {
-    JAMI_DBG("PUPnP: Instance [%p] destroyed", this);
+    stopPUPnPQueue();
+    if (logger_)
+        logger_->debug("PUPnP: Instance [{}] destroyed", fmt::ptr(this));
+}
+
+void
+PUPnP::stopPUPnPQueue()
+{
+    ioContext_->stop();
+    actionContext_->stop();
+    // The last reference may be released by a task running on the queue
+    // or on the action pool.
+    auto stopRunner = [](std::thread& runner) {
+        if (not runner.joinable())
+            return;
+        if (runner.get_id() == std::this_thread::get_id())
+            runner.detach();
+        else
+            runner.join();
+    };
+    stopRunner(ioContextRunner_);
+    for (auto& runner : actionRunners_)
+        stopRunner(runner);
 }
 
 void
@@ -124,7 +161,8 @@ PUPnP::initUpnpLib()
     int upnp_err = UpnpInit2(nullptr, 0);
 
     if (upnp_err != UPNP_E_SUCCESS) {
-        JAMI_ERR("PUPnP: Can't initialize libupnp: %s", UpnpGetErrorMessage(upnp_err));
+        if (logger_)
+            logger_->error("PUPnP: Can't initialize libupnp: {}", UpnpGetErrorMessage(upnp_err));
         UpnpFinish();
         initialized_ = false;
         return;
@@ -132,12 +170,15 @@ PUPnP::initUpnpLib()
 
     // Disable embedded WebServer if any.
     if (UpnpIsWebserverEnabled() == 1) {
-        JAMI_WARN("PUPnP: Web-server is enabled. Disabling");
+        if (logger_)
+            logger_->warn("PUPnP: Web-server is enabled. Disabling");
         UpnpEnableWebserver(0);
         if (UpnpIsWebserverEnabled() == 1) {
-            JAMI_ERR("PUPnP: Could not disable Web-server!");
+            if (logger_)
+                logger_->error("PUPnP: Could not disable Web-server!");
         } else {
-            JAMI_DBG("PUPnP: Web-server successfully disabled");
+            if (logger_)
+                logger_->debug("PUPnP: Web-server successfully disabled");
         }
     }
 
@@ -149,10 +190,16 @@ PUPnP::initUpnpLib()
     ip_address6 = UpnpGetServerIp6Address();
     port6 = UpnpGetServerPort6();
 #endif
-    if (ip_address6 and port6)
-        JAMI_DBG("PUPnP: Initialized on %s:%u | %s:%u", ip_address, port, ip_address6, port6);
-    else
-        JAMI_DBG("PUPnP: Initialized on %s:%u", ip_address, port);
+    if (logger_) {
+        if (ip_address6 and port6)
+            logger_->debug("PUPnP: Initialized on {}:{} | {}:{}",
+                           ip_address,
+                           port,
+                           ip_address6,
+                           port6);
+        else
+            logger_->debug("PUPnP: Initialized on {}:{}", ip_address, port);
+    }
 
     // Relax the parser to allow malformed XML text.
     ixmlRelaxParser(1);
@@ -177,9 +224,11 @@ PUPnP::registerClient()
     // Register Upnp control point.
     int upnp_err = UpnpRegisterClient(ctrlPtCallback, this, &ctrlptHandle_);
     if (upnp_err != UPNP_E_SUCCESS) {
-        JAMI_ERR("PUPnP: Can't register client: %s", UpnpGetErrorMessage(upnp_err));
+        if (logger_)
+            logger_->error("PUPnP: Can't register client: {}", UpnpGetErrorMessage(upnp_err));
     } else {
-        JAMI_DBG("PUPnP: Successfully registered client");
+        if (logger_)
+            logger_->debug("PUPnP: Successfully registered client");
         clientRegistered_ = true;
     }
 }
@@ -196,7 +245,8 @@ PUPnP::setObserver(UpnpMappingObserver* obs)
         return;
     }
 
-    JAMI_DBG("PUPnP: Setting observer to %p", obs);
+    if (logger_)
+        logger_->debug("PUPnP: Setting observer to {}", fmt::ptr(obs));
 
     observer_ = obs;
 }
@@ -211,7 +261,8 @@ PUPnP::getHostAddress() const
 void
 PUPnP::terminate(std::condition_variable& cv)
 {
-    JAMI_DBG("PUPnP: Terminate instance %p", this);
+    if (logger_)
+        logger_->debug("PUPnP: Terminate instance {}", fmt::ptr(this));
 
     clientRegistered_ = false;
     observer_ = nullptr;
@@ -220,7 +271,8 @@ PUPnP::terminate(std::condition_variable& cv)
 
     if (initialized_) {
         if (UpnpFinish() != UPNP_E_SUCCESS) {
-            JAMI_ERR("PUPnP: Failed to properly close lib-upnp");
+            if (logger_)
+                logger_->error("PUPnP: Failed to properly close lib-upnp");
         }
 
         initialized_ = false;
@@ -228,6 +280,7 @@ PUPnP::terminate(std::condition_variable& cv)
 
     // Clear all the lists.
     discoveredIgdList_.clear();
+    pendingValidations_.clear();
 
     {
         std::lock_guard<std::mutex> lock(pupnpMutex_);
@@ -250,12 +303,17 @@ PUPnP::terminate()
     });
 
     if (cv.wait_for(lk, std::chrono::seconds(10), [this] { return shutdownComplete_; })) {
-        JAMI_DBG("PUPnP: Shutdown completed");
+        if (logger_)
+            logger_->debug("PUPnP: Shutdown completed");
     } else {
-        JAMI_ERR("PUPnP: Shutdown timed-out");
+        if (logger_)
+            logger_->error("PUPnP: Shutdown timed-out");
         // Force stop if the shutdown take too much time.
         shutdownComplete_ = true;
     }
+    lk.unlock();
+
+    stopPUPnPQueue();
 }
 
 void
@@ -263,37 +321,42 @@ PUPnP::searchForDevices()
 {
     CHECK_VALID_THREAD();
 
-    JAMI_DBG("PUPnP: Send IGD search request");
+    if (logger_)
+        logger_->debug("PUPnP: Send IGD search request");
 
     // Send out search for multiple types of devices, as some routers may possibly
     // only reply to one.
 
     auto err = UpnpSearchAsync(ctrlptHandle_, SEARCH_TIMEOUT, UPNP_ROOT_DEVICE, this);
     if (err != UPNP_E_SUCCESS) {
-        JAMI_WARN("PUPnP: Send search for UPNP_ROOT_DEVICE failed. Error %d: %s",
-                  err,
-                  UpnpGetErrorMessage(err));
+        if (logger_)
+            logger_->warn("PUPnP: Send search for UPNP_ROOT_DEVICE failed. Error {}: {}",
+                          err,
+                          UpnpGetErrorMessage(err));
     }
 
     err = UpnpSearchAsync(ctrlptHandle_, SEARCH_TIMEOUT, UPNP_IGD_DEVICE, this);
     if (err != UPNP_E_SUCCESS) {
-        JAMI_WARN("PUPnP: Send search for UPNP_IGD_DEVICE failed. Error %d: %s",
-                  err,
-                  UpnpGetErrorMessage(err));
+        if (logger_)
+            logger_->warn("PUPnP: Send search for UPNP_IGD_DEVICE failed. Error {}: {}",
+                          err,
+                          UpnpGetErrorMessage(err));
     }
 
     err = UpnpSearchAsync(ctrlptHandle_, SEARCH_TIMEOUT, UPNP_WANIP_SERVICE, this);
     if (err != UPNP_E_SUCCESS) {
-        JAMI_WARN("PUPnP: Send search for UPNP_WANIP_SERVICE failed. Error %d: %s",
-                  err,
-                  UpnpGetErrorMessage(err));
+        if (logger_)
+            logger_->warn("PUPnP: Send search for UPNP_WANIP_SERVICE failed. Error {}: {}",
+                          err,
+                          UpnpGetErrorMessage(err));
     }
 
     err = UpnpSearchAsync(ctrlptHandle_, SEARCH_TIMEOUT, UPNP_WANPPP_SERVICE, this);
     if (err != UPNP_E_SUCCESS) {
-        JAMI_WARN("PUPnP: Send search for UPNP_WANPPP_SERVICE failed. Error %d: %s",
-                  err,
-                  UpnpGetErrorMessage(err));
+        if (logger_)
+            logger_->warn("PUPnP: Send search for UPNP_WANPPP_SERVICE failed. Error {}: {}",
+                          err,
+                          UpnpGetErrorMessage(err));
     }
 }
 
@@ -309,10 +372,10 @@ PUPnP::clearIgds()
         return;
     }
 
-    JAMI_DBG("PUPnP: clearing IGDs and devices lists");
+    if (logger_)
+        logger_->debug("PUPnP: clearing IGDs and devices lists");
 
-    if (searchForIgdTimer_)
-        searchForIgdTimer_->cancel();
+    searchForIgdTimer_.cancel();
 
     igdSearchCounter_ = 0;
 
@@ -344,23 +407,27 @@ PUPnP::searchForIgd()
     updateHostAddress();
 
     if (isReady()) {
-        JAMI_DBG("PUPnP: Already have a valid IGD. Skip the search request");
+        if (logger_)
+            logger_->debug("PUPnP: Already have a valid IGD. Skip the search request");
         return;
     }
 
     if (igdSearchCounter_++ >= PUPNP_MAX_RESTART_SEARCH_RETRIES) {
-        JAMI_WARN("PUPnP: Setup failed after %u trials. PUPnP will be disabled!",
-                  PUPNP_MAX_RESTART_SEARCH_RETRIES);
+        if (logger_)
+            logger_->warn("PUPnP: Setup failed after {} trials. PUPnP will be disabled!",
+                          PUPNP_MAX_RESTART_SEARCH_RETRIES);
         return;
     }
 
-    JAMI_DBG("PUPnP: Start search for IGD: attempt %u", igdSearchCounter_);
+    if (logger_)
+        logger_->debug("PUPnP: Start search for IGD: attempt {}", igdSearchCounter_);
 
     // Do not init if the host is not valid. Otherwise, the init will fail
     // anyway and may put libupnp in an unstable state (mainly deadlocks)
     // even if the UpnpFinish() method is called.
     if (not hasValidHostAddress()) {
-        JAMI_WARN("PUPnP: Host address is invalid. Skipping the IGD search");
+        if (logger_)
+            logger_->warn("PUPnP: Host address is invalid. Skipping the IGD search");
     } else {
         // Init and register if needed
         if (not initialized_) {
@@ -373,8 +440,13 @@ PUPnP::searchForIgd()
         if (clientRegistered_) {
             assert(initialized_);
             searchForDevices();
+            // Re-validate the known IGDs right away, without waiting
+            // for the search responses.
+            for (const auto& [location, _] : igdCache_)
+                startIgdValidation(location);
         } else {
-            JAMI_WARN("PUPnP: PUPNP not fully setup. Skipping the IGD search");
+            if (logger_)
+                logger_->warn("PUPnP: PUPNP not fully setup. Skipping the IGD search");
         }
     }
 
@@ -382,15 +454,106 @@ PUPnP::searchForIgd()
     // The connectivity change may be received while the the local
     // interface is not fully setup. The rescheduling typically
     // usefull to mitigate this race.
-    if (searchForIgdTimer_)
-        searchForIgdTimer_->cancel();
+    searchForIgdTimer_.expires_after(PUPNP_SEARCH_RETRY_UNIT * igdSearchCounter_);
+    searchForIgdTimer_.async_wait([w = weak()](const asio::error_code& ec) {
+        if (ec == asio::error::operation_aborted)
+            return;
+        if (auto upnpThis = w.lock())
+            upnpThis->searchForIgd();
+    });
+}
 
-    searchForIgdTimer_ = getUpnContextScheduler()->scheduleIn(
-        [w = weak()] {
-            if (auto upnpThis = w.lock())
-                upnpThis->searchForIgd();
-        },
-        PUPNP_SEARCH_RETRY_UNIT * igdSearchCounter_);
+void
+PUPnP::probeIgd(const std::string& locationUrl)
+{
+    if (not isValidThread()) {
+        runOnPUPnPQueue([w = weak(), locationUrl] {
+            if (auto upnpThis = w.lock()) {
+                upnpThis->probeIgd(locationUrl);
+            }
+        });
+        return;
+    }
+
+    if (not hasValidHostAddress())
+        updateHostAddress();
+
+    // Same as for the search, don't init lib-upnp without a valid host address.
+    if (not hasValidHostAddress()) {
+        if (logger_)
+            logger_->warn("PUPnP: Host address is invalid. Skipping the IGD probe");
+        return;
+    }
+
+    if (not initialized_)
+        initUpnpLib();
+    if (initialized_ and not clientRegistered_)
+        registerClient();
+    if (not clientRegistered_) {
+        if (logger_)
+            logger_->warn("PUPnP: PUPNP not fully setup. Skipping the IGD probe");
+        return;
+    }
+
+    if (logger_)
+        logger_->debug("PUPnP: Probing IGD at {}", locationUrl);
+
+    startIgdValidation(locationUrl);
+}
+
+void
+PUPnP::addCachedIgd(const IgdCacheEntry& entry)
+{
+    if (not isValidThread()) {
+        runOnPUPnPQueue([w = weak(), entry] {
+            if (auto upnpThis = w.lock()) {
+                upnpThis->addCachedIgd(entry);
+            }
+        });
+        return;
+    }
+
+    if (entry.locationUrl.empty() or entry.controlUrl.empty())
+        return;
+
+    // Don't override a description downloaded by this instance.
+    igdCache_.emplace(entry.locationUrl,
+                      std::make_shared<UPnPIGD>(std::string(entry.uid),
+                                                std::string(entry.baseUrl),
+                                                std::string(entry.friendlyName),
+                                                std::string(entry.serviceType),
+                                                std::string(entry.serviceId),
+                                                std::string(entry.locationUrl),
+                                                std::string(entry.controlUrl),
+                                                std::string(entry.eventSubUrl)));
+}
+
+std::vector<IgdCacheEntry>
+PUPnP::getIgdCacheEntries() const
+{
+    std::lock_guard<std::mutex> lock(pupnpMutex_);
+    std::vector<IgdCacheEntry> entries;
+    for (auto const& igd : validIgdList_) {
+        auto upnpIgd = std::dynamic_pointer_cast<UPnPIGD>(igd);
+        if (not upnpIgd or not upnpIgd->isValid())
+            continue;
+        entries.push_back({upnpIgd->getUID(),
+                           upnpIgd->getBaseURL(),
+                           upnpIgd->getFriendlyName(),
+                           upnpIgd->getServiceType(),
+                           upnpIgd->getServiceId(),
+                           upnpIgd->getLocationURL(),
+                           upnpIgd->getControlURL(),
+                           upnpIgd->getEventSubURL(),
+                           upnpIgd->getPublicIp().toString()});
+    }
+    return entries;
+}
+
+void
+PUPnP::setLeaseDuration(std::chrono::seconds lease)
+{
+    leaseDuration_ = lease.count();
 }
 
 std::list<std::shared_ptr<IGD>>
@@ -449,6 +612,9 @@ PUPnP::incrementErrorsCounter(const std::shared_ptr<IGD>& igd)
     if (not igd or not igd->isValid())
         return;
     if (not igd->incrementErrorsCounter()) {
+        if (logger_)
+            logger_->warn("PUPnP: IGD {} has too many errors, it will be disabled",
+                          igd->toString());
         // Disable this IGD.
         igd->setValid(false);
         // Notify the listener.
@@ -470,62 +636,147 @@ PUPnP::validateIgd(const std::string& location, IXML_Document* doc_container_ptr
     auto deviceType = getFirstDocItem(descDoc, "deviceType");
     if (deviceType != UPNP_IGD_DEVICE) {
         // Device type not IGD.
+        pendingValidations_.erase(location);
         return false;
     }
 
     std::shared_ptr<UPnPIGD> igd_candidate = parseIgd(descDoc, location);
     if (not igd_candidate) {
         // No valid IGD candidate.
+        pendingValidations_.erase(location);
         return false;
     }
 
-    JAMI_DBG("PUPnP: Validating the IGD candidate [UDN: %s]\n"
-             "    Name         : %s\n"
-             "    Service Type : %s\n"
-             "    Service ID   : %s\n"
-             "    Base URL     : %s\n"
-             "    Location URL : %s\n"
-             "    control URL  : %s\n"
-             "    Event URL    : %s",
-             igd_candidate->getUID().c_str(),
-             igd_candidate->getFriendlyName().c_str(),
-             igd_candidate->getServiceType().c_str(),
-             igd_candidate->getServiceId().c_str(),
-             igd_candidate->getBaseURL().c_str(),
-             igd_candidate->getLocationURL().c_str(),
-             igd_candidate->getControlURL().c_str(),
-             igd_candidate->getEventSubURL().c_str());
-
-    // Check if IGD is connected.
-    if (not actionIsIgdConnected(*igd_candidate)) {
-        JAMI_WARN("PUPnP: IGD candidate %s is not connected", igd_candidate->getUID().c_str());
-        return false;
-    }
+    // Keep the description, so the IGD can be re-validated without
+    // downloading it again.
+    igdCache_[location] = igd_candidate;
 
-    // Validate external Ip.
-    igd_candidate->setPublicIp(actionGetExternalIP(*igd_candidate));
-    if (igd_candidate->getPublicIp().toString().empty()) {
-        JAMI_WARN("PUPnP: IGD candidate %s has no valid external Ip",
-                  igd_candidate->getUID().c_str());
-        return false;
-    }
+    validateIgdCandidate(igd_candidate);
+    return true;
+}
+
+std::shared_ptr<UPnPIGD>
+PUPnP::getCachedIgd(const std::string& locationUrl) const
+{
+    CHECK_VALID_THREAD();
+
+    auto it = igdCache_.find(locationUrl);
+    if (it == igdCache_.end())
+        return {};
+
+    const auto& igd = *it->second;
+    return std::make_shared<UPnPIGD>(igd.getUID(),
+                                     std::string(igd.getBaseURL()),
+                                     std::string(igd.getFriendlyName()),
+                                     std::string(igd.getServiceType()),
+                                     std::string(igd.getServiceId()),
+                                     std::string(igd.getLocationURL()),
+                                     std::string(igd.getControlURL()),
+                                     std::string(igd.getEventSubURL()));
+}
+
+void
+PUPnP::validateIgdCandidate(const std::shared_ptr<UPnPIGD>& igd_candidate)
+{
+    CHECK_VALID_THREAD();
+
+    if (logger_)
+        logger_->debug("PUPnP: Validating the IGD candidate [UDN: {}]\n"
+                       "    Name         : {}\n"
+                       "    Service Type : {}\n"
+                       "    Service ID   : {}\n"
+                       "    Base URL     : {}\n"
+                       "    Location URL : {}\n"
+                       "    control URL  : {}\n"
+                       "    Event URL    : {}",
+                       igd_candidate->getUID(),
+                       igd_candidate->getFriendlyName(),
+                       igd_candidate->getServiceType(),
+                       igd_candidate->getServiceId(),
+                       igd_candidate->getBaseURL(),
+                       igd_candidate->getLocationURL(),
+                       igd_candidate->getControlURL(),
+                       igd_candidate->getEventSubURL());
+
+    // The status and the external address are independent, so both
+    // actions are sent at once. The results are joined on the PUPNP queue.
+    struct ValidationState
+    {
+        unsigned pending {2};
+        bool connected {false};
+        IpAddr publicIp {};
+    };
+    auto state = std::make_shared<ValidationState>();
+
+    auto onResult = [state, igd_candidate](PUPnP& upnpThis) {
+        if (--state->pending > 0)
+            return;
+
+        const auto& location = igd_candidate->getLocationURL();
+        upnpThis.pendingValidations_.erase(location);
+
+        bool valid = false;
+        if (not state->connected) {
+            if (upnpThis.logger_)
+                upnpThis.logger_->warn("PUPnP: IGD candidate {} is not connected",
+                                       igd_candidate->getUID());
+        } else if (state->publicIp.toString().empty()) {
+            if (upnpThis.logger_)
+                upnpThis.logger_->warn("PUPnP: IGD candidate {} has no valid external Ip",
+                                       igd_candidate->getUID());
+        } else {
+            igd_candidate->setPublicIp(state->publicIp);
+            valid = true;
+        }
+
+        if (not valid) {
+            // Download the description again on the next attempt.
+            upnpThis.igdCache_.erase(location);
+            return;
+        }
+        upnpThis.addValidIgd(igd_candidate);
+    };
+
+    runAction(
+        [igd_candidate](PUPnP& upnpThis) { return upnpThis.actionIsIgdConnected(*igd_candidate); },
+        [state, onResult](PUPnP& upnpThis, bool connected) {
+            state->connected = connected;
+            onResult(upnpThis);
+        });
+    runAction(
+        [igd_candidate](PUPnP& upnpThis) { return upnpThis.actionGetExternalIP(*igd_candidate); },
+        [state, onResult](PUPnP& upnpThis, IpAddr publicIp) {
+            state->publicIp = std::move(publicIp);
+            onResult(upnpThis);
+        });
+}
+
+void
+PUPnP::addValidIgd(const std::shared_ptr<UPnPIGD>& igd_candidate)
+{
+    CHECK_VALID_THREAD();
 
     // Validate internal Ip.
     if (igd_candidate->getBaseURL().empty()) {
-        JAMI_WARN("PUPnP: IGD candidate %s has no valid internal Ip",
-                  igd_candidate->getUID().c_str());
-        return false;
+        if (logger_)
+            logger_->warn("PUPnP: IGD candidate {} has no valid internal Ip",
+                          igd_candidate->getUID());
+        return;
     }
 
-    // Typically the IGD local address should be extracted from the XML
-    // document (e.g. parsing the base URL). For simplicity, we assume
-    // that it matches the gateway as seen by the local interface.
-    if (const auto& localGw = ip_utils::getLocalGateway()) {
-        igd_candidate->setLocalIp(localGw);
+    // The IGD local address is the host of its location URL, when it's
+    // an IP address. Otherwise, we assume that it matches the gateway as
+    // seen by the local interface.
+    IpAddr localIp(dht::http::Url(igd_candidate->getLocationURL()).host);
+    if (not localIp)
+        localIp = ip_utils::getLocalGateway();
+    if (localIp) {
+        igd_candidate->setLocalIp(localIp);
     } else {
-        JAMI_WARN("PUPnP: Could not set internal address for IGD candidate %s",
-                  igd_candidate->getUID().c_str());
-        return false;
+        if (logger_)
+            logger_->warn("PUPnP: Could not set internal address for IGD candidate {}",
+                          igd_candidate->getUID());
+        return;
     }
 
     // Store info for subscription.
@@ -538,12 +789,13 @@ PUPnP::validateIgd(const std::string& location, IXML_Document* doc_container_ptr
             // Must not be a null pointer
             assert(igd.get() != nullptr);
             if (*igd == *igd_candidate) {
-                JAMI_DBG("PUPnP: Device [%s] with int/ext addresses [%s:%s] is already in the list "
-                         "of valid IGDs",
-                         igd_candidate->getUID().c_str(),
-                         igd_candidate->toString().c_str(),
-                         igd_candidate->getPublicIp().toString().c_str());
-                return true;
+                if (logger_)
+                    logger_->debug("PUPnP: Device [{}] with int/ext addresses [{}:{}] is already "
+                                   "in the list of valid IGDs",
+                                   igd_candidate->getUID(),
+                                   igd_candidate->toString(),
+                                   igd_candidate->getPublicIp().toString());
+                return;
             }
         }
     }
@@ -551,12 +803,14 @@ PUPnP::validateIgd(const std::string& location, IXML_Document* doc_container_ptr
     // We have a valid IGD
     igd_candidate->setValid(true);
 
-    JAMI_DBG("PUPnP: Added a new IGD [%s] to the list of valid IGDs",
-             igd_candidate->getUID().c_str());
+    if (logger_)
+        logger_->debug("PUPnP: Added a new IGD [{}] to the list of valid IGDs",
+                       igd_candidate->getUID());
 
-    JAMI_DBG("PUPnP: New IGD addresses [int: %s - ext: %s]",
-             igd_candidate->toString().c_str(),
-             igd_candidate->getPublicIp().toString().c_str());
+    if (logger_)
+        logger_->debug("PUPnP: New IGD addresses [int: {} - ext: {}]",
+                       igd_candidate->toString(),
+                       igd_candidate->getPublicIp().toString());
 
     // Subscribe to IGD events.
     int upnp_err = UpnpSubscribeAsync(ctrlptHandle_,
@@ -565,13 +819,15 @@ PUPnP::validateIgd(const std::string& location, IXML_Document* doc_container_ptr
                                       subEventCallback,
                                       this);
     if (upnp_err != UPNP_E_SUCCESS) {
-        JAMI_WARN("PUPnP: Failed to send subscribe request to %s: error %i - %s",
-                  igd_candidate->getUID().c_str(),
-                  upnp_err,
-                  UpnpGetErrorMessage(upnp_err));
+        if (logger_)
+            logger_->warn("PUPnP: Failed to send subscribe request to {}: error {} - {}",
+                          igd_candidate->getUID(),
+                          upnp_err,
+                          UpnpGetErrorMessage(upnp_err));
         // return false;
     } else {
-        JAMI_DBG("PUPnP: Successfully subscribed to IGD %s", igd_candidate->getUID().c_str());
+        if (logger_)
+            logger_->debug("PUPnP: Successfully subscribed to IGD {}", igd_candidate->getUID());
     }
 
     {
@@ -587,49 +843,79 @@ PUPnP::validateIgd(const std::string& location, IXML_Document* doc_container_ptr
                 upnpThis->observer_->onIgdUpdated(igd_candidate, UpnpIgdEvent::ADDED);
         }
     });
-
-    return true;
 }
 
 void
 PUPnP::requestMappingAdd(const Mapping& mapping)
 {
-    runOnPUPnPQueue([w = weak(), mapping] {
-        if (auto upnpThis = w.lock()) {
-            if (not upnpThis->isRunning())
+    // The requests are sent concurrently (up to PUPNP_MAX_PARALLEL_ACTIONS),
+    // and the results are processed on the PUPNP queue.
+    runAction(
+        [mapping](PUPnP& upnpThis) {
+            return upnpThis.isRunning() and upnpThis.actionAddPortMapping(mapping);
+        },
+        [mapping](PUPnP& upnpThis, bool success) {
+            // Abort if we are shutting down.
+            if (not upnpThis.isRunning())
                 return;
             Mapping mapRes(mapping);
-            if (upnpThis->actionAddPortMapping(mapRes)) {
+            if (success) {
                 mapRes.setState(MappingState::OPEN);
-                mapRes.setInternalAddress(upnpThis->getHostAddress().toString());
-                upnpThis->processAddMapAction(mapRes);
+                mapRes.setInternalAddress(upnpThis.getHostAddress().toString());
+                mapRes.setRenewalTime(upnpThis.getRenewalTime());
+                upnpThis.processAddMapAction(mapRes);
             } else {
-                upnpThis->incrementErrorsCounter(mapRes.getIgd());
+                upnpThis.incrementErrorsCounter(mapRes.getIgd());
                 mapRes.setState(MappingState::FAILED);
-                upnpThis->processRequestMappingFailure(mapRes);
+                upnpThis.processRequestMappingFailure(mapRes);
             }
-        }
-    });
+        });
+}
+
+void
+PUPnP::requestMappingRenew(const Mapping& mapping)
+{
+    runAction(
+        [mapping](PUPnP& upnpThis) {
+            return upnpThis.isRunning() and upnpThis.actionAddPortMapping(mapping);
+        },
+        [mapping](PUPnP& upnpThis, bool success) {
+            if (not upnpThis.isRunning())
+                return;
+            Mapping mapRes(mapping);
+            if (success) {
+                mapRes.setRenewalTime(upnpThis.getRenewalTime());
+                upnpThis.processRenewMapAction(mapRes);
+            } else {
+                if (upnpThis.logger_)
+                    upnpThis.logger_->warn("PUPnP: Failed to renew mapping {}", mapRes.toString());
+                upnpThis.incrementErrorsCounter(mapRes.getIgd());
+                mapRes.setState(MappingState::FAILED);
+                upnpThis.processRequestMappingFailure(mapRes);
+            }
+        });
 }
 
 void
 PUPnP::requestMappingRemove(const Mapping& mapping)
 {
     // Send remove request using the matching IGD
-    runOnPUPnPQueue([w = weak(), mapping] {
-        if (auto upnpThis = w.lock()) {
+    runAction(
+        [mapping](PUPnP& upnpThis) {
+            return upnpThis.isRunning() and upnpThis.actionDeletePortMapping(mapping);
+        },
+        [mapping](PUPnP& upnpThis, bool success) {
             // Abort if we are shutting down.
-            if (not upnpThis->isRunning())
+            if (not upnpThis.isRunning())
                 return;
-            if (upnpThis->actionDeletePortMapping(mapping)) {
-                upnpThis->processRemoveMapAction(mapping);
+            if (success) {
+                upnpThis.processRemoveMapAction(mapping);
             } else {
                 assert(mapping.getIgd());
                 // Dont need to report in case of failure.
-                upnpThis->incrementErrorsCounter(mapping.getIgd());
+                upnpThis.incrementErrorsCounter(mapping.getIgd());
             }
-        }
-    });
+        });
 }
 
 std::shared_ptr<UPnPIGD>
@@ -647,7 +933,8 @@ PUPnP::findMatchingIgd(const std::string& ctrlURL) const
                              });
 
     if (iter == validIgdList_.end()) {
-        JAMI_WARN("PUPnP: Did not find the IGD matching ctrl URL [%s]", ctrlURL.c_str());
+        if (logger_)
+            logger_->warn("PUPnP: Did not find the IGD matching ctrl URL [{}]", ctrlURL);
         return {};
     }
 
@@ -670,6 +957,32 @@ PUPnP::processAddMapAction(const Mapping& map)
     });
 }
 
+void
+PUPnP::processRenewMapAction(const Mapping& map)
+{
+    CHECK_VALID_THREAD();
+
+    if (observer_ == nullptr)
+        return;
+
+    runOnUpnpContextQueue([w = weak(), map] {
+        if (auto upnpThis = w.lock()) {
+            if (upnpThis->observer_)
+                upnpThis->observer_->onMappingRenewed(map.getIgd(), std::move(map));
+        }
+    });
+}
+
+sys_clock::time_point
+PUPnP::getRenewalTime() const
+{
+    std::chrono::seconds lease(leaseDuration_);
+    if (lease == std::chrono::seconds::zero())
+        return sys_clock::time_point::max();
+    // Leave some time for the renewal to complete.
+    return sys_clock::now() + lease * 4 / 5;
+}
+
 void
 PUPnP::processRequestMappingFailure(const Mapping& map)
 {
@@ -680,7 +993,8 @@ PUPnP::processRequestMappingFailure(const Mapping& map)
 
     runOnUpnpContextQueue([w = weak(), map] {
         if (auto upnpThis = w.lock()) {
-            JAMI_DBG("PUPnP: Failed to request mapping %s", map.toString().c_str());
+            if (upnpThis->logger_)
+                upnpThis->logger_->debug("PUPnP: Failed to request mapping {}", map.toString());
             if (upnpThis->observer_)
                 upnpThis->observer_->onMappingRequestFailed(map);
         }
@@ -695,8 +1009,9 @@ PUPnP::processRemoveMapAction(const Mapping& map)
     if (observer_ == nullptr)
         return;
 
-    runOnUpnpContextQueue([map, obs = observer_] {
-        JAMI_DBG("PUPnP: Closed mapping %s", map.toString().c_str());
+    runOnUpnpContextQueue([map, obs = observer_, logger = logger_] {
+        if (logger)
+            logger->debug("PUPnP: Closed mapping {}", map.toString());
         obs->onMappingRemoved(map.getIgd(), std::move(map));
     });
 }
@@ -746,7 +1061,7 @@ PUPnP::ctrlPtCallback(Upnp_EventType event_type, const void* event, void* user_d
     auto pupnp = static_cast<PUPnP*>(user_data);
 
     if (pupnp == nullptr) {
-        JAMI_WARN("PUPnP: Control point callback without PUPnP");
+        // Control point callback without PUPnP.
         return UPNP_E_SUCCESS;
     }
 
@@ -794,7 +1109,8 @@ PUPnP::processDiscoverySearchResult(const std::string& cpDeviceId,
 
     // The host address must be valid to proceed.
     if (not hasValidHostAddress()) {
-        JAMI_WARN("PUPnP: Local address is invalid. Ignore search result for now!");
+        if (logger_)
+            logger_->warn("PUPnP: Local address is invalid. Ignore search result for now!");
         return;
     }
 
@@ -804,11 +1120,13 @@ PUPnP::processDiscoverySearchResult(const std::string& cpDeviceId,
     auto igdId = cpDeviceId + " url: " + igdLocationUrl;
 
     if (not discoveredIgdList_.emplace(igdId).second) {
-        // JAMI_WARN("PUPnP: IGD [%s] already in the list", igdId.c_str());
+        // if (logger_)
+        //     logger_->warn("PUPnP: IGD [{}] already in the list", igdId);
         return;
     }
 
-    JAMI_DBG("PUPnP: Discovered a new IGD [%s]", igdId.c_str());
+    if (logger_)
+        logger_->debug("PUPnP: Discovered a new IGD [{}]", igdId);
 
     // NOTE: here, we check if the location given is related to the source address.
     // If it's not the case, it's certainly a router plugged in the network, but not
@@ -818,17 +1136,34 @@ PUPnP::processDiscoverySearchResult(const std::string& cpDeviceId,
     // Only check the IP address (ignore the port number).
     dht::http::Url url(igdLocationUrl);
     if (IpAddr(url.host).toString(false) != dstAddr.toString(false)) {
-        JAMI_DBG("PUPnP: Returned location %s does not match the source address %s",
-                 IpAddr(url.host).toString(true, true).c_str(),
-                 dstAddr.toString(true, true).c_str());
+        if (logger_)
+            logger_->debug("PUPnP: Returned location {} does not match the source address {}",
+                           IpAddr(url.host).toString(true, true),
+                           dstAddr.toString(true, true));
         return;
     }
 
-    // Run a separate thread to prevent blocking this thread
+    startIgdValidation(igdLocationUrl);
+}
+
+void
+PUPnP::startIgdValidation(const std::string& locationUrl)
+{
+    CHECK_VALID_THREAD();
+
+    if (not pendingValidations_.emplace(locationUrl).second)
+        return;
+
+    if (auto igd = getCachedIgd(locationUrl)) {
+        validateIgdCandidate(igd);
+        return;
+    }
+
+    // Download on the action pool to prevent blocking this thread
     // if the IGD HTTP server is not responsive.
-    dht::ThreadPool::io().run([w = weak(), igdLocationUrl] {
+    asio::post(*actionContext_, [w = weak(), locationUrl] {
         if (auto upnpThis = w.lock()) {
-            upnpThis->downLoadIgdDescription(igdLocationUrl);
+            upnpThis->downLoadIgdDescription(locationUrl);
         }
     });
 }
@@ -840,11 +1175,18 @@ PUPnP::downLoadIgdDescription(const std::string& locationUrl)
     int upnp_err = UpnpDownloadXmlDoc(locationUrl.c_str(), &doc_container_ptr);
 
     if (upnp_err != UPNP_E_SUCCESS or not doc_container_ptr) {
-        JAMI_WARN("PUPnP: Error downloading device XML document from %s -> %s",
-                  locationUrl.c_str(),
-                  UpnpGetErrorMessage(upnp_err));
+        if (logger_)
+            logger_->warn("PUPnP: Error downloading device XML document from {} -> {}",
+                          locationUrl,
+                          UpnpGetErrorMessage(upnp_err));
+        runOnPUPnPQueue([w = weak(), locationUrl] {
+            if (auto upnpThis = w.lock()) {
+                upnpThis->pendingValidations_.erase(locationUrl);
+            }
+        });
     } else {
-        JAMI_DBG("PUPnP: Succeeded to download device XML document from %s", locationUrl.c_str());
+        if (logger_)
+            logger_->debug("PUPnP: Succeeded to download device XML document from {}", locationUrl);
         runOnPUPnPQueue([w = weak(), url = locationUrl, doc_container_ptr] {
             if (auto upnpThis = w.lock()) {
                 upnpThis->validateIgd(url, doc_container_ptr);
@@ -866,10 +1208,11 @@ PUPnP::processDiscoveryAdvertisementByebye(const std::string& cpDeviceId)
         for (auto it = validIgdList_.begin(); it != validIgdList_.end();) {
             if ((*it)->getUID() == cpDeviceId) {
                 igd = *it;
-                JAMI_DBG("PUPnP: Received [%s] for IGD [%s] %s. Will be removed.",
-                         PUPnP::eventTypeToString(UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE),
-                         igd->getUID().c_str(),
-                         igd->toString().c_str());
+                if (logger_)
+                    logger_->debug("PUPnP: Received [{}] for IGD [{}] {}. Will be removed.",
+                                   PUPnP::eventTypeToString(UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE),
+                                   igd->getUID(),
+                                   igd->toString());
                 igd->setValid(false);
                 // Remove the IGD.
                 it = validIgdList_.erase(it);
@@ -895,10 +1238,11 @@ PUPnP::processDiscoverySubscriptionExpired(Upnp_EventType event_type, const std:
     for (auto& it : validIgdList_) {
         if (auto igd = std::dynamic_pointer_cast<UPnPIGD>(it)) {
             if (igd->getEventSubURL() == eventSubUrl) {
-                JAMI_DBG("PUPnP: Received [%s] event for IGD [%s] %s. Request a new subscribe.",
-                         PUPnP::eventTypeToString(event_type),
-                         igd->getUID().c_str(),
-                         igd->toString().c_str());
+                if (logger_)
+                    logger_->debug("PUPnP: Received [{}] event for IGD [{}] {}. Request a new subscribe.",
+                                   PUPnP::eventTypeToString(event_type),
+                                   igd->getUID(),
+                                   igd->toString());
                 UpnpSubscribeAsync(ctrlptHandle_,
                                    eventSubUrl.c_str(),
                                    UPNP_INFINITE,
@@ -923,8 +1267,9 @@ PUPnP::handleCtrlPtUPnPEvents(Upnp_EventType event_type, const void* event)
         // First check the error code.
         auto upnp_status = UpnpDiscovery_get_ErrCode(d_event);
         if (upnp_status != UPNP_E_SUCCESS) {
-            JAMI_ERR("PUPnP: UPNP discovery is in erroneous state: %s",
-                     UpnpGetErrorMessage(upnp_status));
+            if (logger_)
+                logger_->error("PUPnP: UPNP discovery is in erroneous state: {}",
+                               UpnpGetErrorMessage(upnp_status));
             break;
         }
 
@@ -969,10 +1314,12 @@ PUPnP::handleCtrlPtUPnPEvents(Upnp_EventType event_type, const void* event)
     case UPNP_EVENT_AUTORENEWAL_FAILED:
     case UPNP_EVENT_SUBSCRIPTION_EXPIRED: // This event will occur only if autorenewal is disabled.
     {
-        JAMI_WARN("PUPnP: Received Subscription Event %s", eventTypeToString(event_type));
+        if (logger_)
+            logger_->warn("PUPnP: Received Subscription Event {}", eventTypeToString(event_type));
         const UpnpEventSubscribe* es_event = (const UpnpEventSubscribe*) event;
         if (es_event == nullptr) {
-            JAMI_WARN("PUPnP: Received Subscription Event with null pointer");
+            if (logger_)
+                logger_->warn("PUPnP: Received Subscription Event with null pointer");
             break;
         }
         std::string publisherUrl(UpnpEventSubscribe_get_PublisherUrl_cstr(es_event));
@@ -989,7 +1336,8 @@ PUPnP::handleCtrlPtUPnPEvents(Upnp_EventType event_type, const void* event)
     case UPNP_EVENT_UNSUBSCRIBE_COMPLETE: {
         UpnpEventSubscribe* es_event = (UpnpEventSubscribe*) event;
         if (es_event == nullptr) {
-            JAMI_WARN("PUPnP: Received Subscription Event with null pointer");
+            if (logger_)
+                logger_->warn("PUPnP: Received Subscription Event with null pointer");
         } else {
             UpnpEventSubscribe_delete(es_event);
         }
@@ -998,18 +1346,23 @@ PUPnP::handleCtrlPtUPnPEvents(Upnp_EventType event_type, const void* event)
     case UPNP_CONTROL_ACTION_COMPLETE: {
         const UpnpActionComplete* a_event = (const UpnpActionComplete*) event;
         if (a_event == nullptr) {
-            JAMI_WARN("PUPnP: Received Action Complete Event with null pointer");
+            if (logger_)
+                logger_->warn("PUPnP: Received Action Complete Event with null pointer");
             break;
         }
         auto res = UpnpActionComplete_get_ErrCode(a_event);
         if (res != UPNP_E_SUCCESS and res != UPNP_E_TIMEDOUT) {
             auto err = UpnpActionComplete_get_ErrCode(a_event);
-            JAMI_WARN("PUPnP: Received Action Complete error %i %s", err, UpnpGetErrorMessage(err));
+            if (logger_)
+                logger_->warn("PUPnP: Received Action Complete error {} {}",
+                              err,
+                              UpnpGetErrorMessage(err));
         } else {
             auto actionRequest = UpnpActionComplete_get_ActionRequest(a_event);
             // Abort if there is no action to process.
             if (actionRequest == nullptr) {
-                JAMI_WARN("PUPnP: Can't get the Action Request data from the event");
+                if (logger_)
+                    logger_->warn("PUPnP: Can't get the Action Request data from the event");
                 break;
             }
 
@@ -1017,13 +1370,15 @@ PUPnP::handleCtrlPtUPnPEvents(Upnp_EventType event_type, const void* event)
             if (actionResult != nullptr) {
                 ixmlDocument_free(actionResult);
             } else {
-                JAMI_WARN("PUPnP: Action Result document not found");
+                if (logger_)
+                    logger_->warn("PUPnP: Action Result document not found");
             }
         }
         break;
     }
     default: {
-        JAMI_WARN("PUPnP: Unhandled Control Point event");
+        if (logger_)
+            logger_->warn("PUPnP: Unhandled Control Point event");
         break;
     }
     }
@@ -1036,7 +1391,7 @@ PUPnP::subEventCallback(Upnp_EventType event_type, const void* event, void* user
 {
     if (auto pupnp = static_cast<PUPnP*>(user_data))
         return pupnp->handleSubscriptionUPnPEvent(event_type, event);
-    JAMI_WARN("PUPnP: Subscription callback without service Id string");
+    // Subscription callback without service Id string.
     return 0;
 }
 
@@ -1046,15 +1401,17 @@ PUPnP::handleSubscriptionUPnPEvent(Upnp_EventType, const void* event)
     UpnpEventSubscribe* es_event = static_cast<UpnpEventSubscribe*>(const_cast<void*>(event));
 
     if (es_event == nullptr) {
-        JAMI_ERR("PUPnP: Unexpected null pointer!");
+        if (logger_)
+            logger_->error("PUPnP: Unexpected null pointer!");
         return UPNP_E_INVALID_ARGUMENT;
     }
     std::string publisherUrl(UpnpEventSubscribe_get_PublisherUrl_cstr(es_event));
     int upnp_err = UpnpEventSubscribe_get_ErrCode(es_event);
     if (upnp_err != UPNP_E_SUCCESS) {
-        JAMI_WARN("PUPnP: Subscription error %s from %s",
-                  UpnpGetErrorMessage(upnp_err),
-                  publisherUrl.c_str());
+        if (logger_)
+            logger_->warn("PUPnP: Subscription error {} from {}",
+                          UpnpGetErrorMessage(upnp_err),
+                          publisherUrl);
         return upnp_err;
     }
 
@@ -1070,7 +1427,8 @@ PUPnP::parseIgd(IXML_Document* doc, std::string locationUrl)
     // Check the UDN to see if its already in our device list.
     std::string UDN(getFirstDocItem(doc, "UDN"));
     if (UDN.empty()) {
-        JAMI_WARN("PUPnP: could not find UDN in description document of device");
+        if (logger_)
+            logger_->warn("PUPnP: could not find UDN in description document of device");
         return nullptr;
     } else {
         std::lock_guard<std::mutex> lk(pupnpMutex_);
@@ -1082,7 +1440,8 @@ PUPnP::parseIgd(IXML_Document* doc, std::string locationUrl)
         }
     }
 
-    JAMI_DBG("PUPnP: Found new device [%s]", UDN.c_str());
+    if (logger_)
+        logger_->debug("PUPnP: Found new device [{}]", UDN);
 
     std::unique_ptr<UPnPIGD> new_igd;
     int upnp_err;
@@ -1145,16 +1504,17 @@ PUPnP::parseIgd(IXML_Document* doc, std::string locationUrl)
         upnp_err = UpnpResolveURL2(baseURL.c_str(), controlURL.c_str(), &absolute_control_url);
         if (upnp_err == UPNP_E_SUCCESS)
             controlURL = absolute_control_url;
-        else
-            JAMI_WARN("PUPnP: Error resolving absolute controlURL -> %s",
-                      UpnpGetErrorMessage(upnp_err));
+        else if (logger_)
+            logger_->warn("PUPnP: Error resolving absolute controlURL -> {}",
+                          UpnpGetErrorMessage(upnp_err));
 
         std::free(absolute_control_url);
 
         // Get the relative eventSubURL and turn it into absolute address using the URLBase.
         std::string eventSubURL(getFirstElementItem(service_element, "eventSubURL"));
         if (eventSubURL.empty()) {
-            JAMI_WARN("PUPnP: IGD event sub URL is empty. Going to next node");
+            if (logger_)
+                logger_->warn("PUPnP: IGD event sub URL is empty. Going to next node");
             continue;
         }
 
@@ -1162,9 +1522,9 @@ PUPnP::parseIgd(IXML_Document* doc, std::string locationUrl)
         upnp_err = UpnpResolveURL2(baseURL.c_str(), eventSubURL.c_str(), &absolute_event_sub_url);
         if (upnp_err == UPNP_E_SUCCESS)
             eventSubURL = absolute_event_sub_url;
-        else
-            JAMI_WARN("PUPnP: Error resolving absolute eventSubURL -> %s",
-                      UpnpGetErrorMessage(upnp_err));
+        else if (logger_)
+            logger_->warn("PUPnP: Error resolving absolute eventSubURL -> {}",
+                          UpnpGetErrorMessage(upnp_err));
 
         std::free(absolute_event_sub_url);
 
@@ -1195,7 +1555,8 @@ PUPnP::actionIsIgdConnected(const UPnPIGD& igd)
                                           0,
                                           nullptr);
     if (not action_container_ptr) {
-        JAMI_WARN("PUPnP: Failed to make GetStatusInfo action");
+        if (logger_)
+            logger_->warn("PUPnP: Failed to make GetStatusInfo action");
         return false;
     }
     XMLDocument action(action_container_ptr, ixmlDocument_free); // Action pointer.
@@ -1208,16 +1569,19 @@ PUPnP::actionIsIgdConnected(const UPnPIGD& igd)
                                   action.get(),
                                   &response_container_ptr);
     if (not response_container_ptr or upnp_err != UPNP_E_SUCCESS) {
-        JAMI_WARN("PUPnP: Failed to send GetStatusInfo action -> %s", UpnpGetErrorMessage(upnp_err));
+        if (logger_)
+            logger_->warn("PUPnP: Failed to send GetStatusInfo action -> {}",
+                          UpnpGetErrorMessage(upnp_err));
         return false;
     }
     XMLDocument response(response_container_ptr, ixmlDocument_free);
 
-    if (errorOnResponse(response.get())) {
-        JAMI_WARN("PUPnP: Failed to get GetStatusInfo from %s -> %d: %s",
-                  igd.getServiceType().c_str(),
-                  upnp_err,
-                  UpnpGetErrorMessage(upnp_err));
+    if (errorOnResponse(response.get(), logger_)) {
+        if (logger_)
+            logger_->warn("PUPnP: Failed to get GetStatusInfo from {} -> {}: {}",
+                          igd.getServiceType(),
+                          upnp_err,
+                          UpnpGetErrorMessage(upnp_err));
         return false;
     }
 
@@ -1246,7 +1610,8 @@ PUPnP::actionGetExternalIP(const UPnPIGD& igd)
     action.reset(action_container_ptr);
 
     if (not action) {
-        JAMI_WARN("PUPnP: Failed to make GetExternalIPAddress action");
+        if (logger_)
+            logger_->warn("PUPnP: Failed to make GetExternalIPAddress action");
         return {};
     }
 
@@ -1260,128 +1625,183 @@ PUPnP::actionGetExternalIP(const UPnPIGD& igd)
     response.reset(response_container_ptr);
 
     if (not response or upnp_err != UPNP_E_SUCCESS) {
-        JAMI_WARN("PUPnP: Failed to send GetExternalIPAddress action -> %s",
-                  UpnpGetErrorMessage(upnp_err));
+        if (logger_)
+            logger_->warn("PUPnP: Failed to send GetExternalIPAddress action -> {}",
+                          UpnpGetErrorMessage(upnp_err));
         return {};
     }
 
-    if (errorOnResponse(response.get())) {
-        JAMI_WARN("PUPnP: Failed to get GetExternalIPAddress from %s -> %d: %s",
-                  igd.getServiceType().c_str(),
-                  upnp_err,
-                  UpnpGetErrorMessage(upnp_err));
+    if (errorOnResponse(response.get(), logger_)) {
+        if (logger_)
+            logger_->warn("PUPnP: Failed to get GetExternalIPAddress from {} -> {}: {}",
+                          igd.getServiceType(),
+                          upnp_err,
+                          UpnpGetErrorMessage(upnp_err));
         return {};
     }
 
     return {getFirstDocItem(response.get(), "NewExternalIPAddress")};
 }
 
-std::map<Mapping::key_t, Mapping>
-PUPnP::getMappingsListByDescr(const std::shared_ptr<IGD>& igd, const std::string& description) const
+PUPnP::MappingEntry
+PUPnP::actionGetGenericPortMappingEntry(const UPnPIGD& igd, int index) const
 {
-    auto upnpIgd = std::dynamic_pointer_cast<UPnPIGD>(igd);
-    assert(upnpIgd);
-
-    std::map<Mapping::key_t, Mapping> mapList;
-
-    if (not clientRegistered_ or not upnpIgd->isValid() or not upnpIgd->getLocalIp())
-        return mapList;
+    MappingEntry entry;
 
     // Set action name.
     static constexpr const char* action_name {"GetGenericPortMappingEntry"};
 
-    for (int entry_idx = 0;; entry_idx++) {
-        std::unique_ptr<IXML_Document, decltype(ixmlDocument_free)&>
-            action(nullptr, ixmlDocument_free); // Action pointer.
-        IXML_Document* action_container_ptr = nullptr;
+    std::unique_ptr<IXML_Document, decltype(ixmlDocument_free)&>
+        action(nullptr, ixmlDocument_free); // Action pointer.
+    IXML_Document* action_container_ptr = nullptr;
+
+    std::unique_ptr<IXML_Document, decltype(ixmlDocument_free)&>
+        response(nullptr, ixmlDocument_free); // Response pointer.
+    IXML_Document* response_container_ptr = nullptr;
+
+    UpnpAddToAction(&action_container_ptr,
+                    action_name,
+                    igd.getServiceType().c_str(),
+                    "NewPortMappingIndex",
+                    std::to_string(index).c_str());
+    action.reset(action_container_ptr);
 
-        std::unique_ptr<IXML_Document, decltype(ixmlDocument_free)&>
-            response(nullptr, ixmlDocument_free); // Response pointer.
-        IXML_Document* response_container_ptr = nullptr;
+    if (not action) {
+        if (logger_)
+            logger_->warn("PUPnP: Failed to add NewPortMappingIndex action");
+        return entry;
+    }
 
-        UpnpAddToAction(&action_container_ptr,
-                        action_name,
-                        upnpIgd->getServiceType().c_str(),
-                        "NewPortMappingIndex",
-                        std::to_string(entry_idx).c_str());
-        action.reset(action_container_ptr);
+    int upnp_err = UpnpSendAction(ctrlptHandle_,
+                                  igd.getControlURL().c_str(),
+                                  igd.getServiceType().c_str(),
+                                  nullptr,
+                                  action.get(),
+                                  &response_container_ptr);
+    response.reset(response_container_ptr);
 
-        if (not action) {
-            JAMI_WARN("PUPnP: Failed to add NewPortMappingIndex action");
-            break;
-        }
+    if (not response) {
+        // No existing mapping. Abort silently.
+        entry.status = MappingEntry::Status::END;
+        return entry;
+    }
 
-        int upnp_err = UpnpSendAction(ctrlptHandle_,
-                                      upnpIgd->getControlURL().c_str(),
-                                      upnpIgd->getServiceType().c_str(),
-                                      nullptr,
-                                      action.get(),
-                                      &response_container_ptr);
-        response.reset(response_container_ptr);
+    if (upnp_err != UPNP_E_SUCCESS) {
+        if (logger_)
+            logger_->error("PUPnP: GetGenericPortMappingEntry returned with error: {}", upnp_err);
+        return entry;
+    }
 
-        if (not response) {
-            // No existing mapping. Abort silently.
-            break;
+    // Check error code.
+    auto errorCode = getFirstDocItem(response.get(), "errorCode");
+    if (not errorCode.empty()) {
+        auto error = to_int<int>(errorCode);
+        if (error == ARRAY_IDX_INVALID or error == CONFLICT_IN_MAPPING) {
+            // No more port mapping entries in the response.
+            entry.status = MappingEntry::Status::END;
+        } else {
+            auto errorDescription = getFirstDocItem(response.get(), "errorDescription");
+            if (logger_)
+                logger_->error("PUPnP: GetGenericPortMappingEntry returned with error: {:s}: {:s}",
+                               errorCode,
+                               errorDescription);
         }
+        return entry;
+    }
+
+    // Parse the response.
+    auto port_internal = getFirstDocItem(response.get(), "NewInternalPort");
+    auto port_external = getFirstDocItem(response.get(), "NewExternalPort");
+    std::string transport(getFirstDocItem(response.get(), "NewProtocol"));
+
+    if (port_internal.empty() || port_external.empty() || transport.empty()) {
+        if (logger_)
+            logger_->error("PUPnP: GetGenericPortMappingEntry returned an invalid entry at index {}",
+                           index);
+        entry.status = MappingEntry::Status::INVALID;
+        return entry;
+    }
+
+    std::transform(transport.begin(), transport.end(), transport.begin(), ::toupper);
+    entry.status = MappingEntry::Status::VALID;
+    entry.description = getFirstDocItem(response.get(), "NewPortMappingDescription");
+    entry.internalClient = getFirstDocItem(response.get(), "NewInternalClient");
+    entry.type = transport.find("TCP") != std::string::npos ? PortType::TCP : PortType::UDP;
+    entry.externalPort = to_int<uint16_t>(port_external);
+    entry.internalPort = to_int<uint16_t>(port_internal);
+    return entry;
+}
 
-        if (upnp_err != UPNP_E_SUCCESS) {
-            JAMI_ERR("PUPnP: GetGenericPortMappingEntry returned with error: %i", upnp_err);
-            break;
+std::map<Mapping::key_t, Mapping>
+PUPnP::getMappingsListByDescr(const std::shared_ptr<IGD>& igd, const std::string& description) const
+{
+    auto upnpIgd = std::dynamic_pointer_cast<UPnPIGD>(igd);
+    assert(upnpIgd);
+
+    std::map<Mapping::key_t, Mapping> mapList;
+
+    if (not clientRegistered_ or not upnpIgd->isValid() or not upnpIgd->getLocalIp())
+        return mapList;
+
+    auto hostAddress = getHostAddress().toString();
+
+    // The entries are fetched by batches of concurrent requests. The end
+    // of the table is detected when the IGD returns an error for an index.
+    int entry_idx = 0;
+    for (bool done = false; not done and isRunning();) {
+        std::vector<std::future<MappingEntry>> batch;
+        batch.reserve(PUPNP_MAX_PARALLEL_ACTIONS);
+        for (unsigned i = 0; i < PUPNP_MAX_PARALLEL_ACTIONS; i++) {
+            auto task = std::make_shared<std::packaged_task<MappingEntry()>>(
+                [this, upnpIgd, index = entry_idx + static_cast<int>(i)] {
+                    return actionGetGenericPortMappingEntry(*upnpIgd, index);
+                });
+            batch.emplace_back(task->get_future());
+            asio::post(*actionContext_, [task] { (*task)(); });
         }
 
-        // Check error code.
-        auto errorCode = getFirstDocItem(response.get(), "errorCode");
-        if (not errorCode.empty()) {
-            auto error = to_int<int>(errorCode);
-            if (error == ARRAY_IDX_INVALID or error == CONFLICT_IN_MAPPING) {
-                // No more port mapping entries in the response.
-                JAMI_DBG("PUPnP: No more mappings (found a total of %i mappings", entry_idx);
+        // Wait for the whole batch, the tasks reference this instance.
+        std::vector<MappingEntry> entries;
+        entries.reserve(batch.size());
+        for (auto& result : batch)
+            entries.emplace_back(result.get());
+
+        for (const auto& entry : entries) {
+            if (entry.status == MappingEntry::Status::END) {
+                if (logger_)
+                    logger_->debug("PUPnP: No more mappings (found a total of {} mappings",
+                                   entry_idx);
+                done = true;
                 break;
-            } else {
-                auto errorDescription = getFirstDocItem(response.get(), "errorDescription");
-                JAMI_ERROR("PUPnP: GetGenericPortMappingEntry returned with error: {:s}: {:s}",
-                         errorCode,
-                         errorDescription);
+            }
+            if (entry.status == MappingEntry::Status::FAILURE) {
+                done = true;
                 break;
             }
-        }
+            entry_idx++;
 
-        // Parse the response.
-        auto desc_actual = getFirstDocItem(response.get(), "NewPortMappingDescription");
-        auto client_ip = getFirstDocItem(response.get(), "NewInternalClient");
+            if (entry.status == MappingEntry::Status::INVALID)
+                continue;
 
-        if (client_ip != getHostAddress().toString()) {
-            // Silently ignore un-matching addresses.
-            continue;
-        }
+            if (entry.internalClient != hostAddress) {
+                // Silently ignore un-matching addresses.
+                continue;
+            }
 
-        if (desc_actual.find(description) == std::string::npos)
-            continue;
+            if (entry.description.find(description) == std::string::npos)
+                continue;
 
-        auto port_internal = getFirstDocItem(response.get(), "NewInternalPort");
-        auto port_external = getFirstDocItem(response.get(), "NewExternalPort");
-        std::string transport(getFirstDocItem(response.get(), "NewProtocol"));
+            Mapping map(entry.type, entry.externalPort, entry.internalPort);
+            map.setIgd(igd);
 
-        if (port_internal.empty() || port_external.empty() || transport.empty()) {
-            JAMI_ERR("PUPnP: GetGenericPortMappingEntry returned an invalid entry at index %i",
-                     entry_idx);
-            continue;
+            mapList.emplace(map.getMapKey(), std::move(map));
         }
-
-        std::transform(transport.begin(), transport.end(), transport.begin(), ::toupper);
-        PortType type = transport.find("TCP") != std::string::npos ? PortType::TCP : PortType::UDP;
-        auto ePort = to_int<uint16_t>(port_external);
-        auto iPort = to_int<uint16_t>(port_internal);
-
-        Mapping map(type, ePort, iPort);
-        map.setIgd(igd);
-
-        mapList.emplace(map.getMapKey(), std::move(map));
     }
 
-    JAMI_DEBUG("PUPnP: Found {:d} allocated mappings on IGD {:s}",
-             mapList.size(),
-             upnpIgd->toString());
+    if (logger_)
+        logger_->debug("PUPnP: Found {:d} allocated mappings on IGD {:s}",
+                       mapList.size(),
+                       upnpIgd->toString());
 
     return mapList;
 }
@@ -1392,9 +1812,10 @@ PUPnP::deleteMappingsByDescription(const std::shared_ptr<IGD>& igd, const std::s
     if (not(clientRegistered_ and igd->getLocalIp()))
         return;
 
-    JAMI_DBG("PUPnP: Remove all mappings (if any) on IGD %s matching descr prefix %s",
-             igd->toString().c_str(),
-             Mapping::UPNP_MAPPING_DESCRIPTION_PREFIX);
+    if (logger_)
+        logger_->debug("PUPnP: Remove all mappings (if any) on IGD {} matching descr prefix {}",
+                       igd->toString(),
+                       Mapping::UPNP_MAPPING_DESCRIPTION_PREFIX);
 
     auto mapList = getMappingsListByDescr(igd, description);
 
@@ -1406,8 +1827,6 @@ PUPnP::deleteMappingsByDescription(const std::shared_ptr<IGD>& igd, const std::s
 bool
 PUPnP::actionAddPortMapping(const Mapping& mapping)
 {
-    CHECK_VALID_THREAD();
-
     if (not clientRegistered_)
         return false;
 
@@ -1467,7 +1886,7 @@ PUPnP::actionAddPortMapping(const Mapping& mapping)
                     ACTION_ADD_PORT_MAPPING,
                     igd->getServiceType().c_str(),
                     "NewLeaseDuration",
-                    "0");
+                    std::to_string(leaseDuration_.load()).c_str());
 
     action.reset(action_container_ptr);
 
@@ -1482,13 +1901,15 @@ PUPnP::actionAddPortMapping(const Mapping& mapping)
     bool success = true;
 
     if (upnp_err != UPNP_E_SUCCESS) {
-        JAMI_WARN("PUPnP: Failed to send action %s for mapping %s. %d: %s",
-                  ACTION_ADD_PORT_MAPPING,
-                  mapping.toString().c_str(),
-                  upnp_err,
-                  UpnpGetErrorMessage(upnp_err));
-        JAMI_WARN("PUPnP: IGD ctrlUrl %s", igd->getControlURL().c_str());
-        JAMI_WARN("PUPnP: IGD service type %s", igd->getServiceType().c_str());
+        if (logger_) {
+            logger_->warn("PUPnP: Failed to send action {} for mapping {}. {}: {}",
+                          ACTION_ADD_PORT_MAPPING,
+                          mapping.toString(),
+                          upnp_err,
+                          UpnpGetErrorMessage(upnp_err));
+            logger_->warn("PUPnP: IGD ctrlUrl {}", igd->getControlURL());
+            logger_->warn("PUPnP: IGD service type {}", igd->getServiceType());
+        }
 
         success = false;
     }
@@ -1503,10 +1924,11 @@ PUPnP::actionAddPortMapping(const Mapping& mapping)
             errorDescription = getFirstDocItem(response.get(), "errorDescription");
         }
 
-        JAMI_WARNING("PUPnP: {:s} returned with error: {:s} {:s}",
-                  ACTION_ADD_PORT_MAPPING,
-                  errorCode,
-                  errorDescription);
+        if (logger_)
+            logger_->warn("PUPnP: {:s} returned with error: {:s} {:s}",
+                          ACTION_ADD_PORT_MAPPING,
+                          errorCode,
+                          errorDescription);
     }
     return success;
 }
@@ -1514,8 +1936,6 @@ PUPnP::actionAddPortMapping(const Mapping& mapping)
 bool
 PUPnP::actionDeletePortMapping(const Mapping& mapping)
 {
-    CHECK_VALID_THREAD();
-
     if (not clientRegistered_)
         return false;
 
@@ -1565,19 +1985,22 @@ PUPnP::actionDeletePortMapping(const Mapping& mapping)
     bool success = true;
 
     if (upnp_err != UPNP_E_SUCCESS) {
-        JAMI_WARN("PUPnP: Failed to send action %s for mapping from %s. %d: %s",
-                  ACTION_DELETE_PORT_MAPPING,
-                  mapping.toString().c_str(),
-                  upnp_err,
-                  UpnpGetErrorMessage(upnp_err));
-        JAMI_WARN("PUPnP: IGD ctrlUrl %s", igd->getControlURL().c_str());
-        JAMI_WARN("PUPnP: IGD service type %s", igd->getServiceType().c_str());
+        if (logger_) {
+            logger_->warn("PUPnP: Failed to send action {} for mapping from {}. {}: {}",
+                          ACTION_DELETE_PORT_MAPPING,
+                          mapping.toString(),
+                          upnp_err,
+                          UpnpGetErrorMessage(upnp_err));
+            logger_->warn("PUPnP: IGD ctrlUrl {}", igd->getControlURL());
+            logger_->warn("PUPnP: IGD service type {}", igd->getServiceType());
+        }
 
         success = false;
     }
 
     if (not response) {
-        JAMI_WARN("PUPnP: Failed to get response for %s", ACTION_DELETE_PORT_MAPPING);
+        if (logger_)
+            logger_->warn("PUPnP: Failed to get response for {}", ACTION_DELETE_PORT_MAPPING);
         success = false;
     }
 
@@ -1585,10 +2008,11 @@ PUPnP::actionDeletePortMapping(const Mapping& mapping)
     auto errorCode = getFirstDocItem(response.get(), "errorCode");
     if (not errorCode.empty()) {
         auto errorDescription = getFirstDocItem(response.get(), "errorDescription");
-        JAMI_WARNING("PUPnP: {:s} returned with error: {:s}: {:s}",
-                  ACTION_DELETE_PORT_MAPPING,
-                  errorCode,
-                  errorDescription);
+        if (logger_)
+            logger_->warn("PUPnP: {:s} returned with error: {:s}: {:s}",
+                          ACTION_DELETE_PORT_MAPPING,
+                          errorCode,
+                          errorDescription);
         success = false;
     }
 
@@ -30,15 +30,15 @@
 #include "../upnp_protocol.h"
 #include "../igd.h"
 #include "upnp_igd.h"
+#include "../../upnp_cache.h"
 
-#include "logger.h"
-#include "connectivity/ip_utils.h"
-#include "noncopyable.h"
-#include "compiler_intrinsics.h"
+#include "ip_utils.h"
 
 #include <upnp/upnp.h>
 #include <upnp/upnptools.h>
 
+#include <asio/steady_timer.hpp>
+
 #ifdef _WIN32
 #include <windows.h>
 #include <wincrypt.h>
@@ -52,6 +52,7 @@
 #include <string>
 #include <memory>
 #include <future>
+#include <vector>
 
 namespace jami {
 class IpAddr;
@@ -74,7 +75,8 @@ public:
         GET_EXTERNAL_IP_ADDRESS
     };
 
-    PUPnP();
+    PUPnP(const std::shared_ptr<asio::io_context>& ctx,
+          const std::shared_ptr<dht::log::Logger>& logger);
     ~PUPnP();
 
     // Set the observer
@@ -92,6 +94,22 @@ public:
     // Sends out async search for IGD.
     void searchForIgd() override;
 
+    // Validate the IGD described at the given location, without
+    // waiting for a response to the SSDP search.
+    void probeIgd(const std::string& locationUrl);
+
+    // Add the description of an IGD validated by a previous instance.
+    // It's validated on the next search, without downloading it.
+    void addCachedIgd(const IgdCacheEntry& entry);
+
+    // Get the description of the valid IGDs, to be cached.
+    std::vector<IgdCacheEntry> getIgdCacheEntries() const;
+
+    // Set the lease duration requested for the new mappings. The open
+    // mappings are renewed before it expires. Zero (the default) requests
+    // mappings that never expire.
+    void setLeaseDuration(std::chrono::seconds lease);
+
     // Get the IGD list.
     std::list<std::shared_ptr<IGD>> getIgdList() const override;
 
@@ -105,9 +123,9 @@ public:
     // Request a new mapping.
     void requestMappingAdd(const Mapping& mapping) override;
 
-    // Renew an allocated mapping.
-    // Not implemented. Currently, UPNP allocations do not have expiration time.
-    void requestMappingRenew([[maybe_unused]] const Mapping& mapping) override { assert(false); };
+    // Renew an allocated mapping. The mapping is added again, which
+    // restarts its lease on the IGD.
+    void requestMappingRenew(const Mapping& mapping) override;
 
     // Removes a mapping.
     void requestMappingRemove(const Mapping& igdMapping) override;
@@ -119,20 +137,45 @@ public:
     void terminate() override;
 
 private:
-    NON_COPYABLE(PUPnP);
+    PUPnP(const PUPnP&) = delete;
+    PUPnP(PUPnP&&) = delete;
+    PUPnP& operator=(PUPnP&&) = delete;
+    PUPnP& operator=(const PUPnP&) = delete;
 
     // Helpers to run tasks on PUPNP private execution queue.
-    ScheduledExecutor* getPUPnPScheduler() { return &pupnpScheduler_; }
+    // Hides UpnpThreadUtil::isValidThread(), the lib-upnp actions are
+    // expected to run on the private queue, not on the UPnP context.
+    bool isValidThread() const { return ioContext_->get_executor().running_in_this_thread(); }
     template<typename Callback>
     void runOnPUPnPQueue(Callback&& cb)
     {
-        pupnpScheduler_.run([cb = std::forward<Callback>(cb)]() mutable { cb(); });
+        asio::post(*ioContext_, std::forward<Callback>(cb));
     }
 
-    // Helper to run tasks on UPNP context execution queue.
-    ScheduledExecutor* getUpnContextScheduler() { return UpnpThreadUtil::getScheduler(); }
+    // Run a (blocking) lib-upnp action on the action pool, then process
+    // its result on the PUPNP private queue.
+    // Action signature: Result(PUPnP&), Callback signature: void(PUPnP&, Result).
+    template<typename Action, typename Callback>
+    void runAction(Action&& action, Callback&& cb)
+    {
+        asio::post(*actionContext_,
+                   [w = weak(),
+                    action = std::forward<Action>(action),
+                    cb = std::forward<Callback>(cb)]() mutable {
+                       auto upnpThis = w.lock();
+                       if (not upnpThis)
+                           return;
+                       auto result = action(*upnpThis);
+                       upnpThis->runOnPUPnPQueue(
+                           [w, cb = std::move(cb), result = std::move(result)]() mutable {
+                               if (auto upnpThis = w.lock())
+                                   cb(*upnpThis, std::move(result));
+                           });
+                   });
+    }
 
     void terminate(std::condition_variable& cv);
+    void stopPUPnPQueue();
 
     // Init lib-upnp
     void initUpnpLib();
@@ -166,6 +209,12 @@ private:
     // Process the reception of an add mapping action answer.
     void processAddMapAction(const Mapping& map);
 
+    // Process the reception of a renew mapping action answer.
+    void processRenewMapAction(const Mapping& map);
+
+    // Time at which a mapping added now must be renewed.
+    sys_clock::time_point getRenewalTime() const;
+
     // Process the a mapping request failure.
     void processRequestMappingFailure(const Mapping& map);
 
@@ -175,12 +224,24 @@ private:
     // Increment IGD errors counter.
     void incrementErrorsCounter(const std::shared_ptr<IGD>& igd);
 
+    // Validate the IGD at the given location, using the cached
+    // description if any. Ignored if already in progress.
+    void startIgdValidation(const std::string& locationUrl);
+
     // Download XML document.
     void downLoadIgdDescription(const std::string& url);
 
     // Validate IGD from the xml document received from the router.
     bool validateIgd(const std::string& location, IXML_Document* doc_container_ptr);
 
+    // Check the IGD status and external address (concurrently), then
+    // add it to the list of valid IGDs.
+    void validateIgdCandidate(const std::shared_ptr<UPnPIGD>& igd_candidate);
+    void addValidIgd(const std::shared_ptr<UPnPIGD>& igd_candidate);
+
+    // Create a new IGD candidate from the cached description, if any.
+    std::shared_ptr<UPnPIGD> getCachedIgd(const std::string& locationUrl) const;
+
     // Returns control point action callback based on xml node.
     static CtrlAction getAction(const char* xmlNode);
 
@@ -218,12 +279,25 @@ private:
     // Parses the IGD candidate.
     std::unique_ptr<UPnPIGD> parseIgd(IXML_Document* doc, std::string locationUrl);
 
+    // Entry returned by the GetGenericPortMappingEntry action.
+    struct MappingEntry
+    {
+        enum class Status { VALID, INVALID, END, FAILURE };
+        Status status {Status::FAILURE};
+        std::string description {};
+        std::string internalClient {};
+        PortType type {PortType::UDP};
+        uint16_t internalPort {0};
+        uint16_t externalPort {0};
+    };
+
     // These functions directly create UPnP actions and make synchronous UPnP
-    // control point calls. Must be run on the PUPNP internal execution queue.
+    // control point calls. They are run on the action pool (see runAction).
     bool actionIsIgdConnected(const UPnPIGD& igd);
     IpAddr actionGetExternalIP(const UPnPIGD& igd);
     bool actionAddPortMapping(const Mapping& mapping);
     bool actionDeletePortMapping(const Mapping& mapping);
+    MappingEntry actionGetGenericPortMappingEntry(const UPnPIGD& igd, int index) const;
 
     // Event type to string
     static const char* eventTypeToString(Upnp_EventType eventType);
@@ -231,19 +305,34 @@ private:
     std::weak_ptr<PUPnP> weak() { return std::static_pointer_cast<PUPnP>(shared_from_this()); }
 
     // Execution queue to run lib upnp actions
-    ScheduledExecutor pupnpScheduler_ {"pupnp"};
+    std::shared_ptr<asio::io_context> ioContext_;
+    std::thread ioContextRunner_;
+
+    // Pool of threads to run the (blocking) SOAP actions concurrently.
+    std::shared_ptr<asio::io_context> actionContext_;
+    std::vector<std::thread> actionRunners_;
 
     // Initialization status.
     std::atomic_bool initialized_ {false};
     // Client registration status.
     std::atomic_bool clientRegistered_ {false};
+    // Lease duration of the mappings, in seconds (see setLeaseDuration).
+    std::atomic<std::chrono::seconds::rep> leaseDuration_ {0};
 
-    std::shared_ptr<Task> searchForIgdTimer_ {};
+    asio::steady_timer searchForIgdTimer_;
     unsigned int igdSearchCounter_ {0};
 
     // List of discovered IGDs.
     std::set<std::string> discoveredIgdList_;
 
+    // Location of the IGDs being validated.
+    std::set<std::string> pendingValidations_;
+
+    // Description of the previously validated IGDs, per location URL.
+    // Not cleared on connectivity changes, so known IGDs can be
+    // re-validated right away.
+    std::map<std::string, std::shared_ptr<UPnPIGD>> igdCache_;
+
     // Control point handle.
     UpnpClient_Handle ctrlptHandle_ {-1};
 
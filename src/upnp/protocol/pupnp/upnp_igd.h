@@ -22,10 +22,9 @@
 
 #pragma once
 
-#include "connectivity/upnp/protocol/igd.h"
+#include "../igd.h"
 
-#include "noncopyable.h"
-#include "connectivity/ip_utils.h"
+#include "ip_utils.h"
 
 #include <map>
 #include <string>
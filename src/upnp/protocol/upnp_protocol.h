@@ -24,7 +24,9 @@
 #include "igd.h"
 #include "mapping.h"
 #include "ip_utils.h"
-//#include "upnp/upnp_thread_util.h"
+#include "../upnp_thread_util.h"
+
+#include <opendht/logger.h>
 
 #include <map>
 #include <string>
@@ -50,10 +52,10 @@ constexpr static const char* UPNP_WANPPP_SERVICE
 enum class UpnpIgdEvent { ADDED, REMOVED, INVALID_STATE };
 
 // Interface used to report mapping event from the protocol implementations.
-// This interface is meant to be implemented only by UPnPConext class. Sincce
-// this class is a singleton, it's assumed that it out-lives the protocol
-// implementations. In other words, the observer is always assumed to point to a
-// valid instance.
+// This interface is meant to be implemented only by UPnPConext class. Since
+// this class owns the protocol implementations, it's assumed that it out-lives
+// them. In other words, the observer is always assumed to point to a valid
+// instance.
 class UpnpMappingObserver
 {
 public:
@@ -63,19 +65,21 @@ public:
     virtual void onIgdUpdated(const std::shared_ptr<IGD>& igd, UpnpIgdEvent event) = 0;
     virtual void onMappingAdded(const std::shared_ptr<IGD>& igd, const Mapping& map) = 0;
     virtual void onMappingRequestFailed(const Mapping& map) = 0;
-#if HAVE_LIBNATPMP
     virtual void onMappingRenewed(const std::shared_ptr<IGD>& igd, const Mapping& map) = 0;
-#endif
     virtual void onMappingRemoved(const std::shared_ptr<IGD>& igd, const Mapping& map) = 0;
 };
 
 // Pure virtual interface class that UPnPContext uses to call protocol functions.
-class UPnPProtocol : public std::enable_shared_from_this<UPnPProtocol>//, protected UpnpThreadUtil
+class UPnPProtocol : public std::enable_shared_from_this<UPnPProtocol>, protected UpnpThreadUtil
 {
 public:
     enum class UpnpError : int { INVALID_ERR = -1, ERROR_OK, CONFLICT_IN_MAPPING };
 
-    UPnPProtocol() {};
+    UPnPProtocol(const std::shared_ptr<asio::io_context>& ctx,
+                 const std::shared_ptr<dht::log::Logger>& logger)
+        : UpnpThreadUtil(ctx)
+        , logger_(logger)
+    {};
     virtual ~UPnPProtocol() {};
 
     // Get protocol type.
@@ -120,6 +124,9 @@ public:
 
     // Terminate
     virtual void terminate() = 0;
+
+protected:
+    std::shared_ptr<dht::log::Logger> logger_;
 };
 
 } // namespace upnp
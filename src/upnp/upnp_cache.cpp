@@ -0,0 +1,69 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#include "upnp_cache.h"
+#include "fileutils.h"
+
+#include <algorithm>
+
+namespace jami {
+namespace upnp {
+
+bool
+MappingCacheEntry::isExpired(std::chrono::system_clock::time_point now) const
+{
+    return std::chrono::system_clock::to_time_t(now) >= expiration;
+}
+
+UpnpCache
+UpnpCache::load(const std::string& path, const std::shared_ptr<dht::log::Logger>& logger)
+{
+    UpnpCache cache;
+    try {
+        auto data = fileutils::loadFile(path);
+        auto oh = msgpack::unpack((const char*) data.data(), data.size());
+        oh.get().convert(cache);
+    } catch (const std::exception& e) {
+        if (logger)
+            logger->debug("UPnP cache not loaded from {}: {}", path, e.what());
+        return {};
+    }
+
+    auto now = std::chrono::system_clock::now();
+    cache.mappings.erase(std::remove_if(cache.mappings.begin(),
+                                        cache.mappings.end(),
+                                        [&](const auto& map) { return map.isExpired(now); }),
+                         cache.mappings.end());
+    return cache;
+}
+
+void
+UpnpCache::save(const std::string& path, const std::shared_ptr<dht::log::Logger>& logger) const
+{
+    msgpack::sbuffer buffer;
+    msgpack::pack(buffer, *this);
+    fileutils::saveFile(path, (const uint8_t*) buffer.data(), buffer.size(), 0600);
+    if (logger)
+        logger->debug("UPnP cache saved to {}: {} IGD(s), {} mapping(s)",
+                      path,
+                      igds.size(),
+                      mappings.size());
+}
+
+} // namespace upnp
+} // namespace jami
@@ -0,0 +1,94 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+#pragma once
+
+#include <opendht/logger.h>
+#include <msgpack.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace jami {
+namespace upnp {
+
+// Lifetime of the cached mappings. UPnP mappings don't expire on the
+// IGD, but the IGD state is not trusted after a long downtime.
+constexpr static auto UPNP_CACHE_MAPPING_LIFETIME {std::chrono::hours(1)};
+
+// Description of a validated UPnP IGD, so it can be used again without
+// waiting for the discovery.
+struct IgdCacheEntry
+{
+    std::string uid;
+    std::string baseUrl;
+    std::string friendlyName;
+    std::string serviceType;
+    std::string serviceId;
+    std::string locationUrl;
+    std::string controlUrl;
+    std::string eventSubUrl;
+    std::string publicIp;
+    MSGPACK_DEFINE_MAP(uid,
+                       baseUrl,
+                       friendlyName,
+                       serviceType,
+                       serviceId,
+                       locationUrl,
+                       controlUrl,
+                       eventSubUrl,
+                       publicIp)
+};
+
+// Mapping opened by a previous instance.
+struct MappingCacheEntry
+{
+    // UID of the IGD owning the mapping.
+    std::string igdUid;
+    bool udp {true};
+    uint16_t internalPort {0};
+    uint16_t externalPort {0};
+    std::string internalAddr;
+    // Seconds since epoch.
+    int64_t expiration {0};
+    MSGPACK_DEFINE_MAP(igdUid, udp, internalPort, externalPort, internalAddr, expiration)
+
+    bool isExpired(std::chrono::system_clock::time_point now
+                   = std::chrono::system_clock::now()) const;
+};
+
+/**
+ * The IGDs and mappings known by the UPnP context, persisted across
+ * restarts.
+ */
+struct UpnpCache
+{
+    std::vector<IgdCacheEntry> igds;
+    std::vector<MappingCacheEntry> mappings;
+    MSGPACK_DEFINE_MAP(igds, mappings)
+
+    // Load the cache, without the expired mappings. The cache is empty
+    // if the file is missing or invalid.
+    static UpnpCache load(const std::string& path,
+                          const std::shared_ptr<dht::log::Logger>& logger = {});
+    void save(const std::string& path, const std::shared_ptr<dht::log::Logger>& logger = {}) const;
+};
+
+} // namespace upnp
+} // namespace jami
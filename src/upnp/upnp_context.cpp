@@ -21,6 +21,7 @@
  */
 
 #include "upnp_context.h"
+#include "fileutils.h"
 
 namespace jami {
 namespace upnp {
@@ -34,34 +35,43 @@ constexpr static uint16_t UPNP_TCP_PORT_MAX {UPNP_TCP_PORT_MIN + 5000};
 constexpr static uint16_t UPNP_UDP_PORT_MIN {20000};
 constexpr static uint16_t UPNP_UDP_PORT_MAX {UPNP_UDP_PORT_MIN + 5000};
 
-UPnPContext::UPnPContext()
+static unsigned
+stateIndex(MappingState state)
 {
-    JAMI_DBG("Creating UPnPContext instance [%p]", this);
-
-    // Set port ranges
-    portRange_.emplace(PortType::TCP, std::make_pair(UPNP_TCP_PORT_MIN, UPNP_TCP_PORT_MAX));
-    portRange_.emplace(PortType::UDP, std::make_pair(UPNP_UDP_PORT_MIN, UPNP_UDP_PORT_MAX));
+    return static_cast<unsigned>(state);
+}
 
-    if (not isValidThread()) {
-        runOnUpnpContextQueue([this] { init(); });
-        return;
-    }
+static unsigned
+typeIndex(PortType type)
+{
+    return type == PortType::TCP ? 0 : 1;
 }
 
-std::shared_ptr<UPnPContext>
-UPnPContext::getUPnPContext()
+UPnPContext::UPnPContext(const std::shared_ptr<asio::io_context>& ioContext,
+                         const std::shared_ptr<dht::log::Logger>& logger)
+    : UpnpThreadUtil(ioContext)
+    , mappingListUpdateTimer_(*ioContext)
+    , logger_(logger)
 {
-    // This is the unique shared instance (singleton) of UPnPContext class.
-    static auto context = std::make_shared<UPnPContext>();
-    return context;
+    if (logger_)
+        logger_->debug("Creating UPnPContext instance [{}]", fmt::ptr(this));
+
+    // Set port ranges
+    portRange_.emplace(PortType::TCP, std::make_pair(UPNP_TCP_PORT_MIN, UPNP_TCP_PORT_MAX));
+    portRange_.emplace(PortType::UDP, std::make_pair(UPNP_UDP_PORT_MIN, UPNP_UDP_PORT_MAX));
 }
 
 void
 UPnPContext::shutdown(std::condition_variable& cv)
 {
-    JAMI_DBG("Shutdown UPnPContext instance [%p]", this);
+    if (logger_)
+        logger_->debug("Shutdown UPnPContext instance [{}]", fmt::ptr(this));
 
-    stopUpnp(true);
+    // The open mappings are kept on the IGD if cached, so the next
+    // instance can use them right away. Their lease expires if they
+    // are not renewed (see init).
+    saveCache();
+    stopUpnp(true, not cacheFile_.empty());
 
     for (auto const& [_, proto] : protocolList_) {
         proto->terminate();
@@ -69,9 +79,14 @@ UPnPContext::shutdown(std::condition_variable& cv)
 
     {
         std::lock_guard<std::mutex> lock(mappingMutex_);
-        mappingList_->clear();
-        if (mappingListUpdateTimer_)
-            mappingListUpdateTimer_->cancel();
+        for (auto& mappingList : mappingList_)
+            mappingList.clear();
+        for (auto& index : mappingIndex_)
+            index = {};
+        mappingsByIgd_.clear();
+        indexedMappings_.clear();
+        waitingReservations_.clear();
+        mappingListUpdateTimer_.cancel();
         controllerList_.clear();
         protocolList_.clear();
         shutdownComplete_ = true;
@@ -82,40 +97,64 @@ UPnPContext::shutdown(std::condition_variable& cv)
 void
 UPnPContext::shutdown()
 {
-    std::unique_lock<std::mutex> lk(mappingMutex_);
-    std::condition_variable cv;
-
-    runOnUpnpContextQueue([&, this] { shutdown(cv); });
-
-    JAMI_DBG("Waiting for shutdown ...");
+    if (isValidThread()) {
+        // Waiting on the context queue from itself would dead-lock.
+        std::condition_variable cv;
+        shutdown(cv);
+        return;
+    }
 
-    if (cv.wait_for(lk, std::chrono::seconds(30), [this] { return shutdownComplete_; })) {
-        JAMI_DBG("Shutdown completed");
+    std::unique_lock<std::mutex> lk(mappingMutex_);
+    if (shutdownComplete_)
+        return;
+    // Still referenced by the task if the wait times out
+    auto cv = std::make_shared<std::condition_variable>();
+    runOnUpnpContextQueue([w = weak_from_this(), cv] {
+        if (auto sthis = w.lock())
+            sthis->shutdown(*cv);
+    });
+
+    if (logger_)
+        logger_->debug("Waiting for shutdown ...");
+
+    if (cv->wait_for(lk, std::chrono::seconds(30), [this] { return shutdownComplete_; })) {
+        if (logger_)
+            logger_->debug("Shutdown completed");
     } else {
-        JAMI_ERR("Shutdown timed-out");
+        if (logger_)
+            logger_->error("Shutdown timed-out");
     }
 }
 
 UPnPContext::~UPnPContext()
 {
-    JAMI_DBG("UPnPContext instance [%p] destroyed", this);
+    mappingListUpdateTimer_.cancel();
+    if (logger_)
+        logger_->debug("UPnPContext instance [{}] destroyed", fmt::ptr(this));
 }
 
 void
 UPnPContext::init()
 {
-    threadId_ = getCurrentThread();
     CHECK_VALID_THREAD();
 
+    if (initialized_)
+        return;
+    initialized_ = true;
+
 #if HAVE_LIBNATPMP
-    auto natPmp = std::make_shared<NatPmp>();
+    auto natPmp = std::make_shared<NatPmp>(ctx_, logger_);
     natPmp->setObserver(this);
     protocolList_.emplace(NatProtocolType::NAT_PMP, std::move(natPmp));
 #endif
 
 #if HAVE_LIBUPNP
-    auto pupnp = std::make_shared<PUPnP>();
+    auto pupnp = std::make_shared<PUPnP>(ctx_, logger_);
     pupnp->setObserver(this);
+    // The mappings may be kept on the IGD at shutdown if cached, so they
+    // must expire if no later instance renews them.
+    if (not cacheFile_.empty())
+        pupnp->setLeaseDuration(UPNP_CACHE_MAPPING_LIFETIME);
     protocolList_.emplace(NatProtocolType::PUPNP, std::move(pupnp));
 #endif
 }
@@ -127,7 +166,8 @@ UPnPContext::startUpnp()
 
     CHECK_VALID_THREAD();
 
-    JAMI_DBG("Starting UPNP context");
+    if (logger_)
+        logger_->debug("Starting UPNP context");
 
     // Request a new IGD search.
     for (auto const& [_, protocol] : protocolList_) {
@@ -138,14 +178,18 @@ UPnPContext::startUpnp()
 }
 
 void
-UPnPContext::stopUpnp(bool forceRelease)
+UPnPContext::stopUpnp(bool forceRelease, bool keepMappings)
 {
     if (not isValidThread()) {
-        runOnUpnpContextQueue([this, forceRelease] { stopUpnp(forceRelease); });
+        runOnUpnpContextQueue([w = weak_from_this(), forceRelease, keepMappings] {
+            if (auto sthis = w.lock())
+                sthis->stopUpnp(forceRelease, keepMappings);
+        });
         return;
     }
 
-    JAMI_DBG("Stopping UPNP context");
+    if (logger_)
+        logger_->debug("Stopping UPNP context");
 
     // Clear all current mappings if any.
 
@@ -167,7 +211,9 @@ UPnPContext::stopUpnp(bool forceRelease)
         validIgdList_.clear();
     }
     for (auto const& map : toRemoveList) {
-        requestRemoveMapping(map);
+        if (not keepMappings or map->getState() != MappingState::OPEN
+            or map->getProtocol() != NatProtocolType::PUPNP)
+            requestRemoveMapping(map);
 
         // Notify is not needed in updateMappingState when
         // shutting down (hence set it to false). NotifyCallback
@@ -198,11 +244,8 @@ UPnPContext::generateRandomPort(PortType type, bool mustBeEven)
     auto minPort = type == PortType::TCP ? UPNP_TCP_PORT_MIN : UPNP_UDP_PORT_MIN;
     auto maxPort = type == PortType::TCP ? UPNP_TCP_PORT_MAX : UPNP_UDP_PORT_MAX;
 
-    if (minPort >= maxPort) {
-        JAMI_ERR("Max port number (%i) must be greater than min port number (%i)", maxPort, minPort);
-        // Must be called with valid range.
-        assert(false);
-    }
+    // Must be called with valid range (max port number greater than min port number).
+    assert(minPort < maxPort);
 
     int fact = mustBeEven ? 2 : 1;
     if (mustBeEven) {
@@ -221,13 +264,17 @@ void
 UPnPContext::connectivityChanged()
 {
     if (not isValidThread()) {
-        runOnUpnpContextQueue([this] { connectivityChanged(); });
+        runOnUpnpContextQueue([w = weak_from_this()] {
+            if (auto sthis = w.lock())
+                sthis->connectivityChanged();
+        });
         return;
     }
 
     auto hostAddr = ip_utils::getLocalAddr(AF_INET);
 
-    JAMI_DBG("Connectivity change check: host address %s", hostAddr.toString().c_str());
+    if (logger_)
+        logger_->debug("Connectivity change check: host address {}", hostAddr.toString());
 
     auto restartUpnp = false;
 
@@ -241,9 +288,10 @@ UPnPContext::connectivityChanged()
         // Check if the host address changed.
         for (auto const& [_, protocol] : protocolList_) {
             if (protocol->isReady() and hostAddr != protocol->getHostAddress()) {
-                JAMI_WARN("Host address changed from %s to %s",
-                          protocol->getHostAddress().toString().c_str(),
-                          hostAddr.toString().c_str());
+                if (logger_)
+                    logger_->warn("Host address changed from {} to {}",
+                                  protocol->getHostAddress().toString(),
+                                  hostAddr.toString());
                 protocol->clearIgds();
                 restartUpnp = true;
                 break;
@@ -262,7 +310,8 @@ UPnPContext::connectivityChanged()
     if (controllerList_.empty())
         return;
 
-    JAMI_DBG("Connectivity changed. Clear the IGDs and restart");
+    if (logger_)
+        logger_->debug("Connectivity changed. Clear the IGDs and restart");
 
     stopUpnp();
     startUpnp();
@@ -280,7 +329,8 @@ UPnPContext::setPublicAddress(const IpAddr& addr)
     std::lock_guard<std::mutex> lock(mappingMutex_);
     if (knownPublicAddress_ != addr) {
         knownPublicAddress_ = std::move(addr);
-        JAMI_DBG("Setting the known public address to %s", addr.toString().c_str());
+        if (logger_)
+            logger_->debug("Setting the known public address to {}", addr.toString());
     }
 }
 
@@ -308,10 +358,14 @@ UPnPContext::reserveMapping(Mapping& requestedMap)
     auto desiredPort = requestedMap.getExternalPort();
 
     if (desiredPort == 0) {
-        JAMI_DBG("Desired port is not set, will provide the first available port for [%s]",
-                 requestedMap.getTypeStr());
+        if (logger_)
+            logger_->debug("Desired port is not set, will provide the first available port for [{}]",
+                           requestedMap.getTypeStr());
     } else {
-        JAMI_DBG("Try to find mapping for port %i [%s]", desiredPort, requestedMap.getTypeStr());
+        if (logger_)
+            logger_->debug("Try to find mapping for port {} [{}]",
+                           desiredPort,
+                           requestedMap.getTypeStr());
     }
 
     Mapping::sharedPtr_t mapRes;
@@ -320,36 +374,57 @@ UPnPContext::reserveMapping(Mapping& requestedMap)
         std::lock_guard<std::mutex> lock(mappingMutex_);
         auto& mappingList = getMappingList(requestedMap.getType());
 
-        // We try to provide a mapping in "OPEN" state. If not found,
-        // we provide any available mapping. In this case, it's up to
-        // the caller to use it or not.
-        for (auto const& [_, map] : mappingList) {
-            // If the desired port is null, we pick the first available port.
-            if (map->isValid() and (desiredPort == 0 or map->getExternalPort() == desiredPort)
-                and map->isAvailable()) {
-                // Considere the first available mapping regardless of its
-                // state. A mapping with OPEN state will be used if found.
-                if (not mapRes)
-                    mapRes = map;
-
-                if (map->getState() == MappingState::OPEN) {
-                    // Found an "OPEN" mapping. We are done.
-                    mapRes = map;
-                    break;
+        if (desiredPort == 0) {
+            // We try to provide a mapping in "OPEN" state. If not found,
+            // we provide any available mapping. In this case, it's up to
+            // the caller to use it or not. Failed mappings are never valid.
+            auto& index = getMappingIndex(requestedMap.getType());
+            for (auto state : {MappingState::OPEN, MappingState::IN_PROGRESS, MappingState::PENDING}) {
+                for (auto key : index.availableByState[stateIndex(state)]) {
+                    // The mapping may be invalid if its IGD was just invalidated.
+                    auto const& map = mappingList.at(key);
+                    if (map->isValid()) {
+                        mapRes = map;
+                        break;
+                    }
                 }
+                if (mapRes)
+                    break;
             }
+        } else {
+            // The mappings are indexed by their internal port, which
+            // matches the external port unless the IGD changed it.
+            Mapping desiredMap(requestedMap.getType(), desiredPort, desiredPort);
+            auto it = mappingList.find(desiredMap.getMapKey());
+            if (it != mappingList.end() and it->second->isValid()
+                and it->second->getExternalPort() == desiredPort and it->second->isAvailable())
+                mapRes = it->second;
         }
     }
 
     // Create a mapping if none was available.
     if (not mapRes) {
-        JAMI_WARN("Did not find any available mapping. Will request one now");
+        if (logger_)
+            logger_->warn("Did not find any available mapping. Will request one now");
         mapRes = registerMapping(requestedMap);
     }
 
+    {
+        std::lock_guard<std::mutex> lock(mappingMutex_);
+        bool hit = mapRes and mapRes->getState() == MappingState::OPEN;
+        poolSizer_[typeIndex(requestedMap.getType())].onReservation(hit);
+        reservationCount_++;
+        if (hit) {
+            hitCount_++;
+            resolvedCount_++;
+        } else if (mapRes) {
+            waitingReservations_[mapRes->getMapKey()] = std::chrono::steady_clock::now();
+        }
+    }
+
     if (mapRes) {
         // Make the mapping unavailable
-        mapRes->setAvailable(false);
+        setMappingAvailable(mapRes, false);
         // Copy attributes.
         mapRes->setNotifyCallback(requestedMap.getNotifyCallback());
         mapRes->enableAutoUpdate(requestedMap.getAutoUpdate());
@@ -363,11 +438,37 @@ UPnPContext::reserveMapping(Mapping& requestedMap)
     return mapRes;
 }
 
+Mapping::sharedPtr_t
+UPnPContext::reserveMapping(Mapping& requestedMap, Mapping::NotifyCallback&& onResolved)
+{
+    if (onResolved) {
+        // Wrap the notify callback of the mapping. The callback is
+        // invoked on each state change, onResolved only on the first
+        // final state.
+        auto resolved = std::make_shared<std::atomic_bool>(false);
+        requestedMap.setNotifyCallback(
+            [notifyCb = requestedMap.getNotifyCallback(),
+             onResolved = std::move(onResolved),
+             resolved](Mapping::sharedPtr_t map) {
+                if (notifyCb)
+                    notifyCb(map);
+                auto state = map->getState();
+                if ((state == MappingState::OPEN or state == MappingState::FAILED)
+                    and not resolved->exchange(true))
+                    onResolved(map);
+            });
+    }
+    return reserveMapping(requestedMap);
+}
+
 void
 UPnPContext::releaseMapping(const Mapping& map)
 {
     if (not isValidThread()) {
-        runOnUpnpContextQueue([this, map] { releaseMapping(map); });
+        runOnUpnpContextQueue([w = weak_from_this(), map] {
+            if (auto sthis = w.lock())
+                sthis->releaseMapping(map);
+        });
         return;
     }
 
@@ -375,12 +476,14 @@ UPnPContext::releaseMapping(const Mapping& map)
 
     if (not mapPtr) {
         // Might happen if the mapping failed or was never granted.
-        JAMI_DBG("Mapping %s does not exist or was already removed", map.toString().c_str());
+        if (logger_)
+            logger_->debug("Mapping {} does not exist or was already removed", map.toString());
         return;
     }
 
     if (mapPtr->isAvailable()) {
-        JAMI_WARN("Trying to release an unused mapping %s", mapPtr->toString().c_str());
+        if (logger_)
+            logger_->warn("Trying to release an unused mapping {}", mapPtr->toString());
         return;
     }
 
@@ -389,45 +492,215 @@ UPnPContext::releaseMapping(const Mapping& map)
     unregisterMapping(mapPtr);
 }
 
+void
+UPnPContext::setMappingPoolBounds(unsigned minSize, unsigned maxSize)
+{
+    {
+        std::lock_guard<std::mutex> lock(mappingMutex_);
+        for (auto& sizer : poolSizer_)
+            sizer.setBounds(minSize, maxSize);
+    }
+    updateMappingList(true);
+}
+
+MappingPoolStats
+UPnPContext::getMappingPoolStats() const
+{
+    std::lock_guard<std::mutex> lock(mappingMutex_);
+    MappingPoolStats stats;
+    stats.reservations = reservationCount_;
+    stats.hits = hitCount_;
+    if (resolvedCount_)
+        stats.meanWait = std::chrono::duration_cast<std::chrono::milliseconds>(totalWait_
+                                                                               / resolvedCount_);
+    stats.igdErrors = igdErrorCount_;
+    for (auto idx : {0, 1})
+        stats.targetSize[idx] = poolSizer_[idx].target();
+    return stats;
+}
+
+void
+UPnPContext::setCachePath(const std::string& cacheDir)
+{
+    runOnUpnpContextQueue([w = weak_from_this(), cacheDir] {
+        auto sthis = w.lock();
+        if (not sthis)
+            return;
+        // The cached IGDs are given to the protocols
+        sthis->cacheFile_ = cacheDir.empty() ? std::string()
+                                             : cacheDir + DIR_SEPARATOR_STR "upnp";
+        sthis->init();
+        sthis->loadCache();
+    });
+}
+
+void
+UPnPContext::loadCache()
+{
+    CHECK_VALID_THREAD();
+
+    if (cacheFile_.empty())
+        return;
+
+    auto cache = UpnpCache::load(cacheFile_, logger_);
+
+#if HAVE_LIBUPNP
+    auto it = protocolList_.find(NatProtocolType::PUPNP);
+    if (it != protocolList_.end()) {
+        auto pupnp = std::static_pointer_cast<PUPnP>(it->second);
+        for (auto const& igd : cache.igds)
+            pupnp->addCachedIgd(igd);
+    }
+#endif
+
+    cachedMappings_ = std::move(cache.mappings);
+
+    if (logger_)
+        logger_->debug("Loaded UPnP cache: {} IGD(s), {} mapping(s)",
+                       cache.igds.size(),
+                       cachedMappings_.size());
+}
+
+void
+UPnPContext::saveCache()
+{
+    CHECK_VALID_THREAD();
+
+    if (cacheFile_.empty())
+        return;
+
+    UpnpCache cache;
+
+#if HAVE_LIBUPNP
+    auto it = protocolList_.find(NatProtocolType::PUPNP);
+    if (it != protocolList_.end())
+        cache.igds = std::static_pointer_cast<PUPnP>(it->second)->getIgdCacheEntries();
+#endif
+
+    // Only the UPNP mappings are cached, NAT-PMP mappings expire
+    // anyway if not renewed.
+    auto expiration = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()
+                                                           + UPNP_CACHE_MAPPING_LIFETIME);
+    {
+        std::lock_guard<std::mutex> lock(mappingMutex_);
+        for (auto type : {PortType::TCP, PortType::UDP}) {
+            auto const& mappingList = getMappingList(type);
+            for (auto key : getMappingIndex(type).byState[stateIndex(MappingState::OPEN)]) {
+                auto const& map = mappingList.at(key);
+                auto igd = map->getIgd();
+                if (not igd or igd->getProtocol() != NatProtocolType::PUPNP)
+                    continue;
+                cache.mappings.push_back({igd->getUID(),
+                                          type == PortType::UDP,
+                                          map->getInternalPort(),
+                                          map->getExternalPort(),
+                                          map->getInternalAddress(),
+                                          expiration});
+            }
+        }
+    }
+    // Keep the mappings of the previous instance not adopted yet.
+    for (auto const& map : cachedMappings_) {
+        if (not map.isExpired())
+            cache.mappings.push_back(map);
+    }
+
+    fileutils::check_dir(cacheFile_.substr(0, cacheFile_.rfind(DIR_SEPARATOR_CH)).c_str());
+    cache.save(cacheFile_, logger_);
+}
+
+void
+UPnPContext::adoptCachedMappings(const std::shared_ptr<IGD>& igd)
+{
+    CHECK_VALID_THREAD();
+
+    if (cachedMappings_.empty() or igd->getProtocol() != NatProtocolType::PUPNP)
+        return;
+
+    // The mappings are only usable if the host address did not change.
+    auto hostAddr = protocolList_.at(NatProtocolType::PUPNP)->getHostAddress();
+    auto igdUid = igd->getUID();
+    unsigned adopted = 0;
+
+    std::lock_guard<std::mutex> lock(mappingMutex_);
+    for (auto it = cachedMappings_.begin(); it != cachedMappings_.end();) {
+        if (it->igdUid != igdUid) {
+            ++it;
+            continue;
+        }
+        if (not it->isExpired() and IpAddr(it->internalAddr) == hostAddr) {
+            Mapping map(it->udp ? PortType::UDP : PortType::TCP,
+                        it->externalPort,
+                        it->internalPort);
+            map.setInternalAddress(it->internalAddr);
+            map.setIgd(igd);
+            map.setState(MappingState::OPEN);
+            auto& mappingList = getMappingList(map.getType());
+            auto ret = mappingList.emplace(map.getMapKey(), std::make_shared<Mapping>(map));
+            if (ret.second) {
+                indexMapping(ret.first->second);
+                adopted++;
+            }
+        }
+        it = cachedMappings_.erase(it);
+    }
+
+    if (logger_ and adopted)
+        logger_->debug("Adopted {} cached mapping(s) on IGD {}", adopted, igd->toString());
+}
+
 void
 UPnPContext::registerController(void* controller)
 {
     {
         std::lock_guard<std::mutex> lock(mappingMutex_);
         if (shutdownComplete_) {
-            JAMI_WARN("UPnPContext already shut down");
+            if (logger_)
+                logger_->warn("UPnPContext already shut down");
             return;
         }
     }
 
     if (not isValidThread()) {
-        runOnUpnpContextQueue([this, controller] { registerController(controller); });
+        runOnUpnpContextQueue([w = weak_from_this(), controller] {
+            if (auto sthis = w.lock())
+                sthis->registerController(controller);
+        });
         return;
     }
 
     auto ret = controllerList_.emplace(controller);
     if (not ret.second) {
-        JAMI_WARN("Controller %p is already registered", controller);
+        if (logger_)
+            logger_->warn("Controller {} is already registered", fmt::ptr(controller));
         return;
     }
 
-    JAMI_DBG("Successfully registered controller %p", controller);
-    if (not started_)
+    if (logger_)
+        logger_->debug("Successfully registered controller {}", fmt::ptr(controller));
+    if (not started_) {
+        init();
         startUpnp();
+    }
 }
 
 void
 UPnPContext::unregisterController(void* controller)
 {
     if (not isValidThread()) {
-        runOnUpnpContextQueue([this, controller] { unregisterController(controller); });
+        runOnUpnpContextQueue([w = weak_from_this(), controller] {
+            if (auto sthis = w.lock())
+                sthis->unregisterController(controller);
+        });
         return;
     }
 
     if (controllerList_.erase(controller) == 1) {
-        JAMI_DBG("Successfully unregistered controller %p", controller);
+        if (logger_)
+            logger_->debug("Successfully unregistered controller {}", fmt::ptr(controller));
     } else {
-        JAMI_DBG("Controller %p was already removed", controller);
+        if (logger_)
+            logger_->debug("Controller {} was already removed", fmt::ptr(controller));
     }
 
     if (controllerList_.empty()) {
@@ -452,7 +725,8 @@ UPnPContext::getAvailablePortNumber(PortType type)
     }
 
     // Very unlikely to get here.
-    JAMI_ERR("Could not find an available port after %i trials", MAX_REQUEST_RETRIES);
+    if (logger_)
+        logger_->error("Could not find an available port after {} trials", MAX_REQUEST_RETRIES);
     return 0;
 }
 
@@ -462,7 +736,10 @@ UPnPContext::requestMapping(const Mapping::sharedPtr_t& map)
     assert(map);
 
     if (not isValidThread()) {
-        runOnUpnpContextQueue([this, map] { requestMapping(map); });
+        runOnUpnpContextQueue([w = weak_from_this(), map] {
+            if (auto sthis = w.lock())
+                sthis->requestMapping(map);
+        });
         return;
     }
 
@@ -472,16 +749,18 @@ UPnPContext::requestMapping(const Mapping::sharedPtr_t& map)
     // because the processing is asynchronous, it's possible that the IGD
     // was invalidated when the this code executed.
     if (not igd) {
-        JAMI_DBG("No valid IGDs available");
+        if (logger_)
+            logger_->debug("No valid IGDs available");
         return;
     }
 
-    map->setIgd(igd);
+    setMappingIgd(map, igd);
 
-    JAMI_DBG("Request mapping %s using protocol [%s] IGD [%s]",
-             map->toString().c_str(),
-             igd->getProtocolName(),
-             igd->toString().c_str());
+    if (logger_)
+        logger_->debug("Request mapping {} using protocol [{}] IGD [{}]",
+                       map->toString(),
+                       igd->getProtocolName(),
+                       igd->toString());
 
     if (map->getState() != MappingState::IN_PROGRESS)
         updateMappingState(map, MappingState::IN_PROGRESS);
@@ -493,7 +772,10 @@ UPnPContext::requestMapping(const Mapping::sharedPtr_t& map)
 bool
 UPnPContext::provisionNewMappings(PortType type, int portCount)
 {
-    JAMI_DBG("Provision %i new mappings of type [%s]", portCount, Mapping::getTypeStr(type));
+    if (logger_)
+        logger_->debug("Provision {} new mappings of type [{}]",
+                       portCount,
+                       Mapping::getTypeStr(type));
 
     assert(portCount > 0);
 
@@ -506,7 +788,8 @@ UPnPContext::provisionNewMappings(PortType type, int portCount)
             registerMapping(map);
         } else {
             // Very unlikely to get here!
-            JAMI_ERR("Can not find any available port to provision!");
+            if (logger_)
+                logger_->error("Can not find any available port to provision!");
             return false;
         }
     }
@@ -517,7 +800,10 @@ UPnPContext::provisionNewMappings(PortType type, int portCount)
 bool
 UPnPContext::deleteUnneededMappings(PortType type, int portCount)
 {
-    JAMI_DBG("Remove %i unneeded mapping of type [%s]", portCount, Mapping::getTypeStr(type));
+    if (logger_)
+        logger_->debug("Remove {} unneeded mapping of type [{}]",
+                       portCount,
+                       Mapping::getTypeStr(type));
 
     assert(portCount > 0);
 
@@ -525,31 +811,31 @@ UPnPContext::deleteUnneededMappings(PortType type, int portCount)
 
     std::lock_guard<std::mutex> lock(mappingMutex_);
     auto& mappingList = getMappingList(type);
+    auto const& index = getMappingIndex(type);
 
-    for (auto it = mappingList.begin(); it != mappingList.end();) {
-        auto map = it->second;
-        assert(map);
-
-        if (not map->isAvailable()) {
-            it++;
-            continue;
-        }
+    // Close portCount available mappings in "OPEN" state.
+    std::vector<Mapping::key_t> toClose;
+    for (auto key : index.availableByState[stateIndex(MappingState::OPEN)]) {
+        if (portCount-- <= 0)
+            break;
+        toClose.emplace_back(key);
+    }
+    for (auto key : toClose) {
+        requestRemoveMapping(mappingList.at(key));
+        unregisterMapping(mappingList.find(key));
+    }
 
-        if (map->getState() == MappingState::OPEN and portCount > 0) {
-            // Close portCount mappings in "OPEN" state.
-            requestRemoveMapping(map);
-            it = unregisterMapping(it);
-            portCount--;
-        } else if (map->getState() != MappingState::OPEN) {
-            // If this methods is called, it means there are more open
-            // mappings than required. So, all mappings in a state other
-            // than "OPEN" state (typically in in-progress state) will
-            // be deleted as well.
-            it = unregisterMapping(it);
-        } else {
-            it++;
-        }
+    // If this methods is called, it means there are more open
+    // mappings than required. So, all available mappings in a state
+    // other than "OPEN" state (typically in in-progress state) will
+    // be deleted as well.
+    std::vector<Mapping::key_t> toDelete;
+    for (auto state : {MappingState::PENDING, MappingState::IN_PROGRESS, MappingState::FAILED}) {
+        auto const& available = index.availableByState[stateIndex(state)];
+        toDelete.insert(toDelete.end(), available.begin(), available.end());
     }
+    for (auto key : toDelete)
+        unregisterMapping(mappingList.find(key));
 
     return true;
 }
@@ -583,10 +869,11 @@ UPnPContext::updatePreferredIgd()
     }
 
     if (preferredIgd_ and preferredIgd_->isValid()) {
-        JAMI_DBG("Preferred IGD updated to [%s] IGD [%s %s] ",
-                 preferredIgd_->getProtocolName(),
-                 preferredIgd_->getUID().c_str(),
-                 preferredIgd_->toString().c_str());
+        if (logger_)
+            logger_->debug("Preferred IGD updated to [{}] IGD [{} {}] ",
+                           preferredIgd_->getProtocolName(),
+                           preferredIgd_->getUID(),
+                           preferredIgd_->toString());
     }
 }
 
@@ -603,7 +890,10 @@ UPnPContext::updateMappingList(bool async)
 {
     // Run async if requested.
     if (async) {
-        runOnUpnpContextQueue([this] { updateMappingList(false); });
+        runOnUpnpContextQueue([w = weak_from_this()] {
+            if (auto sthis = w.lock())
+                sthis->updateMappingList(false);
+        });
         return;
     }
 
@@ -612,10 +902,7 @@ UPnPContext::updateMappingList(bool async)
     // Update the preferred IGD.
     updatePreferredIgd();
 
-    if (mappingListUpdateTimer_) {
-        mappingListUpdateTimer_->cancel();
-        mappingListUpdateTimer_ = {};
-    }
+    mappingListUpdateTimer_.cancel();
 
     // Skip if no controller registered.
     if (controllerList_.empty())
@@ -624,13 +911,21 @@ UPnPContext::updateMappingList(bool async)
     // Cancel the current timer (if any) and re-schedule.
     std::shared_ptr<IGD> prefIgd = getPreferredIgd();
     if (not prefIgd) {
-        JAMI_DBG("UPNP/NAT-PMP enabled, but no valid IGDs available");
+        if (logger_)
+            logger_->debug("UPNP/NAT-PMP enabled, but no valid IGDs available");
         // No valid IGD. Nothing to do.
         return;
     }
 
-    mappingListUpdateTimer_ = getScheduler()->scheduleIn([this] { updateMappingList(false); },
-                                                         MAP_UPDATE_INTERVAL);
+    mappingListUpdateTimer_.expires_after(MAP_UPDATE_INTERVAL);
+    mappingListUpdateTimer_.async_wait([w = weak_from_this()](const asio::error_code& ec) {
+        if (ec == asio::error::operation_aborted)
+            return;
+        if (auto sthis = w.lock()) {
+            sthis->updateMappingList(false);
+            sthis->saveCache();
+        }
+    });
 
     // Process pending requests if any.
     processPendingRequests(prefIgd);
@@ -647,30 +942,38 @@ UPnPContext::updateMappingList(bool async)
         MappingStatus status;
         getMappingStatus(type, status);
 
-        JAMI_DBG("Mapping status [%s] - overall %i: %i open (%i ready + %i in use), %i pending, %i "
-                 "in-progress, %i failed",
-                 Mapping::getTypeStr(type),
-                 status.sum(),
-                 status.openCount_,
-                 status.readyCount_,
-                 status.openCount_ - status.readyCount_,
-                 status.pendingCount_,
-                 status.inProgressCount_,
-                 status.failedCount_);
-
-        if (status.failedCount_ > 0) {
+        if (logger_)
+            logger_->debug("Mapping status [{}] - overall {}: {} open ({} ready + {} in use), "
+                           "{} pending, {} in-progress, {} failed",
+                           Mapping::getTypeStr(type),
+                           status.sum(),
+                           status.openCount_,
+                           status.readyCount_,
+                           status.openCount_ - status.readyCount_,
+                           status.pendingCount_,
+                           status.inProgressCount_,
+                           status.failedCount_);
+
+        if (status.failedCount_ > 0 and logger_) {
             std::lock_guard<std::mutex> lock(mappingMutex_);
             auto const& mappingList = getMappingList(type);
-            for (auto const& [_, map] : mappingList) {
-                if (map->getState() == MappingState::FAILED) {
-                    JAMI_DBG("Mapping status [%s] - Available [%s]",
-                             map->toString(true).c_str(),
-                             map->isAvailable() ? "YES" : "NO");
-                }
+            for (auto key : getMappingIndex(type).byState[stateIndex(MappingState::FAILED)]) {
+                auto const& map = mappingList.at(key);
+                logger_->debug("Mapping status [{}] - Available [{}]",
+                               map->toString(true),
+                               map->isAvailable() ? "YES" : "NO");
             }
         }
 
-        int toRequestCount = (int) minOpenPortLimit_[idx]
+        // The pool size follows the reservation rate.
+        int targetCount, highWatermark;
+        {
+            std::lock_guard<std::mutex> lock(mappingMutex_);
+            targetCount = poolSizer_[idx].target();
+            highWatermark = poolSizer_[idx].highWatermark();
+        }
+
+        int toRequestCount = targetCount
                              - (int) (status.readyCount_ + status.inProgressCount_
                                       + status.pendingCount_);
 
@@ -679,27 +982,27 @@ UPnPContext::updateMappingList(bool async)
             // Take into account the request in-progress when making
             // requests for new mappings.
             provisionNewMappings(type, toRequestCount);
-        } else if (status.readyCount_ > maxOpenPortLimit_[idx]) {
-            deleteUnneededMappings(type, status.readyCount_ - maxOpenPortLimit_[idx]);
+        } else if (status.readyCount_ > highWatermark) {
+            deleteUnneededMappings(type, status.readyCount_ - highWatermark);
         }
     }
 
+    // The available protocols depend on the build options.
+    auto isProtocolReady = [this](NatProtocolType type) {
+        auto it = protocolList_.find(type);
+        return it != protocolList_.end() and it->second->isReady();
+    };
+
     // Prune the mapping list if needed
-    if (protocolList_.at(NatProtocolType::PUPNP)->isReady()) {
-#if HAVE_LIBNATPMP
+    if (isProtocolReady(NatProtocolType::PUPNP)) {
         // Dont perform if NAT-PMP is valid.
-        if (not protocolList_.at(NatProtocolType::NAT_PMP)->isReady())
-#endif
-        {
+        if (not isProtocolReady(NatProtocolType::NAT_PMP)) {
             pruneMappingList();
         }
     }
 
-#if HAVE_LIBNATPMP
-    // Renew nat-pmp allocations
-    if (protocolList_.at(NatProtocolType::NAT_PMP)->isReady())
-        renewAllocations();
-#endif
+    // Renew the allocations that are about to expire
+    renewAllocations();
 }
 
 void
@@ -726,7 +1029,8 @@ UPnPContext::pruneMappingList()
     if (remoteMapList.empty()) {
         std::lock_guard<std::mutex> lock(mappingMutex_);
         if (not getMappingList(PortType::TCP).empty() or getMappingList(PortType::TCP).empty()) {
-            JAMI_WARN("We have provisionned mappings but the PUPNP IGD returned an empty list!");
+            if (logger_)
+                logger_->warn("We have provisionned mappings but the PUPNP IGD returned an empty list!");
         }
     }
 
@@ -749,21 +1053,22 @@ UPnPContext::pruneUnMatchedMappings(const std::shared_ptr<IGD>& igd,
         {
             std::lock_guard<std::mutex> lock(mappingMutex_);
             auto& mappingList = getMappingList(type);
-            for (auto const& [_, map] : mappingList) {
+            for (auto key : getMappingIndex(type).byState[stateIndex(MappingState::OPEN)]) {
+                auto const& map = mappingList.at(key);
                 // Only check mappings allocated by UPNP protocol.
                 if (map->getProtocol() != NatProtocolType::PUPNP) {
                     continue;
                 }
                 // Set mapping as failed if not found in the list
                 // returned by the IGD.
-                if (map->getState() == MappingState::OPEN
-                    and remoteMapList.find(map->getMapKey()) == remoteMapList.end()) {
+                if (remoteMapList.find(key) == remoteMapList.end()) {
                     toRemoveList.emplace_back(map);
 
-                    JAMI_WARN("Mapping %s (IGD %s) marked as \"OPEN\" but not found in the "
-                              "remote list. Mark as failed!",
-                              map->toString().c_str(),
-                              igd->toString().c_str());
+                    if (logger_)
+                        logger_->warn("Mapping {} (IGD {}) marked as \"OPEN\" but not found in "
+                                      "the remote list. Mark as failed!",
+                                      map->toString(),
+                                      igd->toString());
                 }
             }
         }
@@ -818,21 +1123,20 @@ UPnPContext::pruneMappingsWithInvalidIgds(const std::shared_ptr<IGD>& igd)
     {
         std::lock_guard<std::mutex> lock(mappingMutex_);
 
-        PortType types[2] {PortType::TCP, PortType::UDP};
-        for (auto& type : types) {
-            auto& mappingList = getMappingList(type);
-            for (auto const& [_, map] : mappingList) {
-                if (map->getIgd() == igd)
-                    toRemoveList.emplace_back(map);
-            }
+        auto it = mappingsByIgd_.find(igd);
+        if (it != mappingsByIgd_.end()) {
+            for (auto key : it->second)
+                toRemoveList.emplace_back(
+                    getMappingList(Mapping::getTypeFromMapKey(key)).at(key));
         }
     }
 
     for (auto const& map : toRemoveList) {
-        JAMI_DBG("Remove mapping %s (has an invalid IGD %s [%s])",
-                 map->toString().c_str(),
-                 igd->toString().c_str(),
-                 igd->getProtocolName());
+        if (logger_)
+            logger_->debug("Remove mapping {} (has an invalid IGD {} [{}])",
+                           map->toString(),
+                           igd->toString(),
+                           igd->getProtocolName());
         updateMappingState(map, MappingState::FAILED);
         unregisterMapping(map);
     }
@@ -853,13 +1157,13 @@ UPnPContext::processPendingRequests(const std::shared_ptr<IGD>& igd)
 
         for (auto type : typeArray) {
             auto& mappingList = getMappingList(type);
-            for (auto& [_, map] : mappingList) {
-                if (map->getState() == MappingState::PENDING) {
-                    JAMI_DBG("Send pending request for mapping %s to IGD %s",
-                             map->toString().c_str(),
-                             igd->toString().c_str());
-                    requestsList.emplace_back(map);
-                }
+            for (auto key : getMappingIndex(type).byState[stateIndex(MappingState::PENDING)]) {
+                auto const& map = mappingList.at(key);
+                if (logger_)
+                    logger_->debug("Send pending request for mapping {} to IGD {}",
+                                   map->toString(),
+                                   igd->toString());
+                requestsList.emplace_back(map);
             }
         }
     }
@@ -885,8 +1189,9 @@ UPnPContext::processMappingWithAutoUpdate()
 
         for (auto type : typeArray) {
             auto& mappingList = getMappingList(type);
-            for (auto const& [_, map] : mappingList) {
-                if (map->getState() == MappingState::FAILED and map->getAutoUpdate()) {
+            for (auto key : getMappingIndex(type).byState[stateIndex(MappingState::FAILED)]) {
+                auto const& map = mappingList.at(key);
+                if (map->getAutoUpdate()) {
                     requestsList.emplace_back(map);
                 }
             }
@@ -895,8 +1200,9 @@ UPnPContext::processMappingWithAutoUpdate()
 
     for (auto const& oldMap : requestsList) {
         // Request a new mapping if auto-update is enabled.
-        JAMI_DBG("Mapping %s has auto-update enabled, a new mapping will be requested",
-                 oldMap->toString().c_str());
+        if (logger_)
+            logger_->debug("Mapping {} has auto-update enabled, a new mapping will be requested",
+                           oldMap->toString());
 
         // Reserve a new mapping.
         Mapping newMapping(oldMap->getType());
@@ -907,7 +1213,7 @@ UPnPContext::processMappingWithAutoUpdate()
         assert(mapPtr);
 
         // Release the old one.
-        oldMap->setAvailable(true);
+        setMappingAvailable(oldMap, true);
         oldMap->enableAutoUpdate(false);
         oldMap->setNotifyCallback(nullptr);
         unregisterMapping(oldMap);
@@ -920,10 +1226,18 @@ UPnPContext::onIgdUpdated(const std::shared_ptr<IGD>& igd, UpnpIgdEvent event)
     assert(igd);
 
     if (not isValidThread()) {
-        runOnUpnpContextQueue([this, igd, event] { onIgdUpdated(igd, event); });
+        runOnUpnpContextQueue([w = weak_from_this(), igd, event] {
+            if (auto sthis = w.lock())
+                sthis->onIgdUpdated(igd, event);
+        });
         return;
     }
 
+    if (event == UpnpIgdEvent::INVALID_STATE) {
+        std::lock_guard<std::mutex> lock(mappingMutex_);
+        igdErrorCount_++;
+    }
+
     // Reset to start search for a new best IGD.
     preferredIgd_.reset();
 
@@ -934,38 +1248,43 @@ UPnPContext::onIgdUpdated(const std::shared_ptr<IGD>& igd, UpnpIgdEvent event)
     auto const& igdLocalAddr = igd->getLocalIp();
     auto protocolName = igd->getProtocolName();
 
-    JAMI_DBG("New event for IGD [%s %s] [%s]: [%s]",
-             igd->getUID().c_str(),
-             igd->toString().c_str(),
-             protocolName,
-             IgdState);
+    if (logger_)
+        logger_->debug("New event for IGD [{} {}] [{}]: [{}]",
+                       igd->getUID(),
+                       igd->toString(),
+                       protocolName,
+                       IgdState);
 
     // Check if the IGD has valid addresses.
     if (not igdLocalAddr) {
-        JAMI_WARN("[%s] IGD has an invalid local address", protocolName);
+        if (logger_)
+            logger_->warn("[{}] IGD has an invalid local address", protocolName);
         return;
     }
 
     if (not igd->getPublicIp()) {
-        JAMI_WARN("[%s] IGD has an invalid public address", protocolName);
+        if (logger_)
+            logger_->warn("[{}] IGD has an invalid public address", protocolName);
         return;
     }
 
     if (knownPublicAddress_ and igd->getPublicIp() != knownPublicAddress_) {
-        JAMI_WARN("[%s] IGD external address [%s] does not match known public address [%s]."
-                  " The mapped addresses might not be reachable",
-                  protocolName,
-                  igd->getPublicIp().toString().c_str(),
-                  knownPublicAddress_.toString().c_str());
+        if (logger_)
+            logger_->warn("[{}] IGD external address [{}] does not match known public "
+                          "address [{}]. The mapped addresses might not be reachable",
+                          protocolName,
+                          igd->getPublicIp().toString(),
+                          knownPublicAddress_.toString());
     }
 
     // The IGD was removed or is invalid.
     if (event == UpnpIgdEvent::REMOVED or event == UpnpIgdEvent::INVALID_STATE) {
-        JAMI_WARN("State of IGD [%s %s] [%s] changed to [%s]. Pruning the mapping list",
-                  igd->getUID().c_str(),
-                  igd->toString().c_str(),
-                  protocolName,
-                  IgdState);
+        if (logger_)
+            logger_->warn("State of IGD [{} {}] [{}] changed to [{}]. Pruning the mapping list",
+                          igd->getUID(),
+                          igd->toString(),
+                          protocolName,
+                          IgdState);
 
         pruneMappingsWithInvalidIgds(igd);
 
@@ -979,18 +1298,23 @@ UPnPContext::onIgdUpdated(const std::shared_ptr<IGD>& igd, UpnpIgdEvent event)
         std::lock_guard<std::mutex> lock(mappingMutex_);
         auto ret = validIgdList_.emplace(igd);
         if (ret.second) {
-            JAMI_DBG("IGD [%s] on address %s was added. Will process any pending requests",
-                     protocolName,
-                     igdLocalAddr.toString(true, true).c_str());
+            if (logger_)
+                logger_->debug("IGD [{}] on address {} was added. Will process any pending requests",
+                               protocolName,
+                               igdLocalAddr.toString(true, true));
         } else {
             // Already in the list.
-            JAMI_ERR("IGD [%s] on address %s already in the list",
-                     protocolName,
-                     igdLocalAddr.toString(true, true).c_str());
+            if (logger_)
+                logger_->error("IGD [{}] on address {} already in the list",
+                               protocolName,
+                               igdLocalAddr.toString(true, true));
             return;
         }
     }
 
+    // Use the mappings of the previous instance, if any.
+    adoptCachedMappings(igd);
+
     // Update the provisionned mappings.
     updateMappingList(false);
 }
@@ -1004,32 +1328,34 @@ UPnPContext::onMappingAdded(const std::shared_ptr<IGD>& igd, const Mapping& mapR
     auto map = getMappingWithKey(mapRes.getMapKey());
     if (not map) {
         // We may receive a response for a canceled request. Just ignore it.
-        JAMI_DBG("Response for mapping %s [IGD %s] [%s] does not have a local match",
-                 mapRes.toString().c_str(),
-                 igd->toString().c_str(),
-                 mapRes.getProtocolName());
+        if (logger_)
+            logger_->debug("Response for mapping {} [IGD {}] [{}] does not have a local match",
+                           mapRes.toString(),
+                           igd->toString(),
+                           mapRes.getProtocolName());
         return;
     }
 
     // The mapping request is new and successful. Update.
-    map->setIgd(igd);
+    setMappingIgd(map, igd);
     map->setInternalAddress(mapRes.getInternalAddress());
     map->setExternalPort(mapRes.getExternalPort());
+    map->setRenewalTime(mapRes.getRenewalTime());
 
     // Update the state and report to the owner.
     updateMappingState(map, MappingState::OPEN);
 
-    JAMI_DBG("Mapping %s (on IGD %s [%s]) successfully performed",
-             map->toString().c_str(),
-             igd->toString().c_str(),
-             map->getProtocolName());
+    if (logger_)
+        logger_->debug("Mapping {} (on IGD {} [{}]) successfully performed",
+                       map->toString(),
+                       igd->toString(),
+                       map->getProtocolName());
 
     // Call setValid() to reset the errors counter. We need
     // to reset the counter on each successful response.
     igd->setValid(true);
 }
 
-#if HAVE_LIBNATPMP
 void
 UPnPContext::onMappingRenewed(const std::shared_ptr<IGD>& igd, const Mapping& map)
 {
@@ -1037,24 +1363,24 @@ UPnPContext::onMappingRenewed(const std::shared_ptr<IGD>& igd, const Mapping& ma
 
     if (not mapPtr) {
         // We may receive a notification for a canceled request. Ignore it.
-        JAMI_WARN("Renewed mapping %s from IGD  %s [%s] does not have a match in local list",
-                  map.toString().c_str(),
-                  igd->toString().c_str(),
-                  map.getProtocolName());
+        if (logger_)
+            logger_->warn("Renewed mapping {} from IGD  {} [{}] does not have a match in local list",
+                          map.toString(),
+                          igd->toString(),
+                          map.getProtocolName());
         return;
     }
-    if (mapPtr->getProtocol() != NatProtocolType::NAT_PMP or not mapPtr->isValid()
-        or mapPtr->getState() != MappingState::OPEN) {
-        JAMI_WARN("Renewed mapping %s from IGD %s [%s] is in unexpected state",
-                  mapPtr->toString().c_str(),
-                  igd->toString().c_str(),
-                  mapPtr->getProtocolName());
+    if (not mapPtr->isValid() or mapPtr->getState() != MappingState::OPEN) {
+        if (logger_)
+            logger_->warn("Renewed mapping {} from IGD {} [{}] is in unexpected state",
+                          mapPtr->toString(),
+                          igd->toString(),
+                          mapPtr->getProtocolName());
         return;
     }
 
     mapPtr->setRenewalTime(map.getRenewalTime());
 }
-#endif
 
 void
 UPnPContext::requestRemoveMapping(const Mapping::sharedPtr_t& map)
@@ -1062,7 +1388,8 @@ UPnPContext::requestRemoveMapping(const Mapping::sharedPtr_t& map)
     CHECK_VALID_THREAD();
 
     if (not map) {
-        JAMI_ERR("Mapping shared pointer is null!");
+        if (logger_)
+            logger_->error("Mapping shared pointer is null!");
         return;
     }
 
@@ -1079,7 +1406,10 @@ void
 UPnPContext::deleteAllMappings(PortType type)
 {
     if (not isValidThread()) {
-        runOnUpnpContextQueue([this, type] { deleteAllMappings(type); });
+        runOnUpnpContextQueue([w = weak_from_this(), type] {
+            if (auto sthis = w.lock())
+                sthis->deleteAllMappings(type);
+        });
         return;
     }
 
@@ -1098,7 +1428,10 @@ UPnPContext::onMappingRemoved(const std::shared_ptr<IGD>& igd, const Mapping& ma
         return;
 
     if (not isValidThread()) {
-        runOnUpnpContextQueue([this, igd, mapRes] { onMappingRemoved(igd, mapRes); });
+        runOnUpnpContextQueue([w = weak_from_this(), igd, mapRes] {
+            if (auto sthis = w.lock())
+                sthis->onMappingRemoved(igd, mapRes);
+        });
         return;
     }
 
@@ -1112,7 +1445,8 @@ Mapping::sharedPtr_t
 UPnPContext::registerMapping(Mapping& map)
 {
     if (map.getExternalPort() == 0) {
-        JAMI_DBG("Port number not set. Will set a random port number");
+        if (logger_)
+            logger_->debug("Port number not set. Will set a random port number");
         auto port = getAvailablePortNumber(map.getType());
         map.setExternalPort(port);
         map.setInternalPort(port);
@@ -1129,17 +1463,20 @@ UPnPContext::registerMapping(Mapping& map)
 
         auto ret = mappingList.emplace(map.getMapKey(), std::make_shared<Mapping>(map));
         if (not ret.second) {
-            JAMI_WARN("Mapping request for %s already added!", map.toString().c_str());
+            if (logger_)
+                logger_->warn("Mapping request for {} already added!", map.toString());
             return {};
         }
         mapPtr = ret.first->second;
         assert(mapPtr);
+        indexMapping(mapPtr);
     }
 
     // No available IGD. The pending mapping requests will be processed
     // when a IGD becomes available (in onIgdAdded() method).
     if (not isReady()) {
-        JAMI_WARN("No IGD available. Mapping will be requested when an IGD becomes available");
+        if (logger_)
+            logger_->warn("No IGD available. Mapping will be requested when an IGD becomes available");
     } else {
         requestMapping(mapPtr);
     }
@@ -1153,11 +1490,10 @@ UPnPContext::unregisterMapping(std::map<Mapping::key_t, Mapping::sharedPtr_t>::i
     assert(it->second);
 
     CHECK_VALID_THREAD();
-    auto descr = it->second->toString();
+    unindexMapping(it->first);
+    waitingReservations_.erase(it->first);
     auto& mappingList = getMappingList(it->second->getType());
-    auto ret = mappingList.erase(it);
-
-    return ret;
+    return mappingList.erase(it);
 }
 
 void
@@ -1166,7 +1502,8 @@ UPnPContext::unregisterMapping(const Mapping::sharedPtr_t& map)
     CHECK_VALID_THREAD();
 
     if (not map) {
-        JAMI_ERR("Mapping pointer is null");
+        if (logger_)
+            logger_->error("Mapping pointer is null");
         return;
     }
 
@@ -1174,15 +1511,21 @@ UPnPContext::unregisterMapping(const Mapping::sharedPtr_t& map)
         // Dont unregister mappings with auto-update enabled.
         return;
     }
+
+    std::lock_guard<std::mutex> lock(mappingMutex_);
     auto& mappingList = getMappingList(map->getType());
+    auto it = mappingList.find(map->getMapKey());
 
-    if (mappingList.erase(map->getMapKey()) == 1) {
-        JAMI_DBG("Unregistered mapping %s", map->toString().c_str());
+    if (it != mappingList.end() and it->second == map) {
+        unregisterMapping(it);
+        if (logger_)
+            logger_->debug("Unregistered mapping {}", map->toString());
     } else {
         // The mapping may already be un-registered. Just ignore it.
-        JAMI_DBG("Mapping %s [%s] does not have a local match",
-                 map->toString().c_str(),
-                 map->getProtocolName());
+        if (logger_)
+            logger_->debug("Mapping {} [{}] does not have a local match",
+                           map->toString(),
+                           map->getProtocolName());
     }
 }
 
@@ -1193,6 +1536,74 @@ UPnPContext::getMappingList(PortType type)
     return mappingList_[typeIdx];
 }
 
+UPnPContext::MappingIndex&
+UPnPContext::getMappingIndex(PortType type)
+{
+    unsigned typeIdx = type == PortType::TCP ? 0 : 1;
+    return mappingIndex_[typeIdx];
+}
+
+void
+UPnPContext::indexMapping(const Mapping::sharedPtr_t& map)
+{
+    auto key = map->getMapKey();
+
+    // Only the registered mappings are indexed.
+    auto const& mappingList = getMappingList(map->getType());
+    auto it = mappingList.find(key);
+    if (it == mappingList.end() or it->second != map)
+        return;
+
+    unindexMapping(key);
+
+    IndexedMapping indexed {map->getState(), map->isAvailable(), map->getIgd()};
+    auto& index = getMappingIndex(map->getType());
+    index.byState[stateIndex(indexed.state)].emplace(key);
+    if (indexed.available)
+        index.availableByState[stateIndex(indexed.state)].emplace(key);
+    if (indexed.igd)
+        mappingsByIgd_[indexed.igd].emplace(key);
+    indexedMappings_.emplace(key, std::move(indexed));
+}
+
+void
+UPnPContext::unindexMapping(Mapping::key_t key)
+{
+    auto it = indexedMappings_.find(key);
+    if (it == indexedMappings_.end())
+        return;
+
+    auto const& indexed = it->second;
+    auto& index = getMappingIndex(Mapping::getTypeFromMapKey(key));
+    index.byState[stateIndex(indexed.state)].erase(key);
+    index.availableByState[stateIndex(indexed.state)].erase(key);
+    if (indexed.igd) {
+        auto igdIt = mappingsByIgd_.find(indexed.igd);
+        if (igdIt != mappingsByIgd_.end()) {
+            igdIt->second.erase(key);
+            if (igdIt->second.empty())
+                mappingsByIgd_.erase(igdIt);
+        }
+    }
+    indexedMappings_.erase(it);
+}
+
+void
+UPnPContext::setMappingAvailable(const Mapping::sharedPtr_t& map, bool available)
+{
+    std::lock_guard<std::mutex> lock(mappingMutex_);
+    map->setAvailable(available);
+    indexMapping(map);
+}
+
+void
+UPnPContext::setMappingIgd(const Mapping::sharedPtr_t& map, const std::shared_ptr<IGD>& igd)
+{
+    std::lock_guard<std::mutex> lock(mappingMutex_);
+    map->setIgd(igd);
+    indexMapping(map);
+}
+
 Mapping::sharedPtr_t
 UPnPContext::getMappingWithKey(Mapping::key_t key)
 {
@@ -1208,35 +1619,13 @@ void
 UPnPContext::getMappingStatus(PortType type, MappingStatus& status)
 {
     std::lock_guard<std::mutex> lock(mappingMutex_);
-    auto& mappingList = getMappingList(type);
+    auto const& index = getMappingIndex(type);
 
-    for (auto const& [_, map] : mappingList) {
-        switch (map->getState()) {
-        case MappingState::PENDING: {
-            status.pendingCount_++;
-            break;
-        }
-        case MappingState::IN_PROGRESS: {
-            status.inProgressCount_++;
-            break;
-        }
-        case MappingState::FAILED: {
-            status.failedCount_++;
-            break;
-        }
-        case MappingState::OPEN: {
-            status.openCount_++;
-            if (map->isAvailable())
-                status.readyCount_++;
-            break;
-        }
-
-        default:
-            // Must not get here.
-            assert(false);
-            break;
-        }
-    }
+    status.pendingCount_ += index.byState[stateIndex(MappingState::PENDING)].size();
+    status.inProgressCount_ += index.byState[stateIndex(MappingState::IN_PROGRESS)].size();
+    status.failedCount_ += index.byState[stateIndex(MappingState::FAILED)].size();
+    status.openCount_ += index.byState[stateIndex(MappingState::OPEN)].size();
+    status.readyCount_ += index.availableByState[stateIndex(MappingState::OPEN)].size();
 }
 
 void
@@ -1254,25 +1643,33 @@ UPnPContext::onMappingRequestFailed(const Mapping& mapRes)
     auto const& map = getMappingWithKey(mapRes.getMapKey());
     if (not map) {
         // We may receive a response for a removed request. Just ignore it.
-        JAMI_DBG("Mapping %s [IGD %s] does not have a local match",
-                 mapRes.toString().c_str(),
-                 mapRes.getProtocolName());
+        if (logger_)
+            logger_->debug("Mapping {} [IGD {}] does not have a local match",
+                           mapRes.toString(),
+                           mapRes.getProtocolName());
         return;
     }
 
     auto igd = map->getIgd();
     if (not igd) {
-        JAMI_ERR("IGD pointer is null");
+        if (logger_)
+            logger_->error("IGD pointer is null");
         return;
     }
 
+    {
+        std::lock_guard<std::mutex> lock(mappingMutex_);
+        igdErrorCount_++;
+    }
+
     updateMappingState(map, MappingState::FAILED);
     unregisterMapping(map);
 
-    JAMI_WARN("Mapping request for %s failed on IGD %s [%s]",
-              map->toString().c_str(),
-              igd->toString().c_str(),
-              igd->getProtocolName());
+    if (logger_)
+        logger_->warn("Mapping request for {} failed on IGD {} [{}]",
+                      map->toString(),
+                      igd->toString(),
+                      igd->getProtocolName());
 }
 
 void
@@ -1284,40 +1681,49 @@ UPnPContext::updateMappingState(const Mapping::sharedPtr_t& map, MappingState ne
 
     // Ignore if the state did not change.
     if (newState == map->getState()) {
-        JAMI_DBG("Mapping %s already in state %s", map->toString().c_str(), map->getStateStr());
+        if (logger_)
+            logger_->debug("Mapping {} already in state {}", map->toString(), map->getStateStr());
         return;
     }
 
     // Update the state.
-    map->setState(newState);
+    {
+        std::lock_guard<std::mutex> lock(mappingMutex_);
+        map->setState(newState);
+        indexMapping(map);
+
+        if (newState == MappingState::OPEN or newState == MappingState::FAILED) {
+            auto it = waitingReservations_.find(map->getMapKey());
+            if (it != waitingReservations_.end()) {
+                if (newState == MappingState::OPEN) {
+                    totalWait_ += std::chrono::steady_clock::now() - it->second;
+                    resolvedCount_++;
+                }
+                waitingReservations_.erase(it);
+            }
+        }
+    }
 
     // Notify the listener if set.
     if (notify and map->getNotifyCallback())
         map->getNotifyCallback()(map);
 }
 
-#if HAVE_LIBNATPMP
 void
 UPnPContext::renewAllocations()
 {
     CHECK_VALID_THREAD();
 
-    // Check if the we have valid PMP IGD.
-    auto pmpProto = protocolList_.at(NatProtocolType::NAT_PMP);
-
     auto now = sys_clock::now();
     std::vector<Mapping::sharedPtr_t> toRenew;
 
     for (auto type : {PortType::TCP, PortType::UDP}) {
         std::lock_guard<std::mutex> lock(mappingMutex_);
-        auto mappingList = getMappingList(type);
-        for (auto const& [_, map] : mappingList) {
+        auto const& mappingList = getMappingList(type);
+        for (auto key : getMappingIndex(type).byState[stateIndex(MappingState::OPEN)]) {
+            auto const& map = mappingList.at(key);
             if (not map->isValid())
                 continue;
-            if (map->getProtocol() != NatProtocolType::NAT_PMP)
-                continue;
-            if (map->getState() != MappingState::OPEN)
-                continue;
             if (now < map->getRenewalTime())
                 continue;
 
@@ -1330,10 +1736,11 @@ UPnPContext::renewAllocations()
         return;
 
     for (auto const& map : toRenew) {
-        pmpProto->requestMappingRenew(*map);
+        auto it = protocolList_.find(map->getProtocol());
+        if (it != protocolList_.end() and it->second->isReady())
+            it->second->requestMappingRenew(*map);
     }
 }
-#endif
 
 } // namespace upnp
 } // namespace jami
@@ -30,10 +30,14 @@
 #include "protocol/pupnp/pupnp.h"
 #endif
 #include "protocol/igd.h"
+#include "upnp_thread_util.h"
+#include "mapping_pool.h"
+#include "upnp_cache.h"
 
 #include "ip_utils.h"
 
 #include <opendht/rng.h>
+#include <opendht/logger.h>
 #include <asio/steady_timer.hpp>
 
 #include <set>
@@ -46,8 +50,6 @@
 #include <atomic>
 #include <cstdlib>
 
-//#include "upnp_thread_util.h"
-
 using random_device = dht::crypto::random_device;
 
 using IgdFoundCallback = std::function<void()>;
@@ -59,7 +61,9 @@ class IpAddr;
 namespace jami {
 namespace upnp {
 
-class UPnPContext : public UpnpMappingObserver//, protected UpnpThreadUtil
+class UPnPContext : public UpnpMappingObserver,
+                    protected UpnpThreadUtil,
+                    public std::enable_shared_from_this<UPnPContext>
 {
 private:
     struct MappingStatus
@@ -81,14 +85,38 @@ private:
         int sum() { return openCount_ + pendingCount_ + inProgressCount_ + failedCount_; }
     };
 
+    // Number of mapping states (see MappingState).
+    constexpr static unsigned MAPPING_STATE_COUNT {4};
+
+    // Per-type indexes of the mapping list. Each registered mapping is
+    // indexed by its state and, if not in use, is also in the free list
+    // of its state.
+    struct MappingIndex
+    {
+        std::set<Mapping::key_t> byState[MAPPING_STATE_COUNT] {};
+        std::set<Mapping::key_t> availableByState[MAPPING_STATE_COUNT] {};
+    };
+
+    // Attributes of a mapping as currently indexed.
+    struct IndexedMapping
+    {
+        MappingState state;
+        bool available;
+        std::shared_ptr<IGD> igd;
+    };
+
 public:
-    UPnPContext();
+    // All the UPnP context tasks are run on the provided io_context.
+    // Must be owned by a shared_ptr: the queued tasks are dropped once it is
+    // destroyed.
+    UPnPContext(const std::shared_ptr<asio::io_context>& ctx,
+                const std::shared_ptr<dht::log::Logger>& logger);
     ~UPnPContext();
 
-    // Retrieve the UPnPContext singleton.
-    static std::shared_ptr<UPnPContext> getUPnPContext();
+    const std::shared_ptr<dht::log::Logger>& logger() const { return logger_; }
 
-    // Terminate the instance.
+    // Terminate the instance: release the mappings and stop the protocols.
+    // To be called by the owner before dropping it.
     void shutdown();
 
     // Set the known public address
@@ -106,9 +134,29 @@ public:
     // Returns a shared pointer of the mapping.
     Mapping::sharedPtr_t reserveMapping(Mapping& requestedMap);
 
+    // Same as above, but onResolved is also invoked once, when the
+    // mapping is open or failed. If an open mapping is available, it's
+    // invoked right away (from the calling thread), otherwise from the
+    // UPnP context thread once the IGD answered.
+    Mapping::sharedPtr_t reserveMapping(Mapping& requestedMap,
+                                        Mapping::NotifyCallback&& onResolved);
+
     // Release an used mapping (make it available for future use).
     void releaseMapping(const Mapping& map);
 
+    // Set the bounds of the pool of mappings opened in advance. The
+    // pool of each port type is sized within these bounds according to
+    // the reservation rate.
+    void setMappingPoolBounds(unsigned minSize, unsigned maxSize);
+
+    // Get the reservation statistics.
+    MappingPoolStats getMappingPoolStats() const;
+
+    // Persist the known IGDs and the open mappings in the given
+    // directory. On restart, the cached IGDs are validated without
+    // discovery, and their mappings are used right away.
+    void setCachePath(const std::string& cacheDir);
+
     // Register a controller
     void registerController(void* controller);
     // Unregister a controller
@@ -133,20 +181,34 @@ private:
      *
      * @param forceRelease If true, also delete mappings with enabled
      * auto-update feature.
+     * @param keepMappings If true, the open UPNP mappings are not removed
+     * from the IGD (they are cached for the next instance).
      *
      */
-    void stopUpnp(bool forceRelease = false);
+    void stopUpnp(bool forceRelease = false, bool keepMappings = false);
 
     void shutdown(std::condition_variable& cv);
 
     // Create and register a new mapping.
     Mapping::sharedPtr_t registerMapping(Mapping& map);
 
-    // Removes the mapping from the list.
+    // Removes the mapping from the list. The iterator version must be
+    // called with mappingMutex_ held.
     std::map<Mapping::key_t, Mapping::sharedPtr_t>::iterator unregisterMapping(
         std::map<Mapping::key_t, Mapping::sharedPtr_t>::iterator it);
     void unregisterMapping(const Mapping::sharedPtr_t& map);
 
+    // Update the indexes of a registered mapping. Must be called with
+    // mappingMutex_ held after any change of the state, the availability
+    // or the IGD of the mapping.
+    void indexMapping(const Mapping::sharedPtr_t& map);
+    // Remove the mapping from the indexes. Must be called with mappingMutex_ held.
+    void unindexMapping(Mapping::key_t key);
+
+    // Update the availability/IGD of a mapping and its indexes.
+    void setMappingAvailable(const Mapping::sharedPtr_t& map, bool available);
+    void setMappingIgd(const Mapping::sharedPtr_t& map, const std::shared_ptr<IGD>& igd);
+
     // Perform the request on the provided IGD.
     void requestMapping(const Mapping::sharedPtr_t& map);
 
@@ -214,6 +276,9 @@ private:
      */
     std::map<Mapping::key_t, Mapping::sharedPtr_t>& getMappingList(PortType type);
 
+    // Get the mapping indexes of the given type (same warning as above).
+    MappingIndex& getMappingIndex(PortType type);
+
     // Get the mapping from the key.
     Mapping::sharedPtr_t getMappingWithKey(Mapping::key_t key);
 
@@ -221,9 +286,8 @@ private:
     void getMappingStatus(PortType type, MappingStatus& status);
     void getMappingStatus(MappingStatus& status);
 
-#if HAVE_LIBNATPMP
+    // Renew the open mappings whose renewal time is reached.
     void renewAllocations();
-#endif
 
     // Process requests with pending status.
     void processPendingRequests(const std::shared_ptr<IGD>& igd);
@@ -231,6 +295,13 @@ private:
     // Process mapping with auto-update flag enabled.
     void processMappingWithAutoUpdate();
 
+    // Load and save the IGD and mapping cache (see setCachePath).
+    void loadCache();
+    void saveCache();
+
+    // Register the cached mappings of the IGD as open.
+    void adoptCachedMappings(const std::shared_ptr<IGD>& igd);
+
     // Implementation of UpnpMappingObserver interface.
 
     // Callback used to report changes in IGD status.
@@ -240,10 +311,8 @@ private:
     // Callback invoked when a request fails. Reported on failures for both
     // new requests and renewal requests (if supported by the the protocol).
     void onMappingRequestFailed(const Mapping& map) override;
-#if HAVE_LIBNATPMP
     // Callback used to report renew request status.
     void onMappingRenewed(const std::shared_ptr<IGD>& igd, const Mapping& map) override;
-#endif
     // Callback used to report remove request status.
     void onMappingRemoved(const std::shared_ptr<IGD>& igd, const Mapping& map) override;
 
@@ -268,26 +337,48 @@ private:
     // Port ranges for TCP and UDP (in that order).
     std::map<PortType, std::pair<uint16_t, uint16_t>> portRange_ {};
 
-    // Min open ports limit
-    int minOpenPortLimit_[2] {4, 8};
-    // Max open ports limit
-    int maxOpenPortLimit_[2] {8, 12};
-
-    //std::shared_ptr<Task> mappingListUpdateTimer_ {};
-    asio::steady_timer mappingListUpdateTimer_;// {};
+    asio::steady_timer mappingListUpdateTimer_;
 
     // Current preferred IGD. Can be null if there is no valid IGD.
     std::shared_ptr<IGD> preferredIgd_;
 
-    // This mutex must lock only these two members. All other
-    // members must be accessed only from the UPNP context thread.
+    // This mutex must lock only the mapping list, its indexes and the
+    // IGD list. All other members must be accessed only from the UPNP
+    // context thread.
     std::mutex mutable mappingMutex_;
     // List of mappings.
     std::map<Mapping::key_t, Mapping::sharedPtr_t> mappingList_[2] {};
+    // Indexes of the mapping list, so reservations and periodic updates
+    // don't have to scan the whole list.
+    MappingIndex mappingIndex_[2] {};
+    std::map<std::shared_ptr<IGD>, std::set<Mapping::key_t>> mappingsByIgd_ {};
+    std::map<Mapping::key_t, IndexedMapping> indexedMappings_ {};
     std::set<std::shared_ptr<IGD>> validIgdList_ {};
 
+    // Size of the pool of open mappings, per type. Also protected by
+    // mappingMutex_, as the reservation statistics.
+    MappingPoolSizer mutable poolSizer_[2] {};
+    uint64_t reservationCount_ {0};
+    uint64_t hitCount_ {0};
+    uint64_t igdErrorCount_ {0};
+    // Reservations of mappings not open yet, with their reservation time.
+    std::map<Mapping::key_t, std::chrono::steady_clock::time_point> waitingReservations_ {};
+    // Reservations served so far, and their total wait.
+    uint64_t resolvedCount_ {0};
+    std::chrono::steady_clock::duration totalWait_ {};
+
+    // Path of the cache file. Empty if the cache is disabled.
+    std::string cacheFile_ {};
+    // Mappings of the previous instance, waiting for their IGD.
+    std::vector<MappingCacheEntry> cachedMappings_ {};
+
+    // The protocols are created by the first task needing them
+    bool initialized_ {false};
+
     // Shutdown synchronization
     bool shutdownComplete_ {false};
+
+    std::shared_ptr<dht::log::Logger> logger_;
 };
 
 } // namespace upnp
@@ -25,23 +25,21 @@
 namespace jami {
 namespace upnp {
 
-Controller::Controller()
+Controller::Controller(const std::shared_ptr<UPnPContext>& ctx)
+    : upnpContext_(ctx)
+    , logger_(ctx->logger())
 {
-    try {
-        upnpContext_ = UPnPContext::getUPnPContext();
-    } catch (std::runtime_error& e) {
-        JAMI_ERR("UPnP context error: %s", e.what());
-    }
-
     assert(upnpContext_);
     upnpContext_->registerController(this);
 
-    JAMI_DBG("Controller@%p: Created UPnP Controller session", this);
+    if (logger_)
+        logger_->debug("Controller@{}: Created UPnP Controller session", fmt::ptr(this));
 }
 
 Controller::~Controller()
 {
-    JAMI_DBG("Controller@%p: Destroying UPnP Controller session", this);
+    if (logger_)
+        logger_->debug("Controller@{}: Destroying UPnP Controller session", fmt::ptr(this));
 
     releaseAllMappings();
     upnpContext_->unregisterController(this);
@@ -64,6 +62,13 @@ Controller::isReady() const
     return upnpContext_->isReady();
 }
 
+MappingPoolStats
+Controller::getMappingPoolStats() const
+{
+    assert(upnpContext_);
+    return upnpContext_->getMappingPoolStats();
+}
+
 IpAddr
 Controller::getExternalIP() const
 {
@@ -93,6 +98,17 @@ Controller::reserveMapping(Mapping& requestedMap)
     return mapRes;
 }
 
+Mapping::sharedPtr_t
+Controller::reserveMapping(Mapping& requestedMap, Mapping::NotifyCallback&& onResolved)
+{
+    assert(upnpContext_);
+
+    auto mapRes = upnpContext_->reserveMapping(requestedMap, std::move(onResolved));
+    if (mapRes)
+        addLocalMap(*mapRes);
+    return mapRes;
+}
+
 void
 Controller::releaseMapping(const Mapping& map)
 {
@@ -121,7 +137,8 @@ Controller::addLocalMap(const Mapping& map)
         std::lock_guard<std::mutex> lock(mapListMutex_);
         auto ret = mappingList_.emplace(map.getMapKey(), map);
         if (not ret.second) {
-            JAMI_WARN("Mapping request for %s already in the list!", map.toString().c_str());
+            if (logger_)
+                logger_->warn("Mapping request for {} already in the list!", map.toString());
         }
     }
 }
@@ -133,7 +150,8 @@ Controller::removeLocalMap(const Mapping& map)
 
     std::lock_guard<std::mutex> lk(mapListMutex_);
     if (mappingList_.erase(map.getMapKey()) != 1) {
-        JAMI_ERR("Failed to remove mapping %s from local list", map.getTypeStr());
+        if (logger_)
+            logger_->error("Failed to remove mapping {} from local list", map.getTypeStr());
         return false;
     }
 
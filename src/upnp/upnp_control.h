@@ -40,13 +40,18 @@ class UPnPContext;
 class Controller
 {
 public:
-    Controller();
+    Controller(const std::shared_ptr<UPnPContext>& ctx);
     ~Controller();
 
+    // The shared UPnP context this controller is registered to.
+    const std::shared_ptr<UPnPContext>& upnpContext() const { return upnpContext_; }
+
     // Set known public address
     void setPublicAddress(const IpAddr& addr);
     // Checks if a valid IGD is available.
     bool isReady() const;
+    // Get the mapping reservation statistics of the UPnP context.
+    MappingPoolStats getMappingPoolStats() const;
     // Gets the external ip of the first valid IGD in the list.
     IpAddr getExternalIP() const;
 
@@ -55,6 +60,10 @@ public:
     // pointer may point to nothing on failure.
     Mapping::sharedPtr_t reserveMapping(Mapping& map);
     Mapping::sharedPtr_t reserveMapping(uint16_t port, PortType type);
+    // Request port mapping without waiting for the IGD. The returned
+    // mapping may not be open yet, onResolved is invoked once it's
+    // open or failed (see UPnPContext::reserveMapping).
+    Mapping::sharedPtr_t reserveMapping(Mapping& map, Mapping::NotifyCallback&& onResolved);
 
     // Remove port mapping.
     void releaseMapping(const Mapping& map);
@@ -69,6 +78,7 @@ private:
     void releaseAllMappings();
 
     std::shared_ptr<UPnPContext> upnpContext_;
+    std::shared_ptr<dht::log::Logger> logger_;
 
     mutable std::mutex mapListMutex_;
     std::map<Mapping::key_t, Mapping> mappingList_;
@@ -1,13 +1,15 @@
 #pragma once
 
-#include <thread>
+#include <asio/io_context.hpp>
+#include <asio/post.hpp>
+
+#include <memory>
 
 // This macro is used to validate that a code is executed from the expected
 // thread. It's useful to detect unexpected race on data members.
 #define CHECK_VALID_THREAD() \
-    if (not isValidThread()) \
-        JAMI_ERR() << "The calling thread " << getCurrentThread() \
-                   << " is not the expected thread: " << threadId_;
+    if (not isValidThread() and logger_) \
+        logger_->error("The calling thread is not the expected thread");
 
 namespace jami {
 namespace upnp {
@@ -15,20 +17,22 @@ namespace upnp {
 class UpnpThreadUtil
 {
 protected:
-    std::thread::id getCurrentThread() const { return std::this_thread::get_id(); }
+    UpnpThreadUtil(const std::shared_ptr<asio::io_context>& ctx)
+        : ctx_(ctx)
+    {}
 
-    bool isValidThread() const { return threadId_ == getCurrentThread(); }
+    // True if the caller is running on the upnp context queue.
+    bool isValidThread() const { return ctx_ and ctx_->get_executor().running_in_this_thread(); }
 
-    // Upnp context execution queue (same as manager's scheduler)
-    // Helpers to run tasks on upnp context queue.
-    static ScheduledExecutor* getScheduler() { return &Manager::instance().scheduler(); }
+    // Upnp context execution queue (the io_context provided by the owner
+    // of the UPnPContext). Helper to run tasks on upnp context queue.
     template<typename Callback>
-    static void runOnUpnpContextQueue(Callback&& cb)
+    void runOnUpnpContextQueue(Callback&& cb)
     {
-        getScheduler()->run([cb = std::forward<Callback>(cb)]() mutable { cb(); });
+        asio::post(*ctx_, std::forward<Callback>(cb));
     }
 
-    std::thread::id threadId_;
+    std::shared_ptr<asio::io_context> ctx_;
 };
 
 } // namespace upnp
@@ -0,0 +1,90 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "test_runner.h"
+#include "buffer_pool.h"
+
+namespace jami {
+namespace test {
+
+class BufferPoolTest : public CppUnit::TestFixture
+{
+public:
+    static std::string name() { return "BufferPool"; }
+
+private:
+    void testSizeClasses();
+    void testReuse();
+    void testMaxFree();
+
+    CPPUNIT_TEST_SUITE(BufferPoolTest);
+    CPPUNIT_TEST(testSizeClasses);
+    CPPUNIT_TEST(testReuse);
+    CPPUNIT_TEST(testMaxFree);
+    CPPUNIT_TEST_SUITE_END();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(BufferPoolTest, BufferPoolTest::name());
+
+void
+BufferPoolTest::testSizeClasses()
+{
+    BufferPool pool;
+    CPPUNIT_ASSERT(pool.get(1).size() == BufferPool::MIN_SIZE);
+    CPPUNIT_ASSERT(pool.get(1500).size() == 2048);
+    CPPUNIT_ASSERT(pool.get(BufferPool::MAX_SIZE).size() == BufferPool::MAX_SIZE);
+    // Not pooled
+    CPPUNIT_ASSERT(pool.get(BufferPool::MAX_SIZE + 1).size() == BufferPool::MAX_SIZE + 1);
+    CPPUNIT_ASSERT(pool.freeSize() == BufferPool::MIN_SIZE + 2048 + BufferPool::MAX_SIZE);
+}
+
+void
+BufferPoolTest::testReuse()
+{
+    BufferPool pool;
+    uint8_t* data;
+    {
+        auto buffer = pool.get(BufferPool::MAX_SIZE);
+        data = buffer.data();
+        CPPUNIT_ASSERT(pool.freeSize() == 0);
+    }
+    CPPUNIT_ASSERT(pool.freeSize() == BufferPool::MAX_SIZE);
+    auto buffer = pool.get(40 * 1024);
+    CPPUNIT_ASSERT(buffer.data() == data);
+    CPPUNIT_ASSERT(pool.freeSize() == 0);
+}
+
+void
+BufferPoolTest::testMaxFree()
+{
+    BufferPool pool;
+    {
+        std::vector<BufferPool::Buffer> buffers;
+        for (std::size_t i = 0; i < 2 * BufferPool::MAX_FREE; i++)
+            buffers.emplace_back(pool.get(BufferPool::MIN_SIZE));
+    }
+    CPPUNIT_ASSERT(pool.freeSize() == BufferPool::MAX_FREE * BufferPool::MIN_SIZE);
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::BufferPoolTest::name())
@@ -0,0 +1,160 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <map>
+
+#include "test_runner.h"
+#include "channel_table.h"
+
+namespace jami {
+namespace test {
+
+class ChannelTableTest : public CppUnit::TestFixture
+{
+public:
+    static std::string name() { return "ChannelTable"; }
+
+private:
+    void testInsertErase();
+    void testFindFree();
+    void testFindFreeBitmap();
+    void testMatchesMap();
+
+    CPPUNIT_TEST_SUITE(ChannelTableTest);
+    CPPUNIT_TEST(testInsertErase);
+    CPPUNIT_TEST(testFindFree);
+    CPPUNIT_TEST(testFindFreeBitmap);
+    CPPUNIT_TEST(testMatchesMap);
+    CPPUNIT_TEST_SUITE_END();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(ChannelTableTest, ChannelTableTest::name());
+
+void
+ChannelTableTest::testInsertErase()
+{
+    ChannelTable<int> table;
+    CPPUNIT_ASSERT(table.empty());
+    CPPUNIT_ASSERT(not table.find(1));
+    for (int i = 1; i <= 100; i++)
+        table[i] = i;
+    CPPUNIT_ASSERT(table.size() == 100);
+    // Erase every other channel, the remaining ones must still be found
+    for (int i = 1; i <= 100; i += 2)
+        CPPUNIT_ASSERT(table.erase(i));
+    CPPUNIT_ASSERT(not table.erase(1));
+    CPPUNIT_ASSERT(table.size() == 50);
+    for (int i = 1; i <= 100; i++) {
+        auto* value = table.find(i);
+        if (i % 2)
+            CPPUNIT_ASSERT(not value);
+        else
+            CPPUNIT_ASSERT(value and *value == i);
+    }
+    std::size_t count = 0;
+    table.forEach([&](uint16_t id, const int& value) {
+        CPPUNIT_ASSERT(id == value);
+        count++;
+    });
+    CPPUNIT_ASSERT(count == 50);
+    table.clear();
+    CPPUNIT_ASSERT(table.empty());
+    CPPUNIT_ASSERT(not table.find(2));
+}
+
+void
+ChannelTableTest::testFindFree()
+{
+    ChannelTable<int> table;
+    CPPUNIT_ASSERT(table.findFree(10, 1, 20) == 10);
+    for (int i = 10; i <= 20; i++)
+        table[i] = i;
+    // Wraps around
+    CPPUNIT_ASSERT(table.findFree(10, 1, 20) == 1);
+    for (int i = 1; i < 10; i++)
+        table[i] = i;
+    CPPUNIT_ASSERT(table.findFree(10, 1, 20) == 0);
+    table.erase(15);
+    CPPUNIT_ASSERT(table.findFree(3, 1, 20) == 15);
+}
+
+void
+ChannelTableTest::testFindFreeBitmap()
+{
+    ChannelTable<int> table;
+    constexpr uint16_t FIRST = 1, LAST = UINT16_MAX - 1;
+    for (uint32_t i = FIRST; i <= LAST; i++)
+        table[i] = i;
+    CPPUNIT_ASSERT(table.findFree(1000, FIRST, LAST) == 0);
+    table.erase(500);
+    table.erase(40000);
+    CPPUNIT_ASSERT(table.findFree(1000, FIRST, LAST) == 40000);
+    CPPUNIT_ASSERT(table.findFree(40001, FIRST, LAST) == 500);
+    CPPUNIT_ASSERT(table.findFree(LAST, FIRST, LAST) == 500);
+    // Back under the threshold, the bitmap is released
+    for (uint32_t i = FIRST; i <= LAST; i++)
+        table.erase(i);
+    CPPUNIT_ASSERT(table.empty());
+    CPPUNIT_ASSERT(table.findFree(LAST, FIRST, LAST) == LAST);
+}
+
+void
+ChannelTableTest::testMatchesMap()
+{
+    constexpr uint16_t CHANNELS {10000};
+
+    ChannelTable<int> table;
+    for (uint16_t i = 0; i < CHANNELS; i++) {
+        auto id = table.findFree(i * 7, 1, UINT16_MAX - 1);
+        table[id] = i;
+    }
+    uint64_t sum = 0;
+    for (uint32_t id = 1; id < UINT16_MAX; id++)
+        if (auto* value = table.find(id))
+            sum += *value;
+
+    // Previous allocator: probe loop over a std::map
+    std::map<uint16_t, int> map;
+    for (uint16_t i = 0; i < CHANNELS; i++) {
+        for (uint32_t n = 1; n < UINT16_MAX; n++) {
+            uint16_t id = (i * 7 + n) % UINT16_MAX;
+            if (id == 0 || map.find(id) != map.end())
+                continue;
+            map[id] = i;
+            break;
+        }
+    }
+    uint64_t mapSum = 0;
+    for (uint32_t id = 1; id < UINT16_MAX; id++) {
+        auto it = map.find(id);
+        if (it != map.end())
+            mapSum += it->second;
+    }
+
+    CPPUNIT_ASSERT(table.size() == CHANNELS);
+    CPPUNIT_ASSERT(map.size() == CHANNELS);
+    CPPUNIT_ASSERT(sum == mapSum);
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::ChannelTableTest::name())
@@ -20,8 +20,17 @@
 #include <cppunit/TestFixture.h>
 #include <cppunit/extensions/HelperMacros.h>
 
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <fmt/core.h>
+
+#include <array>
 #include <condition_variable>
+#include <filesystem>
+#include <set>
 
+#include "certstore.h"
 #include "connectionmanager.h"
 #include "multiplexed_socket.h"
 #include "test_runner.h"
@@ -31,6 +40,28 @@ using namespace std::literals::chrono_literals;
 namespace jami {
 namespace test {
 
+/**
+ * A device with its own DHT node, bootstrapped on the node of the test,
+ * or using the DHT node of a shared context
+ */
+struct ConnectionHandler
+{
+    dht::crypto::Identity id;
+    std::string cachePath;
+    std::unique_ptr<tls::CertificateStore> certStore;
+    std::shared_ptr<dht::DhtRunner> dht;
+    std::shared_ptr<ConnectionManager> connectionManager;
+
+    ~ConnectionHandler()
+    {
+        connectionManager.reset();
+        if (dht)
+            dht->join();
+        std::error_code ec;
+        std::filesystem::remove_all(cachePath, ec);
+    }
+};
+
 class ConnectionManagerTest : public CppUnit::TestFixture
 {
 public:
@@ -65,6 +96,12 @@ private:
     void testConnectivityChangeTriggerBeacon();
     void testOnNoBeaconTriggersShutdown();
     void testShutdownWhileNegotiating();
+    void testSignalingRouted();
+    void testSignalingFallback();
+    void testKnownPathDirectDial();
+    void testSharedContext();
+    void testIdleConnectionTimeout();
+    void testTcpHandshakeLimit();
 
     CPPUNIT_TEST_SUITE(ConnectionManagerTest);
     CPPUNIT_TEST(testConnectDevice);
@@ -88,7 +125,35 @@ private:
     CPPUNIT_TEST(testConnectivityChangeTriggerBeacon);
     CPPUNIT_TEST(testOnNoBeaconTriggersShutdown);
     CPPUNIT_TEST(testShutdownWhileNegotiating);
+    CPPUNIT_TEST(testSignalingRouted);
+    CPPUNIT_TEST(testSignalingFallback);
+    CPPUNIT_TEST(testKnownPathDirectDial);
+#ifdef OPENDHT_PROXY_SERVER
+    CPPUNIT_TEST(testSharedContext);
+#endif
+    CPPUNIT_TEST(testIdleConnectionTimeout);
+    CPPUNIT_TEST(testTcpHandshakeLimit);
     CPPUNIT_TEST_SUITE_END();
+
+    std::unique_ptr<ConnectionHandler> setupHandler(
+        const std::string& name,
+        const dht::crypto::Identity& account,
+        const std::function<void(ConnectionManager::Config&)>& configure = {},
+        const std::shared_ptr<ConnectionManager::SharedContext>& sharedContext = {});
+    // Started without identity, bootstrapped on the node of the test
+    std::shared_ptr<dht::DhtRunner> startDht(
+        const std::function<std::vector<std::shared_ptr<dht::crypto::Certificate>>(
+            const dht::InfoHash&)>& certificateStore);
+    // Each device knows the certificates of the others
+    void pinCertificates(const std::vector<ConnectionHandler*>& handlers);
+    // Returns the channel, or nullptr on failure
+    std::shared_ptr<ChannelSocket> connect(ConnectionHandler& from,
+                                           const ConnectionHandler& to,
+                                           const std::string& name);
+
+    std::shared_ptr<asio::io_context> ioContext_;
+    std::thread ioContextRunner_;
+    std::shared_ptr<dht::DhtRunner> bootstrap_;
 };
 
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(ConnectionManagerTest, ConnectionManagerTest::name());
@@ -111,6 +176,134 @@ void
 ConnectionManagerTest::tearDown()
 {
     //wait_for_removal_of({aliceId, bobId});
+    if (ioContext_) {
+        ioContext_->stop();
+        if (ioContextRunner_.joinable())
+            ioContextRunner_.join();
+        ioContext_.reset();
+    }
+    if (bootstrap_) {
+        bootstrap_->join();
+        bootstrap_.reset();
+    }
+}
+
+std::unique_ptr<ConnectionHandler>
+ConnectionManagerTest::setupHandler(const std::string& name,
+                                    const dht::crypto::Identity& account,
+                                    const std::function<void(ConnectionManager::Config&)>& configure,
+                                    const std::shared_ptr<ConnectionManager::SharedContext>& sharedContext)
+{
+    if (not ioContext_) {
+        ioContext_ = std::make_shared<asio::io_context>();
+        ioContextRunner_ = std::thread([context = ioContext_]() {
+            auto work = asio::make_work_guard(*context);
+            context->run();
+        });
+        bootstrap_ = std::make_shared<dht::DhtRunner>();
+        dht::DhtRunner::Config bootstrapConfig;
+        bootstrapConfig.threaded = true;
+        bootstrap_->run(0, bootstrapConfig);
+    }
+
+    auto h = std::make_unique<ConnectionHandler>();
+    h->id = dht::crypto::generateIdentity(name, account, 2048);
+    h->cachePath = (std::filesystem::temp_directory_path() / ("dhtnet-connectionManager-" + name))
+                       .string();
+    std::filesystem::create_directories(h->cachePath);
+    h->certStore = std::make_unique<tls::CertificateStore>(name, nullptr);
+
+    if (not sharedContext) {
+        dht::DhtRunner::Config dhtConfig;
+        dhtConfig.dht_config.id = h->id;
+        dhtConfig.threaded = true;
+        dht::DhtRunner::Context dhtContext;
+        dhtContext.certificateStore = [c = h->certStore.get()](const dht::InfoHash& pk_id) {
+            std::vector<std::shared_ptr<dht::crypto::Certificate>> ret;
+            if (auto cert = c->getCertificate(pk_id.toString()))
+                ret.emplace_back(std::move(cert));
+            return ret;
+        };
+        h->dht = std::make_shared<dht::DhtRunner>();
+        h->dht->run(0, dhtConfig, std::move(dhtContext));
+        h->dht->bootstrap("127.0.0.1", std::to_string(bootstrap_->getBoundPort()));
+        for (int i = 0; i < 100 and h->dht->getStatus() != dht::NodeStatus::Connected; i++)
+            std::this_thread::sleep_for(100ms);
+        CPPUNIT_ASSERT(h->dht->getStatus() == dht::NodeStatus::Connected);
+    }
+
+    auto config = std::make_shared<ConnectionManager::Config>();
+    config->dht = h->dht;
+    config->sharedContext = sharedContext;
+    config->id = h->id;
+    config->ioContext = ioContext_;
+    config->certStore = h->certStore.get();
+    config->cachePath = h->cachePath;
+    config->upnpEnabled = false;
+    if (configure)
+        configure(*config);
+
+    h->connectionManager = std::make_shared<ConnectionManager>(config);
+    h->connectionManager->onICERequest([](const DeviceId&) { return true; });
+    h->connectionManager->onChannelRequest(
+        [](const std::shared_ptr<dht::crypto::Certificate>&, const std::string&) { return true; });
+    h->connectionManager->onDhtConnected(*h->id.second->getSharedPublicKey());
+    return h;
+}
+
+std::shared_ptr<dht::DhtRunner>
+ConnectionManagerTest::startDht(
+    const std::function<std::vector<std::shared_ptr<dht::crypto::Certificate>>(const dht::InfoHash&)>&
+        certificateStore)
+{
+    dht::DhtRunner::Config dhtConfig;
+    dhtConfig.threaded = true;
+    dht::DhtRunner::Context dhtContext;
+    dhtContext.certificateStore = certificateStore;
+    auto dht = std::make_shared<dht::DhtRunner>();
+    dht->run(0, dhtConfig, std::move(dhtContext));
+    dht->bootstrap("127.0.0.1", std::to_string(bootstrap_->getBoundPort()));
+    for (int i = 0; i < 100 and dht->getStatus() != dht::NodeStatus::Connected; i++)
+        std::this_thread::sleep_for(100ms);
+    CPPUNIT_ASSERT(dht->getStatus() == dht::NodeStatus::Connected);
+    return dht;
+}
+
+void
+ConnectionManagerTest::pinCertificates(const std::vector<ConnectionHandler*>& handlers)
+{
+    for (auto* h : handlers)
+        for (auto* other : handlers)
+            if (other != h)
+                h->certStore->pinCertificate(other->id.second);
+}
+
+std::shared_ptr<ChannelSocket>
+ConnectionManagerTest::connect(ConnectionHandler& from,
+                               const ConnectionHandler& to,
+                               const std::string& name)
+{
+    // Shared with the callback, which may come after a timeout
+    struct Result
+    {
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool done {false};
+        std::shared_ptr<ChannelSocket> socket;
+    };
+    auto result = std::make_shared<Result>();
+    from.connectionManager->connectDevice(to.id.second,
+                                          name,
+                                          [result](const std::shared_ptr<ChannelSocket>& socket,
+                                                   const DeviceId&) {
+                                              std::lock_guard<std::mutex> lk {result->mtx};
+                                              result->done = true;
+                                              result->socket = socket;
+                                              result->cv.notify_one();
+                                          });
+    std::unique_lock<std::mutex> lk {result->mtx};
+    CPPUNIT_ASSERT(result->cv.wait_for(lk, 60s, [&] { return result->done; }));
+    return result->socket;
 }
 
 void
@@ -1271,6 +1464,262 @@ ConnectionManagerTest::testShutdownWhileNegotiating()
     CPPUNIT_ASSERT(cv.wait_for(lk, 30s, [&] { return notConnected; }));*/
 }
 
+void
+ConnectionManagerTest::testSignalingRouted()
+{
+    auto enableSignaling = [](ConnectionManager::Config& config) {
+        config.signalingEnabled = true;
+    };
+    auto aliceAccount = dht::crypto::generateIdentity("alice account", {}, 2048);
+    auto bobAccount = dht::crypto::generateIdentity("bob account", {}, 2048);
+    auto alice = setupHandler("alice", aliceAccount, enableSignaling);
+    auto bob = setupHandler("bob", bobAccount, enableSignaling);
+    auto bob2 = setupHandler("bob2", bobAccount, enableSignaling);
+    pinCertificates({alice.get(), bob.get(), bob2.get()});
+
+    // bob2 is connected to both, and forwards for bob, a device of its account
+    CPPUNIT_ASSERT(connect(*bob, *bob2, "bob"));
+    CPPUNIT_ASSERT(connect(*alice, *bob2, "alice"));
+    // Let the signaling channels open
+    std::this_thread::sleep_for(1s);
+
+    // Values put on the DHT for alice, shared with the listen callback
+    struct Values
+    {
+        std::mutex mtx;
+        std::set<dht::Value::Id> ids;
+    };
+    auto values = std::make_shared<Values>();
+    auto aliceKey = dht::InfoHash::get(PeerConnectionRequest::key_prefix
+                                       + alice->id.second->getId().toString());
+    auto token = bob2->dht->listen(aliceKey,
+                                   [values](const std::vector<std::shared_ptr<dht::Value>>& vals,
+                                            bool expired) {
+                                       std::lock_guard<std::mutex> lk {values->mtx};
+                                       if (not expired)
+                                           for (const auto& value : vals)
+                                               values->ids.emplace(value->id);
+                                       return true;
+                                   });
+    std::this_thread::sleep_for(1s);
+    auto countValues = [&] {
+        std::lock_guard<std::mutex> lk {values->mtx};
+        return values->ids.size();
+    };
+    auto before = countValues();
+
+    auto routed = connect(*alice, *bob, "routed");
+    std::this_thread::sleep_for(1s);
+    bob2->dht->cancelListen(aliceKey, std::move(token));
+    CPPUNIT_ASSERT(routed);
+    // The request came over signaling, so did the answer, not on the DHT
+    CPPUNIT_ASSERT(countValues() == before);
+}
+
+void
+ConnectionManagerTest::testSignalingFallback()
+{
+    auto enableSignaling = [](ConnectionManager::Config& config) {
+        config.signalingEnabled = true;
+    };
+    auto aliceAccount = dht::crypto::generateIdentity("alice account", {}, 2048);
+    auto bobAccount = dht::crypto::generateIdentity("bob account", {}, 2048);
+    auto alice = setupHandler("alice", aliceAccount, enableSignaling);
+    auto bob = setupHandler("bob", bobAccount, enableSignaling);
+    auto bob2 = setupHandler("bob2", bobAccount, enableSignaling);
+    pinCertificates({alice.get(), bob.get(), bob2.get()});
+
+    // bob2 is a route to bob for alice, but can't forward: it's not connected to bob
+    CPPUNIT_ASSERT(connect(*alice, *bob2, "alice"));
+    std::this_thread::sleep_for(1s);
+
+    auto start = std::chrono::steady_clock::now();
+    CPPUNIT_ASSERT(connect(*alice, *bob, "fallback"));
+    // Put on the DHT once not answered over signaling
+    CPPUNIT_ASSERT(std::chrono::steady_clock::now() - start >= 2s);
+}
+
+void
+ConnectionManagerTest::testKnownPathDirectDial()
+{
+    auto enableDirect = [](ConnectionManager::Config& config) {
+        config.directConnectEnabled = true;
+    };
+    auto aliceAccount = dht::crypto::generateIdentity("alice account", {}, 2048);
+    auto bobAccount = dht::crypto::generateIdentity("bob account", {}, 2048);
+    auto alice = setupHandler("alice", aliceAccount, enableDirect);
+    auto bob = setupHandler("bob", bobAccount, enableDirect);
+    pinCertificates({alice.get(), bob.get()});
+
+    // The first connection learns the path and the port of bob
+    CPPUNIT_ASSERT(connect(*alice, *bob, "first"));
+    alice->connectionManager->closeConnectionsWith(bobAccount.second->getId().toString());
+    std::this_thread::sleep_for(1s);
+
+    // Without DHT, only the direct dial can reach bob
+    bob->dht->join();
+    CPPUNIT_ASSERT(connect(*alice, *bob, "direct"));
+}
+
+void
+ConnectionManagerTest::testSharedContext()
+{
+    auto aliceAccount = dht::crypto::generateIdentity("alice account", {}, 2048);
+    auto bobAccount = dht::crypto::generateIdentity("bob account", {}, 2048);
+    auto carolAccount = dht::crypto::generateIdentity("carol account", {}, 2048);
+    // Outlives the DHT node using it
+    auto certStore = std::make_shared<tls::CertificateStore>("shared", nullptr);
+    auto sharedDht = startDht([certStore](const dht::InfoHash& pk_id) {
+        std::vector<std::shared_ptr<dht::crypto::Certificate>> ret;
+        if (auto cert = certStore->getCertificate(pk_id.toString()))
+            ret.emplace_back(std::move(cert));
+        return ret;
+    });
+    auto sharedCachePath = (std::filesystem::temp_directory_path()
+                            / "dhtnet-connectionManager-shared")
+                               .string();
+    std::filesystem::create_directories(sharedCachePath);
+    auto sharedContext = std::make_shared<ConnectionManager::SharedContext>(sharedDht,
+                                                                            sharedCachePath);
+
+    auto alice = setupHandler("alice", aliceAccount);
+    auto bob = setupHandler("bob", bobAccount, {}, sharedContext);
+    auto carol = setupHandler("carol", carolAccount, {}, sharedContext);
+    pinCertificates({alice.get(), bob.get(), carol.get()});
+    certStore->pinCertificate(alice->id.second);
+    CPPUNIT_ASSERT(sharedContext->listenCount() == 2);
+
+    // Channel names received by each manager
+    struct Received
+    {
+        std::mutex mtx;
+        std::vector<std::string> bob;
+        std::vector<std::string> carol;
+    };
+    auto received = std::make_shared<Received>();
+    bob->connectionManager->onChannelRequest(
+        [received](const std::shared_ptr<dht::crypto::Certificate>&, const std::string& name) {
+            std::lock_guard<std::mutex> lk {received->mtx};
+            received->bob.emplace_back(name);
+            return true;
+        });
+    carol->connectionManager->onChannelRequest(
+        [received](const std::shared_ptr<dht::crypto::Certificate>&, const std::string& name) {
+            std::lock_guard<std::mutex> lk {received->mtx};
+            received->carol.emplace_back(name);
+            return true;
+        });
+
+    CPPUNIT_ASSERT(connect(*alice, *bob, "bob"));
+    CPPUNIT_ASSERT(connect(*alice, *carol, "carol"));
+    {
+        std::lock_guard<std::mutex> lk {received->mtx};
+        CPPUNIT_ASSERT(received->bob == std::vector<std::string> {"bob"});
+        CPPUNIT_ASSERT(received->carol == std::vector<std::string> {"carol"});
+    }
+
+    bob.reset();
+    carol.reset();
+    CPPUNIT_ASSERT(sharedContext->listenCount() == 0);
+    sharedContext.reset();
+    sharedDht->join();
+    std::error_code ec;
+    std::filesystem::remove_all(sharedCachePath, ec);
+}
+
+void
+ConnectionManagerTest::testIdleConnectionTimeout()
+{
+    auto idleTimeout = [](ConnectionManager::Config& config) {
+        config.idleConnectionTimeout = 4s;
+    };
+    auto aliceAccount = dht::crypto::generateIdentity("alice account", {}, 2048);
+    auto bobAccount = dht::crypto::generateIdentity("bob account", {}, 2048);
+    auto alice = setupHandler("alice", aliceAccount, idleTimeout);
+    auto bob = setupHandler("bob", bobAccount, idleTimeout);
+    pinCertificates({alice.get(), bob.get()});
+
+    auto channel = connect(*alice, *bob, "idle");
+    CPPUNIT_ASSERT(channel);
+    // A socket with a channel is never idle
+    std::this_thread::sleep_for(6s);
+    CPPUNIT_ASSERT(alice->connectionManager->activeSockets() == 1);
+
+    // Closing the channel is the last activity
+    auto start = std::chrono::steady_clock::now();
+    channel->shutdown();
+    channel.reset();
+    std::this_thread::sleep_for(2s);
+    CPPUNIT_ASSERT(alice->connectionManager->activeSockets() == 1);
+    for (int i = 0; i < 100 and alice->connectionManager->activeSockets() != 0; i++)
+        std::this_thread::sleep_for(100ms);
+    CPPUNIT_ASSERT(alice->connectionManager->activeSockets() == 0);
+    // Closed after the delay, within a tick of the wheel (1s)
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    CPPUNIT_ASSERT(elapsed >= 4s and elapsed <= 6s);
+
+    // Renegotiated on demand
+    CPPUNIT_ASSERT(connect(*alice, *bob, "again"));
+}
+
+void
+ConnectionManagerTest::testTcpHandshakeLimit()
+{
+    // As TCP_PENDING_HANDSHAKES_PER_SOURCE and TCP_PENDING_HANDSHAKES_MAX
+    constexpr unsigned PER_SOURCE {4};
+    constexpr unsigned SOURCES {4};
+    auto enableDirect = [](ConnectionManager::Config& config) {
+        config.directConnectEnabled = true;
+    };
+    auto aliceAccount = dht::crypto::generateIdentity("alice account", {}, 2048);
+    auto alice = setupHandler("alice", aliceAccount, enableDirect);
+    uint16_t port = 0;
+    for (int i = 0; i < 100 and (port = alice->connectionManager->directConnectPort()) == 0; i++)
+        std::this_thread::sleep_for(100ms);
+    CPPUNIT_ASSERT(port != 0);
+
+    // Connections never sending their TLS hello, so pending until the
+    // handshake times out
+    asio::io_context ctx;
+    asio::ip::tcp::endpoint server(asio::ip::make_address_v4("127.0.0.1"), port);
+    auto open = [&](const std::string& source) {
+        asio::ip::tcp::socket socket(ctx);
+        socket.open(asio::ip::tcp::v4());
+        socket.bind({asio::ip::make_address_v4(source), 0});
+        socket.connect(server);
+        std::this_thread::sleep_for(100ms);
+        return socket;
+    };
+    auto isClosed = [&](asio::ip::tcp::socket& socket) {
+        bool closed = false;
+        std::array<uint8_t, 16> buf;
+        socket.async_read_some(asio::buffer(buf), [&](const asio::error_code& ec, std::size_t) {
+            closed = ec == asio::error::eof or ec == asio::error::connection_reset;
+        });
+        ctx.restart();
+        ctx.run_for(1s);
+        socket.cancel();
+        ctx.restart();
+        ctx.run();
+        return closed;
+    };
+
+    std::vector<asio::ip::tcp::socket> pending;
+    for (unsigned i = 0; i < PER_SOURCE; i++)
+        pending.emplace_back(open("127.0.0.1"));
+    // Over the limit of the source, but not of the others
+    auto extra = open("127.0.0.1");
+    CPPUNIT_ASSERT(isClosed(extra));
+    for (unsigned source = 2; source <= SOURCES; source++)
+        for (unsigned i = 0; i < PER_SOURCE; i++)
+            pending.emplace_back(open(fmt::format("127.0.0.{}", source)));
+    CPPUNIT_ASSERT(not isClosed(pending.back()));
+    // Over the overall limit
+    auto other = open(fmt::format("127.0.0.{}", SOURCES + 1));
+    CPPUNIT_ASSERT(isClosed(other));
+    CPPUNIT_ASSERT(not isClosed(pending.front()));
+}
+
 } // namespace test
 } // namespace jami
 
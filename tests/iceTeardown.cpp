@@ -0,0 +1,137 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+
+#include <thread>
+
+#include "test_runner.h"
+#include "turn_stand_in.h"
+
+using namespace std::literals::chrono_literals;
+
+namespace jami {
+namespace test {
+
+class IceTeardownTest : public CppUnit::TestFixture
+{
+public:
+    IceTeardownTest()
+    {
+        pj_log_set_level(0);
+        pj_init();
+        pjlib_util_init();
+        pjnath_init();
+    }
+    ~IceTeardownTest() { pj_shutdown(); }
+    static std::string name() { return "IceTeardown"; }
+    void setUp();
+    void tearDown();
+
+private:
+    void testDestructionDeadline();
+    void testPoolSizing();
+
+    CPPUNIT_TEST_SUITE(IceTeardownTest);
+    CPPUNIT_TEST(testDestructionDeadline);
+    CPPUNIT_TEST(testPoolSizing);
+    CPPUNIT_TEST_SUITE_END();
+
+    IceTransportOptions makeOptions(IceTransportFactory& factory) const;
+
+    std::shared_ptr<asio::io_context> ioContext_;
+    std::thread ioContextRunner_;
+    std::unique_ptr<TurnStandIn> turn_;
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(IceTeardownTest, IceTeardownTest::name());
+
+void
+IceTeardownTest::setUp()
+{
+    ioContext_ = std::make_shared<asio::io_context>();
+    turn_ = std::make_unique<TurnStandIn>(*ioContext_);
+    ioContextRunner_ = std::thread([context = ioContext_]() {
+        auto work = asio::make_work_guard(*context);
+        context->run();
+    });
+}
+
+void
+IceTeardownTest::tearDown()
+{
+    ioContext_->stop();
+    if (ioContextRunner_.joinable())
+        ioContextRunner_.join();
+    turn_.reset();
+    ioContext_.reset();
+}
+
+IceTransportOptions
+IceTeardownTest::makeOptions(IceTransportFactory& factory) const
+{
+    IceTransportOptions options;
+    options.factory = &factory;
+    options.turnServers.emplace_back(TurnServerInfo().setUri(turn_->uri()));
+    return options;
+}
+
+void
+IceTeardownTest::testDestructionDeadline()
+{
+    IceTransportFactory factory;
+    auto options = makeOptions(factory);
+    turn_->answerDeallocations = false;
+
+    auto ice = factory.createUTransport("");
+    CPPUNIT_ASSERT(initializeIce(*ice, options));
+    // The deallocation is never answered, so the destruction only ends
+    // with the deadline, instead of after 3 seconds
+    ice->setDestructionDeadline(std::chrono::steady_clock::now() + 300ms);
+    auto start = std::chrono::steady_clock::now();
+    ice.reset();
+    auto duration = std::chrono::steady_clock::now() - start;
+    CPPUNIT_ASSERT(duration < 1s);
+    CPPUNIT_ASSERT(turn_->deallocations > 0);
+}
+
+void
+IceTeardownTest::testPoolSizing()
+{
+    IceTransportFactory factory;
+    auto options = makeOptions(factory);
+
+    auto small = factory.createUTransport("");
+    CPPUNIT_ASSERT(initializeIce(*small, options));
+    CPPUNIT_ASSERT(small->memoryUsage() > 0);
+
+    options.poolSize = 256 * 1024;
+    auto large = factory.createUTransport("");
+    CPPUNIT_ASSERT(initializeIce(*large, options));
+    CPPUNIT_ASSERT(large->memoryUsage() >= options.poolSize);
+    CPPUNIT_ASSERT(small->memoryUsage() < large->memoryUsage());
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::IceTeardownTest::name())
@@ -0,0 +1,197 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <asio/executor_work_guard.hpp>
+#include <opendht/peer_discovery.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "test_runner.h"
+#include "lan_discovery.h"
+
+using namespace std::literals::chrono_literals;
+
+namespace jami {
+namespace test {
+
+class LanDiscoveryTest : public CppUnit::TestFixture
+{
+public:
+    LanDiscoveryTest() {}
+    ~LanDiscoveryTest() {}
+    static std::string name() { return "LanDiscovery"; }
+    void setUp();
+    void tearDown();
+
+private:
+    void testDiscovery();
+    void testForgedAnnouncement();
+    void testReplayedAnnouncement();
+
+    CPPUNIT_TEST_SUITE(LanDiscoveryTest);
+    CPPUNIT_TEST(testDiscovery);
+    CPPUNIT_TEST(testForgedAnnouncement);
+    CPPUNIT_TEST(testReplayedAnnouncement);
+    CPPUNIT_TEST_SUITE_END();
+
+    std::shared_ptr<asio::io_context> ioContext_;
+    std::thread ioContextRunner_;
+    dht::crypto::Identity alice_;
+    dht::crypto::Identity bob_;
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(LanDiscoveryTest, LanDiscoveryTest::name());
+
+void
+LanDiscoveryTest::setUp()
+{
+    ioContext_ = std::make_shared<asio::io_context>();
+    ioContextRunner_ = std::thread([context = ioContext_]() {
+        auto work = asio::make_work_guard(*context);
+        context->run();
+    });
+    alice_ = dht::crypto::generateIdentity("alice");
+    bob_ = dht::crypto::generateIdentity("bob");
+}
+
+void
+LanDiscoveryTest::tearDown()
+{
+    ioContext_->stop();
+    if (ioContextRunner_.joinable())
+        ioContextRunner_.join();
+    ioContext_.reset();
+}
+
+void
+LanDiscoveryTest::testDiscovery()
+{
+    constexpr uint16_t PORT {18891};
+    auto alice = std::make_shared<LanDiscovery>(ioContext_, alice_, PORT);
+    auto bob = std::make_shared<LanDiscovery>(ioContext_, bob_, PORT);
+    auto aliceId = alice_.second->getLongId();
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    bool found = false;
+    bob->setOnPeer([&](const DeviceId& deviceId, const IpAddr&) {
+        std::lock_guard<std::mutex> lk {mtx};
+        if (deviceId == aliceId)
+            found = true;
+        cv.notify_one();
+    });
+    bob->start(0);
+    alice->start(4242);
+
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&] { return found; }));
+    auto addr = bob->getAddress(aliceId);
+    CPPUNIT_ASSERT(addr);
+    CPPUNIT_ASSERT(addr.getPort() == 4242);
+    // Bob only discovers, and doesn't discover himself
+    CPPUNIT_ASSERT(not alice->getAddress(bob_.second->getLongId()));
+    CPPUNIT_ASSERT(not bob->getAddress(bob_.second->getLongId()));
+}
+
+void
+LanDiscoveryTest::testForgedAnnouncement()
+{
+    constexpr uint16_t PORT {18892};
+    auto bob = std::make_shared<LanDiscovery>(ioContext_, bob_, PORT);
+    auto aliceId = alice_.second->getLongId();
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    bool forgedAccepted = false, found = false;
+    bob->setOnPeer([&](const DeviceId& deviceId, const IpAddr& addr) {
+        std::lock_guard<std::mutex> lk {mtx};
+        if (deviceId == aliceId) {
+            forgedAccepted |= addr.getPort() == 4242;
+            found = true;
+        }
+        cv.notify_one();
+    });
+    bob->start(0);
+
+    // Announce Alice with a signature of Bob
+    LanAnnouncement announce;
+    announce.owner = alice_.second->getSharedPublicKey()->getPacked();
+    announce.port = 4242;
+    announce.time = std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+    announce.signature = bob_.first->sign(announce.getSignedData());
+    msgpack::sbuffer buffer;
+    msgpack::pack(buffer, announce);
+    dht::PeerDiscovery forger(PORT, ioContext_);
+    forger.startPublish("dhtnet", buffer);
+    CPPUNIT_ASSERT(not cv.wait_for(lk, 2s, [&] { return found; }));
+
+    // The real announce of Alice goes through
+    auto alice = std::make_shared<LanDiscovery>(ioContext_, alice_, PORT);
+    alice->start(4243);
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&] { return found; }));
+    CPPUNIT_ASSERT(not forgedAccepted);
+    CPPUNIT_ASSERT(bob->getAddress(aliceId).getPort() == 4243);
+    forger.stop();
+}
+
+void
+LanDiscoveryTest::testReplayedAnnouncement()
+{
+    constexpr uint16_t PORT {18893};
+    auto bob = std::make_shared<LanDiscovery>(ioContext_, bob_, PORT);
+    auto aliceId = alice_.second->getLongId();
+
+    auto found = std::make_shared<std::atomic_bool>(false);
+    bob->setOnPeer([found, aliceId](const DeviceId& deviceId, const IpAddr&) {
+        if (deviceId == aliceId)
+            *found = true;
+    });
+    bob->start(0);
+
+    // Signed by Alice on another host, replayed from this one
+    LanAnnouncement announce;
+    announce.owner = alice_.second->getSharedPublicKey()->getPacked();
+    announce.port = 4242;
+    announce.time = std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+    announce.addrs = {"192.0.2.1"};
+    announce.signature = alice_.first->sign(announce.getSignedData());
+    msgpack::sbuffer buffer;
+    msgpack::pack(buffer, announce);
+    dht::PeerDiscovery replayer(PORT, ioContext_);
+    replayer.startPublish("dhtnet", buffer);
+    std::this_thread::sleep_for(2s);
+    replayer.stop();
+    CPPUNIT_ASSERT(not *found);
+    CPPUNIT_ASSERT(not bob->getAddress(aliceId));
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::LanDiscoveryTest::name())
@@ -0,0 +1,119 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "test_runner.h"
+#include "upnp/mapping_pool.h"
+
+using namespace std::literals::chrono_literals;
+
+namespace jami {
+namespace test {
+
+using namespace upnp;
+
+class MappingPoolTest : public CppUnit::TestFixture
+{
+public:
+    MappingPoolTest() {}
+    ~MappingPoolTest() {}
+    static std::string name() { return "MappingPool"; }
+
+private:
+    void testIdle();
+    void testBurst();
+    void testDecay();
+    void testBounds();
+
+    CPPUNIT_TEST_SUITE(MappingPoolTest);
+    CPPUNIT_TEST(testIdle);
+    CPPUNIT_TEST(testBurst);
+    CPPUNIT_TEST(testDecay);
+    CPPUNIT_TEST(testBounds);
+    CPPUNIT_TEST_SUITE_END();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(MappingPoolTest, MappingPoolTest::name());
+
+void
+MappingPoolTest::testIdle()
+{
+    MappingPoolSizer sizer(4, 32, 30s);
+    auto now = MappingPoolSizer::clock::now();
+    CPPUNIT_ASSERT(sizer.target(now) == 4);
+    CPPUNIT_ASSERT(sizer.target(now + 10min) == 4);
+    CPPUNIT_ASSERT(sizer.highWatermark(now + 10min) == 8);
+}
+
+void
+MappingPoolTest::testBurst()
+{
+    MappingPoolSizer sizer(4, 32, 30s);
+    auto now = MappingPoolSizer::clock::now();
+    // The pool grows during the burst, without waiting for the window end.
+    for (unsigned i = 0; i < 10; i++)
+        sizer.onReservation(true, now);
+    CPPUNIT_ASSERT(sizer.target(now) == 10);
+    // Misses grow it further.
+    sizer.onReservation(false, now);
+    sizer.onReservation(false, now);
+    CPPUNIT_ASSERT(sizer.target(now) == 14);
+    CPPUNIT_ASSERT(sizer.highWatermark(now) == 28);
+}
+
+void
+MappingPoolTest::testDecay()
+{
+    MappingPoolSizer sizer(4, 32, 30s);
+    auto now = MappingPoolSizer::clock::now();
+    for (unsigned i = 0; i < 30; i++)
+        sizer.onReservation(true, now);
+    CPPUNIT_ASSERT(sizer.target(now) == 30);
+
+    // The demand is remembered for a while, then the pool shrinks back.
+    auto next = sizer.target(now + 31s);
+    CPPUNIT_ASSERT(next > 4 and next < 30);
+    CPPUNIT_ASSERT(sizer.target(now + 5min) < next);
+    CPPUNIT_ASSERT(sizer.target(now + 30min) == 4);
+}
+
+void
+MappingPoolTest::testBounds()
+{
+    MappingPoolSizer sizer(4, 32, 30s);
+    auto now = MappingPoolSizer::clock::now();
+    for (unsigned i = 0; i < 100; i++)
+        sizer.onReservation(false, now);
+    CPPUNIT_ASSERT(sizer.target(now) == 32);
+    CPPUNIT_ASSERT(sizer.highWatermark(now) == 32);
+
+    sizer.setBounds(2, 16);
+    CPPUNIT_ASSERT(sizer.target(now) == 16);
+    // The max can't be lower than the min.
+    sizer.setBounds(8, 1);
+    CPPUNIT_ASSERT(sizer.minSize() == 8 and sizer.maxSize() == 8);
+    CPPUNIT_ASSERT(sizer.target(now + 1h) == 8);
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::MappingPoolTest::name())
@@ -0,0 +1,839 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+#include <asio/post.hpp>
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+
+#include "test_runner.h"
+#include "multiplexed_socket.h"
+#include "peer_connection.h"
+
+using namespace std::literals::chrono_literals;
+
+namespace jami {
+namespace test {
+
+/**
+ * In-memory packets between two transports. Once perturbed, the DTLS
+ * application records are swapped by pairs of the same size class: the
+ * records of at least LARGE_PACKET bytes (the datagrams), and the smaller
+ * ones (the stream). One large record in DROP_EVERY is dropped, and the
+ * SMALL_DROP_AT-th small record of each side. Other records, like the
+ * handshake, alerts and heartbeats, go through untouched.
+ */
+struct LossyLink
+{
+    static constexpr std::size_t LARGE_PACKET {200};
+    static constexpr unsigned DROP_EVERY {4};
+    // A single stream loss: the TLS session waits for each gap in turn
+    static constexpr unsigned SMALL_DROP_AT {10};
+    static constexpr uint8_t APPLICATION_DATA {23};
+
+    std::mutex mutex;
+    GenericSocket<uint8_t>::RecvCb receivers[2];
+    bool perturb {false};
+    std::vector<uint8_t> held[2][2]; // [sender][large]
+    unsigned count[2][2] {{0, 0}, {0, 0}}; // [sender][large]
+    unsigned dropped[2] {0, 0};             // [large]
+    unsigned sent[2] {0, 0};
+    std::size_t sentBytes[2] {0, 0};
+
+    void send(int from, const uint8_t* buf, std::size_t len)
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        sent[from]++;
+        sentBytes[from] += len;
+        auto& receiver = receivers[1 - from];
+        if (not perturb or len == 0 or buf[0] != APPLICATION_DATA) {
+            if (receiver)
+                receiver(buf, len);
+            return;
+        }
+        bool large = len >= LARGE_PACKET;
+        auto n = ++count[from][large];
+        if (large ? n % DROP_EVERY == 0 : n == SMALL_DROP_AT) {
+            dropped[large]++;
+            return;
+        }
+        auto& pending = held[from][large];
+        if (pending.empty()) {
+            pending.assign(buf, buf + len);
+            return;
+        }
+        if (receiver) {
+            receiver(buf, len);
+            receiver(pending.data(), pending.size());
+        }
+        pending.clear();
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        perturb = false;
+        for (int from = 0; from < 2; from++) {
+            for (auto& pending : held[from]) {
+                if (not pending.empty() and receivers[1 - from])
+                    receivers[1 - from](pending.data(), pending.size());
+                pending.clear();
+            }
+        }
+    }
+};
+
+class LossyTransport : public GenericSocket<uint8_t>
+{
+public:
+    LossyTransport(std::shared_ptr<LossyLink> link, int side)
+        : link_(std::move(link))
+        , side_(side)
+    {}
+    ~LossyTransport()
+    {
+        std::lock_guard<std::mutex> lk(link_->mutex);
+        link_->receivers[side_] = {};
+    }
+
+    void setOnRecv(RecvCb&& cb) override
+    {
+        std::lock_guard<std::mutex> lk(link_->mutex);
+        link_->receivers[side_] = std::move(cb);
+    }
+    bool isReliable() const override { return false; }
+    bool isInitiator() const override { return side_ == 0; }
+    int maxPayload() const override { return 1280; }
+    int waitForData(std::chrono::milliseconds, std::error_code&) const override { return 0; }
+    std::size_t read(ValueType*, std::size_t, std::error_code& ec) override
+    {
+        ec = std::make_error_code(std::errc::operation_not_supported);
+        return 0;
+    }
+    std::size_t write(const ValueType* buf, std::size_t len, std::error_code& ec) override
+    {
+        ec.clear();
+        link_->send(side_, buf, len);
+        return len;
+    }
+
+private:
+    std::shared_ptr<LossyLink> link_;
+    const int side_;
+};
+
+/**
+ * In-memory byte stream between two reliable transports, like a TCP
+ * connection. Closed for both sides by the first one shutting down.
+ */
+struct StreamLink
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<uint8_t> pending[2]; // [receiver]
+    bool closed {false};
+};
+
+class StreamTransport : public GenericSocket<uint8_t>
+{
+public:
+    StreamTransport(std::shared_ptr<StreamLink> link, int side)
+        : link_(std::move(link))
+        , side_(side)
+    {}
+    ~StreamTransport() { shutdown(); }
+
+    void shutdown() override
+    {
+        std::lock_guard<std::mutex> lk(link_->mutex);
+        link_->closed = true;
+        link_->cv.notify_all();
+    }
+    void setOnRecv(RecvCb&&) override {}
+    bool isReliable() const override { return true; }
+    bool isInitiator() const override { return side_ == 0; }
+    int maxPayload() const override { return 65536; }
+    int waitForData(std::chrono::milliseconds timeout, std::error_code& ec) const override
+    {
+        ec.clear();
+        std::unique_lock<std::mutex> lk(link_->mutex);
+        link_->cv.wait_for(lk, timeout, [&] {
+            return link_->closed or not link_->pending[side_].empty();
+        });
+        return link_->pending[side_].size();
+    }
+    std::size_t read(ValueType* buf, std::size_t len, std::error_code& ec) override
+    {
+        ec.clear();
+        std::unique_lock<std::mutex> lk(link_->mutex);
+        auto& pending = link_->pending[side_];
+        link_->cv.wait(lk, [&] { return link_->closed or not pending.empty(); });
+        // 0 once closed, as a TCP socket at the end of the stream
+        auto n = std::min(len, pending.size());
+        std::copy_n(pending.begin(), n, buf);
+        pending.erase(pending.begin(), pending.begin() + n);
+        return n;
+    }
+    std::size_t write(const ValueType* buf, std::size_t len, std::error_code& ec) override
+    {
+        std::lock_guard<std::mutex> lk(link_->mutex);
+        if (link_->closed) {
+            ec = std::make_error_code(std::errc::broken_pipe);
+            return 0;
+        }
+        ec.clear();
+        link_->pending[1 - side_].insert(link_->pending[1 - side_].end(), buf, buf + len);
+        link_->cv.notify_all();
+        return len;
+    }
+
+private:
+    std::shared_ptr<StreamLink> link_;
+    const int side_;
+};
+
+class MultiplexedSocketTest : public CppUnit::TestFixture
+{
+public:
+    MultiplexedSocketTest() {}
+    ~MultiplexedSocketTest() {}
+    static std::string name() { return "MultiplexedSocket"; }
+    void setUp();
+    void tearDown();
+
+private:
+    void testDatagramLossAndReorder();
+    void testInitialData();
+    void testInitialDataDeclined();
+    void testPendingWritesLimit();
+    void testTcpMemoryUsage();
+    void testControlBatch();
+    void testCompression();
+
+    CPPUNIT_TEST_SUITE(MultiplexedSocketTest);
+    CPPUNIT_TEST(testDatagramLossAndReorder);
+    CPPUNIT_TEST(testInitialData);
+    CPPUNIT_TEST(testInitialDataDeclined);
+    CPPUNIT_TEST(testPendingWritesLimit);
+    CPPUNIT_TEST(testTcpMemoryUsage);
+    CPPUNIT_TEST(testControlBatch);
+#ifdef HAVE_LIBZSTD
+    CPPUNIT_TEST(testCompression);
+#endif
+    CPPUNIT_TEST_SUITE_END();
+
+    std::unique_ptr<TlsSocketEndpoint> makeEndpoint(const std::shared_ptr<LossyLink>& link,
+                                                    int side,
+                                                    const dht::crypto::Identity& id);
+    std::pair<std::shared_ptr<MultiplexedSocket>, std::shared_ptr<MultiplexedSocket>> makeSockets(
+        const std::shared_ptr<LossyLink>& link);
+    // As sent by the ConnectionManager
+    void requestChannel(const std::shared_ptr<MultiplexedSocket>& mux,
+                        const std::shared_ptr<ChannelSocket>& channel);
+    // Version announced when the sockets start
+    void waitForPeerVersion(const std::shared_ptr<MultiplexedSocket>& mux);
+
+    std::shared_ptr<asio::io_context> ioContext_;
+    std::thread ioContextRunner_;
+    std::unique_ptr<tls::CertificateStore> certStore_;
+    std::shared_future<tls::DhParams> dhParams_;
+    dht::crypto::Identity alice_;
+    dht::crypto::Identity bob_;
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(MultiplexedSocketTest, MultiplexedSocketTest::name());
+
+void
+MultiplexedSocketTest::setUp()
+{
+    ioContext_ = std::make_shared<asio::io_context>();
+    ioContextRunner_ = std::thread([context = ioContext_]() {
+        auto work = asio::make_work_guard(*context);
+        context->run();
+    });
+    certStore_ = std::make_unique<tls::CertificateStore>("multiplexedSocket", nullptr);
+    // The ECDHE suites don't need DH parameters
+    std::promise<tls::DhParams> dhParams;
+    dhParams.set_value(tls::DhParams {});
+    dhParams_ = dhParams.get_future().share();
+    alice_ = dht::crypto::generateIdentity("alice");
+    bob_ = dht::crypto::generateIdentity("bob");
+}
+
+void
+MultiplexedSocketTest::tearDown()
+{
+    ioContext_->stop();
+    if (ioContextRunner_.joinable())
+        ioContextRunner_.join();
+    ioContext_.reset();
+    certStore_.reset();
+}
+
+std::unique_ptr<TlsSocketEndpoint>
+MultiplexedSocketTest::makeEndpoint(const std::shared_ptr<LossyLink>& link,
+                                  int side,
+                                  const dht::crypto::Identity& id)
+{
+    return std::make_unique<TlsSocketEndpoint>(std::make_unique<LossyTransport>(link, side),
+                                               *certStore_,
+                                               id,
+                                               dhParams_,
+                                               [](const dht::crypto::Certificate&) {
+                                                   return true;
+                                               });
+}
+
+std::pair<std::shared_ptr<MultiplexedSocket>, std::shared_ptr<MultiplexedSocket>>
+MultiplexedSocketTest::makeSockets(const std::shared_ptr<LossyLink>& link)
+{
+    auto aliceTls = makeEndpoint(link, 0, alice_);
+    auto bobTls = makeEndpoint(link, 1, bob_);
+    aliceTls->waitForReady(10s);
+    bobTls->waitForReady(10s);
+    CPPUNIT_ASSERT(aliceTls->maxDatagramSize() > 0);
+    CPPUNIT_ASSERT(bobTls->maxDatagramSize() > 0);
+
+    auto aliceMux = std::make_shared<MultiplexedSocket>(ioContext_,
+                                                        bob_.second->getLongId(),
+                                                        std::move(aliceTls));
+    auto bobMux = std::make_shared<MultiplexedSocket>(ioContext_,
+                                                      alice_.second->getLongId(),
+                                                      std::move(bobTls));
+    return {aliceMux, bobMux};
+}
+
+void
+MultiplexedSocketTest::requestChannel(const std::shared_ptr<MultiplexedSocket>& mux,
+                                      const std::shared_ptr<ChannelSocket>& channel)
+{
+    ChannelRequest val;
+    val.name = channel->name();
+    val.channel = channel->channel();
+    val.type = channel->type();
+    val.data = channel->takeInitialData();
+    val.compression = channel->compression();
+    msgpack::sbuffer buffer(256 + val.data.size());
+    msgpack::pack(buffer, val);
+    std::error_code ec;
+    mux->write(CONTROL_CHANNEL, (const uint8_t*) buffer.data(), buffer.size(), ec);
+    CPPUNIT_ASSERT(!ec);
+}
+
+void
+MultiplexedSocketTest::waitForPeerVersion(const std::shared_ptr<MultiplexedSocket>& mux)
+{
+    for (int i = 0; i < 100 && mux->peerVersion() < 2; i++)
+        std::this_thread::sleep_for(50ms);
+    CPPUNIT_ASSERT(mux->peerVersion() >= 2);
+}
+
+void
+MultiplexedSocketTest::testDatagramLossAndReorder()
+{
+    constexpr unsigned COUNT {100};
+    constexpr std::size_t STREAM_MSG_SIZE {20};
+    constexpr std::size_t DATAGRAM_SIZE {300};
+
+    auto link = std::make_shared<LossyLink>();
+    auto sockets = makeSockets(link);
+    auto aliceMux = sockets.first;
+    auto bobMux = sockets.second;
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    std::string streamRx;
+    std::vector<std::vector<uint8_t>> datagramsRx;
+    unsigned accepted = 0;
+
+    aliceMux->setOnReady([](const DeviceId&, const std::shared_ptr<ChannelSocket>&) {});
+    bobMux->setOnRequest([](const auto&, const auto&, const auto&) { return true; });
+    bobMux->setOnReady([&](const DeviceId&, const std::shared_ptr<ChannelSocket>& socket) {
+        auto isDatagram = socket->type() == ChannelType::DATAGRAM;
+        socket->setOnRecv([&, isDatagram](const uint8_t* buf, std::size_t len) {
+            std::lock_guard<std::mutex> lk {mtx};
+            if (isDatagram)
+                datagramsRx.emplace_back(buf, buf + len);
+            else
+                streamRx.append((const char*) buf, len);
+            cv.notify_one();
+            return len;
+        });
+    });
+
+    auto stream = aliceMux->addChannel("stream");
+    auto datagram = aliceMux->addChannel("datagram", ChannelType::DATAGRAM);
+    for (const auto& channel : {stream, datagram}) {
+        channel->onReady([&](bool ok) {
+            std::lock_guard<std::mutex> lk {mtx};
+            accepted += ok;
+            cv.notify_one();
+        });
+        requestChannel(aliceMux, channel);
+    }
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&] { return accepted == 2; }));
+    lk.unlock();
+    CPPUNIT_ASSERT(stream->type() == ChannelType::STREAM);
+    CPPUNIT_ASSERT(datagram->type() == ChannelType::DATAGRAM);
+    CPPUNIT_ASSERT(datagram->maxPayload() >= (int) DATAGRAM_SIZE);
+
+    {
+        std::lock_guard<std::mutex> lkLink(link->mutex);
+        link->perturb = true;
+    }
+    std::error_code ec;
+    for (unsigned i = 0; i < COUNT; i++) {
+        auto msg = fmt::format("{:0{}d}", i, STREAM_MSG_SIZE);
+        stream->write((const uint8_t*) msg.data(), msg.size(), ec);
+        CPPUNIT_ASSERT(!ec);
+        std::vector<uint8_t> payload(DATAGRAM_SIZE, static_cast<uint8_t>(i));
+        payload[0] = static_cast<uint8_t>(i >> 8);
+        CPPUNIT_ASSERT(datagram->write(payload.data(), payload.size(), ec) == DATAGRAM_SIZE);
+        CPPUNIT_ASSERT(!ec);
+    }
+    unsigned droppedStream, droppedDatagrams;
+    {
+        std::lock_guard<std::mutex> lkLink(link->mutex);
+        droppedStream = link->dropped[0];
+        droppedDatagrams = link->dropped[1];
+    }
+    link->flush();
+    CPPUNIT_ASSERT(droppedStream > 0);
+    CPPUNIT_ASSERT(droppedDatagrams > 0);
+
+    // Sent last and not perturbed, so received once the others are handled
+    auto last = fmt::format("{:0{}d}", COUNT, STREAM_MSG_SIZE);
+    stream->write((const uint8_t*) last.data(), last.size(), ec);
+    CPPUNIT_ASSERT(!ec);
+    std::vector<uint8_t> lastPayload(DATAGRAM_SIZE, static_cast<uint8_t>(COUNT));
+    lastPayload[0] = static_cast<uint8_t>(COUNT >> 8);
+    CPPUNIT_ASSERT(datagram->write(lastPayload.data(), lastPayload.size(), ec) == DATAGRAM_SIZE);
+    CPPUNIT_ASSERT(!ec);
+
+    lk.lock();
+    // The stream waits for a lost record until the reordering timeout, the
+    // datagrams don't
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&] {
+        return streamRx.size() >= last.size()
+               and streamRx.compare(streamRx.size() - last.size(), last.size(), last) == 0
+               and not datagramsRx.empty() and datagramsRx.back() == lastPayload;
+    }));
+
+    // A lost stream record is skipped: the messages received are whole,
+    // once and in order, as each fits in a record and the swapped records
+    // arrive well within the reordering timeout
+    CPPUNIT_ASSERT(streamRx.size() % STREAM_MSG_SIZE == 0);
+    auto received = streamRx.size() / STREAM_MSG_SIZE;
+    CPPUNIT_ASSERT(received <= COUNT + 1);
+    CPPUNIT_ASSERT(received + droppedStream >= COUNT + 1);
+    long previous = -1;
+    for (std::size_t i = 0; i < received; i++) {
+        auto index = std::stol(streamRx.substr(i * STREAM_MSG_SIZE, STREAM_MSG_SIZE));
+        CPPUNIT_ASSERT(index > previous and index <= (long) COUNT);
+        previous = index;
+    }
+    CPPUNIT_ASSERT(datagramsRx.size() <= COUNT + 1);
+    CPPUNIT_ASSERT(datagramsRx.size() + droppedDatagrams >= COUNT + 1);
+
+    // Each datagram is whole, once, and they are delivered as received
+    std::set<unsigned> indexes;
+    bool reordered = false;
+    int lastIndex = -1;
+    for (const auto& payload : datagramsRx) {
+        CPPUNIT_ASSERT(payload.size() == DATAGRAM_SIZE);
+        unsigned index = (payload[0] << 8) | payload[1];
+        for (std::size_t i = 1; i < payload.size(); i++)
+            CPPUNIT_ASSERT(payload[i] == static_cast<uint8_t>(index));
+        CPPUNIT_ASSERT(indexes.emplace(index).second);
+        reordered |= (int) index < lastIndex;
+        lastIndex = index;
+    }
+    CPPUNIT_ASSERT(reordered);
+    lk.unlock();
+
+    aliceMux->shutdown();
+    bobMux->shutdown();
+    aliceMux->join();
+    bobMux->join();
+}
+
+void
+MultiplexedSocketTest::testInitialData()
+{
+    auto link = std::make_shared<LossyLink>();
+    auto sockets = makeSockets(link);
+    auto aliceMux = sockets.first;
+    auto bobMux = sockets.second;
+    waitForPeerVersion(aliceMux);
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    std::string firstRead;
+    std::string received;
+    bool accepted = false;
+
+    aliceMux->setOnReady([](const DeviceId&, const std::shared_ptr<ChannelSocket>&) {});
+    bobMux->setOnRequest([](const auto&, const auto&, const auto&) { return true; });
+    bobMux->setOnReady([&](const DeviceId&, const std::shared_ptr<ChannelSocket>& socket) {
+        // The first payload came with the request
+        std::error_code ec;
+        std::string buf(64, '\0');
+        buf.resize(socket->read((uint8_t*) buf.data(), buf.size(), ec));
+        std::lock_guard<std::mutex> lk {mtx};
+        firstRead = buf;
+        socket->setOnRecv([&](const uint8_t* buf, std::size_t len) {
+            std::lock_guard<std::mutex> lk {mtx};
+            received.append((const char*) buf, len);
+            cv.notify_one();
+            return len;
+        });
+    });
+
+    std::string request = "request";
+    auto channel = aliceMux->addChannel("rpc",
+                                        std::vector<uint8_t>(request.begin(), request.end()));
+    channel->onReady([&](bool ok) {
+        std::lock_guard<std::mutex> lk {mtx};
+        accepted = ok;
+        cv.notify_one();
+    });
+    requestChannel(aliceMux, channel);
+    // Queued until accepted
+    std::string next = "-next";
+    std::error_code ec;
+    CPPUNIT_ASSERT(channel->write((const uint8_t*) next.data(), next.size(), ec) == next.size());
+    CPPUNIT_ASSERT(!ec);
+
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&] { return accepted and received == next; }));
+    CPPUNIT_ASSERT(firstRead == request);
+    lk.unlock();
+
+    aliceMux->shutdown();
+    bobMux->shutdown();
+    aliceMux->join();
+    bobMux->join();
+}
+
+void
+MultiplexedSocketTest::testInitialDataDeclined()
+{
+    auto link = std::make_shared<LossyLink>();
+    auto sockets = makeSockets(link);
+    auto aliceMux = sockets.first;
+    auto bobMux = sockets.second;
+    waitForPeerVersion(aliceMux);
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    bool answered = false;
+    bool accepted = true;
+    std::atomic_bool bobReady {false};
+
+    bobMux->setOnRequest([](const auto&, const auto&, const auto&) { return false; });
+    bobMux->setOnReady([&](const DeviceId&, const std::shared_ptr<ChannelSocket>&) {
+        bobReady = true;
+    });
+
+    std::string request = "request";
+    auto channel = aliceMux->addChannel("rpc",
+                                        std::vector<uint8_t>(request.begin(), request.end()));
+    channel->onReady([&](bool ok) {
+        std::lock_guard<std::mutex> lk {mtx};
+        answered = true;
+        accepted = ok;
+        cv.notify_one();
+    });
+    requestChannel(aliceMux, channel);
+    std::error_code ec;
+    CPPUNIT_ASSERT(channel->write((const uint8_t*) request.data(), request.size(), ec)
+                   == request.size());
+
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&] { return answered; }));
+    CPPUNIT_ASSERT(!accepted);
+    CPPUNIT_ASSERT(!bobReady);
+    // The queued write was dropped
+    CPPUNIT_ASSERT(channel->memoryUsage() == 0);
+    lk.unlock();
+
+    aliceMux->shutdown();
+    bobMux->shutdown();
+    aliceMux->join();
+    bobMux->join();
+}
+
+void
+MultiplexedSocketTest::testPendingWritesLimit()
+{
+    auto link = std::make_shared<LossyLink>();
+    auto sockets = makeSockets(link);
+    auto aliceMux = sockets.first;
+    auto bobMux = sockets.second;
+    waitForPeerVersion(aliceMux);
+
+    CPPUNIT_ASSERT(!aliceMux->addChannel("large",
+                                         std::vector<uint8_t>(CHANNEL_PENDING_WRITES_MAX + 1)));
+
+    // Not requested, so never accepted: the writes stay queued
+    auto channel = aliceMux->addChannel("rpc");
+    std::vector<uint8_t> data(CHANNEL_PENDING_WRITES_MAX / 4);
+    std::error_code ec;
+    for (int i = 0; i < 4; i++)
+        CPPUNIT_ASSERT(channel->write(data.data(), data.size(), ec) == data.size());
+    CPPUNIT_ASSERT(channel->write(data.data(), 1, ec) == static_cast<std::size_t>(-1));
+    CPPUNIT_ASSERT(ec == std::errc::no_buffer_space);
+
+    aliceMux->shutdown();
+    bobMux->shutdown();
+    aliceMux->join();
+    bobMux->join();
+}
+
+void
+MultiplexedSocketTest::testTcpMemoryUsage()
+{
+    auto link = std::make_shared<StreamLink>();
+    auto verify = [](const dht::crypto::Certificate&) {
+        return true;
+    };
+    auto aliceTls = std::make_unique<TlsSocketEndpoint>(std::make_unique<StreamTransport>(link, 0),
+                                                        *certStore_,
+                                                        alice_,
+                                                        dhParams_,
+                                                        verify);
+    auto bobTls = std::make_unique<TlsSocketEndpoint>(std::make_unique<StreamTransport>(link, 1),
+                                                      *certStore_,
+                                                      bob_,
+                                                      dhParams_,
+                                                      verify);
+    aliceTls->waitForReady(10s);
+    bobTls->waitForReady(10s);
+    CPPUNIT_ASSERT(aliceTls->isReliable());
+
+    std::string msg = "hello";
+    std::error_code ec;
+    CPPUNIT_ASSERT(aliceTls->write((const uint8_t*) msg.data(), msg.size(), ec) == msg.size());
+    CPPUNIT_ASSERT(!ec);
+    std::string received(msg.size(), '\0');
+    CPPUNIT_ASSERT(bobTls->read((uint8_t*) received.data(), received.size(), ec) == msg.size());
+    CPPUNIT_ASSERT(!ec);
+    CPPUNIT_ASSERT(received == msg);
+
+    // Records are read by the caller, no receive buffer is borrowed
+    CPPUNIT_ASSERT(aliceTls->memoryUsage() == 0);
+    CPPUNIT_ASSERT(bobTls->memoryUsage() == 0);
+
+    aliceTls->shutdown();
+    bobTls->shutdown();
+}
+
+void
+MultiplexedSocketTest::testControlBatch()
+{
+    constexpr unsigned CHANNELS {200};
+
+    auto link = std::make_shared<LossyLink>();
+    auto sockets = makeSockets(link);
+    auto aliceMux = sockets.first;
+    auto bobMux = sockets.second;
+    waitForPeerVersion(aliceMux);
+    waitForPeerVersion(bobMux);
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    unsigned accepted = 0;
+    unsigned closed = 0;
+
+    aliceMux->setOnReady([](const DeviceId&, const std::shared_ptr<ChannelSocket>&) {});
+    bobMux->setOnRequest([](const auto&, const auto&, const auto&) { return true; });
+    bobMux->setOnReady([&](const DeviceId&, const std::shared_ptr<ChannelSocket>& socket) {
+        socket->onShutdown([&] {
+            std::lock_guard<std::mutex> lk {mtx};
+            closed++;
+            cv.notify_one();
+        });
+    });
+
+    unsigned sent[2];
+    {
+        std::lock_guard<std::mutex> lkLink(link->mutex);
+        std::copy_n(link->sent, 2, sent);
+    }
+    // Like a client restoring its channels, in one tick of the context
+    std::vector<std::shared_ptr<ChannelSocket>> channels;
+    asio::post(*ioContext_, [&] {
+        for (unsigned i = 0; i < CHANNELS; i++) {
+            auto channel = aliceMux->addChannel(fmt::format("channel{}", i));
+            channel->onReady([&](bool ok) {
+                std::lock_guard<std::mutex> lk {mtx};
+                accepted += ok;
+                cv.notify_one();
+            });
+            requestChannel(aliceMux, channel);
+            channels.emplace_back(std::move(channel));
+        }
+    });
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&] { return accepted == CHANNELS; }));
+    asio::post(*ioContext_, [&] {
+        for (const auto& channel : channels)
+            channel->shutdown();
+    });
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&] { return closed == CHANNELS; }));
+    lk.unlock();
+
+    // Requests, answers and closes are sent by batches: a few records per
+    // direction instead of one per operation
+    {
+        std::lock_guard<std::mutex> lkLink(link->mutex);
+        CPPUNIT_ASSERT(link->sent[0] - sent[0] < CHANNELS / 4);
+        CPPUNIT_ASSERT(link->sent[1] - sent[1] < CHANNELS / 4);
+    }
+
+    aliceMux->shutdown();
+    bobMux->shutdown();
+    aliceMux->join();
+    bobMux->join();
+}
+
+void
+MultiplexedSocketTest::testCompression()
+{
+    constexpr unsigned COUNT {200};
+    constexpr std::size_t RANDOM_SIZE {2 * 1024 * 1024};
+    constexpr std::size_t WRITE_SIZE {8192};
+
+    auto link = std::make_shared<LossyLink>();
+    auto sockets = makeSockets(link);
+    auto aliceMux = sockets.first;
+    auto bobMux = sockets.second;
+    for (int i = 0; i < 100 && !aliceMux->canWriteCompressed(); i++)
+        std::this_thread::sleep_for(50ms);
+    CPPUNIT_ASSERT(aliceMux->canWriteCompressed());
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    std::map<std::string, std::string> received;
+    std::map<std::string, ChannelCompression> answered;
+    unsigned accepted = 0;
+
+    aliceMux->setOnReady([](const DeviceId&, const std::shared_ptr<ChannelSocket>&) {});
+    bobMux->setOnRequest([](const auto&, const auto&, const auto&) { return true; });
+    bobMux->setOnReady([&](const DeviceId&, const std::shared_ptr<ChannelSocket>& socket) {
+        std::lock_guard<std::mutex> lk {mtx};
+        answered[socket->name()] = socket->compression();
+        socket->setOnRecv([&, name = socket->name()](const uint8_t* buf, std::size_t len) {
+            std::lock_guard<std::mutex> lk {mtx};
+            received[name].append((const char*) buf, len);
+            cv.notify_one();
+            return len;
+        });
+    });
+
+    auto plain = aliceMux->addChannel("plain");
+    auto compressed = aliceMux->addChannel("compressed");
+    compressed->setCompression(ChannelCompression::ZSTD);
+    for (const auto& channel : {plain, compressed}) {
+        channel->onReady([&](bool ok) {
+            std::lock_guard<std::mutex> lk {mtx};
+            accepted += ok;
+            cv.notify_one();
+        });
+        requestChannel(aliceMux, channel);
+    }
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&] { return accepted == 2; }));
+    CPPUNIT_ASSERT(plain->compression() == ChannelCompression::NONE);
+    CPPUNIT_ASSERT(compressed->compression() == ChannelCompression::ZSTD);
+    CPPUNIT_ASSERT(answered["compressed"] == ChannelCompression::ZSTD);
+    lk.unlock();
+
+    // Same messages on both channels, each write is received without
+    // waiting for the next ones
+    std::string text;
+    std::size_t bytes[2];
+    std::error_code ec;
+    for (int i = 0; i < 2; i++) {
+        const auto& channel = i ? compressed : plain;
+        std::size_t before;
+        {
+            std::lock_guard<std::mutex> lkLink(link->mutex);
+            before = link->sentBytes[0];
+        }
+        for (unsigned j = 0; j < COUNT; j++) {
+            auto msg = fmt::format("{{\"id\":{},\"method\":\"sync\",\"status\":\"{}\"}}",
+                                   j,
+                                   j % 3 ? "ok" : "pending");
+            if (i == 0)
+                text += msg;
+            CPPUNIT_ASSERT(channel->write((const uint8_t*) msg.data(), msg.size(), ec)
+                           == msg.size());
+            CPPUNIT_ASSERT(!ec);
+        }
+        lk.lock();
+        CPPUNIT_ASSERT(
+            cv.wait_for(lk, 5s, [&] { return received[channel->name()].size() == text.size(); }));
+        CPPUNIT_ASSERT(received[channel->name()] == text);
+        lk.unlock();
+        std::lock_guard<std::mutex> lkLink(link->mutex);
+        bytes[i] = link->sentBytes[0] - before;
+    }
+    CPPUNIT_ASSERT(bytes[1] < bytes[0]);
+
+    // Incompressible data: compression is skipped once sampled
+    std::string random(RANDOM_SIZE, '\0');
+    std::mt19937 rng(42);
+    for (auto& c : random)
+        c = static_cast<char>(rng());
+    for (std::size_t off = 0; off < random.size(); off += WRITE_SIZE) {
+        compressed->write((const uint8_t*) random.data() + off, WRITE_SIZE, ec);
+        CPPUNIT_ASSERT(!ec);
+    }
+    lk.lock();
+    CPPUNIT_ASSERT(cv.wait_for(lk, 10s, [&] {
+        return received["compressed"].size() == text.size() + random.size();
+    }));
+    CPPUNIT_ASSERT(received["compressed"] == text + random);
+    lk.unlock();
+
+    aliceMux->shutdown();
+    bobMux->shutdown();
+    aliceMux->join();
+    bobMux->join();
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::MultiplexedSocketTest::name())
@@ -0,0 +1,184 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <msgpack.hpp>
+
+#include <cstring>
+
+#include "test_runner.h"
+#include "mux_frame.h"
+
+namespace jami {
+namespace test {
+
+// Framing used before the compact frames, as in multiplexed_socket.cpp
+struct ChanneledMessage
+{
+    uint16_t channel;
+    std::vector<uint8_t> data;
+    MSGPACK_DEFINE(channel, data)
+};
+
+class MuxFrameTest : public CppUnit::TestFixture
+{
+public:
+    static std::string name() { return "MuxFrame"; }
+
+private:
+    void testHeader();
+    void testInvalid();
+    void testCopiedBytes();
+
+    CPPUNIT_TEST_SUITE(MuxFrameTest);
+    CPPUNIT_TEST(testHeader);
+    CPPUNIT_TEST(testInvalid);
+    CPPUNIT_TEST(testCopiedBytes);
+    CPPUNIT_TEST_SUITE_END();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(MuxFrameTest, MuxFrameTest::name());
+
+void
+MuxFrameTest::testHeader()
+{
+    for (std::size_t len : {0, 1, 127, 128, 300, 16383, 16384, UINT16_MAX}) {
+        for (uint16_t channel : {0, 1, 0x1234, UINT16_MAX}) {
+            uint8_t buf[mux::FRAME_HEADER_MAX];
+            auto size = mux::writeFrameHeader(buf, channel, 0, len);
+            CPPUNIT_ASSERT(size <= mux::FRAME_HEADER_MAX);
+            mux::FrameHeader header;
+            CPPUNIT_ASSERT(mux::parseFrameHeader(buf, size, header) == mux::FrameParse::OK);
+            CPPUNIT_ASSERT(header.channel == channel);
+            CPPUNIT_ASSERT(header.flags == 0);
+            CPPUNIT_ASSERT(header.length == len);
+            CPPUNIT_ASSERT(header.size == size);
+            // Cut anywhere, the header is not complete yet
+            for (std::size_t cut = 0; cut < size; cut++)
+                CPPUNIT_ASSERT(mux::parseFrameHeader(buf, cut, header)
+                               == mux::FrameParse::INCOMPLETE);
+        }
+    }
+    uint8_t buf[mux::FRAME_HEADER_MAX];
+    CPPUNIT_ASSERT(mux::writeFrameHeader(buf, 1, 0, 10) == 4);
+    CPPUNIT_ASSERT(mux::writeFrameHeader(buf, 1, 0, 1000) == 5);
+    CPPUNIT_ASSERT(mux::writeFrameHeader(buf, 1, 0, UINT16_MAX) == mux::FRAME_HEADER_MAX);
+}
+
+void
+MuxFrameTest::testInvalid()
+{
+    mux::FrameHeader header;
+    // Unknown flags
+    const uint8_t flags[] {0, 1, 0x80, 4};
+    CPPUNIT_ASSERT(mux::parseFrameHeader(flags, sizeof(flags), header) == mux::FrameParse::INVALID);
+    // Length on more than 3 bytes
+    const uint8_t tooLong[] {0, 1, 0, 0xff, 0xff, 0xff, 0x01};
+    CPPUNIT_ASSERT(mux::parseFrameHeader(tooLong, sizeof(tooLong), header)
+                   == mux::FrameParse::INVALID);
+    // Length bigger than a frame
+    const uint8_t tooBig[] {0, 1, 0, 0x80, 0x80, 0x04};
+    CPPUNIT_ASSERT(mux::parseFrameHeader(tooBig, sizeof(tooBig), header)
+                   == mux::FrameParse::INVALID);
+}
+
+void
+MuxFrameTest::testCopiedBytes()
+{
+    constexpr unsigned FRAMES {10000};
+    constexpr std::size_t READ_SIZE {8192};
+
+    for (std::size_t payloadSize : {64, 1024}) {
+        std::vector<uint8_t> payload(payloadSize, 0x42);
+        uint64_t received = 0;
+
+        // msgpack: packed with a copy of the payload, unpacked in an object
+        // then copied out of it
+        std::size_t msgpackCopied = 0;
+        std::vector<uint8_t> wire;
+        for (unsigned i = 0; i < FRAMES; i++) {
+            msgpack::sbuffer buffer(16 + payloadSize);
+            msgpack::packer<msgpack::sbuffer> pk(&buffer);
+            pk.pack_array(2);
+            pk.pack(static_cast<uint16_t>(1 + i % 100));
+            pk.pack_bin(payloadSize);
+            pk.pack_bin_body((const char*) payload.data(), payloadSize);
+            msgpackCopied += buffer.size();
+            wire.insert(wire.end(), buffer.data(), buffer.data() + buffer.size());
+        }
+        msgpack::unpacker pac(nullptr, nullptr, READ_SIZE);
+        for (std::size_t off = 0; off < wire.size(); off += READ_SIZE) {
+            auto size = std::min(READ_SIZE, wire.size() - off);
+            pac.reserve_buffer(READ_SIZE);
+            std::memcpy(pac.buffer(), wire.data() + off, size);
+            pac.buffer_consumed(size);
+            msgpack::object_handle oh;
+            while (pac.next(oh)) {
+                auto msg = oh.get().as<ChanneledMessage>();
+                msgpackCopied += msg.data.size();
+                received += msg.data.size();
+            }
+        }
+        CPPUNIT_ASSERT(received == FRAMES * payloadSize);
+
+        // Compact frames: the header is gathered with the payload by the
+        // session, and parsed in place
+        std::size_t frameCopied = 0;
+        received = 0;
+        wire.clear();
+        for (unsigned i = 0; i < FRAMES; i++) {
+            uint8_t header[mux::FRAME_HEADER_MAX];
+            auto headerSize = mux::writeFrameHeader(header, 1 + i % 100, 0, payloadSize);
+            frameCopied += headerSize;
+            // What the session does with the two buffers
+            wire.insert(wire.end(), header, header + headerSize);
+            wire.insert(wire.end(), payload.begin(), payload.end());
+        }
+        std::vector<uint8_t> rx;
+        std::size_t rxBegin = 0, rxEnd = 0;
+        for (std::size_t off = 0; off < wire.size(); off += READ_SIZE) {
+            auto size = std::min(READ_SIZE, wire.size() - off);
+            if (rx.size() - rxEnd < READ_SIZE) {
+                std::copy(rx.begin() + rxBegin, rx.begin() + rxEnd, rx.begin());
+                rxEnd -= rxBegin;
+                rxBegin = 0;
+                if (rx.size() - rxEnd < READ_SIZE)
+                    rx.resize(rxEnd + READ_SIZE);
+            }
+            std::memcpy(rx.data() + rxEnd, wire.data() + off, size);
+            rxEnd += size;
+            mux::FrameHeader header;
+            while (mux::parseFrameHeader(rx.data() + rxBegin, rxEnd - rxBegin, header)
+                       == mux::FrameParse::OK
+                   and rxEnd - rxBegin >= header.size + header.length) {
+                received += header.length;
+                rxBegin += header.size + header.length;
+            }
+        }
+        CPPUNIT_ASSERT(received == FRAMES * payloadSize);
+
+        CPPUNIT_ASSERT(frameCopied < msgpackCopied);
+    }
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::MuxFrameTest::name())
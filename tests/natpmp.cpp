@@ -0,0 +1,356 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <asio/executor_work_guard.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "test_runner.h"
+#include "upnp/protocol/natpmp/pmp_client.h"
+
+using namespace std::literals::chrono_literals;
+
+namespace jami {
+namespace test {
+
+using namespace upnp;
+
+/**
+ * Minimal NAT-PMP gateway listening on the loopback.
+ * Requests are answered once the expected number of requests is
+ * received (in reverse order), so the clients must send them concurrently.
+ */
+class StubGateway
+{
+public:
+    StubGateway(asio::io_context& ctx)
+        : socket_(ctx, asio::ip::udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 0))
+    {
+        receive();
+    }
+
+    asio::ip::udp::endpoint endpoint() const { return socket_.local_endpoint(); }
+
+    // Number of requests to wait for before answering.
+    unsigned batchSize {1};
+    // Number of packets to drop before answering.
+    unsigned dropCount {0};
+    // Don't answer at all.
+    bool silent {false};
+    uint16_t resultCode {0};
+    // Error responses end after the result code and the epoch.
+    bool shortErrors {false};
+
+    std::atomic_uint received {0};
+
+private:
+    void receive()
+    {
+        socket_.async_receive_from(asio::buffer(rx_),
+                                   sender_,
+                                   [this](const asio::error_code& ec, size_t size) {
+                                       if (ec)
+                                           return;
+                                       onRequest(size);
+                                       receive();
+                                   });
+    }
+
+    void onRequest(size_t size)
+    {
+        received++;
+        if (silent or size < 2)
+            return;
+        if (dropCount > 0) {
+            dropCount--;
+            return;
+        }
+
+        std::vector<uint8_t> resp {0, uint8_t(rx_[1] + 128)};
+        put16(resp, resultCode);
+        put32(resp, 1234);
+        if (rx_[1] == 0) {
+            // Public address 203.0.113.7
+            resp.insert(resp.end(), {203, 0, 113, 7});
+        } else if (size >= 12 and not (shortErrors and resultCode != 0)) {
+            uint16_t internal = (rx_[4] << 8) | rx_[5];
+            resp.insert(resp.end(), rx_.begin() + 4, rx_.begin() + 6);
+            put16(resp, internal + 1000);
+            resp.insert(resp.end(), rx_.begin() + 8, rx_.begin() + 12);
+        }
+        batch_.emplace_back(std::move(resp));
+
+        if (batch_.size() >= batchSize) {
+            for (auto it = batch_.rbegin(); it != batch_.rend(); ++it)
+                socket_.send_to(asio::buffer(*it), sender_);
+            batch_.clear();
+        }
+    }
+
+    static void put16(std::vector<uint8_t>& buf, uint16_t v)
+    {
+        buf.emplace_back(v >> 8);
+        buf.emplace_back(v & 0xff);
+    }
+
+    static void put32(std::vector<uint8_t>& buf, uint32_t v)
+    {
+        put16(buf, v >> 16);
+        put16(buf, v & 0xffff);
+    }
+
+    asio::ip::udp::socket socket_;
+    asio::ip::udp::endpoint sender_;
+    std::array<uint8_t, 64> rx_;
+    std::vector<std::vector<uint8_t>> batch_;
+};
+
+class NatPmpTest : public CppUnit::TestFixture
+{
+public:
+    NatPmpTest() {}
+    ~NatPmpTest() {}
+    static std::string name() { return "NatPmp"; }
+    void setUp();
+    void tearDown();
+
+private:
+    void testPublicAddress();
+    void testConcurrentMappings();
+    void testRetransmit();
+    void testTimeout();
+    void testErrorResultCode();
+    void testShortErrorResponse();
+
+    CPPUNIT_TEST_SUITE(NatPmpTest);
+    CPPUNIT_TEST(testPublicAddress);
+    CPPUNIT_TEST(testConcurrentMappings);
+    CPPUNIT_TEST(testRetransmit);
+    CPPUNIT_TEST(testTimeout);
+    CPPUNIT_TEST(testErrorResultCode);
+    CPPUNIT_TEST(testShortErrorResponse);
+    CPPUNIT_TEST_SUITE_END();
+
+    std::shared_ptr<asio::io_context> ioContext_;
+    std::thread ioContextRunner_;
+    std::unique_ptr<StubGateway> gateway_;
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(NatPmpTest, NatPmpTest::name());
+
+void
+NatPmpTest::setUp()
+{
+    ioContext_ = std::make_shared<asio::io_context>();
+    gateway_ = std::make_unique<StubGateway>(*ioContext_);
+    ioContextRunner_ = std::thread([context = ioContext_]() {
+        auto work = asio::make_work_guard(*context);
+        context->run();
+    });
+}
+
+void
+NatPmpTest::tearDown()
+{
+    ioContext_->stop();
+    if (ioContextRunner_.joinable())
+        ioContextRunner_.join();
+    gateway_.reset();
+    ioContext_.reset();
+}
+
+void
+NatPmpTest::testPublicAddress()
+{
+    auto client = std::make_shared<PmpClient>(*ioContext_, gateway_->endpoint());
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    bool done = false;
+    asio::error_code result;
+    PmpResponse response;
+    client->requestPublicAddress([&](const asio::error_code& ec, const PmpResponse& resp) {
+        std::lock_guard<std::mutex> lk {mtx};
+        result = ec;
+        response = resp;
+        done = true;
+        cv.notify_one();
+    });
+
+    CPPUNIT_ASSERT(cv.wait_for(lk, 5s, [&] { return done; }));
+    CPPUNIT_ASSERT(not result);
+    CPPUNIT_ASSERT(response.resultCode == PmpResultCode::SUCCESS);
+    CPPUNIT_ASSERT(response.epoch == 1234);
+    CPPUNIT_ASSERT(response.publicAddress.toString() == "203.0.113.7");
+}
+
+void
+NatPmpTest::testConcurrentMappings()
+{
+    // The gateway answers only once all the requests are received. With
+    // a single outstanding request, this would time-out.
+    constexpr unsigned N = 8;
+    gateway_->batchSize = N;
+    auto client = std::make_shared<PmpClient>(*ioContext_, gateway_->endpoint(), nullptr, 2s, 1);
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    unsigned successCount = 0, completed = 0;
+    for (unsigned i = 0; i < N; i++) {
+        uint16_t port = 20000 + i;
+        client->requestMapping(PortType::UDP,
+                               port,
+                               port,
+                               3600,
+                               [&, port](const asio::error_code& ec, const PmpResponse& resp) {
+                                   std::lock_guard<std::mutex> lk {mtx};
+                                   if (not ec and resp.internalPort == port
+                                       and resp.externalPort == port + 1000
+                                       and resp.lifetime == 3600)
+                                       successCount++;
+                                   completed++;
+                                   cv.notify_one();
+                               });
+    }
+
+    CPPUNIT_ASSERT(cv.wait_for(lk, 5s, [&] { return completed == N; }));
+    CPPUNIT_ASSERT(successCount == N);
+    CPPUNIT_ASSERT(gateway_->received == N);
+}
+
+void
+NatPmpTest::testRetransmit()
+{
+    gateway_->dropCount = 1;
+    auto client = std::make_shared<PmpClient>(*ioContext_, gateway_->endpoint(), nullptr, 50ms, 3);
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    bool done = false;
+    asio::error_code result;
+    client->requestMapping(PortType::TCP,
+                           10000,
+                           10000,
+                           3600,
+                           [&](const asio::error_code& ec, const PmpResponse&) {
+                               std::lock_guard<std::mutex> lk {mtx};
+                               result = ec;
+                               done = true;
+                               cv.notify_one();
+                           });
+
+    CPPUNIT_ASSERT(cv.wait_for(lk, 5s, [&] { return done; }));
+    CPPUNIT_ASSERT(not result);
+    CPPUNIT_ASSERT(gateway_->received == 2);
+}
+
+void
+NatPmpTest::testTimeout()
+{
+    gateway_->silent = true;
+    auto client = std::make_shared<PmpClient>(*ioContext_, gateway_->endpoint(), nullptr, 20ms, 3);
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    bool done = false;
+    asio::error_code result;
+    client->requestPublicAddress([&](const asio::error_code& ec, const PmpResponse&) {
+        std::lock_guard<std::mutex> lk {mtx};
+        result = ec;
+        done = true;
+        cv.notify_one();
+    });
+
+    CPPUNIT_ASSERT(cv.wait_for(lk, 5s, [&] { return done; }));
+    CPPUNIT_ASSERT(result == asio::error::timed_out);
+    CPPUNIT_ASSERT(gateway_->received == 3);
+}
+
+void
+NatPmpTest::testErrorResultCode()
+{
+    gateway_->resultCode = static_cast<uint16_t>(PmpResultCode::NOT_AUTHORIZED);
+    auto client = std::make_shared<PmpClient>(*ioContext_, gateway_->endpoint());
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    bool done = false;
+    PmpResponse response;
+    client->requestMapping(PortType::UDP,
+                           10000,
+                           10000,
+                           3600,
+                           [&](const asio::error_code&, const PmpResponse& resp) {
+                               std::lock_guard<std::mutex> lk {mtx};
+                               response = resp;
+                               done = true;
+                               cv.notify_one();
+                           });
+
+    CPPUNIT_ASSERT(cv.wait_for(lk, 5s, [&] { return done; }));
+    CPPUNIT_ASSERT(response.resultCode == PmpResultCode::NOT_AUTHORIZED);
+}
+
+void
+NatPmpTest::testShortErrorResponse()
+{
+    // Both answered at once, the last request first
+    gateway_->batchSize = 2;
+    gateway_->resultCode = static_cast<uint16_t>(PmpResultCode::OUT_OF_RESOURCES);
+    gateway_->shortErrors = true;
+    auto client = std::make_shared<PmpClient>(*ioContext_, gateway_->endpoint());
+
+    std::mutex mtx;
+    std::unique_lock<std::mutex> lk {mtx};
+    std::condition_variable cv;
+    std::vector<uint16_t> completed;
+    // The higher port is requested first
+    for (uint16_t port : {20001, 20000}) {
+        client->requestMapping(PortType::UDP,
+                               port,
+                               port,
+                               3600,
+                               [&, port](const asio::error_code&, const PmpResponse& resp) {
+                                   std::lock_guard<std::mutex> lk {mtx};
+                                   if (resp.resultCode == PmpResultCode::OUT_OF_RESOURCES)
+                                       completed.emplace_back(port);
+                                   cv.notify_one();
+                               });
+    }
+
+    CPPUNIT_ASSERT(cv.wait_for(lk, 5s, [&] { return completed.size() == 2; }));
+    // Without the port, each response completes the oldest request
+    CPPUNIT_ASSERT(completed[0] == 20001);
+    CPPUNIT_ASSERT(completed[1] == 20000);
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::NatPmpTest::name())
@@ -0,0 +1,553 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <asio/executor_work_guard.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/read.hpp>
+#include <asio/read_until.hpp>
+#include <asio/streambuf.hpp>
+#include <asio/write.hpp>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "test_runner.h"
+#include "upnp/protocol/pupnp/pupnp.h"
+
+using namespace std::literals::chrono_literals;
+
+namespace jami {
+namespace test {
+
+using namespace upnp;
+
+/**
+ * Minimal IGD HTTP server listening on the loopback. It serves the device
+ * description and the WANIPConnection SOAP actions used by PUPnP.
+ * Each connection is handled on its own thread, and the SOAP requests are
+ * answered after a fixed latency, so concurrent requests overlap.
+ */
+class MockIgd
+{
+public:
+    struct Entry
+    {
+        std::string protocol;
+        std::string externalPort;
+        std::string internalPort;
+        std::string internalClient;
+        std::string description;
+        std::string leaseDuration {"0"};
+    };
+
+    MockIgd(asio::io_context& ctx)
+        : acceptor_(ctx, asio::ip::tcp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 0))
+    {
+        accept();
+    }
+
+    ~MockIgd()
+    {
+        asio::error_code ec;
+        acceptor_.close(ec);
+        std::vector<std::thread> threads;
+        {
+            std::lock_guard<std::mutex> lk {mutex_};
+            threads = std::move(threads_);
+        }
+        for (auto& t : threads)
+            t.join();
+    }
+
+    std::string location() const
+    {
+        return fmt::format("http://127.0.0.1:{}/desc.xml", acceptor_.local_endpoint().port());
+    }
+
+    void addEntry(Entry&& entry)
+    {
+        std::lock_guard<std::mutex> lk {mutex_};
+        entries_.emplace_back(std::move(entry));
+    }
+
+    size_t entryCount()
+    {
+        std::lock_guard<std::mutex> lk {mutex_};
+        return entries_.size();
+    }
+
+    std::vector<Entry> entries()
+    {
+        std::lock_guard<std::mutex> lk {mutex_};
+        return entries_;
+    }
+
+    // Number of AddPortMapping requests received.
+    std::atomic_uint addCount {0};
+
+    // Latency of the SOAP responses.
+    std::chrono::milliseconds latency {0};
+
+    // Max number of SOAP requests processed at once.
+    std::atomic_uint maxConcurrent {0};
+
+private:
+    void accept()
+    {
+        acceptor_.async_accept([this](const asio::error_code& ec, asio::ip::tcp::socket socket) {
+            if (ec)
+                return;
+            std::lock_guard<std::mutex> lk {mutex_};
+            threads_.emplace_back([this, socket = std::move(socket)]() mutable {
+                handle(socket);
+            });
+            accept();
+        });
+    }
+
+    void handle(asio::ip::tcp::socket& socket)
+    {
+        asio::error_code ec;
+        asio::streambuf buf;
+        auto headerSize = asio::read_until(socket, buf, "\r\n\r\n", ec);
+        if (ec)
+            return;
+        std::string data(asio::buffers_begin(buf.data()), asio::buffers_end(buf.data()));
+        std::string head = data.substr(0, headerSize);
+        std::string body = data.substr(headerSize);
+
+        auto contentLength = getHeader(head, "content-length");
+        if (not contentLength.empty()) {
+            auto length = std::stoul(contentLength);
+            if (body.size() < length) {
+                std::string rest(length - body.size(), '\0');
+                asio::read(socket, asio::buffer(rest), ec);
+                if (ec)
+                    return;
+                body += rest;
+            }
+        }
+
+        std::string response;
+        if (head.rfind("GET ", 0) == 0) {
+            response = httpResponse("200 OK", description());
+        } else if (head.rfind("POST ", 0) == 0) {
+            auto current = ++concurrent_;
+            auto max = maxConcurrent.load();
+            while (current > max and not maxConcurrent.compare_exchange_weak(max, current)) {}
+            std::this_thread::sleep_for(latency);
+            response = soap(head, body);
+            concurrent_--;
+        } else {
+            // Event subscription.
+            response = "HTTP/1.1 412 Precondition Failed\r\n"
+                       "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        }
+        asio::write(socket, asio::buffer(response), ec);
+        socket.close(ec);
+    }
+
+    std::string soap(const std::string& head, const std::string& body)
+    {
+        auto soapAction = getHeader(head, "soapaction");
+        auto pos = soapAction.find('#');
+        if (pos == std::string::npos)
+            return soapError(401, "Invalid Action");
+        auto action = soapAction.substr(pos + 1);
+        action.erase(action.find_last_not_of("\"") + 1);
+
+        std::lock_guard<std::mutex> lk {mutex_};
+        if (action == "GetStatusInfo") {
+            return soapResponse(action,
+                                "<NewConnectionStatus>Connected</NewConnectionStatus>"
+                                "<NewLastConnectionError>ERROR_NONE</NewLastConnectionError>"
+                                "<NewUptime>1000</NewUptime>");
+        } else if (action == "GetExternalIPAddress") {
+            return soapResponse(action, "<NewExternalIPAddress>203.0.113.7</NewExternalIPAddress>");
+        } else if (action == "AddPortMapping") {
+            addCount++;
+            Entry entry {getTag(body, "NewProtocol"),
+                         getTag(body, "NewExternalPort"),
+                         getTag(body, "NewInternalPort"),
+                         getTag(body, "NewInternalClient"),
+                         getTag(body, "NewPortMappingDescription"),
+                         getTag(body, "NewLeaseDuration")};
+            // Adding an existing mapping again updates it.
+            auto it = std::find_if(entries_.begin(), entries_.end(), [&](const Entry& e) {
+                return e.externalPort == entry.externalPort and e.protocol == entry.protocol;
+            });
+            if (it != entries_.end())
+                *it = std::move(entry);
+            else
+                entries_.emplace_back(std::move(entry));
+            return soapResponse(action, "");
+        } else if (action == "DeletePortMapping") {
+            auto port = getTag(body, "NewExternalPort");
+            auto protocol = getTag(body, "NewProtocol");
+            for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+                if (it->externalPort == port and it->protocol == protocol) {
+                    entries_.erase(it);
+                    return soapResponse(action, "");
+                }
+            }
+            return soapError(714, "NoSuchEntryInArray");
+        } else if (action == "GetGenericPortMappingEntry") {
+            auto index = std::stoul(getTag(body, "NewPortMappingIndex"));
+            if (index >= entries_.size())
+                return soapError(713, "SpecifiedArrayIndexInvalid");
+            const auto& entry = entries_[index];
+            return soapResponse(
+                action,
+                fmt::format("<NewRemoteHost></NewRemoteHost>"
+                            "<NewExternalPort>{}</NewExternalPort>"
+                            "<NewProtocol>{}</NewProtocol>"
+                            "<NewInternalPort>{}</NewInternalPort>"
+                            "<NewInternalClient>{}</NewInternalClient>"
+                            "<NewEnabled>1</NewEnabled>"
+                            "<NewPortMappingDescription>{}</NewPortMappingDescription>"
+                            "<NewLeaseDuration>{}</NewLeaseDuration>",
+                            entry.externalPort,
+                            entry.protocol,
+                            entry.internalPort,
+                            entry.internalClient,
+                            entry.description,
+                            entry.leaseDuration));
+        }
+        return soapError(401, "Invalid Action");
+    }
+
+    static std::string description()
+    {
+        return "<?xml version=\"1.0\"?>"
+               "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+               "<specVersion><major>1</major><minor>0</minor></specVersion>"
+               "<device>"
+               "<deviceType>urn:schemas-upnp-org:device:InternetGatewayDevice:1</deviceType>"
+               "<friendlyName>Mock IGD</friendlyName>"
+               "<UDN>uuid:00000000-0000-0000-0000-000000000001</UDN>"
+               "<deviceList><device>"
+               "<deviceType>urn:schemas-upnp-org:device:WANDevice:1</deviceType>"
+               "<deviceList><device>"
+               "<deviceType>urn:schemas-upnp-org:device:WANConnectionDevice:1</deviceType>"
+               "<serviceList><service>"
+               "<serviceType>urn:schemas-upnp-org:service:WANIPConnection:1</serviceType>"
+               "<serviceId>urn:upnp-org:serviceId:WANIPConn1</serviceId>"
+               "<controlURL>/ctl/IPConn</controlURL>"
+               "<eventSubURL>/evt/IPConn</eventSubURL>"
+               "<SCPDURL>/WANIPCn.xml</SCPDURL>"
+               "</service></serviceList>"
+               "</device></deviceList>"
+               "</device></deviceList>"
+               "</device>"
+               "</root>";
+    }
+
+    static std::string soapResponse(const std::string& action, const std::string& args)
+    {
+        return httpResponse(
+            "200 OK",
+            fmt::format("<?xml version=\"1.0\"?>"
+                        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+                        "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+                        "<s:Body><u:{0}Response "
+                        "xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:1\">{1}"
+                        "</u:{0}Response></s:Body></s:Envelope>",
+                        action,
+                        args));
+    }
+
+    static std::string soapError(int code, const std::string& description)
+    {
+        return httpResponse(
+            "500 Internal Server Error",
+            fmt::format("<?xml version=\"1.0\"?>"
+                        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+                        "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+                        "<s:Body><s:Fault><faultcode>s:Client</faultcode>"
+                        "<faultstring>UPnPError</faultstring><detail>"
+                        "<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\">"
+                        "<errorCode>{}</errorCode><errorDescription>{}</errorDescription>"
+                        "</UPnPError></detail></s:Fault></s:Body></s:Envelope>",
+                        code,
+                        description));
+    }
+
+    static std::string httpResponse(const std::string& status, const std::string& body)
+    {
+        return fmt::format("HTTP/1.1 {}\r\n"
+                           "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+                           "Content-Length: {}\r\n"
+                           "Connection: close\r\n"
+                           "\r\n{}",
+                           status,
+                           body.size(),
+                           body);
+    }
+
+    // Case-insensitive lookup of a header value.
+    static std::string getHeader(const std::string& head, const std::string& name)
+    {
+        std::string lower(head);
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        auto pos = lower.find("\r\n" + name + ":");
+        if (pos == std::string::npos)
+            return {};
+        pos += name.size() + 3;
+        auto end = head.find("\r\n", pos);
+        auto value = head.substr(pos, end - pos);
+        value.erase(0, value.find_first_not_of(" \t"));
+        return value;
+    }
+
+    static std::string getTag(const std::string& body, const std::string& tag)
+    {
+        auto start = body.find("<" + tag + ">");
+        if (start == std::string::npos)
+            return {};
+        start += tag.size() + 2;
+        auto end = body.find("</" + tag + ">", start);
+        if (end == std::string::npos)
+            return {};
+        return body.substr(start, end - start);
+    }
+
+    asio::ip::tcp::acceptor acceptor_;
+    std::mutex mutex_;
+    std::vector<std::thread> threads_;
+    std::vector<Entry> entries_;
+    std::atomic_uint concurrent_ {0};
+};
+
+class TestObserver : public UpnpMappingObserver
+{
+public:
+    void onIgdUpdated(const std::shared_ptr<IGD>& igd, UpnpIgdEvent event) override
+    {
+        std::lock_guard<std::mutex> lk {mtx};
+        if (event == UpnpIgdEvent::ADDED)
+            this->igd = igd;
+        cv.notify_all();
+    }
+    void onMappingAdded(const std::shared_ptr<IGD>&, const Mapping&) override
+    {
+        std::lock_guard<std::mutex> lk {mtx};
+        added++;
+        cv.notify_all();
+    }
+    void onMappingRequestFailed(const Mapping&) override
+    {
+        std::lock_guard<std::mutex> lk {mtx};
+        failed++;
+        cv.notify_all();
+    }
+    void onMappingRenewed(const std::shared_ptr<IGD>&, const Mapping& map) override
+    {
+        std::lock_guard<std::mutex> lk {mtx};
+        renewed++;
+        renewalTime = map.getRenewalTime();
+        cv.notify_all();
+    }
+    void onMappingRemoved(const std::shared_ptr<IGD>&, const Mapping&) override {}
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::shared_ptr<IGD> igd;
+    unsigned added {0};
+    unsigned failed {0};
+    unsigned renewed {0};
+    sys_clock::time_point renewalTime {};
+};
+
+class PUPnPTest : public CppUnit::TestFixture
+{
+public:
+    PUPnPTest() {}
+    ~PUPnPTest() {}
+    static std::string name() { return "PUPnP"; }
+    void setUp();
+    void tearDown();
+
+private:
+    void testProbeIgd();
+    void testConcurrentMappings();
+    void testMappingsList();
+    void testMappingLease();
+
+    CPPUNIT_TEST_SUITE(PUPnPTest);
+    CPPUNIT_TEST(testProbeIgd);
+    CPPUNIT_TEST(testConcurrentMappings);
+    CPPUNIT_TEST(testMappingsList);
+    CPPUNIT_TEST(testMappingLease);
+    CPPUNIT_TEST_SUITE_END();
+
+    // Probe the mock IGD and wait until it's validated.
+    std::shared_ptr<IGD> probeIgd();
+
+    std::shared_ptr<asio::io_context> ioContext_;
+    std::thread ioContextRunner_;
+    std::unique_ptr<MockIgd> mockIgd_;
+    std::shared_ptr<PUPnP> pupnp_;
+    TestObserver observer_;
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(PUPnPTest, PUPnPTest::name());
+
+void
+PUPnPTest::setUp()
+{
+    ioContext_ = std::make_shared<asio::io_context>();
+    mockIgd_ = std::make_unique<MockIgd>(*ioContext_);
+    ioContextRunner_ = std::thread([context = ioContext_]() {
+        auto work = asio::make_work_guard(*context);
+        context->run();
+    });
+    pupnp_ = std::make_shared<PUPnP>(ioContext_, nullptr);
+    pupnp_->setObserver(&observer_);
+}
+
+void
+PUPnPTest::tearDown()
+{
+    pupnp_->terminate();
+    pupnp_.reset();
+    ioContext_->stop();
+    if (ioContextRunner_.joinable())
+        ioContextRunner_.join();
+    mockIgd_.reset();
+    ioContext_.reset();
+}
+
+std::shared_ptr<IGD>
+PUPnPTest::probeIgd()
+{
+    pupnp_->probeIgd(mockIgd_->location());
+    std::unique_lock<std::mutex> lk {observer_.mtx};
+    observer_.cv.wait_for(lk, 5s, [&] { return observer_.igd != nullptr; });
+    return observer_.igd;
+}
+
+void
+PUPnPTest::testProbeIgd()
+{
+    auto igd = probeIgd();
+    CPPUNIT_ASSERT(igd);
+    CPPUNIT_ASSERT(igd->getPublicIp().toString() == "203.0.113.7");
+    CPPUNIT_ASSERT(igd->getLocalIp().toString() == "127.0.0.1");
+    CPPUNIT_ASSERT(pupnp_->isReady());
+}
+
+void
+PUPnPTest::testConcurrentMappings()
+{
+    mockIgd_->latency = 200ms;
+    auto igd = probeIgd();
+    CPPUNIT_ASSERT(igd);
+
+    constexpr unsigned N = 8;
+    for (unsigned i = 0; i < N; i++) {
+        Mapping map(PortType::UDP, 20000 + i, 20000 + i);
+        map.setIgd(igd);
+        pupnp_->requestMappingAdd(map);
+    }
+
+    std::unique_lock<std::mutex> lk {observer_.mtx};
+    CPPUNIT_ASSERT(
+        observer_.cv.wait_for(lk, 5s, [&] { return observer_.added + observer_.failed == N; }));
+    CPPUNIT_ASSERT(observer_.added == N);
+    CPPUNIT_ASSERT(mockIgd_->entryCount() == N);
+    // The requests must not be sent one at a time.
+    CPPUNIT_ASSERT(mockIgd_->maxConcurrent > 1);
+}
+
+void
+PUPnPTest::testMappingsList()
+{
+    auto igd = probeIgd();
+    CPPUNIT_ASSERT(igd);
+
+    // More entries than the number of concurrent requests, so the
+    // listing spans several batches.
+    auto host = pupnp_->getHostAddress().toString();
+    for (unsigned i = 0; i < 6; i++) {
+        auto port = std::to_string(30000 + i);
+        mockIgd_->addEntry({"TCP", port, port, host, "JAMI-TCP:" + port});
+    }
+    mockIgd_->addEntry({"UDP", "31000", "31000", host, "OTHER-UDP:31000"});
+    mockIgd_->addEntry({"UDP", "31001", "31001", "192.0.2.1", "JAMI-UDP:31001"});
+
+    auto mappings = pupnp_->getMappingsListByDescr(igd, Mapping::UPNP_MAPPING_DESCRIPTION_PREFIX);
+    CPPUNIT_ASSERT(mappings.size() == 6);
+    for (const auto& [_, map] : mappings)
+        CPPUNIT_ASSERT(map.getType() == PortType::TCP);
+}
+
+void
+PUPnPTest::testMappingLease()
+{
+    auto igd = probeIgd();
+    CPPUNIT_ASSERT(igd);
+
+    // Without a lease, the mapping never expires.
+    Mapping permanent(PortType::UDP, 20000, 20000);
+    permanent.setIgd(igd);
+    pupnp_->requestMappingAdd(permanent);
+    {
+        std::unique_lock<std::mutex> lk {observer_.mtx};
+        CPPUNIT_ASSERT(observer_.cv.wait_for(lk, 5s, [&] { return observer_.added == 1; }));
+    }
+
+    pupnp_->setLeaseDuration(1h);
+    Mapping leased(PortType::TCP, 10000, 10000);
+    leased.setIgd(igd);
+    pupnp_->requestMappingAdd(leased);
+    {
+        std::unique_lock<std::mutex> lk {observer_.mtx};
+        CPPUNIT_ASSERT(observer_.cv.wait_for(lk, 5s, [&] { return observer_.added == 2; }));
+    }
+
+    auto entries = mockIgd_->entries();
+    CPPUNIT_ASSERT(entries.size() == 2);
+    for (const auto& entry : entries)
+        CPPUNIT_ASSERT(entry.leaseDuration == (entry.protocol == "TCP" ? "3600" : "0"));
+
+    // The renewal adds the mapping again and reports when to renew it next.
+    auto before = sys_clock::now();
+    pupnp_->requestMappingRenew(leased);
+    {
+        std::unique_lock<std::mutex> lk {observer_.mtx};
+        CPPUNIT_ASSERT(observer_.cv.wait_for(lk, 5s, [&] { return observer_.renewed == 1; }));
+        CPPUNIT_ASSERT(observer_.renewalTime > before);
+        CPPUNIT_ASSERT(observer_.renewalTime <= sys_clock::now() + 1h);
+    }
+    CPPUNIT_ASSERT(mockIgd_->addCount == 3);
+    CPPUNIT_ASSERT(mockIgd_->entryCount() == 2);
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::PUPnPTest::name())
@@ -0,0 +1,146 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "test_runner.h"
+#include "serial_executor.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+
+using namespace std::literals::chrono_literals;
+
+namespace jami {
+namespace test {
+
+class SerialExecutorTest : public CppUnit::TestFixture
+{
+public:
+    static std::string name() { return "SerialExecutor"; }
+
+private:
+    void testOrdering();
+    void testBatching();
+    void testException();
+
+    CPPUNIT_TEST_SUITE(SerialExecutorTest);
+    CPPUNIT_TEST(testOrdering);
+    CPPUNIT_TEST(testBatching);
+    CPPUNIT_TEST(testException);
+    CPPUNIT_TEST_SUITE_END();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(SerialExecutorTest, SerialExecutorTest::name());
+
+// Shared with the tasks, which may run after a failed assertion
+struct State
+{
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<int> done;
+    std::vector<std::thread::id> threads;
+    std::atomic_int running {0};
+    bool overlap {false};
+    bool open {false};
+};
+
+void
+SerialExecutorTest::testOrdering()
+{
+    static constexpr int TASKS {1000};
+    auto executor = std::make_shared<SerialExecutor>();
+    auto state = std::make_shared<State>();
+    for (int i = 0; i < TASKS; i++) {
+        executor->run([state, i] {
+            if (state->running++ != 0)
+                state->overlap = true;
+            std::this_thread::yield();
+            state->running--;
+            std::lock_guard<std::mutex> lk(state->mtx);
+            state->done.emplace_back(i);
+            state->cv.notify_one();
+        });
+    }
+    std::unique_lock<std::mutex> lk(state->mtx);
+    CPPUNIT_ASSERT(state->cv.wait_for(lk, 10s, [&] { return state->done.size() == TASKS; }));
+    // One at a time, in order
+    CPPUNIT_ASSERT(not state->overlap);
+    for (int i = 0; i < TASKS; i++)
+        CPPUNIT_ASSERT(state->done[i] == i);
+}
+
+void
+SerialExecutorTest::testBatching()
+{
+    auto executor = std::make_shared<SerialExecutor>();
+    auto state = std::make_shared<State>();
+    auto task = [state](int i) {
+        return [state, i] {
+            std::unique_lock<std::mutex> lk(state->mtx);
+            // The first task holds the executor while the others are posted
+            state->cv.wait(lk, [&] { return state->open; });
+            state->done.emplace_back(i);
+            state->threads.emplace_back(std::this_thread::get_id());
+            state->cv.notify_all();
+        };
+    };
+    executor->run(task(0));
+    for (int i = 1; i < 10; i++)
+        executor->run(task(i));
+    std::unique_lock<std::mutex> lk(state->mtx);
+    state->open = true;
+    state->cv.notify_all();
+    CPPUNIT_ASSERT(state->cv.wait_for(lk, 10s, [&] { return state->done.size() == 10; }));
+    // Posted while scheduled, so drained by the same pool task
+    for (const auto& thread : state->threads)
+        CPPUNIT_ASSERT(thread == state->threads.front());
+}
+
+void
+SerialExecutorTest::testException()
+{
+    auto state = std::make_shared<State>();
+    auto logger = std::make_shared<dht::log::Logger>(
+        [state](dht::log::LogLevel level, std::string&& message) {
+            if (level != dht::log::LogLevel::error)
+                return;
+            std::lock_guard<std::mutex> lk(state->mtx);
+            state->done.emplace_back(-1);
+            state->cv.notify_one();
+        });
+    auto executor = std::make_shared<SerialExecutor>(logger);
+    executor->run([] { throw std::runtime_error("failure"); });
+    executor->run([state] {
+        std::lock_guard<std::mutex> lk(state->mtx);
+        state->done.emplace_back(1);
+        state->cv.notify_one();
+    });
+    std::unique_lock<std::mutex> lk(state->mtx);
+    CPPUNIT_ASSERT(state->cv.wait_for(lk, 10s, [&] { return state->done.size() == 2; }));
+    // Logged, then the next task still runs
+    CPPUNIT_ASSERT(state->done[0] == -1);
+    CPPUNIT_ASSERT(state->done[1] == 1);
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::SerialExecutorTest::name())
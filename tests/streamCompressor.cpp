@@ -0,0 +1,185 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <fmt/core.h>
+
+#include <random>
+
+#include "test_runner.h"
+#include "stream_compressor.h"
+
+namespace jami {
+namespace test {
+
+class StreamCompressorTest : public CppUnit::TestFixture
+{
+public:
+    static std::string name() { return "StreamCompressor"; }
+
+private:
+    void testFlushedWrites();
+    void testCorrupted();
+    void testExpansion();
+    void testCompressionRatio();
+
+    CPPUNIT_TEST_SUITE(StreamCompressorTest);
+    CPPUNIT_TEST(testFlushedWrites);
+    CPPUNIT_TEST(testCorrupted);
+    CPPUNIT_TEST(testExpansion);
+    CPPUNIT_TEST(testCompressionRatio);
+    CPPUNIT_TEST_SUITE_END();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(StreamCompressorTest, StreamCompressorTest::name());
+
+// Messages of a chatty protocol, similar to each other
+static std::string
+textMessage(unsigned i)
+{
+    return fmt::format("{{\"id\":{},\"method\":\"sync\",\"device\":\"{:040x}\",\"status\":\"{}\"}}\n",
+                       i,
+                       i % 7,
+                       i % 3 ? "ok" : "pending");
+}
+
+void
+StreamCompressorTest::testFlushedWrites()
+{
+    StreamCompressor compressor;
+    StreamDecompressor decompressor;
+    std::size_t in = 0, out = 0;
+    for (unsigned i = 0; i < 1000; i++) {
+        auto msg = textMessage(i);
+        std::vector<uint8_t> compressed;
+        CPPUNIT_ASSERT(compressor.compress((const uint8_t*) msg.data(), msg.size(), compressed));
+        // Each write comes out whole, without the next ones
+        std::vector<uint8_t> decompressed(COMPRESSION_CHUNK_MAX + 1);
+        auto size = decompressed.size();
+        CPPUNIT_ASSERT(decompressor.decompress(compressed.data(),
+                                               compressed.size(),
+                                               decompressed.data(),
+                                               size));
+        CPPUNIT_ASSERT(std::string(decompressed.begin(), decompressed.begin() + size) == msg);
+        in += msg.size();
+        out += compressed.size();
+    }
+    // The context slides over the previous messages
+    CPPUNIT_ASSERT(out * 3 < in);
+
+    std::vector<uint8_t> big(COMPRESSION_CHUNK_MAX);
+    std::mt19937 rng(42);
+    for (auto& byte : big)
+        byte = static_cast<uint8_t>(rng());
+    std::vector<uint8_t> compressed;
+    CPPUNIT_ASSERT(compressor.compress(big.data(), big.size(), compressed));
+    CPPUNIT_ASSERT(compressed.size() <= UINT16_MAX);
+    std::vector<uint8_t> decompressed(COMPRESSION_CHUNK_MAX + 1);
+    auto size = decompressed.size();
+    CPPUNIT_ASSERT(decompressor.decompress(compressed.data(),
+                                           compressed.size(),
+                                           decompressed.data(),
+                                           size));
+    decompressed.resize(size);
+    CPPUNIT_ASSERT(decompressed == big);
+}
+
+void
+StreamCompressorTest::testCorrupted()
+{
+    StreamDecompressor decompressor;
+    std::vector<uint8_t> garbage(64, 0x55);
+    std::vector<uint8_t> out(COMPRESSION_CHUNK_MAX + 1);
+    auto size = out.size();
+    CPPUNIT_ASSERT(!decompressor.decompress(garbage.data(), garbage.size(), out.data(), size));
+}
+
+void
+StreamCompressorTest::testExpansion()
+{
+    // A few bytes expanding to more than the peer compresses at once
+    std::vector<uint8_t> zeros(16 * COMPRESSION_CHUNK_MAX);
+    StreamCompressor compressor;
+    std::vector<uint8_t> compressed;
+    CPPUNIT_ASSERT(compressor.compress(zeros.data(), zeros.size(), compressed));
+    CPPUNIT_ASSERT(compressed.size() < 1024);
+
+    StreamDecompressor decompressor;
+    std::vector<uint8_t> out(zeros.size());
+    auto size = out.size();
+    CPPUNIT_ASSERT(!decompressor.decompress(compressed.data(), compressed.size(), out.data(), size));
+}
+
+void
+StreamCompressorTest::testCompressionRatio()
+{
+    constexpr std::size_t TOTAL {1024 * 1024};
+    constexpr std::size_t WRITE_SIZE {4096};
+
+    std::string text;
+    for (unsigned i = 0; text.size() < TOTAL; i++)
+        text += textMessage(i);
+    text.resize(TOTAL);
+    std::string random(TOTAL, '\0');
+    std::mt19937 rng(42);
+    for (auto& c : random)
+        c = static_cast<char>(rng());
+
+    for (const auto* data : {&text, &random}) {
+        for (int level : {1, 3}) {
+            StreamCompressor compressor(level);
+            StreamDecompressor decompressor;
+            std::vector<std::vector<uint8_t>> writes;
+            std::size_t compressedSize = 0;
+            for (std::size_t off = 0; off < TOTAL; off += WRITE_SIZE) {
+                writes.emplace_back();
+                CPPUNIT_ASSERT(compressor.compress((const uint8_t*) data->data() + off,
+                                                   WRITE_SIZE,
+                                                   writes.back()));
+                compressedSize += writes.back().size();
+            }
+            std::vector<uint8_t> out;
+            out.reserve(TOTAL);
+            std::vector<uint8_t> chunk(COMPRESSION_CHUNK_MAX + 1);
+            for (const auto& write : writes) {
+                auto size = chunk.size();
+                CPPUNIT_ASSERT(
+                    decompressor.decompress(write.data(), write.size(), chunk.data(), size));
+                out.insert(out.end(), chunk.begin(), chunk.begin() + size);
+            }
+            CPPUNIT_ASSERT(out.size() == TOTAL);
+            CPPUNIT_ASSERT(std::equal(out.begin(), out.end(), data->begin(), [](uint8_t a, char b) {
+                return a == static_cast<uint8_t>(b);
+            }));
+
+            auto saved = 100. * (double(TOTAL) - double(compressedSize)) / TOTAL;
+            if (data == &text)
+                CPPUNIT_ASSERT(saved > 50);
+            else
+                // What the channel gives up on, by sampling the ratio
+                CPPUNIT_ASSERT(saved < 10);
+        }
+    }
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::StreamCompressorTest::name())
@@ -0,0 +1,190 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+
+#include <sstream>
+#include <thread>
+
+#include "test_runner.h"
+#include "turn_stand_in.h"
+
+using namespace std::literals::chrono_literals;
+
+namespace jami {
+namespace test {
+
+class TurnPoolTest : public CppUnit::TestFixture
+{
+public:
+    TurnPoolTest()
+    {
+        pj_log_set_level(0);
+        pj_init();
+        pjlib_util_init();
+        pjnath_init();
+    }
+    ~TurnPoolTest() { pj_shutdown(); }
+    static std::string name() { return "TurnPool"; }
+    void setUp();
+    void tearDown();
+
+private:
+    void testPreallocatedTransport();
+    void testDisabledPool();
+    void testPoolCap();
+
+    CPPUNIT_TEST_SUITE(TurnPoolTest);
+    CPPUNIT_TEST(testPreallocatedTransport);
+    CPPUNIT_TEST(testDisabledPool);
+    CPPUNIT_TEST(testPoolCap);
+    CPPUNIT_TEST_SUITE_END();
+
+    IceTransportOptions makeOptions(IceTransportFactory& factory) const;
+    // Port of the relayed candidate of the transport, 0 if none
+    static uint16_t getRelayedPort(const IceTransport& ice);
+
+    std::shared_ptr<asio::io_context> ioContext_;
+    std::thread ioContextRunner_;
+    std::unique_ptr<TurnStandIn> turn_;
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TurnPoolTest, TurnPoolTest::name());
+
+void
+TurnPoolTest::setUp()
+{
+    ioContext_ = std::make_shared<asio::io_context>();
+    turn_ = std::make_unique<TurnStandIn>(*ioContext_);
+    ioContextRunner_ = std::thread([context = ioContext_]() {
+        auto work = asio::make_work_guard(*context);
+        context->run();
+    });
+}
+
+void
+TurnPoolTest::tearDown()
+{
+    ioContext_->stop();
+    if (ioContextRunner_.joinable())
+        ioContextRunner_.join();
+    turn_.reset();
+    ioContext_.reset();
+}
+
+IceTransportOptions
+TurnPoolTest::makeOptions(IceTransportFactory& factory) const
+{
+    IceTransportOptions options;
+    options.factory = &factory;
+    options.turnServers.emplace_back(TurnServerInfo().setUri(turn_->uri()));
+    return options;
+}
+
+uint16_t
+TurnPoolTest::getRelayedPort(const IceTransport& ice)
+{
+    // <foundation> <comp> <transport> <prio> <addr> <port> typ <type>
+    for (const auto& cand : ice.getLocalCandidates(1)) {
+        std::istringstream in(cand);
+        std::string foundation, comp, transport, prio, addr, typ, type;
+        uint16_t port = 0;
+        in >> foundation >> comp >> transport >> prio >> addr >> port >> typ >> type;
+        if (type == "relay")
+            return port;
+    }
+    return 0;
+}
+
+void
+TurnPoolTest::testPreallocatedTransport()
+{
+    IceTransportFactory factory;
+    factory.setTurnPoolSize(1);
+    auto options = makeOptions(factory);
+
+    // The first transport allocates by itself, and the pool is filled
+    auto first = factory.createUTransport("");
+    CPPUNIT_ASSERT(initializeIce(*first, options));
+    CPPUNIT_ASSERT(getRelayedPort(*first) != 0);
+    for (auto i = 0; i < 100 and factory.turnPoolCount() == 0; i++)
+        std::this_thread::sleep_for(50ms);
+    CPPUNIT_ASSERT(factory.turnPoolCount() == 1);
+    unsigned allocations = turn_->allocations;
+    CPPUNIT_ASSERT(allocations == 2);
+
+    // The next one takes the preallocated transport, so its relayed
+    // address was allocated before
+    auto second = factory.createUTransport("");
+    CPPUNIT_ASSERT(initializeIce(*second, options));
+    CPPUNIT_ASSERT(second->isInitialized());
+    auto port = getRelayedPort(*second);
+    CPPUNIT_ASSERT(port > RELAY_PORT_BASE and port <= RELAY_PORT_BASE + allocations);
+    CPPUNIT_ASSERT(port != getRelayedPort(*first));
+
+    // And the pool is refilled
+    for (auto i = 0; i < 100 and turn_->allocations == allocations; i++)
+        std::this_thread::sleep_for(50ms);
+    CPPUNIT_ASSERT(turn_->allocations == allocations + 1);
+
+    factory.clearTurnPool();
+    CPPUNIT_ASSERT(factory.turnPoolCount() == 0);
+}
+
+void
+TurnPoolTest::testDisabledPool()
+{
+    IceTransportFactory factory;
+    auto options = makeOptions(factory);
+
+    auto first = factory.createUTransport("");
+    CPPUNIT_ASSERT(initializeIce(*first, options));
+    auto second = factory.createUTransport("");
+    CPPUNIT_ASSERT(initializeIce(*second, options));
+    std::this_thread::sleep_for(200ms);
+    CPPUNIT_ASSERT(factory.turnPoolCount() == 0);
+    CPPUNIT_ASSERT(turn_->allocations == 2);
+}
+
+void
+TurnPoolTest::testPoolCap()
+{
+    IceTransportFactory factory;
+    factory.setTurnPoolSize(100);
+    auto options = makeOptions(factory);
+
+    auto first = factory.createUTransport("");
+    CPPUNIT_ASSERT(initializeIce(*first, options));
+    for (auto i = 0; i < 100 and factory.turnPoolCount() < 4; i++)
+        std::this_thread::sleep_for(50ms);
+    std::this_thread::sleep_for(200ms);
+    // Each pooled transport holds an allocation, so the pool is capped
+    CPPUNIT_ASSERT(factory.turnPoolCount() == 4);
+    CPPUNIT_ASSERT(turn_->allocations == 5);
+
+    factory.clearTurnPool();
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::TurnPoolTest::name())
@@ -0,0 +1,178 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <cppunit/TestAssert.h>
+
+#include <asio/io_context.hpp>
+#include <asio/ip/udp.hpp>
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#include "ice_transport.h"
+
+namespace jami {
+namespace test {
+
+// Relayed ports are RELAY_PORT_BASE + the allocation number
+static constexpr uint16_t RELAY_PORT_BASE {50000};
+
+/**
+ * Minimal TURN server listening on the loopback, without authentication.
+ * Allocations are accepted but nothing is relayed.
+ */
+class TurnStandIn
+{
+public:
+    TurnStandIn(asio::io_context& ctx)
+        : socket_(ctx, asio::ip::udp::endpoint(asio::ip::make_address_v4("127.0.0.1"), 0))
+    {
+        pj_caching_pool_init(&cp_, nullptr, 0);
+        receive();
+    }
+    ~TurnStandIn() { pj_caching_pool_destroy(&cp_); }
+
+    std::string uri() const
+    {
+        return "127.0.0.1:" + std::to_string(socket_.local_endpoint().port());
+    }
+
+    std::atomic_uint allocations {0};
+    // Refresh requests with a lifetime of 0
+    std::atomic_uint deallocations {0};
+    std::atomic_bool answerDeallocations {true};
+
+private:
+    void receive()
+    {
+        socket_.async_receive_from(asio::buffer(rx_),
+                                   sender_,
+                                   [this](const asio::error_code& ec, size_t size) {
+                                       if (ec)
+                                           return;
+                                       onRequest(size);
+                                       receive();
+                                   });
+    }
+
+    void onRequest(size_t size)
+    {
+        auto* pool = pj_pool_create(&cp_.factory, "turn-stand-in", 4096, 4096, nullptr);
+        pj_stun_msg* req = nullptr;
+        pj_stun_msg* resp = nullptr;
+        if (pj_stun_msg_decode(pool,
+                               rx_.data(),
+                               size,
+                               PJ_STUN_IS_DATAGRAM | PJ_STUN_CHECK_PACKET,
+                               &req,
+                               nullptr,
+                               nullptr)
+                != PJ_SUCCESS
+            or not PJ_STUN_IS_REQUEST(req->hdr.type)
+            or pj_stun_msg_create_response(pool, req, 0, nullptr, &resp) != PJ_SUCCESS) {
+            pj_pool_release(pool);
+            return;
+        }
+
+        if (req->hdr.type == PJ_STUN_REFRESH_REQUEST) {
+            auto* lifetime = reinterpret_cast<pj_stun_uint_attr*>(
+                pj_stun_msg_find_attr(req, PJ_STUN_ATTR_LIFETIME, 0));
+            if (lifetime and lifetime->value == 0) {
+                deallocations++;
+                if (not answerDeallocations) {
+                    pj_pool_release(pool);
+                    return;
+                }
+            }
+        }
+        if (req->hdr.type == PJ_STUN_ALLOCATE_REQUEST) {
+            auto n = ++allocations;
+            auto relayed = toSockAddr(asio::ip::udp::endpoint(asio::ip::make_address_v4("127.0.0.1"),
+                                                              RELAY_PORT_BASE + n));
+            auto mapped = toSockAddr(sender_);
+            pj_stun_msg_add_sockaddr_attr(pool,
+                                          resp,
+                                          PJ_STUN_ATTR_XOR_RELAYED_ADDR,
+                                          PJ_TRUE,
+                                          &relayed,
+                                          sizeof(pj_sockaddr_in));
+            pj_stun_msg_add_sockaddr_attr(pool,
+                                          resp,
+                                          PJ_STUN_ATTR_XOR_MAPPED_ADDR,
+                                          PJ_TRUE,
+                                          &mapped,
+                                          sizeof(pj_sockaddr_in));
+        }
+        if (req->hdr.type == PJ_STUN_ALLOCATE_REQUEST or req->hdr.type == PJ_STUN_REFRESH_REQUEST)
+            pj_stun_msg_add_uint_attr(pool, resp, PJ_STUN_ATTR_LIFETIME, 600);
+
+        std::array<uint8_t, 512> tx;
+        pj_size_t len = 0;
+        if (pj_stun_msg_encode(resp, tx.data(), tx.size(), 0, nullptr, &len) == PJ_SUCCESS)
+            socket_.send_to(asio::buffer(tx.data(), len), sender_);
+        pj_pool_release(pool);
+    }
+
+    static pj_sockaddr toSockAddr(const asio::ip::udp::endpoint& ep)
+    {
+        pj_sockaddr addr;
+        auto host = ep.address().to_string();
+        pj_str_t str;
+        pj_sockaddr_in_init(&addr.ipv4, pj_cstr(&str, host.c_str()), ep.port());
+        return addr;
+    }
+
+    pj_caching_pool cp_;
+    asio::ip::udp::socket socket_;
+    asio::ip::udp::endpoint sender_;
+    std::array<uint8_t, 2048> rx_;
+};
+
+/**
+ * Initialize a transport and wait for the callback.
+ * Returns whether the initialization succeeded.
+ */
+inline bool
+initializeIce(IceTransport& ice, IceTransportOptions options)
+{
+    // Shared with the callback, which may run after a failed assertion
+    struct State
+    {
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool done {false};
+        bool success {false};
+    };
+    auto state = std::make_shared<State>();
+    options.onInitDone = [state](bool ok) {
+        std::lock_guard<std::mutex> lk {state->mtx};
+        state->done = true;
+        state->success = ok;
+        state->cv.notify_one();
+    };
+    ice.initIceInstance(options);
+    std::unique_lock<std::mutex> lk {state->mtx};
+    CPPUNIT_ASSERT(state->cv.wait_for(lk, std::chrono::seconds(10), [&] { return state->done; }));
+    return state->success;
+}
+
+} // namespace test
+} // namespace jami
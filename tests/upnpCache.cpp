@@ -0,0 +1,144 @@
+/*
+ *  Copyright (C) 2023 Savoir-faire Linux Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <cppunit/TestAssert.h>
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "test_runner.h"
+#include "fileutils.h"
+#include "upnp/upnp_cache.h"
+
+#include <cstdio>
+
+namespace jami {
+namespace test {
+
+using namespace upnp;
+
+class UpnpCacheTest : public CppUnit::TestFixture
+{
+public:
+    UpnpCacheTest() {}
+    ~UpnpCacheTest() {}
+    static std::string name() { return "UpnpCache"; }
+    void setUp();
+    void tearDown();
+
+private:
+    void testSaveLoad();
+    void testExpiredMappings();
+    void testInvalidFile();
+
+    CPPUNIT_TEST_SUITE(UpnpCacheTest);
+    CPPUNIT_TEST(testSaveLoad);
+    CPPUNIT_TEST(testExpiredMappings);
+    CPPUNIT_TEST(testInvalidFile);
+    CPPUNIT_TEST_SUITE_END();
+
+    std::string path_ {"upnp_cache_test"};
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(UpnpCacheTest, UpnpCacheTest::name());
+
+void
+UpnpCacheTest::setUp()
+{
+    std::remove(path_.c_str());
+}
+
+void
+UpnpCacheTest::tearDown()
+{
+    std::remove(path_.c_str());
+}
+
+void
+UpnpCacheTest::testSaveLoad()
+{
+    auto expiration = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()
+                                                           + UPNP_CACHE_MAPPING_LIFETIME);
+    UpnpCache cache;
+    cache.igds.push_back({"uuid:igd",
+                          "http://192.168.1.1:5000",
+                          "Router",
+                          "urn:schemas-upnp-org:service:WANIPConnection:1",
+                          "urn:upnp-org:serviceId:WANIPConn1",
+                          "http://192.168.1.1:5000/rootDesc.xml",
+                          "http://192.168.1.1:5000/ctl/IPConn",
+                          "http://192.168.1.1:5000/evt/IPConn",
+                          "203.0.113.7"});
+    cache.mappings.push_back({"uuid:igd", true, 20000, 20000, "192.168.1.10", expiration});
+    cache.mappings.push_back({"uuid:igd", false, 10000, 10001, "192.168.1.10", expiration});
+    cache.save(path_);
+
+    auto loaded = UpnpCache::load(path_);
+    CPPUNIT_ASSERT(loaded.igds.size() == 1);
+    CPPUNIT_ASSERT(loaded.igds[0].uid == "uuid:igd");
+    CPPUNIT_ASSERT(loaded.igds[0].controlUrl == "http://192.168.1.1:5000/ctl/IPConn");
+    CPPUNIT_ASSERT(loaded.igds[0].publicIp == "203.0.113.7");
+    CPPUNIT_ASSERT(loaded.mappings.size() == 2);
+    CPPUNIT_ASSERT(loaded.mappings[1].udp == false);
+    CPPUNIT_ASSERT(loaded.mappings[1].internalPort == 10000);
+    CPPUNIT_ASSERT(loaded.mappings[1].externalPort == 10001);
+    CPPUNIT_ASSERT(loaded.mappings[1].internalAddr == "192.168.1.10");
+    CPPUNIT_ASSERT(loaded.mappings[1].expiration == expiration);
+}
+
+void
+UpnpCacheTest::testExpiredMappings()
+{
+    auto now = std::chrono::system_clock::now();
+    UpnpCache cache;
+    cache.mappings.push_back({"uuid:igd",
+                              true,
+                              20000,
+                              20000,
+                              "192.168.1.10",
+                              std::chrono::system_clock::to_time_t(now - std::chrono::minutes(1))});
+    cache.mappings.push_back({"uuid:igd",
+                              true,
+                              20002,
+                              20002,
+                              "192.168.1.10",
+                              std::chrono::system_clock::to_time_t(now + std::chrono::minutes(1))});
+    cache.save(path_);
+
+    auto loaded = UpnpCache::load(path_);
+    CPPUNIT_ASSERT(loaded.mappings.size() == 1);
+    CPPUNIT_ASSERT(loaded.mappings[0].internalPort == 20002);
+}
+
+void
+UpnpCacheTest::testInvalidFile()
+{
+    // Missing file.
+    auto loaded = UpnpCache::load(path_);
+    CPPUNIT_ASSERT(loaded.igds.empty() and loaded.mappings.empty());
+
+    // Not a cache.
+    std::vector<uint8_t> garbage {0xc1, 0x00, 0xff};
+    fileutils::saveFile(path_, garbage);
+    loaded = UpnpCache::load(path_);
+    CPPUNIT_ASSERT(loaded.igds.empty() and loaded.mappings.empty());
+}
+
+} // namespace test
+} // namespace jami
+
+JAMI_TEST_RUNNER(jami::test::UpnpCacheTest::name())